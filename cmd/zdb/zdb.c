@@ -544,6 +544,19 @@ dump_metaslab_stats(metaslab_t *msp)
 	(void) printf("\t %25s %10lu   %7s  %6s   %4s %4d%%\n",
 	    "segments", avl_numnodes(t), "maxsize", maxbuf,
 	    "freepct", free_pct);
+
+	if (sm->sm_histogram != NULL) {
+		int i;
+
+		(void) printf("\t %25s\n", "free segment sizes:");
+		for (i = 0; i < SPACE_MAP_HISTOGRAM_SIZE; i++) {
+			if (sm->sm_histogram[i] == 0)
+				continue;
+			zdb_nicenum(1ULL << (i + sm->sm_shift), maxbuf);
+			(void) printf("\t %25s %10llu\n", maxbuf,
+			    (u_longlong_t)sm->sm_histogram[i]);
+		}
+	}
 }
 
 static void
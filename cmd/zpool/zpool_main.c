@@ -1529,7 +1529,7 @@ do_import(nvlist_t *config, const char *newname, const char *mntopts,
 	    ZPOOL_CONFIG_POOL_STATE, &state) == 0);
 	verify(nvlist_lookup_uint64(config,
 	    ZPOOL_CONFIG_VERSION, &version) == 0);
-	if (version > SPA_VERSION) {
+	if (!SPA_VERSION_IS_SUPPORTED(version)) {
 		(void) fprintf(stderr, gettext("cannot import '%s': pool "
 		    "is formatted using a newer ZFS version\n"), name);
 		return (1);
@@ -3383,6 +3383,7 @@ print_dedup_stats(nvlist_t *config)
 	ddt_histogram_t *ddh;
 	ddt_stat_t *dds;
 	ddt_object_t *ddo;
+	ddt_bloom_stat_t *dbs;
 	uint_t c;
 
 	/*
@@ -3400,6 +3401,21 @@ print_dedup_stats(nvlist_t *config)
 	    (u_longlong_t)ddo->ddo_dspace,
 	    (u_longlong_t)ddo->ddo_mspace);
 
+	/*
+	 * Older kernels don't report the bloom filter counters.
+	 */
+	if (nvlist_lookup_uint64_array(config, ZPOOL_CONFIG_DDT_BLOOM_STATS,
+	    (uint64_t **)&dbs, &c) == 0 &&
+	    c >= sizeof (ddt_bloom_stat_t) / sizeof (uint64_t) &&
+	    dbs->dbs_misses + dbs->dbs_false_hits != 0) {
+		(void) printf("DDT bloom filter skipped %llu lookups, "
+		    "%llu false positives (%.2f%%)\n",
+		    (u_longlong_t)dbs->dbs_misses,
+		    (u_longlong_t)dbs->dbs_false_hits,
+		    100.0 * dbs->dbs_false_hits /
+		    (dbs->dbs_misses + dbs->dbs_false_hits));
+	}
+
 	verify(nvlist_lookup_uint64_array(config, ZPOOL_CONFIG_DDT_STATS,
 	    (uint64_t **)&dds, &c) == 0);
 	verify(nvlist_lookup_uint64_array(config, ZPOOL_CONFIG_DDT_HISTOGRAM,
@@ -3798,7 +3814,8 @@ upgrade_cb(zpool_handle_t *zhp, void *arg)
 	verify(nvlist_lookup_uint64(config, ZPOOL_CONFIG_VERSION,
 	    &version) == 0);
 
-	if (!cbp->cb_newer && version < SPA_VERSION) {
+	if (!cbp->cb_newer && SPA_VERSION_IS_SUPPORTED(version) &&
+	    version < SPA_VERSION) {
 		if (!cbp->cb_all) {
 			if (cbp->cb_first) {
 				(void) printf(gettext("The following pools are "
@@ -3821,7 +3838,7 @@ upgrade_cb(zpool_handle_t *zhp, void *arg)
 				    "'%s'\n\n"), zpool_get_name(zhp));
 			}
 		}
-	} else if (cbp->cb_newer && version > SPA_VERSION) {
+	} else if (cbp->cb_newer && !SPA_VERSION_IS_SUPPORTED(version)) {
 		assert(!cbp->cb_all);
 
 		if (cbp->cb_first) {
@@ -3911,8 +3928,8 @@ zpool_do_upgrade(int argc, char **argv)
 			break;
 		case 'V':
 			cb.cb_version = strtoll(optarg, &end, 10);
-			if (*end != '\0' || cb.cb_version > SPA_VERSION ||
-			    cb.cb_version < SPA_VERSION_1) {
+			if (*end != '\0' ||
+			    !SPA_VERSION_IS_SUPPORTED(cb.cb_version)) {
 				(void) fprintf(stderr,
 				    gettext("invalid version '%s'\n"), optarg);
 				usage(B_FALSE);
@@ -3998,6 +4015,10 @@ zpool_do_upgrade(int argc, char **argv)
 		(void) printf(gettext(" 25  Improved scrub stats\n"));
 		(void) printf(gettext(" 26  Improved snapshot deletion "
 		    "performance\n"));
+		(void) printf(gettext(" 1000 Compression using lz4 "
+		    "(private version)\n"));
+		(void) printf(gettext(" 1001 Deduplication table logs "
+		    "(private version)\n"));
 		(void) printf(gettext("\nFor more information on a particular "
 		    "version, including supported releases,\n"));
 		(void) printf(gettext("see the ZFS Administration Guide.\n\n"));
@@ -235,6 +235,7 @@ ztest_func_t ztest_dmu_read_write;
 ztest_func_t ztest_dmu_write_parallel;
 ztest_func_t ztest_dmu_object_alloc_free;
 ztest_func_t ztest_dmu_commit_callbacks;
+ztest_func_t ztest_dmu_tx_assign_rate;
 ztest_func_t ztest_zap;
 ztest_func_t ztest_zap_parallel;
 ztest_func_t ztest_zil_commit;
@@ -269,6 +270,7 @@ ztest_info_t ztest_info[] = {
 	{ ztest_dmu_write_parallel,		10,	&zopt_always	},
 	{ ztest_dmu_object_alloc_free,		1,	&zopt_always	},
 	{ ztest_dmu_commit_callbacks,		1,	&zopt_always	},
+	{ ztest_dmu_tx_assign_rate,		1,	&zopt_often	},
 	{ ztest_zap,				30,	&zopt_always	},
 	{ ztest_zap_parallel,			100,	&zopt_always	},
 	{ ztest_split_pool,			1,	&zopt_always	},
@@ -327,6 +329,8 @@ typedef struct ztest_shared {
 	ztest_info_t	zs_info[ZTEST_FUNCS];
 	uint64_t	zs_splits;
 	uint64_t	zs_mirrors;
+	uint64_t	zs_tx_assigns;
+	uint64_t	zs_tx_assign_time;
 	ztest_ds_t	zs_zd[];
 } ztest_shared_t;
 
@@ -363,6 +367,7 @@ static int zc_cb_counter = 0;
 
 extern uint64_t metaslab_gang_bang;
 extern uint64_t metaslab_df_alloc_threshold;
+extern int zfs_txg_history;
 static uint64_t metaslab_sz;
 
 enum ztest_object {
@@ -535,6 +540,9 @@ process_options(int argc, char **argv)
 	/* By default, test gang blocks for blocks 32K and greater */
 	metaslab_gang_bang = 32 << 10;
 
+	/* Keep the txg history so its bookkeeping gets exercised */
+	zfs_txg_history = 100;
+
 	while ((opt = getopt(argc, argv,
 	    "v:s:a:m:r:R:d:t:g:i:k:p:f:VET:P:hF:")) != EOF) {
 		value = 0;
@@ -4375,6 +4383,36 @@ ztest_dmu_commit_callbacks(ztest_ds_t *zd, uint64_t id)
 	umem_free(od, sizeof(ztest_od_t));
 }
 
+/*
+ * Transaction assignment microbenchmark: assign and commit a batch of
+ * empty transactions as fast as possible.  The rate per thread is
+ * reported in the workload summary; with one thread per CPU, this is
+ * the tx assign rate per core.
+ */
+#define	ZTEST_TX_ASSIGN_BATCH	1000
+
+/* ARGSUSED */
+void
+ztest_dmu_tx_assign_rate(ztest_ds_t *zd, uint64_t id)
+{
+	ztest_shared_t *zs = ztest_shared;
+	objset_t *os = zd->zd_os;
+	hrtime_t start;
+	dmu_tx_t *tx;
+	int i;
+
+	start = gethrtime();
+	for (i = 0; i < ZTEST_TX_ASSIGN_BATCH; i++) {
+		tx = dmu_tx_create(os);
+		if (ztest_tx_assign(tx, TXG_WAIT, FTAG) == 0)
+			return;
+		dmu_tx_commit(tx);
+	}
+
+	atomic_add_64(&zs->zs_tx_assigns, ZTEST_TX_ASSIGN_BATCH);
+	atomic_add_64(&zs->zs_tx_assign_time, gethrtime() - start);
+}
+
 /* ARGSUSED */
 void
 ztest_dsl_prop_get_set(ztest_ds_t *zd, uint64_t id)
@@ -5664,6 +5702,8 @@ main(int argc, char **argv)
 			zi->zi_call_count = 0;
 			zi->zi_call_time = 0;
 		}
+		zs->zs_tx_assigns = 0;
+		zs->zs_tx_assign_time = 0;
 
 		/* Set the allocation switch size */
 		metaslab_df_alloc_threshold = ztest_random(metaslab_sz / 4) + 1;
@@ -5741,6 +5781,12 @@ main(int argc, char **argv)
 				    (u_longlong_t)zi->zi_call_count, timebuf,
 				    dli.dli_sname);
 			}
+			if (zs->zs_tx_assign_time != 0) {
+				(void) printf("\ntx assign rate: %llu/sec "
+				    "per thread\n", (u_longlong_t)
+				    (zs->zs_tx_assigns * (NANOSEC / MICROSEC) /
+				    (zs->zs_tx_assign_time / MICROSEC + 1)));
+			}
 			(void) printf("\n");
 		}
 
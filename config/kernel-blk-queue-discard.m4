@@ -0,0 +1,28 @@
+dnl #
+dnl # 2.6.33 API change
+dnl # Discards are passed to make_request() as bios with BIO_RW_DISCARD
+dnl # set once QUEUE_FLAG_DISCARD is advertised, and blkdev_issue_discard()
+dnl # takes a flags argument to wait for completion.
+dnl #
+AC_DEFUN([ZFS_AC_KERNEL_BLK_QUEUE_DISCARD], [
+	AC_MSG_CHECKING([whether block devices support discard])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <linux/blkdev.h>
+	],[
+		struct request_queue *q = NULL;
+		struct block_device *bdev = NULL;
+		unsigned long rw = (1 << BIO_RW_DISCARD);
+
+		blk_queue_max_discard_sectors(q, 0);
+		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+		(void) blk_queue_discard(q);
+		(void) blkdev_issue_discard(bdev, 0, 0, GFP_NOFS, DISCARD_FL_WAIT);
+		(void) rw;
+	],[
+		AC_MSG_RESULT(yes)
+		AC_DEFINE(HAVE_BLK_QUEUE_DISCARD, 1,
+		          [block devices support discard])
+	],[
+		AC_MSG_RESULT(no)
+	])
+])
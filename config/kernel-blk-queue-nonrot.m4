@@ -0,0 +1,19 @@
+dnl #
+dnl # 2.6.28 API change
+dnl # Request queues flag non-rotational devices with QUEUE_FLAG_NONROT.
+dnl #
+AC_DEFUN([ZFS_AC_KERNEL_BLK_QUEUE_NONROT], [
+	AC_MSG_CHECKING([whether blk_queue_nonrot() is available])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <linux/blkdev.h>
+	],[
+		struct request_queue *q = NULL;
+		(void) blk_queue_nonrot(q);
+	],[
+		AC_MSG_RESULT(yes)
+		AC_DEFINE(HAVE_BLK_QUEUE_NONROT, 1,
+		          [blk_queue_nonrot() is available])
+	],[
+		AC_MSG_RESULT(no)
+	])
+])
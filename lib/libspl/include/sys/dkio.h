@@ -188,6 +188,12 @@ struct dk_geom {
  */
 #define	DKIOCFLUSHWRITECACHE	(DKIOC|34)	/* flush cache to phys medium */
 
+/*
+ * ioctl to free (TRIM/UNMAP) a range of the device.  The zio carrying it
+ * describes the range with io_offset and io_size.
+ */
+#define	DKIOCFREE		(DKIOC|50)	/* free space on the medium */
+
 struct dk_callback {
 	void (*dkc_callback)(void *dkc_cookie, int error);
 	void *dkc_cookie;
@@ -38,7 +38,11 @@
 #include <sys/utsname.h>
 #include <sys/time.h>
 #include <sys/mount.h> /* for BLKGETSIZE64 */
+#ifdef __linux__
+#include <linux/falloc.h> /* for FALLOC_FL_PUNCH_HOLE */
+#endif
 #include <sys/systeminfo.h>
+#include <zfs_fletcher.h>
 
 /*
  * Emulation of kernel services in userland.
@@ -684,6 +688,24 @@ vn_rdwr(int uio, vnode_t *vp, void *addr, ssize_t len, offset_t offset,
 	return (0);
 }
 
+/*
+ * Release the backing store of a range of the file, which then reads back
+ * as zeros.  Returns ENOTSUP if the file system can't do it.
+ */
+int
+vn_trim(vnode_t *vp, offset_t offset, offset_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(vp->v_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    offset, len) == -1)
+		return (errno);
+
+	return (0);
+#else
+	return (ENOTSUP);
+#endif
+}
+
 void
 vn_close(vnode_t *vp)
 {
@@ -1064,6 +1086,7 @@ kernel_init(int mode)
 
 	thread_init();
 	system_taskq_init();
+	fletcher_4_init();
 
 	spa_init(mode);
 }
@@ -1073,6 +1096,7 @@ kernel_fini(void)
 {
 	spa_fini();
 
+	fletcher_4_fini();
 	system_taskq_fini();
 	thread_fini();
 
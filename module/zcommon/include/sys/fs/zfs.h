@@ -335,14 +335,28 @@ typedef enum {
 #define	SPA_VERSION_24			24ULL
 #define	SPA_VERSION_25			25ULL
 #define	SPA_VERSION_26			26ULL
+
+/*
+ * Versions above 26 are assigned by other ZFS implementations, each to
+ * a different on-disk change, so new changes here can't take the next
+ * number without forking the format.  Instead they take private version
+ * numbers well clear of any other implementation's, and the versions in
+ * between are refused as unsupported.
+ */
+#define	SPA_VERSION_1000		1000ULL
+#define	SPA_VERSION_1001		1001ULL
 /*
  * When bumping up SPA_VERSION, make sure GRUB ZFS understands the on-disk
  * format change. Go to usr/src/grub/grub-0.97/stage2/{zfs-include/, fsys_zfs*},
  * and do the appropriate changes.  Also bump the version number in
  * usr/src/grub/capability.
  */
-#define	SPA_VERSION			SPA_VERSION_26
-#define	SPA_VERSION_STRING		"26"
+#define	SPA_VERSION			SPA_VERSION_1001
+#define	SPA_VERSION_STRING		"1001"
+
+#define	SPA_VERSION_IS_SUPPORTED(v) \
+	(((v) >= SPA_VERSION_INITIAL && (v) <= SPA_VERSION_26) || \
+	((v) >= SPA_VERSION_1000 && (v) <= SPA_VERSION_1001))
 
 /*
  * Symbolic names for the changes that caused a SPA_VERSION switch.
@@ -391,6 +405,8 @@ typedef enum {
 #define	SPA_VERSION_SCAN		SPA_VERSION_25
 #define	SPA_VERSION_DIR_CLONES		SPA_VERSION_26
 #define	SPA_VERSION_DEADLISTS		SPA_VERSION_26
+#define	SPA_VERSION_LZ4_COMPRESSION	SPA_VERSION_1000
+#define	SPA_VERSION_DDT_LOG		SPA_VERSION_1001
 
 /*
  * ZPL version - rev'd whenever an incompatible on-disk format change
@@ -475,6 +491,7 @@ typedef struct zpool_rewind_policy {
 #define	ZPOOL_CONFIG_DDT_HISTOGRAM	"ddt_histogram"
 #define	ZPOOL_CONFIG_DDT_OBJ_STATS	"ddt_object_stats"
 #define	ZPOOL_CONFIG_DDT_STATS		"ddt_stats"
+#define	ZPOOL_CONFIG_DDT_BLOOM_STATS	"ddt_bloom_stats"
 #define	ZPOOL_CONFIG_SPLIT		"splitcfg"
 #define	ZPOOL_CONFIG_ORIG_GUID		"orig_guid"
 #define	ZPOOL_CONFIG_SPLIT_GUID		"split_guid"
@@ -659,6 +676,7 @@ typedef struct vdev_stat {
 	uint64_t	vs_self_healed;		/* self-healed bytes	*/
 	uint64_t	vs_scan_removing;	/* removing?	*/
 	uint64_t	vs_scan_processed;	/* scan processed bytes	*/
+	uint64_t	vs_mirror_selected;	/* mirror reads sent here */
 } vdev_stat_t;
 
 /*
@@ -682,6 +700,11 @@ typedef struct ddt_stat {
 	uint64_t	dds_ref_dsize;	/* referenced dsize * refcnt	*/
 } ddt_stat_t;
 
+typedef struct ddt_bloom_stat {
+	uint64_t	dbs_misses;	/* lookups skipped by the filter */
+	uint64_t	dbs_false_hits;	/* filter hits not in the ddt	*/
+} ddt_bloom_stat_t;
+
 typedef struct ddt_histogram {
 	ddt_stat_t	ddh_stat[64];	/* power-of-two histogram buckets */
 } ddt_histogram_t;
@@ -46,6 +46,31 @@ void fletcher_4_incremental_native(const void *, uint64_t,
 void fletcher_4_incremental_byteswap(const void *, uint64_t,
     zio_cksum_t *);
 
+/*
+ * fletcher-4 implementations. fo_native and fo_byteswap are only called on
+ * non-zero multiples of FLETCHER_4_CHUNK bytes; fletcher_4_native() and
+ * fletcher_4_byteswap() run the scalar code on any remainder.
+ */
+#define	FLETCHER_4_CHUNK	64
+
+typedef struct fletcher_4_ops {
+	void (*fo_native)(const void *, uint64_t, zio_cksum_t *);
+	void (*fo_byteswap)(const void *, uint64_t, zio_cksum_t *);
+	boolean_t (*fo_is_supported)(void);
+	const char *fo_name;
+} fletcher_4_ops_t;
+
+extern const fletcher_4_ops_t fletcher_4_scalar_impl;
+#if defined(__x86_64__)
+extern const fletcher_4_ops_t fletcher_4_sse2_impl;
+extern const fletcher_4_ops_t fletcher_4_avx2_impl;
+#endif
+
+extern char *zfs_fletcher_4_impl;
+
+void fletcher_4_init(void);
+void fletcher_4_fini(void);
+
 #ifdef	__cplusplus
 }
 #endif
@@ -123,13 +123,51 @@
  *
  * For both cached and uncached data, both fletcher checksums are much faster
  * than sha-256, and slower than 'off', which doesn't touch the data at all.
+ *
+ * ----------------------
+ * Vectorized Fletcher-4
+ * ----------------------
+ *
+ * The scalar fletcher-4 loop is one long dependency chain.  The vectorized
+ * implementations instead run L independent streams ("lanes"), lane j
+ * summing the words f_j, f_(j+L), f_(j+2L), ... into its own A_j, B_j, C_j
+ * and D_j using the same recurrence.  Writing the n = L*m input words as
+ * i = L*k + j and t = m - k, the weight given to f_i by each of the scalar
+ * accumulators is a polynomial in t, which can be rewritten in terms of the
+ * weights 1, t, t*(t+1)/2 and t*(t+1)*(t+2)/6 used by the lane accumulators:
+ *
+ *	a = sum(A_j)
+ *	b = L * sum(B_j) - sum(j * A_j)
+ *	c = L^2 * sum(C_j) - sum((L*(L-1)/2 + L*j) * B_j)
+ *	    + sum(j*(j-1)/2 * A_j)
+ *	d = L^3 * sum(D_j) - sum(L^2*(L-1+j) * C_j)
+ *	    + sum((L*(L-1)*(L-2)/6 + L*j*(j+L-2)/2) * B_j)
+ *	    - sum(j*(j-1)*(j-2)/6 * A_j)
+ *
+ * Being integer identities these also hold mod 2^64, so the result is
+ * bit-for-bit identical to the scalar checksum.  Similarly, running the
+ * recurrence over n more words starting from (a0, b0, c0, d0) gives the
+ * checksum (a, b, c, d) of those words alone plus
+ *
+ *	(a0, b0 + n*a0, c0 + n*b0 + n*(n+1)/2*a0,
+ *	    d0 + n*c0 + n*(n+1)/2*b0 + n*(n+1)*(n+2)/6*a0)
+ *
+ * which lets the incremental variants use the vectorized code as well.
+ *
+ * fletcher_4_init() times every implementation supported by the CPU on a
+ * 128k buffer, checks its results against the scalar code, and selects the
+ * fastest native and byteswap routines.  The zfs_fletcher_4_impl module
+ * parameter can be used to pin a specific implementation instead.
  */
 
+#include <sys/zfs_context.h>
 #include <sys/types.h>
 #include <sys/sysmacros.h>
 #include <sys/byteorder.h>
 #include <sys/zio.h>
 #include <sys/spa.h>
+#include <sys/kstat.h>
+#include <zfs_fletcher.h>
 
 void
 fletcher_2_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
@@ -165,14 +203,30 @@ fletcher_2_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
 	ZIO_SET_CHECKSUM(zcp, a0, a1, b0, b1);
 }
 
-void
-fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+/*
+ * Fletcher-4 implementation to use: "fastest" (selected by benchmark),
+ * or the name of a specific implementation.
+ */
+char *zfs_fletcher_4_impl = "fastest";
+
+/*
+ * The scalar implementation. It handles buffers of any size and is the
+ * reference the vectorized implementations are verified against.
+ */
+static void
+fletcher_4_scalar_incr_native(const void *buf, uint64_t size,
+    zio_cksum_t *zcp)
 {
 	const uint32_t *ip = buf;
 	const uint32_t *ipend = ip + (size / sizeof (uint32_t));
 	uint64_t a, b, c, d;
 
-	for (a = b = c = d = 0; ip < ipend; ip++) {
+	a = zcp->zc_word[0];
+	b = zcp->zc_word[1];
+	c = zcp->zc_word[2];
+	d = zcp->zc_word[3];
+
+	for (; ip < ipend; ip++) {
 		a += ip[0];
 		b += a;
 		c += b;
@@ -182,14 +236,20 @@ fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
 	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
 }
 
-void
-fletcher_4_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+static void
+fletcher_4_scalar_incr_byteswap(const void *buf, uint64_t size,
+    zio_cksum_t *zcp)
 {
 	const uint32_t *ip = buf;
 	const uint32_t *ipend = ip + (size / sizeof (uint32_t));
 	uint64_t a, b, c, d;
 
-	for (a = b = c = d = 0; ip < ipend; ip++) {
+	a = zcp->zc_word[0];
+	b = zcp->zc_word[1];
+	c = zcp->zc_word[2];
+	d = zcp->zc_word[3];
+
+	for (; ip < ipend; ip++) {
 		a += BSWAP_32(ip[0]);
 		b += a;
 		c += b;
@@ -199,50 +259,331 @@ fletcher_4_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
 	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
 }
 
+static void
+fletcher_4_scalar_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	ZIO_SET_CHECKSUM(zcp, 0, 0, 0, 0);
+	fletcher_4_scalar_incr_native(buf, size, zcp);
+}
+
+static void
+fletcher_4_scalar_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	ZIO_SET_CHECKSUM(zcp, 0, 0, 0, 0);
+	fletcher_4_scalar_incr_byteswap(buf, size, zcp);
+}
+
+static boolean_t
+fletcher_4_scalar_is_supported(void)
+{
+	return (B_TRUE);
+}
+
+const fletcher_4_ops_t fletcher_4_scalar_impl = {
+	fletcher_4_scalar_native,
+	fletcher_4_scalar_byteswap,
+	fletcher_4_scalar_is_supported,
+	"scalar"
+};
+
+static const fletcher_4_ops_t *const fletcher_4_impls[] = {
+	&fletcher_4_scalar_impl,
+#if defined(__x86_64__)
+	&fletcher_4_sse2_impl,
+	&fletcher_4_avx2_impl,
+#endif
+};
+
+#define	FLETCHER_4_IMPL_COUNT \
+	(sizeof (fletcher_4_impls) / sizeof (fletcher_4_impls[0]))
+
+/*
+ * The composite implementation assembled from the fastest native and
+ * byteswap routines found by fletcher_4_init().
+ */
+static fletcher_4_ops_t fletcher_4_fastest_impl;
+
+static const fletcher_4_ops_t *fletcher_4_curr_impl = &fletcher_4_scalar_impl;
+
+/*
+ * Buffers smaller than this are not worth saving the FPU state for.
+ */
+#define	FLETCHER_4_MIN_SIMD_SIZE	256
+
 void
-fletcher_4_incremental_native(const void *buf, uint64_t size,
-    zio_cksum_t *zcp)
+fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
 {
-	const uint32_t *ip = buf;
-	const uint32_t *ipend = ip + (size / sizeof (uint32_t));
-	uint64_t a, b, c, d;
+	uint64_t p2size = P2ALIGN(size, FLETCHER_4_CHUNK);
+
+	if (size < FLETCHER_4_MIN_SIMD_SIZE) {
+		fletcher_4_scalar_native(buf, size, zcp);
+		return;
+	}
+
+	fletcher_4_curr_impl->fo_native(buf, p2size, zcp);
+	if (p2size < size) {
+		fletcher_4_scalar_incr_native((const char *)buf + p2size,
+		    size - p2size, zcp);
+	}
+}
+
+void
+fletcher_4_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	uint64_t p2size = P2ALIGN(size, FLETCHER_4_CHUNK);
+
+	if (size < FLETCHER_4_MIN_SIMD_SIZE) {
+		fletcher_4_scalar_byteswap(buf, size, zcp);
+		return;
+	}
+
+	fletcher_4_curr_impl->fo_byteswap(buf, p2size, zcp);
+	if (p2size < size) {
+		fletcher_4_scalar_incr_byteswap((const char *)buf + p2size,
+		    size - p2size, zcp);
+	}
+}
+
+/*
+ * Return x * (x + 1) / 2 and x * (x + 1) * (x + 2) / 6 mod 2^64, dividing
+ * before multiplying so that the result is exact.
+ */
+static void
+fletcher_4_incr_coeffs(uint64_t n, uint64_t *n2, uint64_t *n3)
+{
+	uint64_t x = n, y = n + 1, z = n + 2;
+
+	if ((x & 1) == 0)
+		x /= 2;
+	else
+		y /= 2;
+	*n2 = x * y;
+
+	if (x % 3 == 0)
+		x /= 3;
+	else if (y % 3 == 0)
+		y /= 3;
+	else
+		z /= 3;
+	*n3 = x * y * z;
+}
+
+/*
+ * Fold the checksum nzcp of the next size bytes into the running checksum
+ * zcp; see the comment at the top of this file.
+ */
+static void
+fletcher_4_incremental_combine(zio_cksum_t *zcp, uint64_t size,
+    const zio_cksum_t *nzcp)
+{
+	uint64_t n = size / sizeof (uint32_t);
+	uint64_t n2, n3, a, b, c, d;
+
+	fletcher_4_incr_coeffs(n, &n2, &n3);
 
 	a = zcp->zc_word[0];
 	b = zcp->zc_word[1];
 	c = zcp->zc_word[2];
 	d = zcp->zc_word[3];
 
-	for (; ip < ipend; ip++) {
-		a += ip[0];
-		b += a;
-		c += b;
-		d += c;
+	ZIO_SET_CHECKSUM(zcp,
+	    a + nzcp->zc_word[0],
+	    b + n * a + nzcp->zc_word[1],
+	    c + n * b + n2 * a + nzcp->zc_word[2],
+	    d + n * c + n2 * b + n3 * a + nzcp->zc_word[3]);
+}
+
+void
+fletcher_4_incremental_native(const void *buf, uint64_t size,
+    zio_cksum_t *zcp)
+{
+	zio_cksum_t nzc;
+
+	if (size < FLETCHER_4_MIN_SIMD_SIZE) {
+		fletcher_4_scalar_incr_native(buf, size, zcp);
+		return;
 	}
 
-	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
+	fletcher_4_native(buf, size, &nzc);
+	fletcher_4_incremental_combine(zcp, size, &nzc);
 }
 
 void
 fletcher_4_incremental_byteswap(const void *buf, uint64_t size,
     zio_cksum_t *zcp)
 {
-	const uint32_t *ip = buf;
-	const uint32_t *ipend = ip + (size / sizeof (uint32_t));
-	uint64_t a, b, c, d;
+	zio_cksum_t nzc;
 
-	a = zcp->zc_word[0];
-	b = zcp->zc_word[1];
-	c = zcp->zc_word[2];
-	d = zcp->zc_word[3];
+	if (size < FLETCHER_4_MIN_SIMD_SIZE) {
+		fletcher_4_scalar_incr_byteswap(buf, size, zcp);
+		return;
+	}
 
-	for (; ip < ipend; ip++) {
-		a += BSWAP_32(ip[0]);
-		b += a;
-		c += b;
-		d += c;
+	fletcher_4_byteswap(buf, size, &nzc);
+	fletcher_4_incremental_combine(zcp, size, &nzc);
+}
+
+/*
+ * Benchmark parameters: a 128k block, each test repeated for at least
+ * FLETCHER_4_BENCH_NS nanoseconds.
+ */
+#define	FLETCHER_4_BENCH_SIZE	(128 << 10)
+#define	FLETCHER_4_BENCH_NS	(NANOSEC / 500)
+
+/*
+ * Throughput in MB/s of each implementation, exported in the
+ * fletcher_4_bench kstat.
+ */
+static kstat_named_t fletcher_4_bench_stats[FLETCHER_4_IMPL_COUNT * 2];
+static kstat_t *fletcher_4_bench_ksp;
+
+static uint64_t
+fletcher_4_bench_run(void (*func)(const void *, uint64_t, zio_cksum_t *),
+    const void *buf)
+{
+	hrtime_t start, delta;
+	uint64_t iters = 0;
+	zio_cksum_t zc;
+
+	start = gethrtime();
+	do {
+		func(buf, FLETCHER_4_BENCH_SIZE, &zc);
+		iters++;
+		delta = gethrtime() - start;
+	} while (delta < FLETCHER_4_BENCH_NS);
+
+	return (((iters * FLETCHER_4_BENCH_SIZE) >> 10) * (NANOSEC >> 10) /
+	    delta);
+}
+
+/*
+ * Verify that an implementation produces exactly the checksums of the
+ * scalar implementation before it is allowed to be used.
+ */
+static boolean_t
+fletcher_4_bench_verify(const fletcher_4_ops_t *ops, const void *buf)
+{
+	zio_cksum_t zc, ref;
+	uint64_t size;
+
+	for (size = FLETCHER_4_BENCH_SIZE; size >= FLETCHER_4_CHUNK;
+	    size = P2ALIGN(size / 3, FLETCHER_4_CHUNK)) {
+		fletcher_4_scalar_native(buf, size, &ref);
+		ops->fo_native(buf, size, &zc);
+		if (!ZIO_CHECKSUM_EQUAL(zc, ref))
+			return (B_FALSE);
+
+		fletcher_4_scalar_byteswap(buf, size, &ref);
+		ops->fo_byteswap(buf, size, &zc);
+		if (!ZIO_CHECKSUM_EQUAL(zc, ref))
+			return (B_FALSE);
 	}
 
-	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
+	return (B_TRUE);
+}
+
+static const fletcher_4_ops_t *
+fletcher_4_impl_lookup(const char *name)
+{
+	int i;
+
+	if (name == NULL || strcmp(name, "fastest") == 0)
+		return (&fletcher_4_fastest_impl);
+
+	for (i = 0; i < FLETCHER_4_IMPL_COUNT; i++) {
+		if (strcmp(name, fletcher_4_impls[i]->fo_name) == 0 &&
+		    fletcher_4_impls[i]->fo_is_supported())
+			return (fletcher_4_impls[i]);
+	}
+
+	return (NULL);
+}
+
+void
+fletcher_4_init(void)
+{
+	const fletcher_4_ops_t *ops, *best_native, *best_bswap;
+	uint64_t native_bw, bswap_bw, best_native_bw = 0, best_bswap_bw = 0;
+	kstat_named_t *ks;
+	void *buf;
+	int i;
+
+	buf = kmem_alloc(FLETCHER_4_BENCH_SIZE, KM_SLEEP);
+	(void) random_get_pseudo_bytes(buf, FLETCHER_4_BENCH_SIZE);
+
+	best_native = best_bswap = &fletcher_4_scalar_impl;
+	for (i = 0; i < FLETCHER_4_IMPL_COUNT; i++) {
+		ops = fletcher_4_impls[i];
+		native_bw = bswap_bw = 0;
+
+		if (ops->fo_is_supported()) {
+			if (fletcher_4_bench_verify(ops, buf)) {
+				native_bw = fletcher_4_bench_run(
+				    ops->fo_native, buf);
+				bswap_bw = fletcher_4_bench_run(
+				    ops->fo_byteswap, buf);
+			} else {
+				cmn_err(CE_WARN, "fletcher-4 %s implementation "
+				    "failed verification, disabled",
+				    ops->fo_name);
+			}
+		}
+
+		if (native_bw > best_native_bw) {
+			best_native_bw = native_bw;
+			best_native = ops;
+		}
+		if (bswap_bw > best_bswap_bw) {
+			best_bswap_bw = bswap_bw;
+			best_bswap = ops;
+		}
+
+		ks = &fletcher_4_bench_stats[i * 2];
+		(void) snprintf(ks[0].name, KSTAT_STRLEN, "%s_native",
+		    ops->fo_name);
+		ks[0].data_type = KSTAT_DATA_UINT64;
+		ks[0].value.ui64 = native_bw;
+		(void) snprintf(ks[1].name, KSTAT_STRLEN, "%s_byteswap",
+		    ops->fo_name);
+		ks[1].data_type = KSTAT_DATA_UINT64;
+		ks[1].value.ui64 = bswap_bw;
+	}
+
+	kmem_free(buf, FLETCHER_4_BENCH_SIZE);
+
+	fletcher_4_fastest_impl.fo_native = best_native->fo_native;
+	fletcher_4_fastest_impl.fo_byteswap = best_bswap->fo_byteswap;
+	fletcher_4_fastest_impl.fo_is_supported =
+	    fletcher_4_scalar_is_supported;
+	fletcher_4_fastest_impl.fo_name = "fastest";
+
+	ops = fletcher_4_impl_lookup(zfs_fletcher_4_impl);
+	if (ops == NULL) {
+		cmn_err(CE_WARN, "unknown or unsupported fletcher-4 "
+		    "implementation '%s', using 'fastest'",
+		    zfs_fletcher_4_impl);
+		ops = &fletcher_4_fastest_impl;
+	}
+	fletcher_4_curr_impl = ops;
+
+	fletcher_4_bench_ksp = kstat_create("zfs", 0, "fletcher_4_bench",
+	    "misc", KSTAT_TYPE_NAMED, FLETCHER_4_IMPL_COUNT * 2,
+	    KSTAT_FLAG_VIRTUAL);
+	if (fletcher_4_bench_ksp != NULL) {
+		fletcher_4_bench_ksp->ks_data = fletcher_4_bench_stats;
+		kstat_install(fletcher_4_bench_ksp);
+	}
+}
+
+void
+fletcher_4_fini(void)
+{
+	if (fletcher_4_bench_ksp != NULL) {
+		kstat_delete(fletcher_4_bench_ksp);
+		fletcher_4_bench_ksp = NULL;
+	}
+
+	fletcher_4_curr_impl = &fletcher_4_scalar_impl;
 }
 
 #if defined(_KERNEL) && defined(HAVE_SPL)
@@ -252,4 +593,8 @@ EXPORT_SYMBOL(fletcher_4_native);
 EXPORT_SYMBOL(fletcher_4_byteswap);
 EXPORT_SYMBOL(fletcher_4_incremental_native);
 EXPORT_SYMBOL(fletcher_4_incremental_byteswap);
+
+module_param(zfs_fletcher_4_impl, charp, 0444);
+MODULE_PARM_DESC(zfs_fletcher_4_impl, "fletcher-4 implementation "
+	"(fastest, scalar, sse2, avx2)");
 #endif
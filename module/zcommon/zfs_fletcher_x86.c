@@ -0,0 +1,250 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/simd.h>
+#include <zfs_fletcher.h>
+
+#if defined(__x86_64__)
+
+/*
+ * SSE2 and AVX2 implementations of fletcher-4.
+ *
+ * The SSE2 code runs 4 lanes, two in each of a pair of xmm registers per
+ * accumulator, and consumes 16 bytes per iteration. The AVX2 code runs 8
+ * lanes in pairs of ymm registers and consumes 32 bytes per iteration. The
+ * 32-bit input words are zero-extended into the 64-bit lanes, so the lane
+ * accumulators wrap exactly like the scalar ones, and the lanes are then
+ * combined into the scalar checksum as described in zfs_fletcher.c.
+ *
+ * Each asm statement below is a complete loop over a non-zero multiple of
+ * FLETCHER_4_CHUNK bytes. Loads are unaligned since the checksummed buffer
+ * need not be.
+ */
+
+#define	FLETCHER_X86_CLOBBERS						\
+	"cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",	\
+	"xmm6", "xmm7", "xmm8", "xmm9", "xmm10"
+
+/*
+ * vpshufb mask byteswapping the zero-extended word in each 64-bit lane.
+ */
+static const uint8_t fletcher_avx2_bswap[32] __attribute__((aligned(32))) = {
+	3, 2, 1, 0, 0x80, 0x80, 0x80, 0x80,
+	11, 10, 9, 8, 0x80, 0x80, 0x80, 0x80,
+	3, 2, 1, 0, 0x80, 0x80, 0x80, 0x80,
+	11, 10, 9, 8, 0x80, 0x80, 0x80, 0x80
+};
+
+/*
+ * Combine the lane accumulators lanes[0..3][0..nlanes-1] (A, B, C and D of
+ * each lane) into the checksum.
+ */
+static void
+fletcher_x86_combine(uint64_t *lanes, uint64_t nlanes, zio_cksum_t *zcp)
+{
+	const uint64_t *A = lanes, *B = A + nlanes, *C = B + nlanes;
+	const uint64_t *D = C + nlanes;
+	uint64_t L = nlanes, L2 = L * L, L3 = L2 * L;
+	uint64_t a = 0, b = 0, c = 0, d = 0, j;
+
+	for (j = 0; j < L; j++) {
+		a += A[j];
+		b += L * B[j] - j * A[j];
+		c += L2 * C[j] - (L * (L - 1) / 2 + L * j) * B[j] +
+		    j * (j - 1) / 2 * A[j];
+		d += L3 * D[j] - L2 * (L - 1 + j) * C[j] +
+		    (L * (L - 1) * (L - 2) / 6 + L * j * (j + L - 2) / 2) * B[j] -
+		    j * (j - 1) * (j - 2) / 6 * A[j];
+	}
+
+	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
+}
+
+/*
+ * SSE2
+ */
+#define	SSE2_BSWAP							\
+	"movdqa	%%xmm9, %%xmm10\n"					\
+	"psllw	$8, %%xmm9\n"						\
+	"psrlw	$8, %%xmm10\n"						\
+	"por	%%xmm10, %%xmm9\n"					\
+	"pshuflw	$0xb1, %%xmm9, %%xmm9\n"			\
+	"pshufhw	$0xb1, %%xmm9, %%xmm9\n"
+
+#define	SSE2_LOOP(bswap)						\
+	__asm__ __volatile__(						\
+	    "pxor	%%xmm0, %%xmm0\n"				\
+	    "pxor	%%xmm1, %%xmm1\n"				\
+	    "pxor	%%xmm2, %%xmm2\n"				\
+	    "pxor	%%xmm3, %%xmm3\n"				\
+	    "pxor	%%xmm4, %%xmm4\n"				\
+	    "pxor	%%xmm5, %%xmm5\n"				\
+	    "pxor	%%xmm6, %%xmm6\n"				\
+	    "pxor	%%xmm7, %%xmm7\n"				\
+	    "pxor	%%xmm8, %%xmm8\n"				\
+	    "1:\n"							\
+	    "movdqu	(%[ip]), %%xmm9\n"				\
+	    bswap							\
+	    "movdqa	%%xmm9, %%xmm10\n"				\
+	    "punpckldq	%%xmm8, %%xmm9\n"				\
+	    "punpckhdq	%%xmm8, %%xmm10\n"				\
+	    "paddq	%%xmm9, %%xmm0\n"				\
+	    "paddq	%%xmm10, %%xmm1\n"				\
+	    "paddq	%%xmm0, %%xmm2\n"				\
+	    "paddq	%%xmm1, %%xmm3\n"				\
+	    "paddq	%%xmm2, %%xmm4\n"				\
+	    "paddq	%%xmm3, %%xmm5\n"				\
+	    "paddq	%%xmm4, %%xmm6\n"				\
+	    "paddq	%%xmm5, %%xmm7\n"				\
+	    "add	$16, %[ip]\n"					\
+	    "sub	$16, %[n]\n"					\
+	    "jnz	1b\n"						\
+	    "movdqu	%%xmm0, 0(%[l])\n"				\
+	    "movdqu	%%xmm1, 16(%[l])\n"				\
+	    "movdqu	%%xmm2, 32(%[l])\n"				\
+	    "movdqu	%%xmm3, 48(%[l])\n"				\
+	    "movdqu	%%xmm4, 64(%[l])\n"				\
+	    "movdqu	%%xmm5, 80(%[l])\n"				\
+	    "movdqu	%%xmm6, 96(%[l])\n"				\
+	    "movdqu	%%xmm7, 112(%[l])\n"				\
+	    : [ip] "+r" (ip), [n] "+r" (size)				\
+	    : [l] "r" (lanes)						\
+	    : FLETCHER_X86_CLOBBERS)
+
+static void
+fletcher_4_sse2_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	uint64_t lanes[4][4];
+	const void *ip = buf;
+
+	kfpu_begin();
+	SSE2_LOOP("");
+	kfpu_end();
+
+	fletcher_x86_combine(&lanes[0][0], 4, zcp);
+}
+
+static void
+fletcher_4_sse2_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	uint64_t lanes[4][4];
+	const void *ip = buf;
+
+	kfpu_begin();
+	SSE2_LOOP(SSE2_BSWAP);
+	kfpu_end();
+
+	fletcher_x86_combine(&lanes[0][0], 4, zcp);
+}
+
+const fletcher_4_ops_t fletcher_4_sse2_impl = {
+	fletcher_4_sse2_native,
+	fletcher_4_sse2_byteswap,
+	zfs_sse2_available,
+	"sse2"
+};
+
+/*
+ * AVX2
+ */
+#define	AVX2_BSWAP							\
+	"vpshufb	%%ymm10, %%ymm8, %%ymm8\n"			\
+	"vpshufb	%%ymm10, %%ymm9, %%ymm9\n"
+
+#define	AVX2_LOOP(bswap)						\
+	__asm__ __volatile__(						\
+	    "vmovdqa	(%[k]), %%ymm10\n"				\
+	    "vpxor	%%ymm0, %%ymm0, %%ymm0\n"			\
+	    "vpxor	%%ymm1, %%ymm1, %%ymm1\n"			\
+	    "vpxor	%%ymm2, %%ymm2, %%ymm2\n"			\
+	    "vpxor	%%ymm3, %%ymm3, %%ymm3\n"			\
+	    "vpxor	%%ymm4, %%ymm4, %%ymm4\n"			\
+	    "vpxor	%%ymm5, %%ymm5, %%ymm5\n"			\
+	    "vpxor	%%ymm6, %%ymm6, %%ymm6\n"			\
+	    "vpxor	%%ymm7, %%ymm7, %%ymm7\n"			\
+	    "1:\n"							\
+	    "vpmovzxdq	(%[ip]), %%ymm8\n"				\
+	    "vpmovzxdq	16(%[ip]), %%ymm9\n"				\
+	    bswap							\
+	    "vpaddq	%%ymm8, %%ymm0, %%ymm0\n"			\
+	    "vpaddq	%%ymm9, %%ymm1, %%ymm1\n"			\
+	    "vpaddq	%%ymm0, %%ymm2, %%ymm2\n"			\
+	    "vpaddq	%%ymm1, %%ymm3, %%ymm3\n"			\
+	    "vpaddq	%%ymm2, %%ymm4, %%ymm4\n"			\
+	    "vpaddq	%%ymm3, %%ymm5, %%ymm5\n"			\
+	    "vpaddq	%%ymm4, %%ymm6, %%ymm6\n"			\
+	    "vpaddq	%%ymm5, %%ymm7, %%ymm7\n"			\
+	    "add	$32, %[ip]\n"					\
+	    "sub	$32, %[n]\n"					\
+	    "jnz	1b\n"						\
+	    "vmovdqu	%%ymm0, 0(%[l])\n"				\
+	    "vmovdqu	%%ymm1, 32(%[l])\n"				\
+	    "vmovdqu	%%ymm2, 64(%[l])\n"				\
+	    "vmovdqu	%%ymm3, 96(%[l])\n"				\
+	    "vmovdqu	%%ymm4, 128(%[l])\n"				\
+	    "vmovdqu	%%ymm5, 160(%[l])\n"				\
+	    "vmovdqu	%%ymm6, 192(%[l])\n"				\
+	    "vmovdqu	%%ymm7, 224(%[l])\n"				\
+	    "vzeroupper\n"						\
+	    : [ip] "+r" (ip), [n] "+r" (size)				\
+	    : [l] "r" (lanes), [k] "r" (fletcher_avx2_bswap)		\
+	    : FLETCHER_X86_CLOBBERS)
+
+static void
+fletcher_4_avx2_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	uint64_t lanes[4][8];
+	const void *ip = buf;
+
+	kfpu_begin();
+	AVX2_LOOP("");
+	kfpu_end();
+
+	fletcher_x86_combine(&lanes[0][0], 8, zcp);
+}
+
+static void
+fletcher_4_avx2_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	uint64_t lanes[4][8];
+	const void *ip = buf;
+
+	kfpu_begin();
+	AVX2_LOOP(AVX2_BSWAP);
+	kfpu_end();
+
+	fletcher_x86_combine(&lanes[0][0], 8, zcp);
+}
+
+const fletcher_4_ops_t fletcher_4_avx2_impl = {
+	fletcher_4_avx2_native,
+	fletcher_4_avx2_byteswap,
+	zfs_avx2_available,
+	"avx2"
+};
+
+#endif /* __x86_64__ */
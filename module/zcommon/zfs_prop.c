@@ -95,6 +95,7 @@ zfs_prop_init(void)
 		{ "gzip-8",	ZIO_COMPRESS_GZIP_8 },
 		{ "gzip-9",	ZIO_COMPRESS_GZIP_9 },
 		{ "zle",	ZIO_COMPRESS_ZLE },
+		{ "lz4",	ZIO_COMPRESS_LZ4 },
 		{ NULL }
 	};
 
@@ -202,7 +203,7 @@ zfs_prop_init(void)
 	zprop_register_index(ZFS_PROP_COMPRESSION, "compression",
 	    ZIO_COMPRESS_DEFAULT, PROP_INHERIT,
 	    ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
-	    "on | off | lzjb | gzip | gzip-[1-9] | zle", "COMPRESS",
+	    "on | off | lzjb | gzip | gzip-[1-9] | zle | lz4", "COMPRESS",
 	    compress_table);
 	zprop_register_index(ZFS_PROP_SNAPDIR, "snapdir", ZFS_SNAPDIR_HIDDEN,
 	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM,
@@ -596,8 +597,21 @@ zfs_prop_align_right(zfs_prop_t prop)
 
 #if defined(_KERNEL) && defined(HAVE_SPL)
 
-static int zcommon_init(void) { return 0; }
-static int zcommon_fini(void) { return 0; }
+#include <zfs_fletcher.h>
+
+static int
+zcommon_init(void)
+{
+	fletcher_4_init();
+	return (0);
+}
+
+static int
+zcommon_fini(void)
+{
+	fletcher_4_fini();
+	return (0);
+}
 
 spl_module_init(zcommon_init);
 spl_module_exit(zcommon_fini);
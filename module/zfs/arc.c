@@ -118,11 +118,15 @@
 
 #include <sys/spa.h>
 #include <sys/zio.h>
+#include <sys/zio_compress.h>
+#include <sys/zio_checksum.h>
 #include <sys/zfs_context.h>
 #include <sys/arc.h>
 #include <sys/refcount.h>
+#include <sys/multilist.h>
 #include <sys/vdev.h>
 #include <sys/vdev_impl.h>
+#include <sys/dsl_pool.h>
 #ifdef _KERNEL
 #include <sys/vmsystm.h>
 #include <vm/anon.h>
@@ -135,12 +139,10 @@
 
 static kmutex_t		arc_reclaim_thr_lock;
 static kcondvar_t	arc_reclaim_thr_cv;	/* used to signal reclaim thr */
+static kcondvar_t	arc_evict_waiters_cv;	/* allocations waiting on it */
+static uint64_t		arc_evict_blocked;	/* waits since its last pass */
 static uint8_t		arc_thread_exit;
 
-extern int zfs_write_limit_shift;
-extern uint64_t zfs_write_limit_max;
-extern kmutex_t zfs_write_limit_lock;
-
 #define	ARC_REDUCE_DNLC_PERCENT	3
 uint_t arc_reduce_dnlc_percent = ARC_REDUCE_DNLC_PERCENT;
 
@@ -181,6 +183,40 @@ int zfs_arc_grow_retry = 0;
 int zfs_arc_shrink_shift = 0;
 int zfs_arc_p_min_shift = 0;
 
+/*
+ * Keep a copy of compressed blocks in their on-disk form.  See the
+ * "Compressed ARC" comment below.
+ */
+int zfs_arc_compressed = 1;
+
+/*
+ * Number of sublists, each with its own lock, that the evictable list of
+ * every ARC state is split into.  0 means one per CPU.
+ */
+int zfs_arc_num_sublists_per_state = 0;
+
+/*
+ * Eviction is done by the reclaim thread, not by the threads allocating
+ * buffers.  Allocations may take the cache over arc_c by 1/2^shift of it
+ * (but at least SPA_MAXBLOCKSIZE) while the thread catches up; beyond
+ * that they wait for it.  To keep them from waiting, the thread evicts
+ * down to arc_evict_headroom below arc_c.  The headroom doubles after a
+ * pass during which allocations had to wait, up to the same 1/2^shift
+ * of arc_c, and halves after a pass during which none did.
+ */
+int zfs_arc_overflow_shift = 8;
+static uint64_t arc_evict_headroom;
+
+/*
+ * Histogram of the time allocations spent waiting for the reclaim thread,
+ * exported in the arc_evict_wait kstat.  Bucket n counts waits of at
+ * least 2^n microseconds (the first also counts shorter ones, the last
+ * all longer ones).
+ */
+#define	ARC_EVICT_WAIT_BUCKETS	24
+static kstat_named_t arc_evict_wait_hist[ARC_EVICT_WAIT_BUCKETS];
+static kstat_t *arc_evict_wait_ksp;
+
 /*
  * Note that buffers can be in one of 6 states:
  *	ARC_anon	- anonymous (discussed below)
@@ -214,10 +250,10 @@ int zfs_arc_p_min_shift = 0;
  */
 
 typedef struct arc_state {
-	list_t	arcs_list[ARC_BUFC_NUMTYPES];	/* list of evictable buffers */
+	/* list of evictable buffers */
+	multilist_t arcs_list[ARC_BUFC_NUMTYPES];
 	uint64_t arcs_lsize[ARC_BUFC_NUMTYPES];	/* amount of evictable data */
 	uint64_t arcs_size;	/* total amount of data in this state */
-	kmutex_t arcs_mtx;
 } arc_state_t;
 
 /* The 6 states: */
@@ -244,7 +280,6 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_mfu_hits;
 	kstat_named_t arcstat_mfu_ghost_hits;
 	kstat_named_t arcstat_deleted;
-	kstat_named_t arcstat_recycle_miss;
 	kstat_named_t arcstat_mutex_miss;
 	kstat_named_t arcstat_evict_skip;
 	kstat_named_t arcstat_evict_l2_cached;
@@ -263,6 +298,9 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_hdr_size;
 	kstat_named_t arcstat_data_size;
 	kstat_named_t arcstat_other_size;
+	kstat_named_t arcstat_compressed_size;
+	kstat_named_t arcstat_uncompressed_size;
+	kstat_named_t arcstat_compressed_hits;
 	kstat_named_t arcstat_l2_hits;
 	kstat_named_t arcstat_l2_misses;
 	kstat_named_t arcstat_l2_feeds;
@@ -281,7 +319,22 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_l2_io_error;
 	kstat_named_t arcstat_l2_size;
 	kstat_named_t arcstat_l2_hdr_size;
+	kstat_named_t arcstat_l2_log_blk_writes;
+	kstat_named_t arcstat_l2_rebuild_successes;
+	kstat_named_t arcstat_l2_rebuild_log_blks;
+	kstat_named_t arcstat_l2_rebuild_bufs;
+	kstat_named_t arcstat_l2_rebuild_bufs_precached;
+	kstat_named_t arcstat_l2_rebuild_cksum_errors;
+	kstat_named_t arcstat_l2_rebuild_io_errors;
+	kstat_named_t arcstat_l2_rebuild_lowmem;
 	kstat_named_t arcstat_memory_throttle_count;
+	kstat_named_t arcstat_mru_lock_contended;
+	kstat_named_t arcstat_mru_ghost_lock_contended;
+	kstat_named_t arcstat_mfu_lock_contended;
+	kstat_named_t arcstat_mfu_ghost_lock_contended;
+	kstat_named_t arcstat_l2c_only_lock_contended;
+	kstat_named_t arcstat_evict_headroom;
+	kstat_named_t arcstat_evict_waits;
 } arc_stats_t;
 
 static arc_stats_t arc_stats = {
@@ -300,7 +353,6 @@ static arc_stats_t arc_stats = {
 	{ "mfu_hits",			KSTAT_DATA_UINT64 },
 	{ "mfu_ghost_hits",		KSTAT_DATA_UINT64 },
 	{ "deleted",			KSTAT_DATA_UINT64 },
-	{ "recycle_miss",		KSTAT_DATA_UINT64 },
 	{ "mutex_miss",			KSTAT_DATA_UINT64 },
 	{ "evict_skip",			KSTAT_DATA_UINT64 },
 	{ "evict_l2_cached",		KSTAT_DATA_UINT64 },
@@ -319,6 +371,9 @@ static arc_stats_t arc_stats = {
 	{ "hdr_size",			KSTAT_DATA_UINT64 },
 	{ "data_size",			KSTAT_DATA_UINT64 },
 	{ "other_size",			KSTAT_DATA_UINT64 },
+	{ "compressed_size",		KSTAT_DATA_UINT64 },
+	{ "uncompressed_size",		KSTAT_DATA_UINT64 },
+	{ "compressed_hits",		KSTAT_DATA_UINT64 },
 	{ "l2_hits",			KSTAT_DATA_UINT64 },
 	{ "l2_misses",			KSTAT_DATA_UINT64 },
 	{ "l2_feeds",			KSTAT_DATA_UINT64 },
@@ -337,7 +392,22 @@ static arc_stats_t arc_stats = {
 	{ "l2_io_error",		KSTAT_DATA_UINT64 },
 	{ "l2_size",			KSTAT_DATA_UINT64 },
 	{ "l2_hdr_size",		KSTAT_DATA_UINT64 },
-	{ "memory_throttle_count",	KSTAT_DATA_UINT64 }
+	{ "l2_log_blk_writes",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_successes",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_log_blks",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs_precached",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_cksum_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_io_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_lowmem",		KSTAT_DATA_UINT64 },
+	{ "memory_throttle_count",	KSTAT_DATA_UINT64 },
+	{ "mru_lock_contended",		KSTAT_DATA_UINT64 },
+	{ "mru_ghost_lock_contended",	KSTAT_DATA_UINT64 },
+	{ "mfu_lock_contended",		KSTAT_DATA_UINT64 },
+	{ "mfu_ghost_lock_contended",	KSTAT_DATA_UINT64 },
+	{ "l2c_only_lock_contended",	KSTAT_DATA_UINT64 },
+	{ "evict_headroom",		KSTAT_DATA_UINT64 },
+	{ "evict_waits",		KSTAT_DATA_UINT64 }
 };
 
 #define	ARCSTAT(stat)	(arc_stats.stat.value.ui64)
@@ -446,6 +516,11 @@ struct arc_buf_hdr {
 	arc_callback_t		*b_acb;
 	kcondvar_t		b_cv;
 
+	/* compressed copy of the block, see arc_cdata_alloc() */
+	void			*b_cdata;
+	uint64_t		b_psize;
+	enum zio_compress	b_compress;
+
 	/* immutable */
 	arc_buf_contents_t	b_type;
 	uint64_t		b_size;
@@ -479,6 +554,10 @@ static boolean_t l2arc_write_eligible(uint64_t spa_guid, arc_buf_hdr_t *ab);
 	((state) == arc_mru_ghost || (state) == arc_mfu_ghost ||	\
 	(state) == arc_l2c_only)
 
+/* bytes of data held by a non-ghost hdr: its bufs and compressed copy */
+#define	HDR_DATA_SIZE(hdr)	\
+	((hdr)->b_datacnt * (hdr)->b_size + (hdr)->b_psize)
+
 /*
  * Private ARC flags.  These flags are private ARC only flags that will show up
  * in b_flags in the arc_hdr_buf_t.  Some flags are publicly declared, and can
@@ -497,6 +576,8 @@ static boolean_t l2arc_write_eligible(uint64_t spa_guid, arc_buf_hdr_t *ab);
 #define	ARC_L2_WRITING		(1 << 16)	/* L2ARC write in progress */
 #define	ARC_L2_EVICTED		(1 << 17)	/* evicted during I/O */
 #define	ARC_L2_WRITE_HEAD	(1 << 18)	/* head of write list */
+#define	ARC_UNCOMPRESSED	(1 << 19)	/* stored as is on disk */
+#define	ARC_L2_REBUILT		(1 << 20)	/* restored from L2ARC log */
 
 #define	HDR_IN_HASH_TABLE(hdr)	((hdr)->b_flags & ARC_IN_HASH_TABLE)
 #define	HDR_IO_IN_PROGRESS(hdr)	((hdr)->b_flags & ARC_IO_IN_PROGRESS)
@@ -511,6 +592,8 @@ static boolean_t l2arc_write_eligible(uint64_t spa_guid, arc_buf_hdr_t *ab);
 #define	HDR_L2_WRITING(hdr)	((hdr)->b_flags & ARC_L2_WRITING)
 #define	HDR_L2_EVICTED(hdr)	((hdr)->b_flags & ARC_L2_EVICTED)
 #define	HDR_L2_WRITE_HEAD(hdr)	((hdr)->b_flags & ARC_L2_WRITE_HEAD)
+#define	HDR_UNCOMPRESSED(hdr)	((hdr)->b_flags & ARC_UNCOMPRESSED)
+#define	HDR_L2_REBUILT(hdr)	((hdr)->b_flags & ARC_L2_REBUILT)
 
 /*
  * Other sizes
@@ -574,6 +657,87 @@ uint64_t l2arc_feed_min_ms = L2ARC_FEED_MIN_MS;	/* min interval milliseconds */
 boolean_t l2arc_noprefetch = B_TRUE;		/* don't cache prefetch bufs */
 boolean_t l2arc_feed_again = B_TRUE;		/* turbo warmup */
 boolean_t l2arc_norw = B_TRUE;			/* no reads during writes */
+boolean_t l2arc_rebuild_enabled = B_TRUE;	/* rebuild from device log */
+
+/*
+ * Persistent L2ARC
+ *
+ * Every l2arc_write_buffers() batch ends with a log block describing the
+ * buffers it wrote, and each log block points back at the one before it.
+ * Just past the front labels every cache device carries a small header
+ * pointing at the most recent log block, which is rewritten once the
+ * batch has reached the device:
+ *
+ *	+-----+--------+------------------------+----+-------------+----+---
+ *	| hdr | ... bufs of batch n-1 | log n-1 | bufs of batch n | log n |
+ *	+-----+--------+------------------------+----+-------------+----+---
+ *	   |                              ^                           ^  |
+ *	   |                              +---------------------------|--'
+ *	   +----------------------------------------------------------'
+ *
+ * When a device is added, l2arc_dev_rebuild_thread() walks this chain
+ * from the newest log block back and restores a header in the l2c_only
+ * state for every buffer it describes, so the cache survives an export
+ * or reboot.  The walk stops at the first log block which fails its
+ * checksum or lies in space that the write hand has since reused.  The
+ * rebuild runs in the background; the device is not fed until it is done.
+ *
+ * A restored header has no freeze checksum, so reads of its L2ARC copy
+ * are verified against the block pointer instead.  Only buffers whose
+ * L2ARC copy is the physical block (uncompressed blocks, and the compressed
+ * copy kept by the compressed ARC) can be checked this way, so only those
+ * are logged.
+ */
+#define	L2ARC_DEV_HDR_MAGIC	0x5a46534c32415243ULL	/* ZFSL2ARC */
+#define	L2ARC_LOG_BLK_MAGIC	0x4c32415243424c4bULL	/* L2ARCBLK */
+#define	L2ARC_LOG_BLK_ENTRIES	1364	/* fills a 64k log block */
+
+typedef struct l2arc_log_blkptr {
+	uint64_t	lbp_daddr;		/* device address of log block */
+	uint64_t	lbp_size;		/* bytes written */
+	zio_cksum_t	lbp_cksum;		/* fletcher-4 of those bytes */
+} l2arc_log_blkptr_t;
+
+typedef struct l2arc_log_ent_phys {
+	dva_t		le_dva;			/* identity of the block */
+	uint64_t	le_birth;
+	uint64_t	le_cksum0;
+	uint64_t	le_daddr;		/* device address of the data */
+	uint64_t	le_prop;		/* see LE_* below */
+} l2arc_log_ent_phys_t;
+
+#define	LE_GET_LSIZE(le)	\
+	BF64_GET_SB((le)->le_prop, 0, 16, SPA_MINBLOCKSHIFT, 1)
+#define	LE_SET_LSIZE(le, x)	\
+	BF64_SET_SB((le)->le_prop, 0, 16, SPA_MINBLOCKSHIFT, 1, x)
+#define	LE_GET_ASIZE(le)	\
+	BF64_GET_SB((le)->le_prop, 16, 16, SPA_MINBLOCKSHIFT, 1)
+#define	LE_SET_ASIZE(le, x)	\
+	BF64_SET_SB((le)->le_prop, 16, 16, SPA_MINBLOCKSHIFT, 1, x)
+#define	LE_GET_COMPRESS(le)	BF64_GET((le)->le_prop, 32, 8)
+#define	LE_SET_COMPRESS(le, x)	BF64_SET((le)->le_prop, 32, 8, x)
+#define	LE_GET_TYPE(le)		BF64_GET((le)->le_prop, 40, 8)
+#define	LE_SET_TYPE(le, x)	BF64_SET((le)->le_prop, 40, 8, x)
+
+typedef struct l2arc_log_blk_phys {
+	uint64_t		lb_magic;
+	uint64_t		lb_nents;	/* entries in use */
+	l2arc_log_blkptr_t	lb_prev;	/* previous log block */
+	l2arc_log_ent_phys_t	lb_entries[L2ARC_LOG_BLK_ENTRIES];
+} l2arc_log_blk_phys_t;
+
+#define	L2ARC_LOG_BLK_SIZE	sizeof (l2arc_log_blk_phys_t)
+#define	L2ARC_LOG_BLK_USED(n)	\
+	offsetof(l2arc_log_blk_phys_t, lb_entries[n])
+
+typedef struct l2arc_dev_hdr_phys {
+	uint64_t		dh_magic;
+	uint64_t		dh_spa_guid;
+	uint64_t		dh_vdev_guid;
+	uint64_t		dh_hand;	/* write hand after last batch */
+	l2arc_log_blkptr_t	dh_log;		/* most recent log block */
+	zio_cksum_t		dh_cksum;	/* fletcher-4 of the above */
+} l2arc_dev_hdr_phys_t;
 
 /*
  * L2ARC Internals
@@ -591,6 +755,10 @@ typedef struct l2arc_dev {
 	boolean_t		l2ad_writing;	/* currently writing */
 	list_t			*l2ad_buflist;	/* buffer list */
 	list_node_t		l2ad_node;	/* device list node */
+	uint64_t		l2ad_dev_hdr_asize; /* persistent header size */
+	l2arc_log_blkptr_t	l2ad_log_prev;	/* last log block written */
+	boolean_t		l2ad_rebuild;	/* rebuild in progress */
+	boolean_t		l2ad_rebuild_cancel; /* device being removed */
 } l2arc_dev_t;
 
 static list_t L2ARC_dev_list;			/* device list */
@@ -602,6 +770,7 @@ static list_t L2ARC_free_on_write;		/* free after write buf list */
 static list_t *l2arc_free_on_write;		/* free after write list ptr */
 static kmutex_t l2arc_free_on_write_mtx;	/* mutex for list */
 static uint64_t l2arc_ndev;			/* number of devices */
+static kcondvar_t l2arc_rebuild_cv;		/* rebuild completed */
 
 typedef struct l2arc_read_callback {
 	arc_buf_t	*l2rcb_buf;		/* read buffer */
@@ -609,6 +778,9 @@ typedef struct l2arc_read_callback {
 	blkptr_t	l2rcb_bp;		/* original blkptr */
 	zbookmark_t	l2rcb_zb;		/* original bookmark */
 	int		l2rcb_flags;		/* original flags */
+	void		*l2rcb_data;		/* compressed read buffer */
+	uint64_t	l2rcb_size;		/* compressed read size */
+	enum zio_compress l2rcb_compress;	/* compression algorithm */
 } l2arc_read_callback_t;
 
 typedef struct l2arc_write_callback {
@@ -620,6 +792,8 @@ struct l2arc_buf_hdr {
 	/* protected by arc_buf_hdr  mutex */
 	l2arc_dev_t	*b_dev;			/* L2ARC device */
 	uint64_t	b_daddr;		/* disk address, offset byte */
+	uint64_t	b_asize;		/* space used on the device */
+	enum zio_compress b_compress;		/* compression of stored data */
 };
 
 typedef struct l2arc_data_free {
@@ -1022,14 +1196,12 @@ add_reference(arc_buf_hdr_t *ab, kmutex_t *hash_lock, void *tag)
 
 	if ((refcount_add(&ab->b_refcnt, tag) == 1) &&
 	    (ab->b_state != arc_anon)) {
-		uint64_t delta = ab->b_size * ab->b_datacnt;
-		list_t *list = &ab->b_state->arcs_list[ab->b_type];
+		uint64_t delta = HDR_DATA_SIZE(ab);
+		multilist_t *list = &ab->b_state->arcs_list[ab->b_type];
 		uint64_t *size = &ab->b_state->arcs_lsize[ab->b_type];
 
-		ASSERT(!MUTEX_HELD(&ab->b_state->arcs_mtx));
-		mutex_enter(&ab->b_state->arcs_mtx);
 		ASSERT(list_link_active(&ab->b_arc_node));
-		list_remove(list, ab);
+		multilist_remove(list, ab);
 		if (GHOST_STATE(ab->b_state)) {
 			ASSERT3U(ab->b_datacnt, ==, 0);
 			ASSERT3P(ab->b_buf, ==, NULL);
@@ -1038,7 +1210,6 @@ add_reference(arc_buf_hdr_t *ab, kmutex_t *hash_lock, void *tag)
 		ASSERT(delta > 0);
 		ASSERT3U(*size, >=, delta);
 		atomic_add_64(size, -delta);
-		mutex_exit(&ab->b_state->arcs_mtx);
 		/* remove the prefetch flag if we get a reference */
 		if (ab->b_flags & ARC_PREFETCH)
 			ab->b_flags &= ~ARC_PREFETCH;
@@ -1058,13 +1229,10 @@ remove_reference(arc_buf_hdr_t *ab, kmutex_t *hash_lock, void *tag)
 	    (state != arc_anon)) {
 		uint64_t *size = &state->arcs_lsize[ab->b_type];
 
-		ASSERT(!MUTEX_HELD(&state->arcs_mtx));
-		mutex_enter(&state->arcs_mtx);
 		ASSERT(!list_link_active(&ab->b_arc_node));
-		list_insert_head(&state->arcs_list[ab->b_type], ab);
+		multilist_insert(&state->arcs_list[ab->b_type], ab);
 		ASSERT(ab->b_datacnt > 0);
-		atomic_add_64(size, ab->b_size * ab->b_datacnt);
-		mutex_exit(&state->arcs_mtx);
+		atomic_add_64(size, HDR_DATA_SIZE(ab));
 	}
 	return (cnt);
 }
@@ -1084,9 +1252,10 @@ arc_change_state(arc_state_t *new_state, arc_buf_hdr_t *ab, kmutex_t *hash_lock)
 	ASSERT(new_state != old_state);
 	ASSERT(refcnt == 0 || ab->b_datacnt > 0);
 	ASSERT(ab->b_datacnt == 0 || !GHOST_STATE(new_state));
+	ASSERT(ab->b_cdata == NULL || !GHOST_STATE(new_state));
 	ASSERT(ab->b_datacnt <= 1 || old_state != arc_anon);
 
-	from_delta = to_delta = ab->b_datacnt * ab->b_size;
+	from_delta = to_delta = HDR_DATA_SIZE(ab);
 
 	/*
 	 * If this buffer is evictable, transfer it from the
@@ -1094,14 +1263,10 @@ arc_change_state(arc_state_t *new_state, arc_buf_hdr_t *ab, kmutex_t *hash_lock)
 	 */
 	if (refcnt == 0) {
 		if (old_state != arc_anon) {
-			int use_mutex = !MUTEX_HELD(&old_state->arcs_mtx);
 			uint64_t *size = &old_state->arcs_lsize[ab->b_type];
 
-			if (use_mutex)
-				mutex_enter(&old_state->arcs_mtx);
-
 			ASSERT(list_link_active(&ab->b_arc_node));
-			list_remove(&old_state->arcs_list[ab->b_type], ab);
+			multilist_remove(&old_state->arcs_list[ab->b_type], ab);
 
 			/*
 			 * If prefetching out of the ghost cache,
@@ -1114,18 +1279,11 @@ arc_change_state(arc_state_t *new_state, arc_buf_hdr_t *ab, kmutex_t *hash_lock)
 			}
 			ASSERT3U(*size, >=, from_delta);
 			atomic_add_64(size, -from_delta);
-
-			if (use_mutex)
-				mutex_exit(&old_state->arcs_mtx);
 		}
 		if (new_state != arc_anon) {
-			int use_mutex = !MUTEX_HELD(&new_state->arcs_mtx);
 			uint64_t *size = &new_state->arcs_lsize[ab->b_type];
 
-			if (use_mutex)
-				mutex_enter(&new_state->arcs_mtx);
-
-			list_insert_head(&new_state->arcs_list[ab->b_type], ab);
+			multilist_insert(&new_state->arcs_list[ab->b_type], ab);
 
 			/* ghost elements have a ghost size */
 			if (GHOST_STATE(new_state)) {
@@ -1134,9 +1292,6 @@ arc_change_state(arc_state_t *new_state, arc_buf_hdr_t *ab, kmutex_t *hash_lock)
 				to_delta = ab->b_size;
 			}
 			atomic_add_64(size, to_delta);
-
-			if (use_mutex)
-				mutex_exit(&new_state->arcs_mtx);
 		}
 	}
 
@@ -1180,6 +1335,9 @@ arc_space_consume(uint64_t space, arc_space_type_t type)
 	case ARC_SPACE_L2HDRS:
 		ARCSTAT_INCR(arcstat_l2_hdr_size, space);
 		break;
+	case ARC_SPACE_COMPRESSED:
+		ARCSTAT_INCR(arcstat_compressed_size, space);
+		break;
 	}
 
 	atomic_add_64(&arc_meta_used, space);
@@ -1206,6 +1364,9 @@ arc_space_return(uint64_t space, arc_space_type_t type)
 	case ARC_SPACE_L2HDRS:
 		ARCSTAT_INCR(arcstat_l2_hdr_size, -space);
 		break;
+	case ARC_SPACE_COMPRESSED:
+		ARCSTAT_INCR(arcstat_compressed_size, -space);
+		break;
 	}
 
 	ASSERT(arc_meta_used >= space);
@@ -1242,6 +1403,7 @@ arc_buf_alloc(spa_t *spa, int size, void *tag, arc_buf_contents_t type)
 	ASSERT3U(size, >, 0);
 	hdr = kmem_cache_alloc(hdr_cache, KM_PUSHPAGE);
 	ASSERT(BUF_EMPTY(hdr));
+	ASSERT(hdr->b_cdata == NULL);
 	hdr->b_size = size;
 	hdr->b_type = type;
 	hdr->b_spa = spa_guid(spa);
@@ -1391,6 +1553,129 @@ arc_buf_data_free(arc_buf_hdr_t *hdr, void (*free_func)(void *, size_t),
 	}
 }
 
+/*
+ * Compressed ARC
+ *
+ * A block that is compressed on disk (and is not a gang block) is read
+ * without decompression (ZIO_FLAG_RAW, the checksum is still verified)
+ * into b_cdata, and is then decompressed into the hdr's arc_buf_t.  The
+ * uncompressed buffers are only a working copy of b_cdata, kept while the
+ * block is referenced: when the last reference goes away they are freed
+ * (see arc_cdata_only()) and the hdr stays in its state with just the
+ * compressed copy.  A later hit decompresses a new buffer from it, and
+ * when the hdr comes up for eviction the compressed copy is freed and the
+ * hdr moved to a ghost list.  Ghost hdrs never hold data.
+ *
+ * The compressed copy is part of the hdr's size in its state (see
+ * HDR_DATA_SIZE()) and in arc_size, so it is evicted like any other
+ * buffer.  b_cdata is only set or cleared under the hash lock, or while
+ * the hdr is anonymous.  It is freed as soon as the block is released
+ * for modification, and the L2ARC writes it in place of the uncompressed
+ * buffer.
+ */
+static void
+arc_cdata_alloc(arc_buf_hdr_t *hdr, const blkptr_t *bp)
+{
+	arc_state_t *state = hdr->b_state;
+	uint64_t psize = BP_GET_PSIZE(bp);
+
+	ASSERT(hdr->b_cdata == NULL);
+	ASSERT(!GHOST_STATE(state));
+	ASSERT(BP_GET_COMPRESS(bp) != ZIO_COMPRESS_OFF);
+
+	if (hdr->b_type == ARC_BUFC_METADATA) {
+		hdr->b_cdata = zio_buf_alloc(psize);
+		arc_space_consume(psize, ARC_SPACE_COMPRESSED);
+	} else {
+		ASSERT(hdr->b_type == ARC_BUFC_DATA);
+		hdr->b_cdata = zio_data_buf_alloc(psize);
+		ARCSTAT_INCR(arcstat_compressed_size, psize);
+		atomic_add_64(&arc_size, psize);
+	}
+	ARCSTAT_INCR(arcstat_uncompressed_size, hdr->b_size);
+	hdr->b_psize = psize;
+	hdr->b_compress = BP_GET_COMPRESS(bp);
+
+	atomic_add_64(&state->arcs_size, psize);
+	if (list_link_active(&hdr->b_arc_node)) {
+		ASSERT(refcount_is_zero(&hdr->b_refcnt));
+		atomic_add_64(&state->arcs_lsize[hdr->b_type], psize);
+	}
+}
+
+static void
+arc_cdata_free(arc_buf_hdr_t *hdr)
+{
+	arc_state_t *state = hdr->b_state;
+	uint64_t psize = hdr->b_psize;
+
+	if (hdr->b_cdata == NULL)
+		return;
+
+	ASSERT(!GHOST_STATE(state));
+
+	if (hdr->b_type == ARC_BUFC_METADATA) {
+		arc_buf_data_free(hdr, zio_buf_free, hdr->b_cdata, psize);
+		arc_space_return(psize, ARC_SPACE_COMPRESSED);
+	} else {
+		ASSERT(hdr->b_type == ARC_BUFC_DATA);
+		arc_buf_data_free(hdr, zio_data_buf_free, hdr->b_cdata, psize);
+		ARCSTAT_INCR(arcstat_compressed_size, -psize);
+		atomic_add_64(&arc_size, -psize);
+	}
+	ARCSTAT_INCR(arcstat_uncompressed_size, -hdr->b_size);
+	hdr->b_cdata = NULL;
+	hdr->b_psize = 0;
+	hdr->b_compress = ZIO_COMPRESS_OFF;
+
+	if (list_link_active(&hdr->b_arc_node)) {
+		uint64_t *size = &state->arcs_lsize[hdr->b_type];
+
+		ASSERT(refcount_is_zero(&hdr->b_refcnt));
+		ASSERT3U(*size, >=, psize);
+		atomic_add_64(size, -psize);
+	}
+	ASSERT3U(state->arcs_size, >=, psize);
+	atomic_add_64(&state->arcs_size, -psize);
+}
+
+/*
+ * Create a buf for a hdr that is down to its compressed copy.  The
+ * caller holds the hash lock and a reference on the hdr.
+ */
+static arc_buf_t *
+arc_cdata_buf(arc_buf_hdr_t *hdr, const blkptr_t *bp)
+{
+	arc_buf_t *buf;
+
+	ASSERT(hdr->b_cdata != NULL);
+	ASSERT(hdr->b_buf == NULL);
+	ASSERT(!refcount_is_zero(&hdr->b_refcnt));
+
+	buf = kmem_cache_alloc(buf_cache, KM_PUSHPAGE);
+	buf->b_hdr = hdr;
+	buf->b_data = NULL;
+	buf->b_efunc = NULL;
+	buf->b_private = NULL;
+	buf->b_next = NULL;
+	hdr->b_buf = buf;
+	arc_get_data_buf(buf);
+	hdr->b_datacnt = 1;
+
+	/* this already decompressed once, when the block was read */
+	VERIFY(zio_decompress_data(hdr->b_compress, hdr->b_cdata,
+	    buf->b_data, hdr->b_psize, hdr->b_size) == 0);
+
+	if (BP_SHOULD_BYTESWAP(bp)) {
+		arc_byteswap_func_t *func = BP_GET_LEVEL(bp) > 0 ?
+		    byteswap_uint64_array : dmu_ot[BP_GET_TYPE(bp)].ot_byteswap;
+		func(buf->b_data, hdr->b_size);
+	}
+
+	arc_cksum_compute(buf, B_FALSE);
+	return (buf);
+}
+
 static void
 arc_buf_destroy(arc_buf_t *buf, boolean_t recycle, boolean_t all)
 {
@@ -1478,7 +1763,7 @@ arc_hdr_destroy(arc_buf_hdr_t *hdr)
 
 		if (l2hdr != NULL) {
 			list_remove(l2hdr->b_dev->l2ad_buflist, hdr);
-			ARCSTAT_INCR(arcstat_l2_size, -hdr->b_size);
+			ARCSTAT_INCR(arcstat_l2_size, -l2hdr->b_asize);
 			kmem_free(l2hdr, sizeof (l2arc_buf_hdr_t));
 			if (hdr->b_state == arc_l2c_only)
 				l2arc_hdr_stat_remove();
@@ -1493,6 +1778,7 @@ arc_hdr_destroy(arc_buf_hdr_t *hdr)
 		ASSERT(!HDR_IN_HASH_TABLE(hdr));
 		buf_discard_identity(hdr);
 	}
+	arc_cdata_free(hdr);
 	while (hdr->b_buf) {
 		arc_buf_t *buf = hdr->b_buf;
 
@@ -1526,6 +1812,52 @@ arc_hdr_destroy(arc_buf_hdr_t *hdr)
 	kmem_cache_free(hdr_cache, hdr);
 }
 
+/*
+ * Once the last reference on a cached hdr with a compressed copy is gone,
+ * free its uncompressed bufs so that it only holds b_psize bytes until the
+ * next hit.  A buf with an eviction callback goes to the eviction list as
+ * in arc_evict_sublist(), and one whose evict lock is busy is left to be
+ * evicted later.
+ */
+static void
+arc_cdata_only(arc_buf_hdr_t *hdr, kmutex_t *hash_lock)
+{
+	arc_buf_t **bufp = &hdr->b_buf;
+	arc_buf_t *buf;
+
+	ASSERT(MUTEX_HELD(hash_lock));
+
+	if (hdr->b_cdata == NULL || hdr->b_state == arc_anon ||
+	    HDR_IO_IN_PROGRESS(hdr) || !refcount_is_zero(&hdr->b_refcnt))
+		return;
+
+	/* keep the checksum that l2arc_read_done() verifies the block by */
+	if (hdr->b_buf != NULL && (hdr->b_flags & ARC_L2CACHE))
+		arc_cksum_compute(hdr->b_buf, B_TRUE);
+
+	while ((buf = *bufp) != NULL) {
+		if (!mutex_tryenter(&buf->b_evict_lock)) {
+			bufp = &buf->b_next;
+			continue;
+		}
+		if (buf->b_efunc) {
+			mutex_enter(&arc_eviction_mtx);
+			arc_buf_destroy(buf, FALSE, FALSE);
+			*bufp = buf->b_next;
+			buf->b_hdr = &arc_eviction_hdr;
+			buf->b_next = arc_eviction_list;
+			arc_eviction_list = buf;
+			mutex_exit(&arc_eviction_mtx);
+			mutex_exit(&buf->b_evict_lock);
+		} else {
+			mutex_exit(&buf->b_evict_lock);
+			arc_buf_destroy(buf, FALSE, TRUE);
+		}
+	}
+	if (hdr->b_datacnt == 0)
+		hdr->b_flags &= ~ARC_BUF_AVAILABLE;
+}
+
 void
 arc_buf_free(arc_buf_t *buf, void *tag)
 {
@@ -1550,6 +1882,7 @@ arc_buf_free(arc_buf_t *buf, void *tag)
 			ASSERT(buf->b_efunc == NULL);
 			hdr->b_flags |= ARC_BUF_AVAILABLE;
 		}
+		arc_cdata_only(hdr, hash_lock);
 		mutex_exit(hash_lock);
 	} else if (HDR_IO_IN_PROGRESS(hdr)) {
 		int destroy_hdr;
@@ -1603,6 +1936,7 @@ arc_buf_remove_ref(arc_buf_t *buf, void* tag)
 	}
 	ASSERT(no_callback || hdr->b_datacnt > 1 ||
 	    refcount_is_zero(&hdr->b_refcnt));
+	arc_cdata_only(hdr, hash_lock);
 	mutex_exit(hash_lock);
 	return (no_callback);
 }
@@ -1614,39 +1948,21 @@ arc_buf_size(arc_buf_t *buf)
 }
 
 /*
- * Evict buffers from list until we've removed the specified number of
- * bytes.  Move the removed buffers to the appropriate evict state.
- * If the recycle flag is set, then attempt to "recycle" a buffer:
- * - look for a buffer to evict that is `bytes' long.
- * - return the data block from this buffer rather than freeing it.
- * This flag is used by callers that are trying to make space for a
- * new buffer in a full arc cache.
- *
- * This function makes a "best effort".  It skips over any buffers
- * it can't get a hash_lock on, and so may not catch all candidates.
- * It may also return without evicting as much space as requested.
+ * Evict buffers from one sublist of an arc_mru or arc_mfu list until we've
+ * removed the specified number of bytes, moving them to evicted_state.
+ * Returns the number of bytes evicted.
  */
-static void *
-arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
-    arc_buf_contents_t type)
+static uint64_t
+arc_evict_sublist(multilist_sublist_t *mls, arc_state_t *evicted_state,
+    uint64_t spa, int64_t bytes)
 {
-	arc_state_t *evicted_state;
 	uint64_t bytes_evicted = 0, skipped = 0, missed = 0;
 	arc_buf_hdr_t *ab, *ab_prev = NULL;
-	list_t *list = &state->arcs_list[type];
 	kmutex_t *hash_lock;
 	boolean_t have_lock;
-	void *stolen = NULL;
-
-	ASSERT(state == arc_mru || state == arc_mfu);
-
-	evicted_state = (state == arc_mru) ? arc_mru_ghost : arc_mfu_ghost;
 
-	mutex_enter(&state->arcs_mtx);
-	mutex_enter(&evicted_state->arcs_mtx);
-
-	for (ab = list_tail(list); ab; ab = ab_prev) {
-		ab_prev = list_prev(list, ab);
+	for (ab = multilist_sublist_tail(mls); ab; ab = ab_prev) {
+		ab_prev = multilist_sublist_prev(mls, ab);
 		/* prefetch buffers have a minimum lifespan */
 		if (HDR_IO_IN_PROGRESS(ab) ||
 		    (spa && ab->b_spa != spa) ||
@@ -1656,34 +1972,24 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 			skipped++;
 			continue;
 		}
-		/* "lookahead" for better eviction candidate */
-		if (recycle && ab->b_size != bytes &&
-		    ab_prev && ab_prev->b_size == bytes)
-			continue;
 		hash_lock = HDR_LOCK(ab);
 		have_lock = MUTEX_HELD(hash_lock);
 		if (have_lock || mutex_tryenter(hash_lock)) {
+			uint64_t datacnt = ab->b_datacnt;
+
 			ASSERT3U(refcount_count(&ab->b_refcnt), ==, 0);
-			ASSERT(ab->b_datacnt > 0);
+			ASSERT(ab->b_datacnt > 0 || ab->b_cdata != NULL);
 			while (ab->b_buf) {
 				arc_buf_t *buf = ab->b_buf;
 				if (!mutex_tryenter(&buf->b_evict_lock)) {
 					missed += 1;
 					break;
 				}
-				if (buf->b_data) {
+				if (buf->b_data)
 					bytes_evicted += ab->b_size;
-					if (recycle && ab->b_type == type &&
-					    ab->b_size == bytes &&
-					    !HDR_L2_WRITING(ab)) {
-						stolen = buf->b_data;
-						recycle = FALSE;
-					}
-				}
 				if (buf->b_efunc) {
 					mutex_enter(&arc_eviction_mtx);
-					arc_buf_destroy(buf,
-					    buf->b_data == stolen, FALSE);
+					arc_buf_destroy(buf, FALSE, FALSE);
 					ab->b_buf = buf->b_next;
 					buf->b_hdr = &arc_eviction_hdr;
 					buf->b_next = arc_eviction_list;
@@ -1692,16 +1998,28 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 					mutex_exit(&buf->b_evict_lock);
 				} else {
 					mutex_exit(&buf->b_evict_lock);
-					arc_buf_destroy(buf,
-					    buf->b_data == stolen, TRUE);
+					arc_buf_destroy(buf, FALSE, TRUE);
 				}
 			}
+			if (ab->b_datacnt == 0)
+				ab->b_flags &= ~ARC_BUF_AVAILABLE;
 
-			if (ab->b_l2hdr) {
-				ARCSTAT_INCR(arcstat_evict_l2_cached,
-				    ab->b_size);
-			} else {
-				if (l2arc_write_eligible(ab->b_spa, ab)) {
+			/*
+			 * A compressed hdr that still had buffers keeps its
+			 * compressed copy, unless the list is being flushed.
+			 */
+			if (ab->b_datacnt == 0 && ab->b_cdata != NULL &&
+			    (datacnt == 0 || bytes < 0)) {
+				bytes_evicted += ab->b_psize;
+				arc_cdata_free(ab);
+			}
+
+			if (ab->b_datacnt == 0 && ab->b_cdata == NULL) {
+				if (ab->b_l2hdr) {
+					ARCSTAT_INCR(arcstat_evict_l2_cached,
+					    ab->b_size);
+				} else if (l2arc_write_eligible(ab->b_spa,
+				    ab)) {
 					ARCSTAT_INCR(arcstat_evict_l2_eligible,
 					    ab->b_size);
 				} else {
@@ -1709,13 +2027,10 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 					    arcstat_evict_l2_ineligible,
 					    ab->b_size);
 				}
-			}
 
-			if (ab->b_datacnt == 0) {
 				arc_change_state(evicted_state, ab, hash_lock);
 				ASSERT(HDR_IN_HASH_TABLE(ab));
 				ab->b_flags |= ARC_IN_HASH_TABLE;
-				ab->b_flags &= ~ARC_BUF_AVAILABLE;
 				DTRACE_PROBE1(arc__evict, arc_buf_hdr_t *, ab);
 			}
 			if (!have_lock)
@@ -1727,19 +2042,76 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 		}
 	}
 
-	mutex_exit(&evicted_state->arcs_mtx);
-	mutex_exit(&state->arcs_mtx);
-
-	if (bytes_evicted < bytes)
-		dprintf("only evicted %lld bytes from %x\n",
-		    (longlong_t)bytes_evicted, state);
-
 	if (skipped)
 		ARCSTAT_INCR(arcstat_evict_skip, skipped);
 
 	if (missed)
 		ARCSTAT_INCR(arcstat_mutex_miss, missed);
 
+	return (bytes_evicted);
+}
+
+/*
+ * Evict buffers from list until we've removed the specified number of
+ * bytes.  Move the removed buffers to the appropriate evict state.
+ * Returns the number of bytes evicted.
+ *
+ * The list is split into sublists which are evicted from in turn,
+ * starting from a random one.  A first pass takes an equal share of
+ * the bytes from each sublist, so that no one sublist is drained while
+ * the others stay full; a second pass makes up any shortfall.  Only
+ * one sublist lock is held at a time.
+ *
+ * This function makes a "best effort".  It skips over any buffers
+ * it can't get a hash_lock on, and so may not catch all candidates.
+ * It may also return without evicting as much space as requested.
+ */
+static uint64_t
+arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes,
+    arc_buf_contents_t type)
+{
+	arc_state_t *evicted_state;
+	multilist_t *ml = &state->arcs_list[type];
+	uint64_t bytes_evicted = 0;
+	int num_sublists, start, pass, i;
+	int64_t share, want;
+
+	ASSERT(state == arc_mru || state == arc_mfu);
+
+	evicted_state = (state == arc_mru) ? arc_mru_ghost : arc_mfu_ghost;
+
+	num_sublists = multilist_get_num_sublists(ml);
+	start = multilist_get_random_index(ml);
+	share = (bytes < 0) ? bytes : MAX(bytes / num_sublists, 1);
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < num_sublists; i++) {
+			multilist_sublist_t *mls;
+
+			if (bytes >= 0 && bytes_evicted >= bytes)
+				break;
+
+			if (bytes < 0)
+				want = bytes;
+			else if (pass == 0)
+				want = MIN(share, bytes - bytes_evicted);
+			else
+				want = bytes - bytes_evicted;
+
+			mls = multilist_sublist_lock(ml,
+			    (start + i) % num_sublists);
+			bytes_evicted += arc_evict_sublist(mls, evicted_state,
+			    spa, want);
+			multilist_sublist_unlock(mls);
+		}
+		if (bytes < 0 || bytes_evicted >= bytes)
+			break;
+	}
+
+	if (bytes_evicted < bytes)
+		dprintf("only evicted %lld bytes from %x\n",
+		    (longlong_t)bytes_evicted, state);
+
 	/*
 	 * We have just evicted some date into the ghost state, make
 	 * sure we also adjust the ghost state size if necessary.
@@ -1761,71 +2133,85 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 		}
 	}
 
-	return (stolen);
+	return (bytes_evicted);
 }
 
 /*
  * Remove buffers from list until we've removed the specified number of
- * bytes.  Destroy the buffers that are removed.
+ * bytes.  Destroy the buffers that are removed.  Each list is walked
+ * one sublist at a time, starting from a random one.
  */
 static void
 arc_evict_ghost(arc_state_t *state, uint64_t spa, int64_t bytes)
 {
 	arc_buf_hdr_t *ab, *ab_prev;
-	list_t *list = &state->arcs_list[ARC_BUFC_DATA];
+	multilist_t *ml = &state->arcs_list[ARC_BUFC_DATA];
+	multilist_sublist_t *mls;
 	kmutex_t *hash_lock;
 	uint64_t bytes_deleted = 0;
 	uint64_t bufs_skipped = 0;
+	int num_sublists, start, i;
 
 	ASSERT(GHOST_STATE(state));
+next_list:
+	num_sublists = multilist_get_num_sublists(ml);
+	start = multilist_get_random_index(ml);
+	for (i = 0; i < num_sublists; i++) {
+		if (bytes >= 0 && bytes_deleted >= bytes)
+			break;
 top:
-	mutex_enter(&state->arcs_mtx);
-	for (ab = list_tail(list); ab; ab = ab_prev) {
-		ab_prev = list_prev(list, ab);
-		if (spa && ab->b_spa != spa)
-			continue;
-		hash_lock = HDR_LOCK(ab);
-		/* caller may be trying to modify this buffer, skip it */
-		if (MUTEX_HELD(hash_lock))
-			continue;
-		if (mutex_tryenter(hash_lock)) {
-			ASSERT(!HDR_IO_IN_PROGRESS(ab));
-			ASSERT(ab->b_buf == NULL);
-			ARCSTAT_BUMP(arcstat_deleted);
-			bytes_deleted += ab->b_size;
+		mls = multilist_sublist_lock(ml, (start + i) % num_sublists);
+		for (ab = multilist_sublist_tail(mls); ab; ab = ab_prev) {
+			ab_prev = multilist_sublist_prev(mls, ab);
+			if (spa && ab->b_spa != spa)
+				continue;
+			hash_lock = HDR_LOCK(ab);
+			/* caller may be trying to modify this buffer, skip it */
+			if (MUTEX_HELD(hash_lock))
+				continue;
+			if (mutex_tryenter(hash_lock)) {
+				ASSERT(!HDR_IO_IN_PROGRESS(ab));
+				ASSERT(ab->b_buf == NULL);
+				ASSERT(ab->b_cdata == NULL);
+				ARCSTAT_BUMP(arcstat_deleted);
+				bytes_deleted += ab->b_size;
+
+				if (ab->b_l2hdr != NULL) {
+					/*
+					 * This buffer is cached on the 2nd
+					 * Level ARC; don't destroy the header.
+					 */
+					arc_change_state(arc_l2c_only, ab,
+					    hash_lock);
+					mutex_exit(hash_lock);
+				} else {
+					arc_change_state(arc_anon, ab,
+					    hash_lock);
+					mutex_exit(hash_lock);
+					arc_hdr_destroy(ab);
+				}
 
-			if (ab->b_l2hdr != NULL) {
-				/*
-				 * This buffer is cached on the 2nd Level ARC;
-				 * don't destroy the header.
-				 */
-				arc_change_state(arc_l2c_only, ab, hash_lock);
-				mutex_exit(hash_lock);
+				DTRACE_PROBE1(arc__delete,
+				    arc_buf_hdr_t *, ab);
+				if (bytes >= 0 && bytes_deleted >= bytes)
+					break;
 			} else {
-				arc_change_state(arc_anon, ab, hash_lock);
-				mutex_exit(hash_lock);
-				arc_hdr_destroy(ab);
-			}
-
-			DTRACE_PROBE1(arc__delete, arc_buf_hdr_t *, ab);
-			if (bytes >= 0 && bytes_deleted >= bytes)
-				break;
-		} else {
-			if (bytes < 0) {
-				mutex_exit(&state->arcs_mtx);
-				mutex_enter(hash_lock);
-				mutex_exit(hash_lock);
-				goto top;
+				if (bytes < 0) {
+					multilist_sublist_unlock(mls);
+					mutex_enter(hash_lock);
+					mutex_exit(hash_lock);
+					goto top;
+				}
+				bufs_skipped += 1;
 			}
-			bufs_skipped += 1;
 		}
+		multilist_sublist_unlock(mls);
 	}
-	mutex_exit(&state->arcs_mtx);
 
-	if (list == &state->arcs_list[ARC_BUFC_DATA] &&
+	if (ml == &state->arcs_list[ARC_BUFC_DATA] &&
 	    (bytes < 0 || bytes_deleted < bytes)) {
-		list = &state->arcs_list[ARC_BUFC_METADATA];
-		goto top;
+		ml = &state->arcs_list[ARC_BUFC_METADATA];
+		goto next_list;
 	}
 
 	if (bufs_skipped) {
@@ -1838,47 +2224,70 @@ top:
 		    (longlong_t)bytes_deleted, state);
 }
 
-static void
+/*
+ * Evict enough to bring the cache down to arc_c less arc_evict_headroom,
+ * and metadata down to arc_meta_limit, then trim the ghost lists.  Returns
+ * the bytes evicted from the cache proper.
+ */
+static uint64_t
 arc_adjust(void)
 {
-	int64_t adjustment, delta;
+	int64_t adjustment, delta, target;
+	uint64_t total = 0;
+
+	target = arc_c - MIN(arc_evict_headroom, arc_c);
+
+	/*
+	 * Adjust metadata
+	 */
+
+	adjustment = arc_meta_used - arc_meta_limit;
+
+	if (adjustment > 0 && arc_mru->arcs_lsize[ARC_BUFC_METADATA] > 0) {
+		delta = MIN(arc_mru->arcs_lsize[ARC_BUFC_METADATA], adjustment);
+		total += arc_evict(arc_mru, 0, delta, ARC_BUFC_METADATA);
+		adjustment -= delta;
+	}
+
+	if (adjustment > 0 && arc_mfu->arcs_lsize[ARC_BUFC_METADATA] > 0) {
+		delta = MIN(arc_mfu->arcs_lsize[ARC_BUFC_METADATA], adjustment);
+		total += arc_evict(arc_mfu, 0, delta, ARC_BUFC_METADATA);
+	}
 
 	/*
 	 * Adjust MRU size
 	 */
 
-	adjustment = MIN(arc_size - arc_c,
-	    arc_anon->arcs_size + arc_mru->arcs_size + arc_meta_used - arc_p);
+	adjustment = MIN((int64_t)(arc_size - target),
+	    (int64_t)(arc_anon->arcs_size + arc_mru->arcs_size +
+	    arc_meta_used - arc_p));
 
 	if (adjustment > 0 && arc_mru->arcs_lsize[ARC_BUFC_DATA] > 0) {
 		delta = MIN(arc_mru->arcs_lsize[ARC_BUFC_DATA], adjustment);
-		(void) arc_evict(arc_mru, 0, delta, FALSE, ARC_BUFC_DATA);
+		total += arc_evict(arc_mru, 0, delta, ARC_BUFC_DATA);
 		adjustment -= delta;
 	}
 
 	if (adjustment > 0 && arc_mru->arcs_lsize[ARC_BUFC_METADATA] > 0) {
 		delta = MIN(arc_mru->arcs_lsize[ARC_BUFC_METADATA], adjustment);
-		(void) arc_evict(arc_mru, 0, delta, FALSE,
-		    ARC_BUFC_METADATA);
+		total += arc_evict(arc_mru, 0, delta, ARC_BUFC_METADATA);
 	}
 
 	/*
 	 * Adjust MFU size
 	 */
 
-	adjustment = arc_size - arc_c;
+	adjustment = arc_size - target;
 
 	if (adjustment > 0 && arc_mfu->arcs_lsize[ARC_BUFC_DATA] > 0) {
 		delta = MIN(adjustment, arc_mfu->arcs_lsize[ARC_BUFC_DATA]);
-		(void) arc_evict(arc_mfu, 0, delta, FALSE, ARC_BUFC_DATA);
+		total += arc_evict(arc_mfu, 0, delta, ARC_BUFC_DATA);
 		adjustment -= delta;
 	}
 
 	if (adjustment > 0 && arc_mfu->arcs_lsize[ARC_BUFC_METADATA] > 0) {
-		int64_t delta = MIN(adjustment,
-		    arc_mfu->arcs_lsize[ARC_BUFC_METADATA]);
-		(void) arc_evict(arc_mfu, 0, delta, FALSE,
-		    ARC_BUFC_METADATA);
+		delta = MIN(adjustment, arc_mfu->arcs_lsize[ARC_BUFC_METADATA]);
+		total += arc_evict(arc_mfu, 0, delta, ARC_BUFC_METADATA);
 	}
 
 	/*
@@ -1899,6 +2308,8 @@ arc_adjust(void)
 		delta = MIN(arc_mfu_ghost->arcs_size, adjustment);
 		arc_evict_ghost(arc_mfu_ghost, 0, delta);
 	}
+
+	return (total);
 }
 
 static void
@@ -1936,23 +2347,23 @@ arc_flush(spa_t *spa)
 	if (spa)
 		guid = spa_guid(spa);
 
-	while (list_head(&arc_mru->arcs_list[ARC_BUFC_DATA])) {
-		(void) arc_evict(arc_mru, guid, -1, FALSE, ARC_BUFC_DATA);
+	while (!multilist_is_empty(&arc_mru->arcs_list[ARC_BUFC_DATA])) {
+		(void) arc_evict(arc_mru, guid, -1, ARC_BUFC_DATA);
 		if (spa)
 			break;
 	}
-	while (list_head(&arc_mru->arcs_list[ARC_BUFC_METADATA])) {
-		(void) arc_evict(arc_mru, guid, -1, FALSE, ARC_BUFC_METADATA);
+	while (!multilist_is_empty(&arc_mru->arcs_list[ARC_BUFC_METADATA])) {
+		(void) arc_evict(arc_mru, guid, -1, ARC_BUFC_METADATA);
 		if (spa)
 			break;
 	}
-	while (list_head(&arc_mfu->arcs_list[ARC_BUFC_DATA])) {
-		(void) arc_evict(arc_mfu, guid, -1, FALSE, ARC_BUFC_DATA);
+	while (!multilist_is_empty(&arc_mfu->arcs_list[ARC_BUFC_DATA])) {
+		(void) arc_evict(arc_mfu, guid, -1, ARC_BUFC_DATA);
 		if (spa)
 			break;
 	}
-	while (list_head(&arc_mfu->arcs_list[ARC_BUFC_METADATA])) {
-		(void) arc_evict(arc_mfu, guid, -1, FALSE, ARC_BUFC_METADATA);
+	while (!multilist_is_empty(&arc_mfu->arcs_list[ARC_BUFC_METADATA])) {
+		(void) arc_evict(arc_mfu, guid, -1, ARC_BUFC_METADATA);
 		if (spa)
 			break;
 	}
@@ -1960,9 +2371,7 @@ arc_flush(spa_t *spa)
 	arc_evict_ghost(arc_mru_ghost, guid, -1);
 	arc_evict_ghost(arc_mfu_ghost, guid, -1);
 
-	mutex_enter(&arc_reclaim_thr_lock);
 	arc_do_user_evicts();
-	mutex_exit(&arc_reclaim_thr_lock);
 	ASSERT(spa || arc_eviction_list == NULL);
 }
 
@@ -1992,7 +2401,7 @@ arc_shrink(void)
 	}
 
 	if (arc_size > arc_c)
-		arc_adjust();
+		(void) arc_adjust();
 }
 
 static int
@@ -2099,17 +2508,63 @@ arc_kmem_reap_now(arc_reclaim_strategy_t strat)
 	kmem_cache_reap_now(hdr_cache);
 }
 
+static uint64_t
+arc_state_contended(arc_state_t *state)
+{
+	return (multilist_get_contended(&state->arcs_list[ARC_BUFC_DATA]) +
+	    multilist_get_contended(&state->arcs_list[ARC_BUFC_METADATA]));
+}
+
+/*
+ * Publish the number of times a sublist lock of each state was found
+ * held by another thread.
+ */
+static void
+arc_update_lock_stats(void)
+{
+	ARCSTAT(arcstat_mru_lock_contended) = arc_state_contended(arc_mru);
+	ARCSTAT(arcstat_mru_ghost_lock_contended) =
+	    arc_state_contended(arc_mru_ghost);
+	ARCSTAT(arcstat_mfu_lock_contended) = arc_state_contended(arc_mfu);
+	ARCSTAT(arcstat_mfu_ghost_lock_contended) =
+	    arc_state_contended(arc_mfu_ghost);
+	ARCSTAT(arcstat_l2c_only_lock_contended) =
+	    arc_state_contended(arc_l2c_only);
+}
+
+/*
+ * See zfs_arc_overflow_shift.
+ */
+static void
+arc_evict_adapt_headroom(uint64_t blocked)
+{
+	uint64_t max = arc_c >> zfs_arc_overflow_shift;
+
+	if (blocked > 0) {
+		arc_evict_headroom = MIN(max,
+		    MAX(2 * arc_evict_headroom, SPA_MAXBLOCKSIZE));
+	} else {
+		arc_evict_headroom = MIN(max, arc_evict_headroom >> 1);
+	}
+	ARCSTAT(arcstat_evict_headroom) = arc_evict_headroom;
+}
+
 static void
 arc_reclaim_thread(void)
 {
 	clock_t			growtime = 0;
 	arc_reclaim_strategy_t	last_reclaim = ARC_RECLAIM_CONS;
 	callb_cpr_t		cpr;
+	uint64_t		blocked, evicted;
 
 	CALLB_CPR_INIT(&cpr, &arc_reclaim_thr_lock, callb_generic_cpr, FTAG);
 
 	mutex_enter(&arc_reclaim_thr_lock);
 	while (arc_thread_exit == 0) {
+		blocked = arc_evict_blocked;
+		arc_evict_blocked = 0;
+		mutex_exit(&arc_reclaim_thr_lock);
+
 		if (arc_reclaim_needed()) {
 
 			if (arc_no_grow) {
@@ -2134,13 +2589,29 @@ arc_reclaim_thread(void)
 			arc_no_grow = FALSE;
 		}
 
-		if (2 * arc_c < arc_size +
-		    arc_mru_ghost->arcs_size + arc_mfu_ghost->arcs_size)
-			arc_adjust();
+		arc_evict_adapt_headroom(blocked);
+		evicted = arc_adjust();
+
+		mutex_enter(&arc_reclaim_thr_lock);
+		cv_broadcast(&arc_evict_waiters_cv);
+		mutex_exit(&arc_reclaim_thr_lock);
 
 		if (arc_eviction_list != NULL)
 			arc_do_user_evicts();
 
+		arc_update_lock_stats();
+
+		mutex_enter(&arc_reclaim_thr_lock);
+
+		/*
+		 * Go around again at once if allocations started waiting
+		 * for us during this pass, as long as it made progress;
+		 * if it couldn't evict anything, another pass won't either
+		 * until something changes, so wait to be signalled.
+		 */
+		if (arc_evict_blocked > 0 && evicted > 0)
+			continue;
+
 		/* block until needed, or one second, whichever is shorter */
 		CALLB_CPR_SAFE_BEGIN(&cpr);
 		(void) cv_timedwait(&arc_reclaim_thr_cv,
@@ -2248,6 +2719,55 @@ arc_evict_needed(arc_buf_contents_t type)
 	return (arc_size > arc_c);
 }
 
+/*
+ * Check if allocations have taken the cache so far past arc_c that they
+ * must wait for the reclaim thread.  The metadata limit is left to the
+ * thread alone, since metadata is often held and cannot be evicted.
+ */
+static boolean_t
+arc_is_overflowing(void)
+{
+	uint64_t overflow = MAX(SPA_MAXBLOCKSIZE,
+	    arc_c >> zfs_arc_overflow_shift);
+
+	return (arc_size >= arc_c + overflow);
+}
+
+static void
+arc_evict_wait_hist_add(hrtime_t delta)
+{
+	uint64_t us = delta / (NANOSEC / MICROSEC);
+	int bucket = MIN(MAX(highbit(us), 1), ARC_EVICT_WAIT_BUCKETS) - 1;
+
+	atomic_add_64(&arc_evict_wait_hist[bucket].value.ui64, 1);
+}
+
+/*
+ * Wait for the reclaim thread to make room.  The wait is bounded, since
+ * the thread may be held up by a lock our caller holds.
+ */
+static void
+arc_wait_for_eviction(void)
+{
+	hrtime_t start;
+
+	mutex_enter(&arc_reclaim_thr_lock);
+	if (!arc_is_overflowing()) {
+		mutex_exit(&arc_reclaim_thr_lock);
+		return;
+	}
+
+	start = gethrtime();
+	arc_evict_blocked++;
+	cv_signal(&arc_reclaim_thr_cv);
+	(void) cv_timedwait(&arc_evict_waiters_cv,
+	    &arc_reclaim_thr_lock, ddi_get_lbolt() + hz);
+	mutex_exit(&arc_reclaim_thr_lock);
+
+	ARCSTAT_BUMP(arcstat_evict_waits);
+	arc_evict_wait_hist_add(gethrtime() - start);
+}
+
 /*
  * The buffer, supplied as the first argument, needs a data block.
  * So, if we are at cache max, determine which cache should be victimized.
@@ -2281,55 +2801,27 @@ arc_get_data_buf(arc_buf_t *buf)
 	arc_adapt(size, state);
 
 	/*
-	 * We have not yet reached cache maximum size,
-	 * just allocate a new buffer.
+	 * Once the cache has reached its maximum size, kick the reclaim
+	 * thread to evict, and only wait for it if it has fallen too far
+	 * behind.
 	 */
-	if (!arc_evict_needed(type)) {
-		if (type == ARC_BUFC_METADATA) {
-			buf->b_data = zio_buf_alloc(size);
-			arc_space_consume(size, ARC_SPACE_DATA);
-		} else {
-			ASSERT(type == ARC_BUFC_DATA);
-			buf->b_data = zio_data_buf_alloc(size);
-			ARCSTAT_INCR(arcstat_data_size, size);
-			atomic_add_64(&arc_size, size);
-		}
-		goto out;
+	if (arc_evict_needed(type)) {
+		if (arc_is_overflowing())
+			arc_wait_for_eviction();
+		else
+			cv_signal(&arc_reclaim_thr_cv);
 	}
 
-	/*
-	 * If we are prefetching from the mfu ghost list, this buffer
-	 * will end up on the mru list; so steal space from there.
-	 */
-	if (state == arc_mfu_ghost)
-		state = buf->b_hdr->b_flags & ARC_PREFETCH ? arc_mru : arc_mfu;
-	else if (state == arc_mru_ghost)
-		state = arc_mru;
-
-	if (state == arc_mru || state == arc_anon) {
-		uint64_t mru_used = arc_anon->arcs_size + arc_mru->arcs_size;
-		state = (arc_mfu->arcs_lsize[type] >= size &&
-		    arc_p > mru_used) ? arc_mfu : arc_mru;
+	if (type == ARC_BUFC_METADATA) {
+		buf->b_data = zio_buf_alloc(size);
+		arc_space_consume(size, ARC_SPACE_DATA);
 	} else {
-		/* MFU cases */
-		uint64_t mfu_space = arc_c - arc_p;
-		state =  (arc_mru->arcs_lsize[type] >= size &&
-		    mfu_space > arc_mfu->arcs_size) ? arc_mru : arc_mfu;
+		ASSERT(type == ARC_BUFC_DATA);
+		buf->b_data = zio_data_buf_alloc(size);
+		ARCSTAT_INCR(arcstat_data_size, size);
+		atomic_add_64(&arc_size, size);
 	}
-	if ((buf->b_data = arc_evict(state, 0, size, TRUE, type)) == NULL) {
-		if (type == ARC_BUFC_METADATA) {
-			buf->b_data = zio_buf_alloc(size);
-			arc_space_consume(size, ARC_SPACE_DATA);
-		} else {
-			ASSERT(type == ARC_BUFC_DATA);
-			buf->b_data = zio_data_buf_alloc(size);
-			ARCSTAT_INCR(arcstat_data_size, size);
-			atomic_add_64(&arc_size, size);
-		}
-		ARCSTAT_BUMP(arcstat_recycle_miss);
-	}
-	ASSERT(buf->b_data != NULL);
-out:
+
 	/*
 	 * Update the state size.  Note that ghost states have a
 	 * "ghost size" and so don't need to be updated.
@@ -2542,6 +3034,16 @@ arc_read_done(zio_t *zio)
 	if (l2arc_noprefetch && (hdr->b_flags & ARC_PREFETCH))
 		hdr->b_flags &= ~ARC_L2CACHE;
 
+	/* decompress the block if we read it raw */
+	if (hdr->b_cdata != NULL && zio->io_data == hdr->b_cdata) {
+		if (zio->io_error == 0 &&
+		    zio_decompress_data(hdr->b_compress, hdr->b_cdata,
+		    buf->b_data, hdr->b_psize, hdr->b_size) != 0)
+			zio->io_error = EIO;
+		if (zio->io_error != 0)
+			arc_cdata_free(hdr);
+	}
+
 	/* byteswap if necessary */
 	callback_list = hdr->b_acb;
 	ASSERT(callback_list != NULL);
@@ -2602,6 +3104,9 @@ arc_read_done(zio_t *zio)
 	cv_broadcast(&hdr->b_cv);
 
 	if (hash_lock) {
+		/* a block read without a consumer is only kept compressed */
+		if (zio->io_error == 0 && abuf == buf)
+			arc_cdata_only(hdr, hash_lock);
 		mutex_exit(hash_lock);
 	} else {
 		/*
@@ -2695,7 +3200,7 @@ arc_read_nolock(zio_t *pio, spa_t *spa, const blkptr_t *bp,
 top:
 	hdr = buf_hash_find(guid, BP_IDENTITY(bp), BP_PHYSICAL_BIRTH(bp),
 	    &hash_lock);
-	if (hdr && hdr->b_datacnt > 0) {
+	if (hdr && (hdr->b_datacnt > 0 || hdr->b_cdata != NULL)) {
 
 		*arc_flags |= ARC_CACHED;
 
@@ -2737,12 +3242,15 @@ top:
 			/*
 			 * If this block is already in use, create a new
 			 * copy of the data so that we will be guaranteed
-			 * that arc_release() will always succeed.
+			 * that arc_release() will always succeed.  If it
+			 * is down to its compressed copy, decompress it.
 			 */
 			buf = hdr->b_buf;
-			ASSERT(buf);
-			ASSERT(buf->b_data);
-			if (HDR_BUF_AVAILABLE(hdr)) {
+			if (buf == NULL) {
+				buf = arc_cdata_buf(hdr, bp);
+				ARCSTAT_BUMP(arcstat_compressed_hits);
+			} else if (HDR_BUF_AVAILABLE(hdr)) {
+				ASSERT(buf->b_data);
 				ASSERT(buf->b_efunc == NULL);
 				hdr->b_flags &= ~ARC_BUF_AVAILABLE;
 			} else {
@@ -2770,6 +3278,8 @@ top:
 		arc_callback_t	*acb;
 		vdev_t *vd = NULL;
 		daddr_t addr = -1;
+		uint64_t l2asize = 0;
+		enum zio_compress l2compress = ZIO_COMPRESS_OFF;
 		boolean_t devw = B_FALSE;
 
 		if (hdr == NULL) {
@@ -2799,6 +3309,9 @@ top:
 				hdr->b_flags |= ARC_L2CACHE;
 			if (BP_GET_LEVEL(bp) > 0)
 				hdr->b_flags |= ARC_INDIRECT;
+			if (BP_GET_COMPRESS(bp) == ZIO_COMPRESS_OFF &&
+			    !BP_IS_GANG(bp))
+				hdr->b_flags |= ARC_UNCOMPRESSED;
 		} else {
 			/* this block is in the ghost cache */
 			ASSERT(GHOST_STATE(hdr->b_state));
@@ -2840,6 +3353,8 @@ top:
 		    (vd = hdr->b_l2hdr->b_dev->l2ad_vdev) != NULL) {
 			devw = hdr->b_l2hdr->b_dev->l2ad_writing;
 			addr = hdr->b_l2hdr->b_daddr;
+			l2asize = hdr->b_l2hdr->b_asize;
+			l2compress = hdr->b_l2hdr->b_compress;
 			/*
 			 * Lock out device removal.
 			 */
@@ -2848,6 +3363,16 @@ top:
 				vd = NULL;
 		}
 
+		/*
+		 * Read a compressed block raw, so that the hdr can keep its
+		 * compressed copy.  An L2ARC read can only fill that copy if
+		 * the device holds the block in the same form.
+		 */
+		if (zfs_arc_compressed && !BP_IS_GANG(bp) &&
+		    BP_GET_COMPRESS(bp) != ZIO_COMPRESS_OFF &&
+		    (vd == NULL || l2compress == BP_GET_COMPRESS(bp)))
+			arc_cdata_alloc(hdr, bp);
+
 		mutex_exit(hash_lock);
 
 		ASSERT3U(hdr->b_size, ==, size);
@@ -2883,20 +3408,29 @@ top:
 				cb->l2rcb_bp = *bp;
 				cb->l2rcb_zb = *zb;
 				cb->l2rcb_flags = zio_flags;
+				cb->l2rcb_compress = l2compress;
+				cb->l2rcb_size = size;
+				cb->l2rcb_data = buf->b_data;
+				if (l2compress != ZIO_COMPRESS_OFF) {
+					cb->l2rcb_size = l2asize;
+					cb->l2rcb_data =
+					    zio_buf_alloc(l2asize);
+				}
 
 				/*
 				 * l2arc read.  The SCL_L2ARC lock will be
 				 * released by l2arc_read_done().
 				 */
-				rzio = zio_read_phys(pio, vd, addr, size,
-				    buf->b_data, ZIO_CHECKSUM_OFF,
-				    l2arc_read_done, cb, priority, zio_flags |
-				    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_CANFAIL |
-				    ZIO_FLAG_DONT_PROPAGATE |
+				rzio = zio_read_phys(pio, vd, addr,
+				    cb->l2rcb_size, cb->l2rcb_data,
+				    ZIO_CHECKSUM_OFF, l2arc_read_done, cb,
+				    priority, zio_flags | ZIO_FLAG_DONT_CACHE |
+				    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE |
 				    ZIO_FLAG_DONT_RETRY, B_FALSE);
 				DTRACE_PROBE2(l2arc__read, vdev_t *, vd,
 				    zio_t *, rzio);
-				ARCSTAT_INCR(arcstat_l2_read_bytes, size);
+				ARCSTAT_INCR(arcstat_l2_read_bytes,
+				    cb->l2rcb_size);
 
 				if (*arc_flags & ARC_NOWAIT) {
 					zio_nowait(rzio);
@@ -2926,8 +3460,14 @@ top:
 			}
 		}
 
-		rzio = zio_read(pio, spa, bp, buf->b_data, size,
-		    arc_read_done, buf, priority, zio_flags, zb);
+		if (hdr->b_cdata != NULL) {
+			rzio = zio_read(pio, spa, bp, hdr->b_cdata,
+			    hdr->b_psize, arc_read_done, buf, priority,
+			    zio_flags | ZIO_FLAG_RAW, zb);
+		} else {
+			rzio = zio_read(pio, spa, bp, buf->b_data, size,
+			    arc_read_done, buf, priority, zio_flags, zb);
+		}
 
 		if (*arc_flags & ARC_WAIT)
 			return (zio_wait(rzio));
@@ -3002,7 +3542,11 @@ arc_buf_evict(arc_buf_t *buf)
 	ASSERT(buf->b_data != NULL);
 	arc_buf_destroy(buf, FALSE, FALSE);
 
-	if (hdr->b_datacnt == 0) {
+	if (hdr->b_datacnt == 0)
+		hdr->b_flags &= ~ARC_BUF_AVAILABLE;
+
+	/* a compressed hdr stays cached with just its compressed copy */
+	if (hdr->b_datacnt == 0 && hdr->b_cdata == NULL) {
 		arc_state_t *old_state = hdr->b_state;
 		arc_state_t *evicted_state;
 
@@ -3012,16 +3556,9 @@ arc_buf_evict(arc_buf_t *buf)
 		evicted_state =
 		    (old_state == arc_mru) ? arc_mru_ghost : arc_mfu_ghost;
 
-		mutex_enter(&old_state->arcs_mtx);
-		mutex_enter(&evicted_state->arcs_mtx);
-
 		arc_change_state(evicted_state, hdr, hash_lock);
 		ASSERT(HDR_IN_HASH_TABLE(hdr));
 		hdr->b_flags |= ARC_IN_HASH_TABLE;
-		hdr->b_flags &= ~ARC_BUF_AVAILABLE;
-
-		mutex_exit(&evicted_state->arcs_mtx);
-		mutex_exit(&old_state->arcs_mtx);
 	}
 	mutex_exit(hash_lock);
 	mutex_exit(&buf->b_evict_lock);
@@ -3075,7 +3612,7 @@ arc_release(arc_buf_t *buf, void *tag)
 	if (l2hdr) {
 		mutex_enter(&l2arc_buflist_mtx);
 		hdr->b_l2hdr = NULL;
-		buf_size = hdr->b_size;
+		buf_size = l2hdr->b_asize;
 	}
 
 	/*
@@ -3111,6 +3648,7 @@ arc_release(arc_buf_t *buf, void *tag)
 		hdr->b_datacnt -= 1;
 		arc_cksum_verify(buf);
 
+		arc_cdata_only(hdr, hash_lock);
 		mutex_exit(hash_lock);
 
 		nhdr = kmem_cache_alloc(hdr_cache, KM_PUSHPAGE);
@@ -3122,6 +3660,9 @@ arc_release(arc_buf_t *buf, void *tag)
 		nhdr->b_arc_access = 0;
 		nhdr->b_flags = flags & ARC_L2_WRITING;
 		nhdr->b_l2hdr = NULL;
+		nhdr->b_cdata = NULL;
+		nhdr->b_psize = 0;
+		nhdr->b_compress = ZIO_COMPRESS_OFF;
 		nhdr->b_datacnt = 1;
 		nhdr->b_freeze_cksum = NULL;
 		(void) refcount_add(&nhdr->b_refcnt, tag);
@@ -3136,6 +3677,7 @@ arc_release(arc_buf_t *buf, void *tag)
 		if (hdr->b_state != arc_anon)
 			arc_change_state(arc_anon, hdr, hash_lock);
 		hdr->b_arc_access = 0;
+		arc_cdata_free(hdr);
 		if (hash_lock)
 			mutex_exit(hash_lock);
 
@@ -3242,6 +3784,9 @@ arc_write_done(zio_t *zio)
 		hdr->b_dva = *BP_IDENTITY(zio->io_bp);
 		hdr->b_birth = BP_PHYSICAL_BIRTH(zio->io_bp);
 		hdr->b_cksum0 = zio->io_bp->blk_cksum.zc_word[0];
+		if (BP_GET_COMPRESS(zio->io_bp) == ZIO_COMPRESS_OFF &&
+		    !BP_IS_GANG(zio->io_bp))
+			hdr->b_flags |= ARC_UNCOMPRESSED;
 	} else {
 		ASSERT(BUF_EMPTY(hdr));
 	}
@@ -3341,7 +3886,7 @@ arc_memory_throttle(uint64_t reserve, uint64_t inflight_data, uint64_t txg)
 	available_memory =
 	    MIN(available_memory, vmem_size(heap_arena, VMEM_FREE));
 #endif
-	if (available_memory >= zfs_write_limit_max)
+	if (available_memory >= zfs_dirty_data_max)
 		return (0);
 
 	if (txg > last_txg) {
@@ -3447,11 +3992,53 @@ arc_tempreserve_space(uint64_t reserve, uint64_t txg)
 	return (0);
 }
 
+/*
+ * A header's sublist is chosen by the hash of its identity, which stays
+ * the same while it is on any of the lists, so it takes the same index
+ * in every state.
+ */
+static unsigned int
+arc_state_multilist_index_func(multilist_t *ml, void *obj)
+{
+	arc_buf_hdr_t *hdr = obj;
+
+	ASSERT(!BUF_EMPTY(hdr));
+	return (buf_hash(hdr->b_spa, &hdr->b_dva, hdr->b_birth) %
+	    multilist_get_num_sublists(ml));
+}
+
+static void
+arc_state_init(arc_state_t *state)
+{
+	int num_sublists = zfs_arc_num_sublists_per_state;
+	int type;
+
+	if (num_sublists <= 0)
+		num_sublists = max_ncpus;
+
+	for (type = 0; type < ARC_BUFC_NUMTYPES; type++)
+		multilist_create(&state->arcs_list[type],
+		    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node),
+		    num_sublists, arc_state_multilist_index_func);
+}
+
+static void
+arc_state_fini(arc_state_t *state)
+{
+	int type;
+
+	for (type = 0; type < ARC_BUFC_NUMTYPES; type++)
+		multilist_destroy(&state->arcs_list[type]);
+}
+
 void
 arc_init(void)
 {
+	int i;
+
 	mutex_init(&arc_reclaim_thr_lock, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&arc_reclaim_thr_cv, NULL, CV_DEFAULT, NULL);
+	cv_init(&arc_evict_waiters_cv, NULL, CV_DEFAULT, NULL);
 
 	/* Convert seconds to clock ticks */
 	arc_min_prefetch_lifespan = 1 * hz;
@@ -3522,33 +4109,11 @@ arc_init(void)
 	arc_l2c_only = &ARC_l2c_only;
 	arc_size = 0;
 
-	mutex_init(&arc_anon->arcs_mtx, NULL, MUTEX_DEFAULT, NULL);
-	mutex_init(&arc_mru->arcs_mtx, NULL, MUTEX_DEFAULT, NULL);
-	mutex_init(&arc_mru_ghost->arcs_mtx, NULL, MUTEX_DEFAULT, NULL);
-	mutex_init(&arc_mfu->arcs_mtx, NULL, MUTEX_DEFAULT, NULL);
-	mutex_init(&arc_mfu_ghost->arcs_mtx, NULL, MUTEX_DEFAULT, NULL);
-	mutex_init(&arc_l2c_only->arcs_mtx, NULL, MUTEX_DEFAULT, NULL);
-
-	list_create(&arc_mru->arcs_list[ARC_BUFC_METADATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_mru->arcs_list[ARC_BUFC_DATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_mru_ghost->arcs_list[ARC_BUFC_METADATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_mru_ghost->arcs_list[ARC_BUFC_DATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_mfu->arcs_list[ARC_BUFC_METADATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_mfu->arcs_list[ARC_BUFC_DATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_mfu_ghost->arcs_list[ARC_BUFC_METADATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_mfu_ghost->arcs_list[ARC_BUFC_DATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_l2c_only->arcs_list[ARC_BUFC_METADATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
-	list_create(&arc_l2c_only->arcs_list[ARC_BUFC_DATA],
-	    sizeof (arc_buf_hdr_t), offsetof(arc_buf_hdr_t, b_arc_node));
+	arc_state_init(arc_mru);
+	arc_state_init(arc_mru_ghost);
+	arc_state_init(arc_mfu);
+	arc_state_init(arc_mfu_ghost);
+	arc_state_init(arc_l2c_only);
 
 	buf_init();
 
@@ -3565,17 +4130,36 @@ arc_init(void)
 		kstat_install(arc_ksp);
 	}
 
+	for (i = 0; i < ARC_EVICT_WAIT_BUCKETS; i++) {
+		kstat_named_t *ks = &arc_evict_wait_hist[i];
+
+		(void) snprintf(ks->name, KSTAT_STRLEN, "%lluus",
+		    (u_longlong_t)1 << i);
+		ks->data_type = KSTAT_DATA_UINT64;
+		ks->value.ui64 = 0;
+	}
+
+	arc_evict_wait_ksp = kstat_create("zfs", 0, "arc_evict_wait", "misc",
+	    KSTAT_TYPE_NAMED, ARC_EVICT_WAIT_BUCKETS, KSTAT_FLAG_VIRTUAL);
+	if (arc_evict_wait_ksp != NULL) {
+		arc_evict_wait_ksp->ks_data = arc_evict_wait_hist;
+		kstat_install(arc_evict_wait_ksp);
+	}
+
 	(void) thread_create(NULL, 0, arc_reclaim_thread, NULL, 0, &p0,
 	    TS_RUN, minclsyspri);
 
 	arc_dead = FALSE;
 	arc_warm = B_FALSE;
 
-	if (zfs_write_limit_max == 0)
-		zfs_write_limit_max = ptob(physmem) >> zfs_write_limit_shift;
-	else
-		zfs_write_limit_shift = 0;
-	mutex_init(&zfs_write_limit_lock, NULL, MUTEX_DEFAULT, NULL);
+	/*
+	 * Size the write throttle's dirty data limit from physical memory
+	 * unless it was set explicitly.
+	 */
+	if (zfs_dirty_data_max == 0) {
+		zfs_dirty_data_max = MIN(ptob(physmem) *
+		    zfs_dirty_data_max_percent / 100, zfs_dirty_data_max_max);
+	}
 }
 
 void
@@ -3596,27 +4180,21 @@ arc_fini(void)
 		arc_ksp = NULL;
 	}
 
+	if (arc_evict_wait_ksp != NULL) {
+		kstat_delete(arc_evict_wait_ksp);
+		arc_evict_wait_ksp = NULL;
+	}
+
 	mutex_destroy(&arc_eviction_mtx);
 	mutex_destroy(&arc_reclaim_thr_lock);
 	cv_destroy(&arc_reclaim_thr_cv);
+	cv_destroy(&arc_evict_waiters_cv);
 
-	list_destroy(&arc_mru->arcs_list[ARC_BUFC_METADATA]);
-	list_destroy(&arc_mru_ghost->arcs_list[ARC_BUFC_METADATA]);
-	list_destroy(&arc_mfu->arcs_list[ARC_BUFC_METADATA]);
-	list_destroy(&arc_mfu_ghost->arcs_list[ARC_BUFC_METADATA]);
-	list_destroy(&arc_mru->arcs_list[ARC_BUFC_DATA]);
-	list_destroy(&arc_mru_ghost->arcs_list[ARC_BUFC_DATA]);
-	list_destroy(&arc_mfu->arcs_list[ARC_BUFC_DATA]);
-	list_destroy(&arc_mfu_ghost->arcs_list[ARC_BUFC_DATA]);
-
-	mutex_destroy(&arc_anon->arcs_mtx);
-	mutex_destroy(&arc_mru->arcs_mtx);
-	mutex_destroy(&arc_mru_ghost->arcs_mtx);
-	mutex_destroy(&arc_mfu->arcs_mtx);
-	mutex_destroy(&arc_mfu_ghost->arcs_mtx);
-	mutex_destroy(&arc_l2c_only->arcs_mtx);
-
-	mutex_destroy(&zfs_write_limit_lock);
+	arc_state_fini(arc_mru);
+	arc_state_fini(arc_mru_ghost);
+	arc_state_fini(arc_mfu);
+	arc_state_fini(arc_mfu_ghost);
+	arc_state_fini(arc_l2c_only);
 
 	buf_fini();
 
@@ -3865,10 +4443,14 @@ l2arc_dev_get_next(void)
 		else if (next == first)
 			break;
 
-	} while (vdev_is_dead(next->l2ad_vdev));
+	} while (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild);
 
-	/* if we were unable to find any usable vdevs, return NULL */
-	if (vdev_is_dead(next->l2ad_vdev))
+	/*
+	 * If we were unable to find any usable vdevs, return NULL.  Devices
+	 * still being rebuilt are skipped, as writes would overwrite the
+	 * log blocks being read.
+	 */
+	if (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild)
 		next = NULL;
 
 	l2arc_dev_last = next;
@@ -3965,8 +4547,8 @@ l2arc_write_done(zio_t *zio)
 			list_remove(buflist, ab);
 			abl2 = ab->b_l2hdr;
 			ab->b_l2hdr = NULL;
+			ARCSTAT_INCR(arcstat_l2_size, -abl2->b_asize);
 			kmem_free(abl2, sizeof (l2arc_buf_hdr_t));
-			ARCSTAT_INCR(arcstat_l2_size, -ab->b_size);
 		}
 
 		/*
@@ -3987,6 +4569,26 @@ l2arc_write_done(zio_t *zio)
 	kmem_free(cb, sizeof (l2arc_write_callback_t));
 }
 
+/*
+ * Check the L2ARC copy of a block, as stored on the device, against its
+ * block pointer.  Only used for headers restored from the device log.
+ */
+static boolean_t
+l2arc_bp_cksum_equal(const blkptr_t *bp, void *data)
+{
+	zio_checksum_info_t *ci = &zio_checksum_table[BP_GET_CHECKSUM(bp)];
+	zio_cksum_t zc;
+
+	if (BP_GET_CHECKSUM(bp) >= ZIO_CHECKSUM_FUNCTIONS ||
+	    BP_GET_CHECKSUM(bp) == ZIO_CHECKSUM_OFF ||
+	    ci->ci_func[0] == NULL || ci->ci_eck || BP_IS_GANG(bp))
+		return (B_FALSE);
+
+	ci->ci_func[BP_SHOULD_BYTESWAP(bp)](data, BP_GET_PSIZE(bp), &zc);
+
+	return (ZIO_CHECKSUM_EQUAL(zc, bp->blk_cksum));
+}
+
 /*
  * A read to a cache device completed.  Validate buffer contents before
  * handing over to the regular ARC routines.
@@ -3998,6 +4600,7 @@ l2arc_read_done(zio_t *zio)
 	arc_buf_hdr_t *hdr;
 	arc_buf_t *buf;
 	kmutex_t *hash_lock;
+	boolean_t valid;
 	int equal;
 
 	ASSERT(zio->io_vd != NULL);
@@ -4015,10 +4618,37 @@ l2arc_read_done(zio_t *zio)
 	hdr = buf->b_hdr;
 	ASSERT3P(hash_lock, ==, HDR_LOCK(hdr));
 
+	/*
+	 * Headers restored from the device log have no freeze checksum,
+	 * check what we read against the block pointer instead.
+	 */
+	valid = B_TRUE;
+	if (HDR_L2_REBUILT(hdr) && zio->io_error == 0)
+		valid = l2arc_bp_cksum_equal(&cb->l2rcb_bp, cb->l2rcb_data);
+
+	/*
+	 * The L2ARC keeps compressed blocks in their compressed form.
+	 */
+	if (cb->l2rcb_compress != ZIO_COMPRESS_OFF) {
+		if (zio->io_error == 0 &&
+		    zio_decompress_data(cb->l2rcb_compress, cb->l2rcb_data,
+		    buf->b_data, cb->l2rcb_size, hdr->b_size) != 0)
+			zio->io_error = EIO;
+		if (zio->io_error == 0 && hdr->b_cdata != NULL) {
+			ASSERT3U(hdr->b_compress, ==, cb->l2rcb_compress);
+			ASSERT3U(hdr->b_psize, <=, cb->l2rcb_size);
+			bcopy(cb->l2rcb_data, hdr->b_cdata, hdr->b_psize);
+		}
+		zio_buf_free(cb->l2rcb_data, cb->l2rcb_size);
+	}
+
 	/*
 	 * Check this survived the L2ARC journey.
 	 */
-	equal = arc_cksum_equal(buf);
+	if (valid && zio->io_error == 0 && !HDR_L2_REBUILT(hdr))
+		equal = arc_cksum_equal(buf);
+	else
+		equal = valid;
 	if (equal && zio->io_error == 0 && !HDR_L2_EVICTED(hdr)) {
 		mutex_exit(hash_lock);
 		zio->io_private = buf;
@@ -4049,9 +4679,18 @@ l2arc_read_done(zio_t *zio)
 
 			ASSERT(!pio || pio->io_child_type == ZIO_CHILD_LOGICAL);
 
-			zio_nowait(zio_read(pio, cb->l2rcb_spa, &cb->l2rcb_bp,
-			    buf->b_data, zio->io_size, arc_read_done, buf,
-			    zio->io_priority, cb->l2rcb_flags, &cb->l2rcb_zb));
+			if (hdr->b_cdata != NULL) {
+				zio_nowait(zio_read(pio, cb->l2rcb_spa,
+				    &cb->l2rcb_bp, hdr->b_cdata, hdr->b_psize,
+				    arc_read_done, buf, zio->io_priority,
+				    cb->l2rcb_flags | ZIO_FLAG_RAW,
+				    &cb->l2rcb_zb));
+			} else {
+				zio_nowait(zio_read(pio, cb->l2rcb_spa,
+				    &cb->l2rcb_bp, buf->b_data, hdr->b_size,
+				    arc_read_done, buf, zio->io_priority,
+				    cb->l2rcb_flags, &cb->l2rcb_zb));
+			}
 		}
 	}
 
@@ -4065,38 +4704,32 @@ l2arc_read_done(zio_t *zio)
  * performance.
  *
  * Currently the metadata lists are hit first, MFU then MRU, followed by
- * the data lists.  This function returns a locked list, and also returns
- * the lock pointer.
+ * the data lists.  This function returns a locked sublist, picked at
+ * random from the list so that every sublist is fed over time.
  */
-static list_t *
-l2arc_list_locked(int list_num, kmutex_t **lock)
+static multilist_sublist_t *
+l2arc_sublist_lock(int list_num)
 {
-	list_t *list = NULL;
+	multilist_t *ml = NULL;
 
 	ASSERT(list_num >= 0 && list_num <= 3);
 
 	switch (list_num) {
 	case 0:
-		list = &arc_mfu->arcs_list[ARC_BUFC_METADATA];
-		*lock = &arc_mfu->arcs_mtx;
+		ml = &arc_mfu->arcs_list[ARC_BUFC_METADATA];
 		break;
 	case 1:
-		list = &arc_mru->arcs_list[ARC_BUFC_METADATA];
-		*lock = &arc_mru->arcs_mtx;
+		ml = &arc_mru->arcs_list[ARC_BUFC_METADATA];
 		break;
 	case 2:
-		list = &arc_mfu->arcs_list[ARC_BUFC_DATA];
-		*lock = &arc_mfu->arcs_mtx;
+		ml = &arc_mfu->arcs_list[ARC_BUFC_DATA];
 		break;
 	case 3:
-		list = &arc_mru->arcs_list[ARC_BUFC_DATA];
-		*lock = &arc_mru->arcs_mtx;
+		ml = &arc_mru->arcs_list[ARC_BUFC_DATA];
 		break;
 	}
 
-	ASSERT(!(MUTEX_HELD(*lock)));
-	mutex_enter(*lock);
-	return (list);
+	return (multilist_sublist_lock(ml, multilist_get_random_index(ml)));
 }
 
 /*
@@ -4211,8 +4844,8 @@ top:
 			if (ab->b_l2hdr != NULL) {
 				abl2 = ab->b_l2hdr;
 				ab->b_l2hdr = NULL;
+				ARCSTAT_INCR(arcstat_l2_size, -abl2->b_asize);
 				kmem_free(abl2, sizeof (l2arc_buf_hdr_t));
-				ARCSTAT_INCR(arcstat_l2_size, -ab->b_size);
 			}
 			list_remove(buflist, ab);
 
@@ -4230,26 +4863,107 @@ top:
 	dev->l2ad_evict = taddr;
 }
 
+/*
+ * Add a buffer about to be written to the device to the batch's log block.
+ */
+static void
+l2arc_log_blk_add(l2arc_log_blk_phys_t *lb, const arc_buf_hdr_t *ab)
+{
+	l2arc_log_ent_phys_t *le = &lb->lb_entries[lb->lb_nents++];
+
+	ASSERT3U(lb->lb_nents, <=, L2ARC_LOG_BLK_ENTRIES);
+
+	le->le_dva = ab->b_dva;
+	le->le_birth = ab->b_birth;
+	le->le_cksum0 = ab->b_cksum0;
+	le->le_daddr = ab->b_l2hdr->b_daddr;
+	le->le_prop = 0;
+	LE_SET_LSIZE(le, ab->b_size);
+	LE_SET_ASIZE(le, ab->b_l2hdr->b_asize);
+	LE_SET_COMPRESS(le, ab->b_l2hdr->b_compress);
+	LE_SET_TYPE(le, ab->b_type);
+}
+
+/*
+ * Write the batch's log block at the write hand, chained to the previous
+ * one.  Returns the space it takes on the device.
+ */
+static uint64_t
+l2arc_log_blk_write(l2arc_dev_t *dev, zio_t *pio, l2arc_log_blk_phys_t *lb)
+{
+	uint64_t used = L2ARC_LOG_BLK_USED(lb->lb_nents);
+	uint64_t asize = vdev_psize_to_asize(dev->l2ad_vdev, used);
+	l2arc_log_blkptr_t *lbp = &dev->l2ad_log_prev;
+
+	ASSERT3U(asize, <=, L2ARC_LOG_BLK_SIZE);
+
+	lb->lb_magic = L2ARC_LOG_BLK_MAGIC;
+	lb->lb_prev = *lbp;
+	bzero((char *)lb + used, asize - used);
+
+	lbp->lbp_daddr = dev->l2ad_hand;
+	lbp->lbp_size = asize;
+	fletcher_4_native(lb, asize, &lbp->lbp_cksum);
+
+	(void) zio_nowait(zio_write_phys(pio, dev->l2ad_vdev,
+	    dev->l2ad_hand, asize, lb, ZIO_CHECKSUM_OFF, NULL, NULL,
+	    ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, B_FALSE));
+	ARCSTAT_BUMP(arcstat_l2_log_blk_writes);
+
+	return (asize);
+}
+
+/*
+ * Point the device header at the most recent log block.  This is only
+ * done once the log block and the buffers it describes are on the device.
+ */
+static void
+l2arc_dev_hdr_update(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *dh;
+	uint64_t asize = dev->l2ad_dev_hdr_asize;
+
+	dh = zio_buf_alloc(asize);
+	bzero(dh, asize);
+	dh->dh_magic = L2ARC_DEV_HDR_MAGIC;
+	dh->dh_spa_guid = spa_guid(dev->l2ad_spa);
+	dh->dh_vdev_guid = dev->l2ad_vdev->vdev_guid;
+	dh->dh_hand = dev->l2ad_hand;
+	dh->dh_log = dev->l2ad_log_prev;
+	fletcher_4_native(dh, offsetof(l2arc_dev_hdr_phys_t, dh_cksum),
+	    &dh->dh_cksum);
+
+	(void) zio_wait(zio_write_phys(NULL, dev->l2ad_vdev,
+	    VDEV_LABEL_START_SIZE, asize, dh, ZIO_CHECKSUM_OFF, NULL, NULL,
+	    ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, B_FALSE));
+
+	zio_buf_free(dh, asize);
+}
+
 /*
  * Find and write ARC buffers to the L2ARC device.
  *
  * An ARC_L2_WRITING flag is set so that the L2ARC buffers are not valid
- * for reading until they have completed writing.
+ * for reading until they have completed writing.  The buffers that can
+ * be restored after a reboot are recorded in a log block written at the
+ * end of the batch.
  */
 static uint64_t
 l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 {
 	arc_buf_hdr_t *ab, *ab_prev, *head;
 	l2arc_buf_hdr_t *hdrl2;
-	list_t *list;
+	multilist_sublist_t *mls;
 	uint64_t passed_sz, write_sz, buf_sz, headroom;
 	void *buf_data;
-	kmutex_t *hash_lock, *list_lock = NULL;
+	kmutex_t *hash_lock;
 	boolean_t have_lock, full;
 	l2arc_write_callback_t *cb;
+	l2arc_log_blk_phys_t *lb = NULL;
 	zio_t *pio, *wzio;
 	uint64_t guid = spa_guid(spa);
-	int try;
+	uint64_t log_sz = 0;
+	int try, error;
 
 	ASSERT(dev->l2ad_vdev != NULL);
 
@@ -4259,12 +4973,21 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	head = kmem_cache_alloc(hdr_cache, KM_PUSHPAGE);
 	head->b_flags |= ARC_L2_WRITE_HEAD;
 
+	/*
+	 * Leave room for the log block unless the writes are too small.
+	 */
+	if (target_sz >= 2 * L2ARC_LOG_BLK_SIZE) {
+		lb = zio_buf_alloc(L2ARC_LOG_BLK_SIZE);
+		lb->lb_nents = 0;
+		log_sz = L2ARC_LOG_BLK_SIZE;
+	}
+
 	/*
 	 * Copy buffers for L2ARC writing.
 	 */
 	mutex_enter(&l2arc_buflist_mtx);
 	for (try = 0; try <= 3; try++) {
-		list = l2arc_list_locked(try, &list_lock);
+		mls = l2arc_sublist_lock(try);
 		passed_sz = 0;
 
 		/*
@@ -4275,15 +4998,15 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 		 */
 		headroom = target_sz * l2arc_headroom;
 		if (arc_warm == B_FALSE)
-			ab = list_head(list);
+			ab = multilist_sublist_head(mls);
 		else
-			ab = list_tail(list);
+			ab = multilist_sublist_tail(mls);
 
 		for (; ab; ab = ab_prev) {
 			if (arc_warm == B_FALSE)
-				ab_prev = list_next(list, ab);
+				ab_prev = multilist_sublist_next(mls, ab);
 			else
-				ab_prev = list_prev(list, ab);
+				ab_prev = multilist_sublist_prev(mls, ab);
 
 			hash_lock = HDR_LOCK(ab);
 			have_lock = MUTEX_HELD(hash_lock);
@@ -4303,12 +5026,19 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 				break;
 			}
 
-			if (!l2arc_write_eligible(guid, ab)) {
+			/*
+			 * Skip hdrs that are down to their compressed copy
+			 * without the checksum l2arc_read_done() needs.
+			 */
+			if (!l2arc_write_eligible(guid, ab) ||
+			    (ab->b_buf == NULL && ab->b_freeze_cksum == NULL)) {
 				mutex_exit(hash_lock);
 				continue;
 			}
 
-			if ((write_sz + ab->b_size) > target_sz) {
+			if ((write_sz + ab->b_size + log_sz) > target_sz ||
+			    (lb != NULL &&
+			    lb->lb_nents == L2ARC_LOG_BLK_ENTRIES)) {
 				full = B_TRUE;
 				mutex_exit(hash_lock);
 				break;
@@ -4340,15 +5070,35 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 			ab->b_flags |= ARC_L2_WRITING;
 			ab->b_l2hdr = hdrl2;
 			list_insert_head(dev->l2ad_buflist, ab);
-			buf_data = ab->b_buf->b_data;
-			buf_sz = ab->b_size;
+
+			/*
+			 * Write the compressed copy if the hdr has one; it
+			 * is decompressed again by l2arc_read_done().
+			 */
+			if (ab->b_cdata != NULL) {
+				buf_data = ab->b_cdata;
+				buf_sz = ab->b_psize;
+				hdrl2->b_compress = ab->b_compress;
+			} else {
+				buf_data = ab->b_buf->b_data;
+				buf_sz = ab->b_size;
+				hdrl2->b_compress = ZIO_COMPRESS_OFF;
+			}
+			hdrl2->b_asize =
+			    vdev_psize_to_asize(dev->l2ad_vdev, buf_sz);
+
+			if (lb != NULL &&
+			    (ab->b_cdata != NULL || HDR_UNCOMPRESSED(ab)))
+				l2arc_log_blk_add(lb, ab);
 
 			/*
 			 * Compute and store the buffer cksum before
 			 * writing.  On debug the cksum is verified first.
 			 */
-			arc_cksum_verify(ab->b_buf);
-			arc_cksum_compute(ab->b_buf, B_TRUE);
+			if (ab->b_buf != NULL) {
+				arc_cksum_verify(ab->b_buf);
+				arc_cksum_compute(ab->b_buf, B_TRUE);
+			}
 
 			mutex_exit(hash_lock);
 
@@ -4370,7 +5120,7 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 			dev->l2ad_hand += buf_sz;
 		}
 
-		mutex_exit(list_lock);
+		multilist_sublist_unlock(mls);
 
 		if (full == B_TRUE)
 			break;
@@ -4380,13 +5130,22 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	if (pio == NULL) {
 		ASSERT3U(write_sz, ==, 0);
 		kmem_cache_free(hdr_cache, head);
+		if (lb != NULL)
+			zio_buf_free(lb, L2ARC_LOG_BLK_SIZE);
 		return (0);
 	}
 
+	ARCSTAT_INCR(arcstat_l2_size, write_sz);
+
+	if (lb != NULL && lb->lb_nents > 0) {
+		buf_sz = l2arc_log_blk_write(dev, pio, lb);
+		write_sz += buf_sz;
+		dev->l2ad_hand += buf_sz;
+	}
+
 	ASSERT3U(write_sz, <=, target_sz);
 	ARCSTAT_BUMP(arcstat_l2_writes_sent);
 	ARCSTAT_INCR(arcstat_l2_write_bytes, write_sz);
-	ARCSTAT_INCR(arcstat_l2_size, write_sz);
 	vdev_space_update(dev->l2ad_vdev, write_sz, 0, 0);
 
 	/*
@@ -4402,9 +5161,23 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	}
 
 	dev->l2ad_writing = B_TRUE;
-	(void) zio_wait(pio);
+	error = zio_wait(pio);
 	dev->l2ad_writing = B_FALSE;
 
+	if (lb != NULL) {
+		/*
+		 * If anything failed to make it to the device, start a new
+		 * log chain rather than point at a broken one.
+		 */
+		if (lb->lb_nents > 0) {
+			if (error != 0)
+				bzero(&dev->l2ad_log_prev,
+				    sizeof (l2arc_log_blkptr_t));
+			l2arc_dev_hdr_update(dev);
+		}
+		zio_buf_free(lb, L2ARC_LOG_BLK_SIZE);
+	}
+
 	return (write_sz);
 }
 
@@ -4495,6 +5268,235 @@ l2arc_feed_thread(void)
 	thread_exit();
 }
 
+/*
+ * Read from a device being rebuilt.  The config lock is only tried, since
+ * l2arc_remove_vdev() holds it as writer while it waits for the rebuild to
+ * notice that it has been cancelled.
+ */
+static int
+l2arc_rebuild_read(l2arc_dev_t *dev, uint64_t daddr, uint64_t size,
+    void *data)
+{
+	spa_t *spa = dev->l2ad_spa;
+	int error;
+
+	while (!spa_config_tryenter(spa, SCL_L2ARC, dev, RW_READER)) {
+		if (dev->l2ad_rebuild_cancel)
+			return (ECANCELED);
+		delay(1);
+	}
+
+	if (dev->l2ad_rebuild_cancel) {
+		error = ECANCELED;
+	} else {
+		error = zio_wait(zio_read_phys(NULL, dev->l2ad_vdev, daddr,
+		    size, data, ZIO_CHECKSUM_OFF, NULL, NULL,
+		    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_DONT_CACHE |
+		    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE |
+		    ZIO_FLAG_DONT_RETRY, B_FALSE));
+		if (error != 0)
+			ARCSTAT_BUMP(arcstat_l2_rebuild_io_errors);
+	}
+
+	spa_config_exit(spa, SCL_L2ARC, dev);
+
+	return (error);
+}
+
+/*
+ * Restore the header of one logged buffer in the l2c_only state, unless
+ * the ARC already knows the block.
+ */
+static void
+l2arc_hdr_restore(l2arc_dev_t *dev, const l2arc_log_ent_phys_t *le)
+{
+	arc_buf_hdr_t *hdr, *exists;
+	l2arc_buf_hdr_t *l2hdr;
+	kmutex_t *hash_lock;
+
+	hdr = kmem_cache_alloc(hdr_cache, KM_PUSHPAGE);
+	ASSERT(BUF_EMPTY(hdr));
+	ASSERT(hdr->b_cdata == NULL);
+	hdr->b_dva = le->le_dva;
+	hdr->b_birth = le->le_birth;
+	hdr->b_cksum0 = le->le_cksum0;
+	hdr->b_size = LE_GET_LSIZE(le);
+	hdr->b_type = LE_GET_TYPE(le);
+	hdr->b_spa = spa_guid(dev->l2ad_spa);
+	hdr->b_state = arc_anon;
+	hdr->b_arc_access = 0;
+	hdr->b_buf = NULL;
+	hdr->b_datacnt = 0;
+	hdr->b_flags = ARC_L2CACHE | ARC_L2_REBUILT;
+	if (LE_GET_COMPRESS(le) == ZIO_COMPRESS_OFF)
+		hdr->b_flags |= ARC_UNCOMPRESSED;
+
+	exists = buf_hash_insert(hdr, &hash_lock);
+	if (exists) {
+		mutex_exit(hash_lock);
+		buf_discard_identity(hdr);
+		kmem_cache_free(hdr_cache, hdr);
+		ARCSTAT_BUMP(arcstat_l2_rebuild_bufs_precached);
+		return;
+	}
+
+	l2hdr = kmem_zalloc(sizeof (l2arc_buf_hdr_t), KM_SLEEP);
+	l2hdr->b_dev = dev;
+	l2hdr->b_daddr = le->le_daddr;
+	l2hdr->b_asize = LE_GET_ASIZE(le);
+	l2hdr->b_compress = LE_GET_COMPRESS(le);
+
+	arc_change_state(arc_l2c_only, hdr, hash_lock);
+
+	/* oldest buffers go to the tail, as l2arc_evict() expects */
+	mutex_enter(&l2arc_buflist_mtx);
+	hdr->b_l2hdr = l2hdr;
+	list_insert_tail(dev->l2ad_buflist, hdr);
+	mutex_exit(&l2arc_buflist_mtx);
+	mutex_exit(hash_lock);
+
+	ARCSTAT_INCR(arcstat_l2_size, l2hdr->b_asize);
+	ARCSTAT_BUMP(arcstat_l2_rebuild_bufs);
+}
+
+/*
+ * Sanity check a logged buffer before trusting it with a header.
+ */
+static boolean_t
+l2arc_log_ent_valid(l2arc_dev_t *dev, const l2arc_log_ent_phys_t *le)
+{
+	uint64_t asize = LE_GET_ASIZE(le);
+
+	if (le->le_daddr < dev->l2ad_start ||
+	    le->le_daddr + asize > dev->l2ad_end)
+		return (B_FALSE);
+	if (LE_GET_COMPRESS(le) >= ZIO_COMPRESS_FUNCTIONS ||
+	    LE_GET_TYPE(le) >= ARC_BUFC_NUMTYPES)
+		return (B_FALSE);
+	if (LE_GET_COMPRESS(le) == ZIO_COMPRESS_OFF &&
+	    LE_GET_LSIZE(le) > asize)
+		return (B_FALSE);
+
+	return (B_TRUE);
+}
+
+/*
+ * Walk the log chain of a newly added device, restoring headers for the
+ * buffers it still holds, then let the feed thread at the device.
+ */
+static void
+l2arc_dev_rebuild_thread(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *dh;
+	l2arc_log_blk_phys_t *lb;
+	l2arc_log_blkptr_t lbp;
+	uint64_t hdr_asize = dev->l2ad_dev_hdr_asize;
+	uint64_t hand, limit, nblks = 0, i;
+	boolean_t wrapped = B_FALSE;
+	zio_cksum_t cksum;
+
+	dh = zio_buf_alloc(hdr_asize);
+	lb = zio_buf_alloc(L2ARC_LOG_BLK_SIZE);
+
+	if (l2arc_rebuild_read(dev, VDEV_LABEL_START_SIZE, hdr_asize,
+	    dh) != 0)
+		goto out;
+
+	fletcher_4_native(dh, offsetof(l2arc_dev_hdr_phys_t, dh_cksum),
+	    &cksum);
+	if (dh->dh_magic != L2ARC_DEV_HDR_MAGIC ||
+	    dh->dh_spa_guid != spa_guid(dev->l2ad_spa) ||
+	    dh->dh_vdev_guid != dev->l2ad_vdev->vdev_guid ||
+	    !ZIO_CHECKSUM_EQUAL(cksum, dh->dh_cksum) ||
+	    dh->dh_hand < dev->l2ad_start || dh->dh_hand >= dev->l2ad_end)
+		goto out;
+
+	/*
+	 * Log blocks are walked from the newest back.  The first lap ends
+	 * at the write hand; a log block past it means the chain has moved
+	 * on to the previous lap, which must then stay beyond the hand, as
+	 * the space before it has been rewritten.
+	 */
+	hand = dh->dh_hand;
+	limit = hand;
+	lbp = dh->dh_log;
+
+	while (lbp.lbp_size != 0) {
+		if (lbp.lbp_size > L2ARC_LOG_BLK_SIZE ||
+		    lbp.lbp_size < L2ARC_LOG_BLK_USED(0) ||
+		    lbp.lbp_daddr < dev->l2ad_start ||
+		    lbp.lbp_daddr + lbp.lbp_size > dev->l2ad_end)
+			break;
+		if (lbp.lbp_daddr + lbp.lbp_size > limit) {
+			if (wrapped || lbp.lbp_daddr < hand)
+				break;
+			wrapped = B_TRUE;
+			limit = lbp.lbp_daddr + lbp.lbp_size;
+		}
+		if (wrapped && lbp.lbp_daddr < hand)
+			break;
+
+		if (arc_reclaim_needed()) {
+			ARCSTAT_BUMP(arcstat_l2_rebuild_lowmem);
+			break;
+		}
+
+		if (l2arc_rebuild_read(dev, lbp.lbp_daddr, lbp.lbp_size,
+		    lb) != 0)
+			break;
+
+		fletcher_4_native(lb, lbp.lbp_size, &cksum);
+		if (!ZIO_CHECKSUM_EQUAL(cksum, lbp.lbp_cksum) ||
+		    lb->lb_magic != L2ARC_LOG_BLK_MAGIC ||
+		    lb->lb_nents > L2ARC_LOG_BLK_ENTRIES ||
+		    L2ARC_LOG_BLK_USED(lb->lb_nents) > lbp.lbp_size) {
+			ARCSTAT_BUMP(arcstat_l2_rebuild_cksum_errors);
+			break;
+		}
+
+		for (i = lb->lb_nents; i > 0; i--) {
+			l2arc_log_ent_phys_t *le = &lb->lb_entries[i - 1];
+
+			if (!l2arc_log_ent_valid(dev, le))
+				continue;
+			if (wrapped && le->le_daddr < hand)
+				continue;
+			l2arc_hdr_restore(dev, le);
+		}
+		ARCSTAT_BUMP(arcstat_l2_rebuild_log_blks);
+
+		/* the log blocks of one lap cannot outnumber its space */
+		if (++nblks > (dev->l2ad_end - dev->l2ad_start) /
+		    L2ARC_LOG_BLK_USED(0))
+			break;
+
+		limit = lbp.lbp_daddr;
+		lbp = lb->lb_prev;
+	}
+
+	if (nblks > 0) {
+		dev->l2ad_hand = hand;
+		dev->l2ad_evict = hand;
+		dev->l2ad_first = !wrapped;
+		dev->l2ad_log_prev = dh->dh_log;
+		vdev_space_update(dev->l2ad_vdev, wrapped ?
+		    dev->l2ad_end - dev->l2ad_start :
+		    hand - dev->l2ad_start, 0, 0);
+		ARCSTAT_BUMP(arcstat_l2_rebuild_successes);
+	}
+
+out:
+	zio_buf_free(lb, L2ARC_LOG_BLK_SIZE);
+	zio_buf_free(dh, hdr_asize);
+
+	mutex_enter(&l2arc_dev_mtx);
+	dev->l2ad_rebuild = B_FALSE;
+	cv_broadcast(&l2arc_rebuild_cv);
+	mutex_exit(&l2arc_dev_mtx);
+
+	thread_exit();
+}
+
 boolean_t
 l2arc_vdev_present(vdev_t *vd)
 {
@@ -4530,7 +5532,9 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	adddev->l2ad_vdev = vd;
 	adddev->l2ad_write = l2arc_write_max;
 	adddev->l2ad_boost = l2arc_write_boost;
-	adddev->l2ad_start = VDEV_LABEL_START_SIZE;
+	adddev->l2ad_dev_hdr_asize = vdev_psize_to_asize(vd,
+	    sizeof (l2arc_dev_hdr_phys_t));
+	adddev->l2ad_start = VDEV_LABEL_START_SIZE + adddev->l2ad_dev_hdr_asize;
 	adddev->l2ad_end = VDEV_LABEL_START_SIZE + vdev_get_min_asize(vd);
 	adddev->l2ad_hand = adddev->l2ad_start;
 	adddev->l2ad_evict = adddev->l2ad_start;
@@ -4550,12 +5554,18 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	vdev_space_update(vd, 0, 0, adddev->l2ad_end - adddev->l2ad_hand);
 
 	/*
-	 * Add device to global list
+	 * Add device to global list.  It is left alone by the feed thread
+	 * until its contents have been restored.
 	 */
+	adddev->l2ad_rebuild = l2arc_rebuild_enabled;
 	mutex_enter(&l2arc_dev_mtx);
 	list_insert_head(l2arc_dev_list, adddev);
 	atomic_inc_64(&l2arc_ndev);
 	mutex_exit(&l2arc_dev_mtx);
+
+	if (adddev->l2ad_rebuild)
+		(void) thread_create(NULL, 0, l2arc_dev_rebuild_thread,
+		    adddev, 0, &p0, TS_RUN, minclsyspri);
 }
 
 /*
@@ -4579,6 +5589,13 @@ l2arc_remove_vdev(vdev_t *vd)
 	}
 	ASSERT(remdev != NULL);
 
+	/*
+	 * Stop any rebuild still reading from the device.
+	 */
+	remdev->l2ad_rebuild_cancel = B_TRUE;
+	while (remdev->l2ad_rebuild)
+		cv_wait(&l2arc_rebuild_cv, &l2arc_dev_mtx);
+
 	/*
 	 * Remove device from global list
 	 */
@@ -4609,6 +5626,7 @@ l2arc_init(void)
 	mutex_init(&l2arc_dev_mtx, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&l2arc_buflist_mtx, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&l2arc_free_on_write_mtx, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&l2arc_rebuild_cv, NULL, CV_DEFAULT, NULL);
 
 	l2arc_dev_list = &L2ARC_dev_list;
 	l2arc_free_on_write = &L2ARC_free_on_write;
@@ -4634,6 +5652,7 @@ l2arc_fini(void)
 	mutex_destroy(&l2arc_dev_mtx);
 	mutex_destroy(&l2arc_buflist_mtx);
 	mutex_destroy(&l2arc_free_on_write_mtx);
+	cv_destroy(&l2arc_rebuild_cv);
 
 	list_destroy(l2arc_dev_list);
 	list_destroy(l2arc_free_on_write);
@@ -4676,4 +5695,13 @@ MODULE_PARM_DESC(zfs_arc_max, "Maximum arc size");
 
 module_param(zfs_arc_meta_limit, ulong, 0644);
 MODULE_PARM_DESC(zfs_arc_meta_limit, "Meta limit for arc size");
+
+module_param(zfs_arc_compressed, int, 0644);
+MODULE_PARM_DESC(zfs_arc_compressed, "Cache compressed blocks compressed");
+
+module_param(zfs_arc_overflow_shift, int, 0644);
+MODULE_PARM_DESC(zfs_arc_overflow_shift, "log2(fraction of arc allowed over target before waiting)");
+
+module_param(zfs_arc_num_sublists_per_state, int, 0444);
+MODULE_PARM_DESC(zfs_arc_num_sublists_per_state, "Sublists per ARC state, 0 for one per CPU");
 #endif
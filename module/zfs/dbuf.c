@@ -98,25 +98,71 @@ dbuf_dest(void *vdb, void *unused)
  */
 static dbuf_hash_table_t dbuf_hash_table;
 
-static uint64_t dbuf_hash_count;
+/*
+ * The table starts small and doubles whenever it holds more than
+ * zfs_dbuf_hash_load dbufs per bucket, up to one bucket for every 4K of
+ * physical memory.
+ */
+int zfs_dbuf_hash_load = 1;
+static uint64_t dbuf_hash_table_max;
+
+typedef struct dbuf_stats {
+	kstat_named_t dbufstat_hash_elements;
+	kstat_named_t dbufstat_hash_elements_max;
+	kstat_named_t dbufstat_hash_collisions;
+	kstat_named_t dbufstat_hash_chains;
+	kstat_named_t dbufstat_hash_chain_max;
+	kstat_named_t dbufstat_hash_buckets;
+	kstat_named_t dbufstat_hash_locks;
+	kstat_named_t dbufstat_hash_lock_contended;
+	kstat_named_t dbufstat_hash_resizes;
+} dbuf_stats_t;
+
+static dbuf_stats_t dbuf_stats = {
+	{ "hash_elements",		KSTAT_DATA_UINT64 },
+	{ "hash_elements_max",		KSTAT_DATA_UINT64 },
+	{ "hash_collisions",		KSTAT_DATA_UINT64 },
+	{ "hash_chains",		KSTAT_DATA_UINT64 },
+	{ "hash_chain_max",		KSTAT_DATA_UINT64 },
+	{ "hash_buckets",		KSTAT_DATA_UINT64 },
+	{ "hash_locks",			KSTAT_DATA_UINT64 },
+	{ "hash_lock_contended",	KSTAT_DATA_UINT64 },
+	{ "hash_resizes",		KSTAT_DATA_UINT64 },
+};
+
+#define	DBUFSTAT(stat)	(dbuf_stats.stat.value.ui64)
+
+#define	DBUFSTAT_INCR(stat, val) \
+	atomic_add_64(&dbuf_stats.stat.value.ui64, (val));
+
+#define	DBUFSTAT_BUMP(stat)	DBUFSTAT_INCR(stat, 1)
+#define	DBUFSTAT_BUMPDOWN(stat)	DBUFSTAT_INCR(stat, -1)
 
+#define	DBUFSTAT_MAX(stat, val) {					\
+	uint64_t m;							\
+	while ((val) > (m = DBUFSTAT(stat)) &&				\
+	    (m != atomic_cas_64(&DBUFSTAT(stat), m, (val))))		\
+		continue;						\
+}
+
+static kstat_t *dbuf_ksp;
+
+/*
+ * A couple of multiply-and-fold rounds mix the identity well enough for
+ * the low bits to index the table, at a fraction of the cost of a CRC.
+ */
 static uint64_t
 dbuf_hash(void *os, uint64_t obj, uint8_t lvl, uint64_t blkid)
 {
-	uintptr_t osv = (uintptr_t)os;
-	uint64_t crc = -1ULL;
-
-	ASSERT(zfs_crc64_table[128] == ZFS_CRC64_POLY);
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (lvl)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (osv >> 6)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (obj >> 0)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (obj >> 8)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (blkid >> 0)) & 0xFF];
-	crc = (crc >> 8) ^ zfs_crc64_table[(crc ^ (blkid >> 8)) & 0xFF];
+	uint64_t hv = ((uintptr_t)os >> 6) ^ obj;
 
-	crc ^= (osv>>14) ^ (obj>>16) ^ (blkid>>16);
+	hv *= 0x9e3779b97f4a7c15ULL;
+	hv ^= (hv >> 32) ^ blkid;
+	hv *= 0xc2b2ae3d27d4eb4fULL;
+	hv ^= (hv >> 32) ^ lvl;
+	hv *= 0x9e3779b97f4a7c15ULL;
 
-	return (crc);
+	return (hv ^ (hv >> 29));
 }
 
 #define	DBUF_HASH(os, obj, level, blkid) dbuf_hash(os, obj, level, blkid);
@@ -127,32 +173,149 @@ dbuf_hash(void *os, uint64_t obj, uint8_t lvl, uint64_t blkid)
 	(dbuf)->db_level == (level) &&			\
 	(dbuf)->db_blkid == (blkid))
 
+static dbuf_hash_lock_t *
+dbuf_hash_lock(uint64_t hv)
+{
+	dbuf_hash_lock_t *hl = DBUF_HASH_LOCK(&dbuf_hash_table, hv);
+
+	if (!mutex_tryenter(&hl->hl_lock)) {
+		DBUFSTAT_BUMP(dbufstat_hash_lock_contended);
+		mutex_enter(&hl->hl_lock);
+	}
+
+	return (hl);
+}
+
+static dmu_buf_impl_t **
+dbuf_hash_table_alloc(uint64_t hsize)
+{
+#if defined(_KERNEL) && defined(HAVE_SPL)
+	/* Large allocations which do not require contiguous pages
+	 * should be using vmem_alloc() in the linux kernel */
+	return (vmem_zalloc(hsize * sizeof (void *), KM_SLEEP));
+#else
+	return (kmem_zalloc(hsize * sizeof (void *), KM_NOSLEEP));
+#endif
+}
+
+static void
+dbuf_hash_table_free(dmu_buf_impl_t **table, uint64_t hsize)
+{
+#if defined(_KERNEL) && defined(HAVE_SPL)
+	/* Large allocations which do not require contiguous pages
+	 * should be using vmem_free() in the linux kernel */
+	vmem_free(table, hsize * sizeof (void *));
+#else
+	kmem_free(table, hsize * sizeof (void *));
+#endif
+}
+
+/*
+ * Double the size of the hash table.  Since a lock covers the same
+ * buckets in both tables, the buckets are moved one lock at a time, and
+ * lookups under each lock use whichever table it says holds its buckets.
+ */
+/* ARGSUSED */
+static void
+dbuf_hash_resize(void *unused)
+{
+	dbuf_hash_table_t *h = &dbuf_hash_table;
+	uint64_t omask = h->hash_table_mask;
+	uint64_t nmask = (omask << 1) | 1;
+	dmu_buf_impl_t **otable = h->hash_table;
+	dmu_buf_impl_t **ntable = dbuf_hash_table_alloc(nmask + 1);
+	uint64_t stride = h->hash_lock_mask + 1;
+	dmu_buf_impl_t *db, *next;
+	uint64_t i, idx, hv, len, chains = 0, chain_max = 0;
+
+	if (ntable != NULL) {
+		for (i = 0; i < stride; i++) {
+			dbuf_hash_lock_t *hl = &h->hash_locks[i];
+
+			mutex_enter(&hl->hl_lock);
+			ASSERT(hl->hl_table == otable);
+			for (idx = i; idx <= omask; idx += stride) {
+				for (db = otable[idx]; db != NULL; db = next) {
+					next = db->db_hash_next;
+					hv = DBUF_HASH(db->db_objset,
+					    db->db.db_object, db->db_level,
+					    db->db_blkid);
+					db->db_hash_next = ntable[hv & nmask];
+					ntable[hv & nmask] = db;
+				}
+				otable[idx] = NULL;
+			}
+			hl->hl_table = ntable;
+			hl->hl_mask = nmask;
+
+			for (idx = i; idx <= nmask; idx += stride) {
+				len = 0;
+				for (db = ntable[idx]; db != NULL;
+				    db = db->db_hash_next)
+					len++;
+				if (len > 1)
+					chains++;
+				chain_max = MAX(chain_max, len - (len != 0));
+			}
+			mutex_exit(&hl->hl_lock);
+		}
+
+		h->hash_table = ntable;
+		h->hash_table_mask = nmask;
+		dbuf_hash_table_free(otable, omask + 1);
+
+		DBUFSTAT(dbufstat_hash_chains) = chains;
+		DBUFSTAT(dbufstat_hash_chain_max) = chain_max;
+		DBUFSTAT(dbufstat_hash_buckets) = nmask + 1;
+		DBUFSTAT_BUMP(dbufstat_hash_resizes);
+	}
+
+	mutex_enter(&h->hash_resize_lock);
+	h->hash_resizing = B_FALSE;
+	cv_broadcast(&h->hash_resize_cv);
+	mutex_exit(&h->hash_resize_lock);
+}
+
+static void
+dbuf_hash_grow(void)
+{
+	dbuf_hash_table_t *h = &dbuf_hash_table;
+
+	mutex_enter(&h->hash_resize_lock);
+	if (!h->hash_resizing && h->hash_table_mask < dbuf_hash_table_max) {
+		h->hash_resizing = B_TRUE;
+		if (taskq_dispatch(system_taskq, dbuf_hash_resize, NULL,
+		    TQ_NOSLEEP) == 0)
+			h->hash_resizing = B_FALSE;
+	}
+	mutex_exit(&h->hash_resize_lock);
+}
+
 dmu_buf_impl_t *
 dbuf_find(dnode_t *dn, uint8_t level, uint64_t blkid)
 {
-	dbuf_hash_table_t *h = &dbuf_hash_table;
 	objset_t *os = dn->dn_objset;
+	dbuf_hash_lock_t *hl;
 	uint64_t obj;
 	uint64_t hv;
-	uint64_t idx;
 	dmu_buf_impl_t *db;
 
 	obj = dn->dn_object;
 	hv = DBUF_HASH(os, obj, level, blkid);
-	idx = hv & h->hash_table_mask;
 
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	for (db = h->hash_table[idx]; db != NULL; db = db->db_hash_next) {
+	hl = dbuf_hash_lock(hv);
+	for (db = hl->hl_table[hv & hl->hl_mask]; db != NULL;
+	    db = db->db_hash_next) {
 		if (DBUF_EQUAL(db, os, obj, level, blkid)) {
 			mutex_enter(&db->db_mtx);
 			if (db->db_state != DB_EVICTING) {
-				mutex_exit(DBUF_HASH_MUTEX(h, idx));
+				mutex_exit(&hl->hl_lock);
 				return (db);
 			}
 			mutex_exit(&db->db_mtx);
 		}
 	}
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
+	mutex_exit(&hl->hl_lock);
 	return (NULL);
 }
 
@@ -169,19 +332,22 @@ dbuf_hash_insert(dmu_buf_impl_t *db)
 	objset_t *os = db->db_objset;
 	uint64_t obj = db->db.db_object;
 	int level = db->db_level;
-	uint64_t blkid, hv, idx;
+	uint64_t blkid, hv, idx, count;
+	dbuf_hash_lock_t *hl;
 	dmu_buf_impl_t *dbf;
+	uint64_t i;
 
 	blkid = db->db_blkid;
 	hv = DBUF_HASH(os, obj, level, blkid);
-	idx = hv & h->hash_table_mask;
 
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	for (dbf = h->hash_table[idx]; dbf != NULL; dbf = dbf->db_hash_next) {
+	hl = dbuf_hash_lock(hv);
+	idx = hv & hl->hl_mask;
+	for (dbf = hl->hl_table[idx], i = 0; dbf != NULL;
+	    dbf = dbf->db_hash_next, i++) {
 		if (DBUF_EQUAL(dbf, os, obj, level, blkid)) {
 			mutex_enter(&dbf->db_mtx);
 			if (dbf->db_state != DB_EVICTING) {
-				mutex_exit(DBUF_HASH_MUTEX(h, idx));
+				mutex_exit(&hl->hl_lock);
 				return (dbf);
 			}
 			mutex_exit(&dbf->db_mtx);
@@ -189,10 +355,24 @@ dbuf_hash_insert(dmu_buf_impl_t *db)
 	}
 
 	mutex_enter(&db->db_mtx);
-	db->db_hash_next = h->hash_table[idx];
-	h->hash_table[idx] = db;
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
-	atomic_add_64(&dbuf_hash_count, 1);
+	db->db_hash_next = hl->hl_table[idx];
+	hl->hl_table[idx] = db;
+	mutex_exit(&hl->hl_lock);
+
+	/* collect some hash table performance data */
+	if (i > 0) {
+		DBUFSTAT_BUMP(dbufstat_hash_collisions);
+		if (i == 1)
+			DBUFSTAT_BUMP(dbufstat_hash_chains);
+
+		DBUFSTAT_MAX(dbufstat_hash_chain_max, i);
+	}
+
+	count = atomic_add_64_nv(&DBUFSTAT(dbufstat_hash_elements), 1);
+	DBUFSTAT_MAX(dbufstat_hash_elements_max, count);
+
+	if (count > (h->hash_table_mask + 1) * zfs_dbuf_hash_load)
+		dbuf_hash_grow();
 
 	return (NULL);
 }
@@ -204,32 +384,36 @@ dbuf_hash_insert(dmu_buf_impl_t *db)
 static void
 dbuf_hash_remove(dmu_buf_impl_t *db)
 {
-	dbuf_hash_table_t *h = &dbuf_hash_table;
+	dbuf_hash_lock_t *hl;
 	uint64_t hv, idx;
 	dmu_buf_impl_t *dbf, **dbp;
 
 	hv = DBUF_HASH(db->db_objset, db->db.db_object,
 	    db->db_level, db->db_blkid);
-	idx = hv & h->hash_table_mask;
 
 	/*
 	 * We musn't hold db_mtx to maintin lock ordering:
-	 * DBUF_HASH_MUTEX > db_mtx.
+	 * DBUF_HASH_LOCK > db_mtx.
 	 */
 	ASSERT(refcount_is_zero(&db->db_holds));
 	ASSERT(db->db_state == DB_EVICTING);
 	ASSERT(!MUTEX_HELD(&db->db_mtx));
 
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	dbp = &h->hash_table[idx];
+	hl = dbuf_hash_lock(hv);
+	idx = hv & hl->hl_mask;
+	dbp = &hl->hl_table[idx];
 	while ((dbf = *dbp) != db) {
 		dbp = &dbf->db_hash_next;
 		ASSERT(dbf != NULL);
 	}
 	*dbp = db->db_hash_next;
 	db->db_hash_next = NULL;
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
-	atomic_add_64(&dbuf_hash_count, -1);
+	if (hl->hl_table[idx] != NULL &&
+	    hl->hl_table[idx]->db_hash_next == NULL)
+		DBUFSTAT_BUMPDOWN(dbufstat_hash_chains);
+	mutex_exit(&hl->hl_lock);
+
+	DBUFSTAT_BUMPDOWN(dbufstat_hash_elements);
 }
 
 static arc_evict_func_t dbuf_do_evict;
@@ -266,55 +450,92 @@ dbuf_init(void)
 {
 	uint64_t hsize = 1ULL << 16;
 	dbuf_hash_table_t *h = &dbuf_hash_table;
-	int i;
+	uint64_t nlocks = 256;
+	uint64_t i;
 
 	/*
-	 * The hash table is big enough to fill all of physical memory
-	 * with an average 4K block size.  The table will take up
-	 * totalmem*sizeof(void*)/4K (i.e. 2MB/GB with 8-byte pointers).
+	 * The hash table may grow until it is big enough to fill all of
+	 * physical memory with an average 4K block size.  The table will
+	 * then take up totalmem*sizeof(void*)/4K (i.e. 2MB/GB with 8-byte
+	 * pointers).  Start with 1/64th of that.
 	 */
-	while (hsize * 4096 < physmem * PAGESIZE)
+	dbuf_hash_table_max = hsize;
+	while (dbuf_hash_table_max * 4096 < physmem * PAGESIZE)
+		dbuf_hash_table_max <<= 1;
+	while (hsize * 64 < dbuf_hash_table_max)
 		hsize <<= 1;
 
+	/*
+	 * Scale the lock array with the number of CPUs, but keep it no
+	 * larger than the smallest table.
+	 */
+	while (nlocks < max_ncpus * 64 && nlocks < (1ULL << 16))
+		nlocks <<= 1;
+
 retry:
 	h->hash_table_mask = hsize - 1;
-#if defined(_KERNEL) && defined(HAVE_SPL)
-	/* Large allocations which do not require contiguous pages
-	 * should be using vmem_alloc() in the linux kernel */
-	h->hash_table = vmem_zalloc(hsize * sizeof (void *), KM_SLEEP);
-#else
-	h->hash_table = kmem_zalloc(hsize * sizeof (void *), KM_NOSLEEP);
-#endif
+	h->hash_table = dbuf_hash_table_alloc(hsize);
 	if (h->hash_table == NULL) {
 		/* XXX - we should really return an error instead of assert */
 		ASSERT(hsize > (1ULL << 10));
 		hsize >>= 1;
+		nlocks = MIN(nlocks, hsize);
 		goto retry;
 	}
+	dbuf_hash_table_max--;
 
 	dbuf_cache = kmem_cache_create("dmu_buf_impl_t",
 	    sizeof (dmu_buf_impl_t),
 	    0, dbuf_cons, dbuf_dest, NULL, NULL, NULL, 0);
 
-	for (i = 0; i < DBUF_MUTEXES; i++)
-		mutex_init(&h->hash_mutexes[i], NULL, MUTEX_DEFAULT, NULL);
+	h->hash_lock_mask = nlocks - 1;
+	h->hash_locks = vmem_zalloc(nlocks * sizeof (dbuf_hash_lock_t),
+	    KM_SLEEP);
+	for (i = 0; i < nlocks; i++) {
+		mutex_init(&h->hash_locks[i].hl_lock, NULL, MUTEX_DEFAULT,
+		    NULL);
+		h->hash_locks[i].hl_table = h->hash_table;
+		h->hash_locks[i].hl_mask = h->hash_table_mask;
+	}
+	mutex_init(&h->hash_resize_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&h->hash_resize_cv, NULL, CV_DEFAULT, NULL);
+	h->hash_resizing = B_FALSE;
+
+	DBUFSTAT(dbufstat_hash_buckets) = hsize;
+	DBUFSTAT(dbufstat_hash_locks) = nlocks;
+
+	dbuf_ksp = kstat_create("zfs", 0, "dbufstats", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (dbuf_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (dbuf_ksp != NULL) {
+		dbuf_ksp->ks_data = &dbuf_stats;
+		kstat_install(dbuf_ksp);
+	}
 }
 
 void
 dbuf_fini(void)
 {
 	dbuf_hash_table_t *h = &dbuf_hash_table;
-	int i;
+	uint64_t i;
 
-	for (i = 0; i < DBUF_MUTEXES; i++)
-		mutex_destroy(&h->hash_mutexes[i]);
-#if defined(_KERNEL) && defined(HAVE_SPL)
-	/* Large allocations which do not require contiguous pages
-	 * should be using vmem_free() in the linux kernel */
-	vmem_free(h->hash_table, (h->hash_table_mask + 1) * sizeof (void *));
-#else
-	kmem_free(h->hash_table, (h->hash_table_mask + 1) * sizeof (void *));
-#endif
+	if (dbuf_ksp != NULL) {
+		kstat_delete(dbuf_ksp);
+		dbuf_ksp = NULL;
+	}
+
+	mutex_enter(&h->hash_resize_lock);
+	while (h->hash_resizing)
+		cv_wait(&h->hash_resize_cv, &h->hash_resize_lock);
+	mutex_exit(&h->hash_resize_lock);
+	mutex_destroy(&h->hash_resize_lock);
+	cv_destroy(&h->hash_resize_cv);
+
+	for (i = 0; i <= h->hash_lock_mask; i++)
+		mutex_destroy(&h->hash_locks[i].hl_lock);
+	vmem_free(h->hash_locks,
+	    (h->hash_lock_mask + 1) * sizeof (dbuf_hash_lock_t));
+	dbuf_hash_table_free(h->hash_table, h->hash_table_mask + 1);
 	kmem_cache_destroy(dbuf_cache);
 }
 
@@ -1115,6 +1336,7 @@ dbuf_dirty(dmu_buf_impl_t *db, dmu_tx_t *tx)
 	 */
 	dr = kmem_zalloc(sizeof (dbuf_dirty_record_t), KM_SLEEP);
 	list_link_init(&dr->dr_dirty_node);
+	txg_history_dirty_dbuf(tx->tx_pool, tx->tx_txg);
 	if (db->db_level == 0) {
 		void *data_old = db->db_buf;
 
@@ -1755,6 +1977,18 @@ dbuf_destroy(dmu_buf_impl_t *db)
 
 void
 dbuf_prefetch(dnode_t *dn, uint64_t blkid)
+{
+	dbuf_prefetch_level(dn, 0, blkid);
+}
+
+/*
+ * Start reading a block at the given level into the ARC, if it isn't
+ * there already.  For indirect blocks this lets a prefetch stream get the
+ * block pointers for its data in before they're needed, instead of
+ * waiting on them in dbuf_findbp() for every data prefetch.
+ */
+void
+dbuf_prefetch_level(dnode_t *dn, int level, uint64_t blkid)
 {
 	dmu_buf_impl_t *db = NULL;
 	blkptr_t *bp = NULL;
@@ -1762,11 +1996,11 @@ dbuf_prefetch(dnode_t *dn, uint64_t blkid)
 	ASSERT(blkid != DMU_BONUS_BLKID);
 	ASSERT(RW_LOCK_HELD(&dn->dn_struct_rwlock));
 
-	if (dnode_block_freed(dn, blkid))
+	if (level == 0 && dnode_block_freed(dn, blkid))
 		return;
 
 	/* dbuf_find() returns with db_mtx held */
-	if ((db = dbuf_find(dn, 0, blkid))) {
+	if ((db = dbuf_find(dn, level, blkid))) {
 		if (refcount_count(&db->db_holds) > 0) {
 			/*
 			 * This dbuf is active.  We assume that it is
@@ -1780,7 +2014,7 @@ dbuf_prefetch(dnode_t *dn, uint64_t blkid)
 		db = NULL;
 	}
 
-	if (dbuf_findbp(dn, 0, blkid, TRUE, &db, &bp, NULL) == 0) {
+	if (dbuf_findbp(dn, level, blkid, TRUE, &db, &bp, NULL) == 0) {
 		if (bp && !BP_IS_HOLE(bp)) {
 			int priority = dn->dn_type == DMU_OT_DDT_ZAP ?
 			    ZIO_PRIORITY_DDT_PREFETCH : ZIO_PRIORITY_ASYNC_READ;
@@ -1790,7 +2024,7 @@ dbuf_prefetch(dnode_t *dn, uint64_t blkid)
 			zbookmark_t zb;
 
 			SET_BOOKMARK(&zb, ds ? ds->ds_object : DMU_META_OBJSET,
-			    dn->dn_object, 0, blkid);
+			    dn->dn_object, level, blkid);
 
 			if (db)
 				pbuf = db->db_buf;
@@ -2662,4 +2896,7 @@ dbuf_write(dbuf_dirty_record_t *dr, arc_buf_t *data, dmu_tx_t *tx)
 #if defined(_KERNEL) && defined(HAVE_SPL)
 EXPORT_SYMBOL(dmu_buf_rele);
 EXPORT_SYMBOL(dmu_buf_will_dirty);
+
+module_param(zfs_dbuf_hash_load, int, 0644);
+MODULE_PARM_DESC(zfs_dbuf_hash_load, "dbufs per hash bucket before growing");
 #endif
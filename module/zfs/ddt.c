@@ -35,9 +35,11 @@
 #include <sys/zio_checksum.h>
 #include <sys/zio_compress.h>
 #include <sys/dsl_scan.h>
+#include <sys/dnode.h>
 
 static const ddt_ops_t *ddt_ops[DDT_TYPES] = {
 	&ddt_zap_ops,
+	&ddt_log_ops,
 };
 
 static const char *ddt_class_name[DDT_CLASSES] = {
@@ -46,6 +48,60 @@ static const char *ddt_class_name[DDT_CLASSES] = {
 	"unique",
 };
 
+/*
+ * Build an in-core index of each DDT when it's loaded, so that lookups of
+ * new blocks can skip the DDT objects (see ddt.h).  zfs_ddt_index_max is
+ * the most memory, in bytes, one DDT's index may use; 0 means 1/64th of
+ * physical memory.
+ */
+int zfs_ddt_index_enabled = 1;
+unsigned long zfs_ddt_index_max = 0;
+
+/*
+ * New and changed entries are written to log objects (see ddt_log.c) if
+ * zfs_ddt_log_enabled is set and the pool is at SPA_VERSION_DDT_LOG, and
+ * to ZAP objects if not.  Entries in objects of the other type are moved
+ * over, zfs_ddt_convert_batch a txg.
+ */
+int zfs_ddt_log_enabled = 0;
+unsigned long zfs_ddt_convert_batch = 1000;
+
+/*
+ * Keep a bloom filter of each DDT's keys (see ddt.h), with about
+ * zfs_ddt_bloom_bits_per_key bits per entry.  It is written out every
+ * zfs_ddt_bloom_sync_txgs txgs and when the pool is exported.
+ */
+int zfs_ddt_bloom_enabled = 1;
+int zfs_ddt_bloom_bits_per_key = 10;
+int zfs_ddt_bloom_sync_txgs = 1000;
+
+static ddt_stats_t ddt_stats_template = {
+	{ "lookups",			KSTAT_DATA_UINT64 },
+	{ "index_misses",		KSTAT_DATA_UINT64 },
+	{ "index_hits",			KSTAT_DATA_UINT64 },
+	{ "index_false_hits",		KSTAT_DATA_UINT64 },
+	{ "index_bypassed",		KSTAT_DATA_UINT64 },
+	{ "index_entries",		KSTAT_DATA_UINT64 },
+	{ "index_bytes",		KSTAT_DATA_UINT64 },
+	{ "index_state",		KSTAT_DATA_UINT64 },
+	{ "bloom_misses",		KSTAT_DATA_UINT64 },
+	{ "bloom_false_hits",		KSTAT_DATA_UINT64 },
+	{ "bloom_bytes",		KSTAT_DATA_UINT64 },
+};
+
+/*
+ * Each index slot holds the first word of the key's checksum, with the low
+ * bits replaced by a tag naming the object the entry is in.  A zero slot
+ * is empty; the tag is never zero.
+ */
+#define	DDT_INDEX_TAG_MASK	0xfULL
+#define	DDT_INDEX_MIN_SLOTS	1024ULL
+
+#define	DDT_BLOOM_HASHES	7
+#define	DDT_BLOOM_MIN_BITS	(1ULL << 16)
+#define	DDT_BLOOM_BLOCKSIZE	SPA_MAXBLOCKSIZE
+#define	DDT_BLOOM_MIN_REMOVED	(1ULL << 16)	/* before a rebuild */
+
 static void
 ddt_object_create(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     dmu_tx_t *tx)
@@ -108,6 +164,16 @@ ddt_object_load(ddt_t *ddt, enum ddt_type type, enum ddt_class class)
 	if (error)
 		return (error);
 
+	/*
+	 * Log objects are only ever created at SPA_VERSION_DDT_LOG; one in
+	 * an older pool can't be trusted, so refuse to load it.
+	 */
+	if (type == DDT_TYPE_LOG &&
+	    spa_version(ddt->ddt_spa) < SPA_VERSION_DDT_LOG) {
+		ddt->ddt_object[type][class] = 0;
+		return (ENOTSUP);
+	}
+
 	error = zap_lookup(ddt->ddt_os, ddt->ddt_spa->spa_ddt_stat_object, name,
 	    sizeof (uint64_t), sizeof (ddt_histogram_t) / sizeof (uint64_t),
 	    &ddt->ddt_histogram[type][class]);
@@ -125,6 +191,16 @@ ddt_object_load(ddt_t *ddt, enum ddt_type type, enum ddt_class class)
 	return (error);
 }
 
+static enum ddt_type
+ddt_type_current(ddt_t *ddt)
+{
+	if (zfs_ddt_log_enabled &&
+	    spa_version(ddt->ddt_spa) >= SPA_VERSION_DDT_LOG)
+		return (DDT_TYPE_LOG);
+
+	return (DDT_TYPE_ZAP);
+}
+
 static void
 ddt_object_sync(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     dmu_tx_t *tx)
@@ -139,6 +215,10 @@ ddt_object_sync(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
 	    sizeof (uint64_t), sizeof (ddt_histogram_t) / sizeof (uint64_t),
 	    &ddt->ddt_histogram[type][class], tx) == 0);
 
+	if (ddt_ops[type]->ddt_op_sync != NULL)
+		ddt_ops[type]->ddt_op_sync(ddt->ddt_os,
+		    ddt->ddt_object[type][class], tx);
+
 	/*
 	 * Cache DDT statistics; this is the only time they'll change.
 	 */
@@ -164,7 +244,8 @@ static void
 ddt_object_prefetch(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     ddt_entry_t *dde)
 {
-	if (!ddt_object_exists(ddt, type, class))
+	if (!ddt_object_exists(ddt, type, class) ||
+	    ddt_ops[type]->ddt_op_prefetch == NULL)
 		return;
 
 	ddt_ops[type]->ddt_op_prefetch(ddt->ddt_os,
@@ -506,6 +587,20 @@ ddt_get_dedup_stats(spa_t *spa, ddt_stat_t *dds_total)
 	kmem_free(ddh_total, sizeof (ddt_histogram_t));
 }
 
+void
+ddt_get_dedup_bloom_stats(spa_t *spa, ddt_bloom_stat_t *dbs_total)
+{
+	enum zio_checksum c;
+
+	for (c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+		dbs_total->dbs_misses +=
+		    ddt->ddt_stats.dds_bloom_misses.value.ui64;
+		dbs_total->dbs_false_hits +=
+		    ddt->ddt_stats.dds_bloom_false_hits.value.ui64;
+	}
+}
+
 uint64_t
 ddt_get_dedup_dspace(spa_t *spa)
 {
@@ -684,12 +779,816 @@ ddt_remove(ddt_t *ddt, ddt_entry_t *dde)
 	ddt_free(dde);
 }
 
+/*
+ * ==========================================================================
+ * In-core DDT index
+ * ==========================================================================
+ */
+static uint64_t
+ddt_index_slot(const ddt_key_t *ddk, enum ddt_type type, enum ddt_class class)
+{
+	ASSERT3U(DDT_TYPES * DDT_CLASSES, <=, DDT_INDEX_TAG_MASK);
+
+	return ((ddk->ddk_cksum.zc_word[0] & ~DDT_INDEX_TAG_MASK) |
+	    (type * DDT_CLASSES + class + 1));
+}
+
+static uint64_t
+ddt_index_hash(uint64_t slot)
+{
+	uint64_t h = (slot >> 4) * 0x9e3779b97f4a7c15ULL;
+
+	return (h ^ (h >> 32));
+}
+
+static void
+ddt_index_insert(uint64_t *index, uint64_t size, uint64_t slot)
+{
+	uint64_t mask = size - 1;
+	uint64_t i;
+
+	for (i = ddt_index_hash(slot) & mask; index[i] != 0; i = (i + 1) & mask)
+		continue;
+
+	index[i] = slot;
+}
+
+/*
+ * Empty slot i, shifting later slots of the same probe run back so that
+ * lookups never stop short at the hole.
+ */
+static void
+ddt_index_delete(uint64_t *index, uint64_t size, uint64_t i)
+{
+	uint64_t mask = size - 1;
+	uint64_t j = i;
+	uint64_t k;
+
+	for (;;) {
+		index[i] = 0;
+		do {
+			j = (j + 1) & mask;
+			if (index[j] == 0)
+				return;
+			k = ddt_index_hash(index[j]) & mask;
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		index[i] = index[j];
+		i = j;
+	}
+}
+
+static void
+ddt_index_set_state(ddt_t *ddt, ddt_index_state_t state)
+{
+	ASSERT(RW_WRITE_HELD(&ddt->ddt_index_lock));
+
+	ddt->ddt_index_state = state;
+	ddt->ddt_stats.dds_index_state.value.ui64 = state;
+}
+
+static void
+ddt_index_disable(ddt_t *ddt)
+{
+	ASSERT(RW_WRITE_HELD(&ddt->ddt_index_lock));
+
+	if (ddt->ddt_index != NULL)
+		vmem_free(ddt->ddt_index,
+		    ddt->ddt_index_size * sizeof (uint64_t));
+	ddt->ddt_index = NULL;
+	ddt->ddt_index_size = 0;
+	ddt->ddt_index_count = 0;
+	ddt->ddt_stats.dds_index_entries.value.ui64 = 0;
+	ddt->ddt_stats.dds_index_bytes.value.ui64 = 0;
+	ddt_index_set_state(ddt, DDT_INDEX_DISABLED);
+}
+
+/*
+ * Grow the index so that it holds count slots at no more than 3/4 load.
+ * Returns B_FALSE, leaving the index as it was, if that would take more
+ * memory than zfs_ddt_index_max allows.
+ */
+static boolean_t
+ddt_index_grow(ddt_t *ddt, uint64_t count)
+{
+	uint64_t osize = ddt->ddt_index_size;
+	uint64_t *oindex = ddt->ddt_index;
+	uint64_t size = MAX(osize, DDT_INDEX_MIN_SLOTS);
+	uint64_t limit = zfs_ddt_index_max;
+	uint64_t *index;
+	uint64_t i;
+
+	ASSERT(RW_WRITE_HELD(&ddt->ddt_index_lock));
+
+	while (size / 4 * 3 < count)
+		size <<= 1;
+
+	if (size == osize)
+		return (B_TRUE);
+
+	if (limit == 0)
+		limit = ptob(physmem) / 64;
+	if (size * sizeof (uint64_t) > limit)
+		return (B_FALSE);
+
+	index = vmem_zalloc(size * sizeof (uint64_t), KM_PUSHPAGE);
+	for (i = 0; i < osize; i++)
+		if (oindex[i] != 0)
+			ddt_index_insert(index, size, oindex[i]);
+	if (oindex != NULL)
+		vmem_free(oindex, osize * sizeof (uint64_t));
+
+	ddt->ddt_index = index;
+	ddt->ddt_index_size = size;
+	ddt->ddt_stats.dds_index_bytes.value.ui64 = size * sizeof (uint64_t);
+
+	return (B_TRUE);
+}
+
+static void
+ddt_index_add(ddt_t *ddt, const ddt_key_t *ddk, enum ddt_type type,
+    enum ddt_class class)
+{
+	rw_enter(&ddt->ddt_index_lock, RW_WRITER);
+
+	if (ddt->ddt_index_state != DDT_INDEX_DISABLED) {
+		if (ddt_index_grow(ddt, ddt->ddt_index_count + 1)) {
+			ddt_index_insert(ddt->ddt_index, ddt->ddt_index_size,
+			    ddt_index_slot(ddk, type, class));
+			ddt->ddt_stats.dds_index_entries.value.ui64 =
+			    ++ddt->ddt_index_count;
+		} else {
+			ddt_index_disable(ddt);
+		}
+	}
+
+	rw_exit(&ddt->ddt_index_lock);
+}
+
+/*
+ * Drop one slot for an entry that has left the given object.  While the
+ * index is being built the builder may not have seen the entry yet, so
+ * the slot is left in place; a stale slot only costs a wasted lookup.
+ */
+static void
+ddt_index_remove(ddt_t *ddt, const ddt_key_t *ddk, enum ddt_type type,
+    enum ddt_class class)
+{
+	uint64_t slot = ddt_index_slot(ddk, type, class);
+	uint64_t mask, i;
+
+	rw_enter(&ddt->ddt_index_lock, RW_WRITER);
+
+	if (ddt->ddt_index_state == DDT_INDEX_READY &&
+	    ddt->ddt_index_size != 0) {
+		mask = ddt->ddt_index_size - 1;
+		for (i = ddt_index_hash(slot) & mask; ddt->ddt_index[i] != 0;
+		    i = (i + 1) & mask) {
+			if (ddt->ddt_index[i] == slot) {
+				ddt_index_delete(ddt->ddt_index,
+				    ddt->ddt_index_size, i);
+				ddt->ddt_stats.dds_index_entries.value.ui64 =
+				    --ddt->ddt_index_count;
+				break;
+			}
+		}
+	}
+
+	rw_exit(&ddt->ddt_index_lock);
+}
+
+/*
+ * Returns B_FALSE if the index proves that no DDT object holds the key.
+ * Otherwise the key may be on disk; if the index has its fingerprint,
+ * *typep and *classp name the object it was last added to, else they are
+ * set to DDT_TYPES and DDT_CLASSES.
+ */
+static boolean_t
+ddt_index_contains(ddt_t *ddt, const ddt_key_t *ddk, enum ddt_type *typep,
+    enum ddt_class *classp)
+{
+	uint64_t fp = ddt_index_slot(ddk, 0, 0) & ~DDT_INDEX_TAG_MASK;
+	boolean_t found = B_FALSE;
+	uint64_t mask, i, tag;
+
+	*typep = DDT_TYPES;
+	*classp = DDT_CLASSES;
+
+	rw_enter(&ddt->ddt_index_lock, RW_READER);
+
+	if (ddt->ddt_index_state != DDT_INDEX_READY) {
+		rw_exit(&ddt->ddt_index_lock);
+		DDT_STAT_BUMP(ddt, dds_index_bypassed);
+		return (B_TRUE);
+	}
+
+	if (ddt->ddt_index_size != 0) {
+		mask = ddt->ddt_index_size - 1;
+		for (i = ddt_index_hash(fp) & mask; ddt->ddt_index[i] != 0;
+		    i = (i + 1) & mask) {
+			if ((ddt->ddt_index[i] & ~DDT_INDEX_TAG_MASK) == fp) {
+				tag = ddt->ddt_index[i] & DDT_INDEX_TAG_MASK;
+				*typep = (tag - 1) / DDT_CLASSES;
+				*classp = (tag - 1) % DDT_CLASSES;
+				found = B_TRUE;
+				break;
+			}
+		}
+	}
+
+	rw_exit(&ddt->ddt_index_lock);
+
+	if (!found)
+		DDT_STAT_BUMP(ddt, dds_index_misses);
+
+	return (found);
+}
+
+static uint64_t
+ddt_entry_count(ddt_t *ddt)
+{
+	enum ddt_type type;
+	enum ddt_class class;
+	uint64_t count = 0;
+
+	for (type = 0; type < DDT_TYPES; type++)
+		for (class = 0; class < DDT_CLASSES; class++)
+			count += ddt->ddt_object_stats[type][class].ddo_count;
+
+	return (count);
+}
+
+/*
+ * ==========================================================================
+ * DDT bloom filter
+ * ==========================================================================
+ */
+static uint64_t
+ddt_bloom_bit(const ddt_bloom_phys_t *dbp, const ddt_key_t *ddk, int i)
+{
+	uint64_t h1 = ddk->ddk_cksum.zc_word[1] * 0x9e3779b97f4a7c15ULL;
+	uint64_t h2 = ddk->ddk_cksum.zc_word[2] * 0xc2b2ae3d27d4eb4fULL;
+
+	h1 ^= h1 >> 32;
+	h2 ^= h2 >> 32;
+
+	return ((h1 + i * (h2 | 1)) & (dbp->dbp_bits - 1));
+}
+
+static uint64_t
+ddt_bloom_blocks(const ddt_bloom_phys_t *dbp)
+{
+	return (MAX(dbp->dbp_bits / NBBY / DDT_BLOOM_BLOCKSIZE, 1));
+}
+
+/*
+ * Size a filter for count keys, up to 1/64th of physical memory.
+ */
+static uint64_t
+ddt_bloom_size(uint64_t count)
+{
+	uint64_t limit = ptob(physmem) / 64 * NBBY;
+	uint64_t bits = DDT_BLOOM_MIN_BITS;
+
+	while (bits < count * zfs_ddt_bloom_bits_per_key && bits < limit)
+		bits <<= 1;
+
+	return (bits);
+}
+
+static void
+ddt_bloom_alloc(ddt_t *ddt, uint64_t count)
+{
+	ddt_bloom_phys_t *dbp = &ddt->ddt_bloom_phys;
+
+	ASSERT(RW_WRITE_HELD(&ddt->ddt_bloom_lock));
+	ASSERT(ddt->ddt_bloom == NULL);
+
+	bzero(dbp, sizeof (ddt_bloom_phys_t));
+	dbp->dbp_bits = ddt_bloom_size(count);
+	dbp->dbp_hashes = DDT_BLOOM_HASHES;
+
+	ddt->ddt_bloom = vmem_zalloc(dbp->dbp_bits / NBBY, KM_PUSHPAGE);
+	ddt->ddt_bloom_dirty = kmem_alloc(ddt_bloom_blocks(dbp), KM_PUSHPAGE);
+	(void) memset(ddt->ddt_bloom_dirty, 1, ddt_bloom_blocks(dbp));
+	ddt->ddt_stats.dds_bloom_bytes.value.ui64 = dbp->dbp_bits / NBBY;
+}
+
+static void
+ddt_bloom_free(ddt_t *ddt)
+{
+	ddt_bloom_phys_t *dbp = &ddt->ddt_bloom_phys;
+
+	if (ddt->ddt_bloom != NULL) {
+		vmem_free(ddt->ddt_bloom, dbp->dbp_bits / NBBY);
+		kmem_free(ddt->ddt_bloom_dirty, ddt_bloom_blocks(dbp));
+	}
+	ddt->ddt_bloom = NULL;
+	ddt->ddt_bloom_dirty = NULL;
+	ddt->ddt_bloom_valid = B_FALSE;
+	ddt->ddt_stats.dds_bloom_bytes.value.ui64 = 0;
+}
+
+static void
+ddt_bloom_add(ddt_t *ddt, const ddt_key_t *ddk)
+{
+	ddt_bloom_phys_t *dbp = &ddt->ddt_bloom_phys;
+	uint64_t bit;
+	int i;
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_WRITER);
+
+	/*
+	 * A valid filter with no bits is for an empty DDT; it's allocated
+	 * when the first key is added.
+	 */
+	if (ddt->ddt_bloom == NULL && ddt->ddt_bloom_valid)
+		ddt_bloom_alloc(ddt, 0);
+
+	if (ddt->ddt_bloom != NULL) {
+		for (i = 0; i < dbp->dbp_hashes; i++) {
+			bit = ddt_bloom_bit(dbp, ddk, i);
+			ddt->ddt_bloom[bit / 64] |= 1ULL << (bit % 64);
+			bit /= NBBY * DDT_BLOOM_BLOCKSIZE;
+			ddt->ddt_bloom_dirty[bit] = 1;
+		}
+		dbp->dbp_keys++;
+	}
+
+	rw_exit(&ddt->ddt_bloom_lock);
+}
+
+/*
+ * Returns B_FALSE if the filter proves that no DDT object holds the key.
+ */
+static boolean_t
+ddt_bloom_contains(ddt_t *ddt, const ddt_key_t *ddk)
+{
+	ddt_bloom_phys_t *dbp = &ddt->ddt_bloom_phys;
+	boolean_t found = B_TRUE;
+	uint64_t bit;
+	int i;
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_READER);
+
+	if (ddt->ddt_bloom_valid && ddt->ddt_bloom == NULL) {
+		found = B_FALSE;
+	} else if (ddt->ddt_bloom_valid) {
+		for (i = 0; i < dbp->dbp_hashes; i++) {
+			bit = ddt_bloom_bit(dbp, ddk, i);
+			if ((ddt->ddt_bloom[bit / 64] >> (bit % 64) & 1) == 0) {
+				found = B_FALSE;
+				break;
+			}
+		}
+	}
+
+	rw_exit(&ddt->ddt_bloom_lock);
+
+	if (!found)
+		DDT_STAT_BUMP(ddt, dds_bloom_misses);
+
+	return (found);
+}
+
+/*
+ * The txg in which a DDT object's contents last changed.
+ */
+static uint64_t
+ddt_object_birth(ddt_t *ddt, enum ddt_type type, enum ddt_class class)
+{
+	uint64_t birth = 0;
+	dnode_t *dn;
+	int i;
+
+	if (dnode_hold(ddt->ddt_os, ddt->ddt_object[type][class],
+	    FTAG, &dn) != 0)
+		return (UINT64_MAX);
+
+	rw_enter(&dn->dn_struct_rwlock, RW_READER);
+	for (i = 0; i < dn->dn_phys->dn_nblkptr; i++)
+		birth = MAX(birth, dn->dn_phys->dn_blkptr[i].blk_birth);
+	rw_exit(&dn->dn_struct_rwlock);
+
+	dnode_rele(dn, FTAG);
+
+	return (birth);
+}
+
+/*
+ * Read the on-disk filter.  It's only used if it wasn't marked stale (see
+ * ddt_bloom_sync()) and no DDT object was created after it was written:
+ * software that doesn't know about the filter may have added keys without
+ * setting their bits.  Otherwise a new filter is allocated for
+ * ddt_index_build() to fill.  The object is looked up even if the filter
+ * is disabled, so that it can still be marked stale.
+ */
+static void
+ddt_bloom_load(ddt_t *ddt)
+{
+	ddt_bloom_phys_t *dbp = &ddt->ddt_bloom_phys;
+	uint64_t count = ddt_entry_count(ddt);
+	char name[DDT_NAMELEN];
+	enum ddt_type type;
+	enum ddt_class class;
+	boolean_t valid;
+	dmu_buf_t *db;
+	uint64_t object;
+
+	(void) sprintf(name, DMU_POOL_DDT_BLOOM,
+	    zio_checksum_table[ddt->ddt_checksum].ci_name);
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_WRITER);
+
+	if (zap_lookup(ddt->ddt_os, DMU_POOL_DIRECTORY_OBJECT, name,
+	    sizeof (uint64_t), 1, &object) == 0 &&
+	    dmu_bonus_hold(ddt->ddt_os, object, FTAG, &db) == 0) {
+		bcopy(db->db_data, dbp, sizeof (ddt_bloom_phys_t));
+		dmu_buf_rele(db, FTAG);
+
+		ddt->ddt_bloom_object = object;
+		ddt->ddt_bloom_object_bits = dbp->dbp_bits;
+		ddt->ddt_bloom_stale = (dbp->dbp_txg == 0);
+		ddt->ddt_bloom_synced_txg = dbp->dbp_txg;
+
+		valid = (zfs_ddt_bloom_enabled && count != 0 &&
+		    dbp->dbp_txg != 0 && ISP2(dbp->dbp_bits) &&
+		    dbp->dbp_bits >= DDT_BLOOM_MIN_BITS &&
+		    dbp->dbp_hashes == DDT_BLOOM_HASHES);
+		for (type = 0; type < DDT_TYPES; type++)
+			for (class = 0; class < DDT_CLASSES; class++)
+				if (valid &&
+				    ddt_object_exists(ddt, type, class) &&
+				    ddt_object_birth(ddt, type, class) >
+				    dbp->dbp_txg)
+					valid = B_FALSE;
+
+		if (valid) {
+			ddt->ddt_bloom = vmem_alloc(dbp->dbp_bits / NBBY,
+			    KM_SLEEP);
+			ddt->ddt_bloom_dirty =
+			    kmem_zalloc(ddt_bloom_blocks(dbp), KM_SLEEP);
+			ddt->ddt_stats.dds_bloom_bytes.value.ui64 =
+			    dbp->dbp_bits / NBBY;
+			if (dmu_read(ddt->ddt_os, object, 0,
+			    dbp->dbp_bits / NBBY, ddt->ddt_bloom,
+			    DMU_READ_PREFETCH) == 0) {
+				ddt->ddt_bloom_valid = B_TRUE;
+				rw_exit(&ddt->ddt_bloom_lock);
+				return;
+			}
+			ddt_bloom_free(ddt);
+		}
+	}
+
+	bzero(dbp, sizeof (ddt_bloom_phys_t));
+	if (!zfs_ddt_bloom_enabled) {
+		ddt->ddt_bloom_valid = B_FALSE;
+	} else if (count == 0) {
+		ddt->ddt_bloom_valid = B_TRUE;
+	} else {
+		ddt->ddt_bloom_valid = B_FALSE;
+		ddt_bloom_alloc(ddt, count);
+	}
+
+	rw_exit(&ddt->ddt_bloom_lock);
+}
+
+/*
+ * Each key sets DDT_BLOOM_HASHES bits, so even a few new keys a txg soon
+ * dirty every block of the filter; it is only written out every
+ * zfs_ddt_bloom_sync_txgs txgs, or at export (see ddt_bloom_persist()).
+ * In between, the first txg to add keys zeroes dbp_txg in the on-disk
+ * header, and a filter left stale that way is rebuilt when the pool is
+ * next opened.  When the filter is written out, its header records that
+ * it holds every key as of this txg.  A filter that was resized gets a
+ * new object.
+ */
+static void
+ddt_bloom_sync(ddt_t *ddt, dmu_tx_t *tx)
+{
+	ddt_bloom_phys_t *dbp = &ddt->ddt_bloom_phys;
+	objset_t *os = ddt->ddt_os;
+	uint64_t txg = dmu_tx_get_txg(tx);
+	char name[DDT_NAMELEN];
+	uint64_t bytes, off, b;
+	dmu_buf_t *db;
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_WRITER);
+
+	if (ddt->ddt_bloom_changed && !ddt->ddt_bloom_stale &&
+	    ddt->ddt_bloom_object != 0) {
+		VERIFY(dmu_bonus_hold(os, ddt->ddt_bloom_object, FTAG,
+		    &db) == 0);
+		dmu_buf_will_dirty(db, tx);
+		((ddt_bloom_phys_t *)db->db_data)->dbp_txg = 0;
+		dmu_buf_rele(db, FTAG);
+		ddt->ddt_bloom_stale = B_TRUE;
+	}
+	ddt->ddt_bloom_changed = B_FALSE;
+
+	if (spa_sync_pass(ddt->ddt_spa) != 1 || !ddt->ddt_bloom_valid ||
+	    ddt->ddt_bloom == NULL) {
+		rw_exit(&ddt->ddt_bloom_lock);
+		return;
+	}
+
+	if (ddt->ddt_bloom_object != 0 && !ddt->ddt_bloom_stale &&
+	    ddt->ddt_bloom_object_bits == dbp->dbp_bits) {
+		/* The on-disk filter is current. */
+		ddt->ddt_bloom_persist = B_FALSE;
+		rw_exit(&ddt->ddt_bloom_lock);
+		return;
+	}
+
+	if (!ddt->ddt_bloom_persist &&
+	    txg < ddt->ddt_bloom_synced_txg + zfs_ddt_bloom_sync_txgs) {
+		rw_exit(&ddt->ddt_bloom_lock);
+		return;
+	}
+
+	(void) sprintf(name, DMU_POOL_DDT_BLOOM,
+	    zio_checksum_table[ddt->ddt_checksum].ci_name);
+	bytes = dbp->dbp_bits / NBBY;
+
+	if (ddt->ddt_bloom_object != 0 &&
+	    ddt->ddt_bloom_object_bits != dbp->dbp_bits) {
+		VERIFY(zap_remove(os, DMU_POOL_DIRECTORY_OBJECT, name,
+		    tx) == 0);
+		VERIFY(dmu_object_free(os, ddt->ddt_bloom_object, tx) == 0);
+		ddt->ddt_bloom_object = 0;
+	}
+
+	if (ddt->ddt_bloom_object == 0) {
+		ddt->ddt_bloom_object = dmu_object_alloc(os,
+		    DMU_OT_UINT64_OTHER, MIN(bytes, DDT_BLOOM_BLOCKSIZE),
+		    DMU_OT_UINT64_OTHER, sizeof (ddt_bloom_phys_t), tx);
+		ddt->ddt_bloom_object_bits = dbp->dbp_bits;
+		VERIFY(zap_add(os, DMU_POOL_DIRECTORY_OBJECT, name,
+		    sizeof (uint64_t), 1, &ddt->ddt_bloom_object, tx) == 0);
+		(void) memset(ddt->ddt_bloom_dirty, 1, ddt_bloom_blocks(dbp));
+	}
+
+	for (b = 0; b < ddt_bloom_blocks(dbp); b++) {
+		if (!ddt->ddt_bloom_dirty[b])
+			continue;
+		off = b * DDT_BLOOM_BLOCKSIZE;
+		dmu_write(os, ddt->ddt_bloom_object, off,
+		    MIN(bytes - off, DDT_BLOOM_BLOCKSIZE),
+		    (char *)ddt->ddt_bloom + off, tx);
+		ddt->ddt_bloom_dirty[b] = 0;
+	}
+
+	dbp->dbp_txg = txg;
+	VERIFY(dmu_bonus_hold(os, ddt->ddt_bloom_object, FTAG, &db) == 0);
+	dmu_buf_will_dirty(db, tx);
+	bcopy(dbp, db->db_data, sizeof (ddt_bloom_phys_t));
+	dmu_buf_rele(db, FTAG);
+
+	ddt->ddt_bloom_stale = B_FALSE;
+	ddt->ddt_bloom_persist = B_FALSE;
+	ddt->ddt_bloom_synced_txg = txg;
+
+	rw_exit(&ddt->ddt_bloom_lock);
+}
+
+/*
+ * Have the next txg write out each DDT's bloom filter, so that it can be
+ * used as soon as the pool is imported again.
+ */
+void
+ddt_bloom_persist(spa_t *spa)
+{
+	enum zio_checksum c;
+
+	for (c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+
+		rw_enter(&ddt->ddt_bloom_lock, RW_WRITER);
+		ddt->ddt_bloom_persist = B_TRUE;
+		rw_exit(&ddt->ddt_bloom_lock);
+	}
+}
+
+/*
+ * Fill the index and the bloom filter from the DDT objects, if they need
+ * it.  This runs from the pool's spa_ddt_taskq while the pool is in use;
+ * entries synced meanwhile are added by ddt_sync_entry() as usual, and
+ * ddt_index_remove() leaves slots alone until we're done.  A walk of a big
+ * DDT can take hours, which is why it has a taskq of its own.
+ */
+static void
+ddt_index_build(void *arg)
+{
+	ddt_t *ddt = arg;
+	ddt_entry_t *dde = kmem_zalloc(sizeof (ddt_entry_t), KM_SLEEP);
+	enum ddt_type type;
+	enum ddt_class class;
+	boolean_t index, bloom;
+	int error = 0;
+
+	rw_enter(&ddt->ddt_index_lock, RW_WRITER);
+	index = (ddt->ddt_index_state == DDT_INDEX_BUILDING);
+	if (index && !ddt_index_grow(ddt, ddt_entry_count(ddt))) {
+		ddt_index_disable(ddt);
+		index = B_FALSE;
+	}
+	rw_exit(&ddt->ddt_index_lock);
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_READER);
+	bloom = (ddt->ddt_bloom != NULL && !ddt->ddt_bloom_valid);
+	rw_exit(&ddt->ddt_bloom_lock);
+
+	for (type = 0; type < DDT_TYPES; type++) {
+		for (class = 0; class < DDT_CLASSES; class++) {
+			uint64_t object = ddt->ddt_object[type][class];
+			uint64_t walk = 0;
+
+			if (object == 0)
+				continue;
+
+			while ((index || bloom) && !ddt->ddt_index_cancel &&
+			    (error = ddt_ops[type]->ddt_op_walk(ddt->ddt_os,
+			    object, dde, &walk)) == 0) {
+				index = (index && ddt->ddt_index_state ==
+				    DDT_INDEX_BUILDING);
+				if (index)
+					ddt_index_add(ddt, &dde->dde_key,
+					    type, class);
+				if (bloom)
+					ddt_bloom_add(ddt, &dde->dde_key);
+			}
+
+			if (error != 0 && error != ENOENT)
+				break;
+			error = 0;
+		}
+		if (error != 0)
+			break;
+	}
+
+	kmem_free(dde, sizeof (ddt_entry_t));
+
+	rw_enter(&ddt->ddt_index_lock, RW_WRITER);
+	if (ddt->ddt_index_state == DDT_INDEX_BUILDING) {
+		if (error == 0 && !ddt->ddt_index_cancel)
+			ddt_index_set_state(ddt, DDT_INDEX_READY);
+		else
+			ddt_index_disable(ddt);
+	}
+	rw_exit(&ddt->ddt_index_lock);
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_WRITER);
+	if (bloom) {
+		if (error == 0 && !ddt->ddt_index_cancel)
+			ddt->ddt_bloom_valid = B_TRUE;
+		else
+			ddt_bloom_free(ddt);
+	}
+	rw_exit(&ddt->ddt_bloom_lock);
+
+	ddt_enter(ddt);
+	ddt->ddt_index_building = B_FALSE;
+	cv_broadcast(&ddt->ddt_index_cv);
+	ddt_exit(ddt);
+}
+
+static void
+ddt_index_dispatch(ddt_t *ddt)
+{
+	if (taskq_dispatch(ddt->ddt_spa->spa_ddt_taskq, ddt_index_build, ddt,
+	    TQ_SLEEP) == 0) {
+		rw_enter(&ddt->ddt_index_lock, RW_WRITER);
+		if (ddt->ddt_index_state == DDT_INDEX_BUILDING)
+			ddt_index_disable(ddt);
+		rw_exit(&ddt->ddt_index_lock);
+
+		rw_enter(&ddt->ddt_bloom_lock, RW_WRITER);
+		if (!ddt->ddt_bloom_valid)
+			ddt_bloom_free(ddt);
+		rw_exit(&ddt->ddt_bloom_lock);
+
+		ddt_enter(ddt);
+		ddt->ddt_index_building = B_FALSE;
+		cv_broadcast(&ddt->ddt_index_cv);
+		ddt_exit(ddt);
+	}
+}
+
+static void
+ddt_index_start(ddt_t *ddt)
+{
+	boolean_t bloom;
+
+	ddt_bloom_load(ddt);
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_READER);
+	bloom = (ddt->ddt_bloom != NULL && !ddt->ddt_bloom_valid);
+	rw_exit(&ddt->ddt_bloom_lock);
+
+	rw_enter(&ddt->ddt_index_lock, RW_WRITER);
+	if (ddt_entry_count(ddt) != 0 &&
+	    ddt->ddt_index_state == DDT_INDEX_READY)
+		ddt_index_set_state(ddt, DDT_INDEX_BUILDING);
+	rw_exit(&ddt->ddt_index_lock);
+
+	if (ddt->ddt_index_state != DDT_INDEX_BUILDING && !bloom)
+		return;
+
+	ddt->ddt_index_building = B_TRUE;
+	ddt_index_dispatch(ddt);
+}
+
+/*
+ * Rebuild the bloom filter if the DDT has outgrown it, or if most of the
+ * keys it was given, and at least DDT_BLOOM_MIN_REMOVED, have since been
+ * removed.
+ */
+static void
+ddt_bloom_check(ddt_t *ddt)
+{
+	ddt_bloom_phys_t *dbp = &ddt->ddt_bloom_phys;
+	uint64_t count = ddt_entry_count(ddt);
+	boolean_t rebuild;
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_READER);
+	rebuild = (ddt->ddt_bloom != NULL && ddt->ddt_bloom_valid &&
+	    (ddt_bloom_size(count) > dbp->dbp_bits ||
+	    (dbp->dbp_keys / 2 > count &&
+	    dbp->dbp_keys > count + DDT_BLOOM_MIN_REMOVED)));
+	rw_exit(&ddt->ddt_bloom_lock);
+
+	if (!rebuild)
+		return;
+
+	ddt_enter(ddt);
+	if (ddt->ddt_index_building || ddt->ddt_index_cancel) {
+		ddt_exit(ddt);
+		return;
+	}
+	ddt->ddt_index_building = B_TRUE;
+	ddt_exit(ddt);
+
+	rw_enter(&ddt->ddt_bloom_lock, RW_WRITER);
+	ddt_bloom_free(ddt);
+	ddt_bloom_alloc(ddt, count);
+	rw_exit(&ddt->ddt_bloom_lock);
+
+	ddt_index_dispatch(ddt);
+}
+
+/*
+ * Stop any index builders and tear down their taskq; they read the MOS,
+ * so this must be called before the pool is closed.
+ */
+void
+ddt_index_stop(spa_t *spa)
+{
+	enum zio_checksum c;
+
+	for (c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+
+		if (ddt == NULL)
+			continue;
+
+		ddt_enter(ddt);
+		ddt->ddt_index_cancel = B_TRUE;
+		while (ddt->ddt_index_building)
+			cv_wait(&ddt->ddt_index_cv, &ddt->ddt_lock);
+		ddt_exit(ddt);
+	}
+
+	if (spa->spa_ddt_taskq != NULL) {
+		taskq_destroy(spa->spa_ddt_taskq);
+		spa->spa_ddt_taskq = NULL;
+	}
+}
+
+/*
+ * Returns B_FALSE if the index or the bloom filter proves that no DDT
+ * object holds the key.  Otherwise *typep and *classp are set as by
+ * ddt_index_contains().  The filter is only needed when the index can't
+ * be used, such as while it's being built after the pool is opened.
+ */
+static boolean_t
+ddt_may_contain(ddt_t *ddt, const ddt_key_t *ddk, enum ddt_type *typep,
+    enum ddt_class *classp)
+{
+	if (!ddt_index_contains(ddt, ddk, typep, classp))
+		return (B_FALSE);
+
+	if (*typep == DDT_TYPES && !ddt_bloom_contains(ddt, ddk))
+		return (B_FALSE);
+
+	return (B_TRUE);
+}
+
 ddt_entry_t *
 ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 {
 	ddt_entry_t *dde, dde_search;
-	enum ddt_type type;
-	enum ddt_class class;
+	enum ddt_type type, htype;
+	enum ddt_class class, hclass;
 	avl_index_t where;
 	int error;
 
@@ -717,14 +1616,45 @@ ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 
 	error = ENOENT;
 
-	for (type = 0; type < DDT_TYPES; type++) {
-		for (class = 0; class < DDT_CLASSES; class++) {
-			error = ddt_object_lookup(ddt, type, class, dde);
-			if (error != ENOENT)
-				break;
+	/*
+	 * If the index says the key isn't on disk, we're done.  If it
+	 * knows which object the entry is in, try that one first.
+	 */
+	if (!ddt_may_contain(ddt, &dde->dde_key, &htype, &hclass)) {
+		type = DDT_TYPES;
+		class = DDT_CLASSES;
+	} else {
+		DDT_STAT_BUMP(ddt, dds_lookups);
+
+		if (htype != DDT_TYPES)
+			error = ddt_object_lookup(ddt, htype, hclass, dde);
+
+		if (error != ENOENT) {
+			type = htype;
+			class = hclass;
+		} else {
+			for (type = 0; type < DDT_TYPES; type++) {
+				for (class = 0; class < DDT_CLASSES; class++) {
+					if (type == htype && class == hclass)
+						continue;
+					error = ddt_object_lookup(ddt,
+					    type, class, dde);
+					if (error != ENOENT)
+						break;
+				}
+				if (error != ENOENT)
+					break;
+			}
+		}
+
+		if (htype != DDT_TYPES) {
+			if (error == 0)
+				DDT_STAT_BUMP(ddt, dds_index_hits);
+			else
+				DDT_STAT_BUMP(ddt, dds_index_false_hits);
+		} else if (error == ENOENT && ddt->ddt_bloom_valid) {
+			DDT_STAT_BUMP(ddt, dds_bloom_false_hits);
 		}
-		if (error != ENOENT)
-			break;
 	}
 
 	ASSERT(error == 0 || error == ENOENT);
@@ -766,6 +1696,14 @@ ddt_prefetch(spa_t *spa, const blkptr_t *bp)
 	ddt = ddt_select(spa, bp);
 	ddt_key_fill(&dde.dde_key, bp);
 
+	if (!ddt_may_contain(ddt, &dde.dde_key, &type, &class))
+		return;
+
+	if (type != DDT_TYPES) {
+		ddt_object_prefetch(ddt, type, class, &dde);
+		return;
+	}
+
 	for (type = 0; type < DDT_TYPES; type++) {
 		for (class = 0; class < DDT_CLASSES; class++) {
 			ddt_object_prefetch(ddt, type, class, &dde);
@@ -796,6 +1734,7 @@ static ddt_t *
 ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 {
 	ddt_t *ddt;
+	char kname[KSTAT_STRLEN];
 
 	/* XXX: Move to a slab */
 	ddt = kmem_zalloc(sizeof (*ddt), KM_SLEEP | KM_NODEBUG);
@@ -809,20 +1748,77 @@ ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 	ddt->ddt_spa = spa;
 	ddt->ddt_os = spa->spa_meta_objset;
 
+	rw_init(&ddt->ddt_index_lock, NULL, RW_DEFAULT, NULL);
+	cv_init(&ddt->ddt_index_cv, NULL, CV_DEFAULT, NULL);
+	rw_init(&ddt->ddt_bloom_lock, NULL, RW_DEFAULT, NULL);
+	ddt->ddt_bloom_valid = !!zfs_ddt_bloom_enabled;
+	ddt->ddt_stats = ddt_stats_template;
+	rw_enter(&ddt->ddt_index_lock, RW_WRITER);
+	ddt_index_set_state(ddt, zfs_ddt_index_enabled ?
+	    DDT_INDEX_READY : DDT_INDEX_DISABLED);
+	rw_exit(&ddt->ddt_index_lock);
+
+	if (zio_checksum_table[c].ci_dedup) {
+		(void) snprintf(kname, KSTAT_STRLEN, "ddt-%s-%s",
+		    zio_checksum_table[c].ci_name, spa_name(spa));
+		ddt->ddt_kstat = kstat_create("zfs", 0, kname, "misc",
+		    KSTAT_TYPE_NAMED, sizeof (ddt_stats_t) /
+		    sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+		if (ddt->ddt_kstat != NULL) {
+			ddt->ddt_kstat->ks_data = &ddt->ddt_stats;
+			kstat_install(ddt->ddt_kstat);
+		}
+	}
+
 	return (ddt);
 }
 
 static void
 ddt_table_free(ddt_t *ddt)
 {
+	enum ddt_type type;
+	enum ddt_class class;
+
+	for (type = 0; type < DDT_TYPES; type++) {
+		for (class = 0; class < DDT_CLASSES; class++) {
+			if (ddt_object_exists(ddt, type, class) &&
+			    ddt_ops[type]->ddt_op_close != NULL)
+				ddt_ops[type]->ddt_op_close(ddt->ddt_os,
+				    ddt->ddt_object[type][class]);
+		}
+	}
+
 	ASSERT(avl_numnodes(&ddt->ddt_tree) == 0);
 	ASSERT(avl_numnodes(&ddt->ddt_repair_tree) == 0);
+	ASSERT(!ddt->ddt_index_building);
+
+	if (ddt->ddt_kstat != NULL)
+		kstat_delete(ddt->ddt_kstat);
+	if (ddt->ddt_index != NULL)
+		vmem_free(ddt->ddt_index,
+		    ddt->ddt_index_size * sizeof (uint64_t));
+	cv_destroy(&ddt->ddt_index_cv);
+	rw_destroy(&ddt->ddt_index_lock);
+	ddt_bloom_free(ddt);
+	rw_destroy(&ddt->ddt_bloom_lock);
 	avl_destroy(&ddt->ddt_tree);
 	avl_destroy(&ddt->ddt_repair_tree);
 	mutex_destroy(&ddt->ddt_lock);
 	kmem_free(ddt, sizeof (*ddt));
 }
 
+void
+ddt_init(void)
+{
+	ddt_log_init();
+}
+
+void
+ddt_fini(void)
+{
+	ddt_log_fini();
+}
+
 void
 ddt_create(spa_t *spa)
 {
@@ -830,6 +1826,10 @@ ddt_create(spa_t *spa)
 
 	spa->spa_dedup_checksum = ZIO_DEDUPCHECKSUM;
 
+	ASSERT(spa->spa_ddt_taskq == NULL);
+	spa->spa_ddt_taskq = taskq_create("ddt_index", 1, minclsyspri,
+	    1, 1, 0);
+
 	for (c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++)
 		spa->spa_ddt[c] = ddt_table_alloc(spa, c);
 }
@@ -867,6 +1867,8 @@ ddt_load(spa_t *spa)
 		 */
 		bcopy(ddt->ddt_histogram, &ddt->ddt_histogram_cache,
 		    sizeof (ddt->ddt_histogram));
+
+		ddt_index_start(ddt);
 	}
 
 	return (0);
@@ -877,6 +1879,8 @@ ddt_unload(spa_t *spa)
 {
 	enum zio_checksum c;
 
+	ASSERT(spa->spa_ddt_taskq == NULL);
+
 	for (c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
 		if (spa->spa_ddt[c]) {
 			ddt_table_free(spa->spa_ddt[c]);
@@ -903,6 +1907,9 @@ ddt_class_contains(spa_t *spa, enum ddt_class max_class, const blkptr_t *bp)
 
 	ddt_key_fill(&dde.dde_key, bp);
 
+	if (!ddt_may_contain(ddt, &dde.dde_key, &type, &class))
+		return (B_FALSE);
+
 	for (type = 0; type < DDT_TYPES; type++)
 		for (class = 0; class <= max_class; class++)
 			if (ddt_object_lookup(ddt, type, class, &dde) == 0)
@@ -1025,7 +2032,7 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 	ddt_phys_t *ddp = dde->dde_phys;
 	ddt_key_t *ddk = &dde->dde_key;
 	enum ddt_type otype = dde->dde_type;
-	enum ddt_type ntype = DDT_TYPE_CURRENT;
+	enum ddt_type ntype = ddt_type_current(ddt);
 	enum ddt_class oclass = dde->dde_class;
 	enum ddt_class nclass;
 	uint64_t total_refcnt = 0;
@@ -1062,6 +2069,7 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 	    (otype != ntype || oclass != nclass || total_refcnt == 0)) {
 		VERIFY(ddt_object_remove(ddt, otype, oclass, dde, tx) == 0);
 		ASSERT(ddt_object_lookup(ddt, otype, oclass, dde) == ENOENT);
+		ddt_index_remove(ddt, ddk, otype, oclass);
 	}
 
 	if (total_refcnt != 0) {
@@ -1071,21 +2079,90 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 		if (!ddt_object_exists(ddt, ntype, nclass))
 			ddt_object_create(ddt, ntype, nclass, tx);
 		VERIFY(ddt_object_update(ddt, ntype, nclass, dde, tx) == 0);
+		if (otype != ntype || oclass != nclass) {
+			ddt_index_add(ddt, ddk, ntype, nclass);
+			ddt_bloom_add(ddt, ddk);
+			ddt->ddt_bloom_changed = B_TRUE;
+		}
 
 		/*
-		 * If the class changes, the order that we scan this bp
-		 * changes.  If it decreases, we could miss it, so
+		 * If the class or type changes, the order that we scan
+		 * this bp changes.  If it decreases, we could miss it, so
 		 * scan it right now.  (This covers both class changing
 		 * while we are doing ddt_walk(), and when we are
 		 * traversing.)
 		 */
-		if (nclass < oclass) {
+		if (nclass < oclass || ntype < otype) {
 			dsl_scan_ddt_entry(dp->dp_scan,
 			    ddt->ddt_checksum, dde, tx);
 		}
 	}
 }
 
+static boolean_t
+ddt_convert_entry(ddt_t *ddt, const ddt_entry_t *dde)
+{
+	ddt_entry_t *ndde;
+	avl_index_t where;
+
+	ddt_enter(ddt);
+
+	if (avl_find(&ddt->ddt_tree, dde, &where) != NULL) {
+		ddt_exit(ddt);
+		return (B_FALSE);
+	}
+
+	ndde = ddt_alloc(&dde->dde_key);
+	bcopy(dde->dde_phys, ndde->dde_phys, sizeof (ndde->dde_phys));
+	ndde->dde_type = dde->dde_type;
+	ndde->dde_class = dde->dde_class;
+	ndde->dde_loaded = B_TRUE;
+	ddt_stat_update(ddt, ndde, -1ULL);
+	avl_insert(&ddt->ddt_tree, ndde, where);
+
+	ddt_exit(ddt);
+
+	return (B_TRUE);
+}
+
+/*
+ * Load a batch of entries from objects that aren't of the current type
+ * into the tree, so that ddt_sync_entry() moves them.
+ */
+static void
+ddt_convert(ddt_t *ddt)
+{
+	enum ddt_type ctype = ddt_type_current(ddt);
+	enum ddt_type type;
+	enum ddt_class class;
+	ddt_entry_t *dde;
+	uint64_t n = 0;
+
+	dde = kmem_zalloc(sizeof (ddt_entry_t), KM_SLEEP);
+
+	for (type = 0; type < DDT_TYPES; type++) {
+		if (type == ctype)
+			continue;
+		for (class = 0; class < DDT_CLASSES; class++) {
+			uint64_t walk = 0;
+
+			if (!ddt_object_exists(ddt, type, class))
+				continue;
+
+			while (n < zfs_ddt_convert_batch &&
+			    ddt_object_walk(ddt, type, class, &walk,
+			    dde) == 0) {
+				dde->dde_type = type;
+				dde->dde_class = class;
+				if (ddt_convert_entry(ddt, dde))
+					n++;
+			}
+		}
+	}
+
+	kmem_free(dde, sizeof (ddt_entry_t));
+}
+
 static void
 ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 {
@@ -1095,8 +2172,24 @@ ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 	enum ddt_type type;
 	enum ddt_class class;
 
-	if (avl_numnodes(&ddt->ddt_tree) == 0)
+	if (spa_sync_pass(spa) == 1)
+		ddt_convert(ddt);
+
+	if (avl_numnodes(&ddt->ddt_tree) == 0) {
+		/*
+		 * Nothing changed, but log objects may have merging to do.
+		 */
+		for (type = 0; type < DDT_TYPES; type++) {
+			for (class = 0; class < DDT_CLASSES; class++) {
+				if (ddt_object_exists(ddt, type, class) &&
+				    ddt_ops[type]->ddt_op_sync != NULL)
+					ddt_ops[type]->ddt_op_sync(ddt->ddt_os,
+					    ddt->ddt_object[type][class], tx);
+			}
+		}
+		ddt_bloom_sync(ddt, tx);
 		return;
+	}
 
 	ASSERT(spa->spa_uberblock.ub_version >= SPA_VERSION_DEDUP);
 
@@ -1123,6 +2216,10 @@ ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 		}
 	}
 
+	ddt_bloom_sync(ddt, tx);
+	if (spa_sync_pass(spa) == 1)
+		ddt_bloom_check(ddt);
+
 	bcopy(ddt->ddt_histogram, &ddt->ddt_histogram_cache,
 	    sizeof (ddt->ddt_histogram));
 }
@@ -1181,3 +2278,26 @@ ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde)
 
 	return (ENOENT);
 }
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_ddt_index_enabled, int, 0644);
+MODULE_PARM_DESC(zfs_ddt_index_enabled, "Build an in-core index of each DDT");
+
+module_param(zfs_ddt_index_max, ulong, 0644);
+MODULE_PARM_DESC(zfs_ddt_index_max, "Max bytes of memory per DDT index");
+
+module_param(zfs_ddt_log_enabled, int, 0644);
+MODULE_PARM_DESC(zfs_ddt_log_enabled, "Write DDT entries to log objects");
+
+module_param(zfs_ddt_convert_batch, ulong, 0644);
+MODULE_PARM_DESC(zfs_ddt_convert_batch, "DDT entries converted per txg");
+
+module_param(zfs_ddt_bloom_enabled, int, 0644);
+MODULE_PARM_DESC(zfs_ddt_bloom_enabled, "Keep a bloom filter of DDT keys");
+
+module_param(zfs_ddt_bloom_bits_per_key, int, 0644);
+MODULE_PARM_DESC(zfs_ddt_bloom_bits_per_key, "DDT bloom filter bits per key");
+
+module_param(zfs_ddt_bloom_sync_txgs, int, 0644);
+MODULE_PARM_DESC(zfs_ddt_bloom_sync_txgs, "Txgs between bloom filter writes");
+#endif
@@ -0,0 +1,1078 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2009, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/zio.h>
+#include <sys/ddt.h>
+#include <sys/dmu.h>
+#include <sys/dmu_tx.h>
+#include <sys/refcount.h>
+
+/*
+ * Log-structured DDT objects.
+ *
+ * A ZAP object updates each entry in place, so syncing a DDT dirties leaf
+ * blocks scattered across the whole table.  A log object instead appends
+ * every change to the end of its data as a ddt_log_record_t, and keeps the
+ * latest record for each key in the log in an in-core AVL tree.  Once the
+ * log holds zfs_ddt_log_flush records, the tree is written out, in key
+ * order, to a new object as a sorted run, and the log is truncated.  When
+ * there are DDT_LOG_MERGE_RUNS runs, they're merged into one, at most
+ * zfs_ddt_log_merge_batch records per txg; runs flushed meanwhile are left
+ * out of the merge.  All of these are sequential writes.
+ *
+ * A lookup checks the tree, then bisects each run from newest to oldest;
+ * the first record found for the key wins, and a removal record hides any
+ * older ones.  The log object's bonus buffer holds a ddt_log_phys_t
+ * naming the runs and the state of any merge in progress.
+ *
+ * MOS objects can only be changed in syncing context, so flushing and
+ * merging are done from ddt_log_sync() in the first sync pass rather than
+ * by a separate thread; the records the next merge step will read are
+ * prefetched as each step finishes.  Walks keep cursors into the runs
+ * between calls (see ddt_log_walk()), so they read each run in order.
+ *
+ * The ops vector is keyed by object number, so each object's in-core
+ * state lives in ddt_log_tree, created from disk on first use.
+ */
+
+#define	DDT_LOG_MAX_RUNS	8
+#define	DDT_LOG_MERGE_RUNS	4
+#define	DDT_LOG_CHUNK		128	/* records per I/O */
+#define	DDT_LOG_WALK_CD		0xffULL	/* walk collision differentiator */
+#define	DDT_LOG_WALKERS		4	/* concurrent walks resumed */
+
+#define	DDT_LOG_REMOVED		(1ULL << 0)
+
+/*
+ * On-disk record, in the log and in sorted runs.  All fields are
+ * uint64_t, so the objects byteswap as DMU_OT_UINT64_OTHER.
+ */
+typedef struct ddt_log_record {
+	ddt_key_t	dlr_key;
+	ddt_phys_t	dlr_phys[DDT_PHYS_TYPES];
+	uint64_t	dlr_flags;
+} ddt_log_record_t;
+
+/*
+ * Bonus buffer of a log object.
+ */
+typedef struct ddt_log_phys {
+	uint64_t	dlp_count;		/* live entries */
+	uint64_t	dlp_log_records;	/* records in the log */
+	uint64_t	dlp_nruns;		/* sorted runs, oldest first */
+	uint64_t	dlp_run_object[DDT_LOG_MAX_RUNS];
+	uint64_t	dlp_run_records[DDT_LOG_MAX_RUNS];
+	uint64_t	dlp_merge_nruns;	/* oldest runs being merged */
+	uint64_t	dlp_merge_object;	/* merged run being written */
+	uint64_t	dlp_merge_records;	/* records in merge object */
+	uint64_t	dlp_merge_pos[DDT_LOG_MAX_RUNS]; /* next input record */
+} ddt_log_phys_t;
+
+typedef struct ddt_log_entry {
+	ddt_log_record_t dle_rec;	/* must be first; see compare */
+	avl_node_t	dle_node;
+} ddt_log_entry_t;
+
+/*
+ * Read position in a sorted run.
+ */
+typedef struct ddt_log_cursor {
+	uint64_t	dlc_object;
+	uint64_t	dlc_pos;	/* next record */
+	uint64_t	dlc_end;	/* records in the run */
+	uint64_t	dlc_first;	/* first record in dlc_buf */
+	uint64_t	dlc_count;	/* records in dlc_buf */
+	ddt_log_record_t *dlc_buf;
+} ddt_log_cursor_t;
+
+/*
+ * Where a walk left off.  The next call with the cookie it returned picks
+ * up the cursors and carries on reading the runs in sequence, rather than
+ * bisecting each of them again.  The cursors are only good for the runs
+ * they were set up on; see dl_gen.
+ */
+typedef struct ddt_log_walker {
+	uint64_t	dlw_walk;	/* cookie to resume, 0 if none */
+	uint64_t	dlw_gen;	/* dl_gen of the cursors */
+	uint64_t	dlw_used;	/* dl_walk_clock at last use */
+	boolean_t	dlw_busy;	/* in use by a ddt_log_walk() */
+	ddt_key_t	dlw_key;	/* last key returned */
+	ddt_log_cursor_t dlw_run[DDT_LOG_MAX_RUNS];
+} ddt_log_walker_t;
+
+/*
+ * Identifies a log object; ddt_log_tree is searched with a bare one.
+ */
+typedef struct ddt_log_key {
+	objset_t	*dlk_os;
+	uint64_t	dlk_object;
+} ddt_log_key_t;
+
+typedef struct ddt_log {
+	ddt_log_key_t	dl_key;		/* must be first; see compare */
+	avl_node_t	dl_node;	/* ddt_log_tree linkage */
+	refcount_t	dl_refcnt;
+	krwlock_t	dl_lock;	/* protects everything below */
+	avl_tree_t	dl_tree;	/* latest log record of each key */
+	ddt_log_phys_t	dl_phys;	/* in-core copy of the bonus */
+	boolean_t	dl_dirty;	/* dl_phys needs syncing */
+	uint64_t	dl_gen;		/* bumped when the runs change */
+	kmutex_t	dl_walk_lock;	/* protects the walkers' use */
+	kcondvar_t	dl_walk_cv;	/* a walker was released */
+	uint64_t	dl_walk_clock;
+	ddt_log_walker_t dl_walkers[DDT_LOG_WALKERS];
+} ddt_log_t;
+
+int ddt_log_blockshift = 14;
+unsigned long zfs_ddt_log_flush = 16384;
+unsigned long zfs_ddt_log_merge_batch = 16384;
+
+static krwlock_t ddt_log_lock;
+static avl_tree_t ddt_log_tree;
+
+static int
+ddt_log_key_compare(const ddt_key_t *k1, const ddt_key_t *k2)
+{
+	const uint64_t *u1 = (const uint64_t *)k1;
+	const uint64_t *u2 = (const uint64_t *)k2;
+	int i;
+
+	for (i = 0; i < DDT_KEY_WORDS; i++) {
+		if (u1[i] < u2[i])
+			return (-1);
+		if (u1[i] > u2[i])
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Entries start with their key, so a bare ddt_key_t can be used to search
+ * the tree.
+ */
+static int
+ddt_log_entry_compare(const void *x1, const void *x2)
+{
+	return (ddt_log_key_compare(x1, x2));
+}
+
+/*
+ * Logs start with their key, so a bare ddt_log_key_t can be used to
+ * search the tree.
+ */
+static int
+ddt_log_compare(const void *x1, const void *x2)
+{
+	const ddt_log_key_t *k1 = x1;
+	const ddt_log_key_t *k2 = x2;
+
+	if ((uintptr_t)k1->dlk_os < (uintptr_t)k2->dlk_os)
+		return (-1);
+	if ((uintptr_t)k1->dlk_os > (uintptr_t)k2->dlk_os)
+		return (1);
+	if (k1->dlk_object < k2->dlk_object)
+		return (-1);
+	if (k1->dlk_object > k2->dlk_object)
+		return (1);
+	return (0);
+}
+
+void
+ddt_log_init(void)
+{
+	rw_init(&ddt_log_lock, NULL, RW_DEFAULT, NULL);
+	avl_create(&ddt_log_tree, ddt_log_compare, sizeof (ddt_log_t),
+	    offsetof(ddt_log_t, dl_node));
+}
+
+void
+ddt_log_fini(void)
+{
+	ASSERT(avl_numnodes(&ddt_log_tree) == 0);
+	avl_destroy(&ddt_log_tree);
+	rw_destroy(&ddt_log_lock);
+}
+
+static int
+ddt_log_read(objset_t *os, uint64_t object, uint64_t first, uint64_t n,
+    ddt_log_record_t *recs)
+{
+	return (dmu_read(os, object, first * sizeof (ddt_log_record_t),
+	    n * sizeof (ddt_log_record_t), recs, DMU_READ_NO_PREFETCH));
+}
+
+static void
+ddt_log_tree_update(ddt_log_t *dl, const ddt_log_record_t *rec)
+{
+	ddt_log_entry_t *dle;
+	avl_index_t where;
+
+	dle = avl_find(&dl->dl_tree, &rec->dlr_key, &where);
+	if (dle == NULL) {
+		dle = kmem_alloc(sizeof (ddt_log_entry_t), KM_PUSHPAGE);
+		avl_insert(&dl->dl_tree, dle, where);
+	}
+	dle->dle_rec = *rec;
+}
+
+static ddt_log_t *
+ddt_log_alloc(objset_t *os, uint64_t object)
+{
+	ddt_log_t *dl;
+
+	dl = kmem_zalloc(sizeof (ddt_log_t), KM_SLEEP);
+	dl->dl_key.dlk_os = os;
+	dl->dl_key.dlk_object = object;
+	refcount_create(&dl->dl_refcnt);
+	rw_init(&dl->dl_lock, NULL, RW_DEFAULT, NULL);
+	avl_create(&dl->dl_tree, ddt_log_entry_compare,
+	    sizeof (ddt_log_entry_t), offsetof(ddt_log_entry_t, dle_node));
+	mutex_init(&dl->dl_walk_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&dl->dl_walk_cv, NULL, CV_DEFAULT, NULL);
+
+	return (dl);
+}
+
+static void
+ddt_log_free(ddt_log_t *dl)
+{
+	ddt_log_entry_t *dle;
+	ddt_log_cursor_t *dlc;
+	void *cookie = NULL;
+	int i, run;
+
+	for (i = 0; i < DDT_LOG_WALKERS; i++) {
+		ASSERT(!dl->dl_walkers[i].dlw_busy);
+		for (run = 0; run < DDT_LOG_MAX_RUNS; run++) {
+			dlc = &dl->dl_walkers[i].dlw_run[run];
+			if (dlc->dlc_buf != NULL)
+				zio_buf_free(dlc->dlc_buf, DDT_LOG_CHUNK *
+				    sizeof (ddt_log_record_t));
+		}
+	}
+	cv_destroy(&dl->dl_walk_cv);
+	mutex_destroy(&dl->dl_walk_lock);
+
+	while ((dle = avl_destroy_nodes(&dl->dl_tree, &cookie)) != NULL)
+		kmem_free(dle, sizeof (ddt_log_entry_t));
+	avl_destroy(&dl->dl_tree);
+	rw_destroy(&dl->dl_lock);
+	refcount_destroy(&dl->dl_refcnt);
+	kmem_free(dl, sizeof (ddt_log_t));
+}
+
+/*
+ * Read the bonus buffer and replay the log into the tree.
+ */
+static int
+ddt_log_open(ddt_log_t *dl)
+{
+	objset_t *os = dl->dl_key.dlk_os;
+	uint64_t object = dl->dl_key.dlk_object;
+	ddt_log_record_t *recs;
+	dmu_buf_t *db;
+	uint64_t i, j, n;
+	int error;
+
+	error = dmu_bonus_hold(os, object, FTAG, &db);
+	if (error)
+		return (error);
+	ASSERT3U(db->db_size, >=, sizeof (ddt_log_phys_t));
+	bcopy(db->db_data, &dl->dl_phys, sizeof (ddt_log_phys_t));
+	dmu_buf_rele(db, FTAG);
+
+	recs = zio_buf_alloc(DDT_LOG_CHUNK * sizeof (ddt_log_record_t));
+	for (i = 0; i < dl->dl_phys.dlp_log_records && error == 0; i += n) {
+		n = MIN(DDT_LOG_CHUNK, dl->dl_phys.dlp_log_records - i);
+		error = ddt_log_read(os, object, i, n, recs);
+		for (j = 0; j < n && error == 0; j++)
+			ddt_log_tree_update(dl, &recs[j]);
+	}
+	zio_buf_free(recs, DDT_LOG_CHUNK * sizeof (ddt_log_record_t));
+
+	return (error);
+}
+
+/*
+ * Find an object's in-core state, creating it if need be.  Opening it
+ * reads and replays the log, so that's done without ddt_log_lock held;
+ * if another thread gets there first, its copy is used and ours dropped.
+ */
+static int
+ddt_log_hold(objset_t *os, uint64_t object, void *tag, ddt_log_t **dlp)
+{
+	ddt_log_key_t search;
+	ddt_log_t *dl, *ndl;
+	avl_index_t where;
+	int error;
+
+	search.dlk_os = os;
+	search.dlk_object = object;
+
+	rw_enter(&ddt_log_lock, RW_READER);
+	dl = avl_find(&ddt_log_tree, &search, NULL);
+	if (dl != NULL) {
+		(void) refcount_add(&dl->dl_refcnt, tag);
+		rw_exit(&ddt_log_lock);
+		*dlp = dl;
+		return (0);
+	}
+	rw_exit(&ddt_log_lock);
+
+	ndl = ddt_log_alloc(os, object);
+	if ((error = ddt_log_open(ndl)) != 0) {
+		ddt_log_free(ndl);
+		return (error);
+	}
+
+	rw_enter(&ddt_log_lock, RW_WRITER);
+	dl = avl_find(&ddt_log_tree, &search, &where);
+	if (dl == NULL) {
+		dl = ndl;
+		ndl = NULL;
+		(void) refcount_add(&dl->dl_refcnt, &ddt_log_tree);
+		avl_insert(&ddt_log_tree, dl, where);
+	}
+	(void) refcount_add(&dl->dl_refcnt, tag);
+	rw_exit(&ddt_log_lock);
+
+	if (ndl != NULL)
+		ddt_log_free(ndl);
+
+	*dlp = dl;
+	return (0);
+}
+
+static void
+ddt_log_rele(ddt_log_t *dl, void *tag)
+{
+	if (refcount_remove(&dl->dl_refcnt, tag) == 0)
+		ddt_log_free(dl);
+}
+
+/*
+ * Drop an object's in-core state; it's freed once the last hold is gone.
+ */
+static void
+ddt_log_close(objset_t *os, uint64_t object)
+{
+	ddt_log_key_t search;
+	ddt_log_t *dl;
+
+	search.dlk_os = os;
+	search.dlk_object = object;
+
+	rw_enter(&ddt_log_lock, RW_WRITER);
+	dl = avl_find(&ddt_log_tree, &search, NULL);
+	if (dl != NULL)
+		avl_remove(&ddt_log_tree, dl);
+	rw_exit(&ddt_log_lock);
+
+	if (dl != NULL)
+		ddt_log_rele(dl, &ddt_log_tree);
+}
+
+/*
+ * Find the first record of a run whose key is at or after ddk.  *idxp is
+ * set to its index, or to the length of the run if there is none.
+ */
+static int
+ddt_log_run_search(ddt_log_t *dl, int run, const ddt_key_t *ddk,
+    ddt_log_record_t *rec, uint64_t *idxp)
+{
+	uint64_t object = dl->dl_phys.dlp_run_object[run];
+	uint64_t lo = 0;
+	uint64_t hi = dl->dl_phys.dlp_run_records[run];
+	uint64_t mid;
+	int error;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		error = ddt_log_read(dl->dl_key.dlk_os, object, mid, 1, rec);
+		if (error)
+			return (error);
+		if (ddt_log_key_compare(&rec->dlr_key, ddk) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*idxp = lo;
+	if (lo == dl->dl_phys.dlp_run_records[run])
+		return (0);
+
+	return (ddt_log_read(dl->dl_key.dlk_os, object, lo, 1, rec));
+}
+
+/*
+ * Find the newest record of a key.  Returns ENOENT if there is none, or
+ * if it's a removal.
+ */
+static int
+ddt_log_find(ddt_log_t *dl, const ddt_key_t *ddk, ddt_log_record_t *rec)
+{
+	ddt_log_entry_t *dle;
+	uint64_t idx;
+	int run, error;
+
+	ASSERT(RW_LOCK_HELD(&dl->dl_lock));
+
+	dle = avl_find(&dl->dl_tree, ddk, NULL);
+	if (dle != NULL) {
+		*rec = dle->dle_rec;
+		return ((rec->dlr_flags & DDT_LOG_REMOVED) ? ENOENT : 0);
+	}
+
+	for (run = dl->dl_phys.dlp_nruns - 1; run >= 0; run--) {
+		error = ddt_log_run_search(dl, run, ddk, rec, &idx);
+		if (error)
+			return (error);
+		if (idx < dl->dl_phys.dlp_run_records[run] &&
+		    ddt_log_key_compare(&rec->dlr_key, ddk) == 0)
+			break;
+	}
+
+	if (run < 0 || (rec->dlr_flags & DDT_LOG_REMOVED))
+		return (ENOENT);
+
+	return (0);
+}
+
+static void
+ddt_log_append(ddt_log_t *dl, const ddt_log_record_t *rec, dmu_tx_t *tx)
+{
+	ASSERT(RW_WRITE_HELD(&dl->dl_lock));
+
+	dmu_write(dl->dl_key.dlk_os, dl->dl_key.dlk_object,
+	    dl->dl_phys.dlp_log_records * sizeof (ddt_log_record_t),
+	    sizeof (ddt_log_record_t), rec, tx);
+	dl->dl_phys.dlp_log_records++;
+	dl->dl_dirty = B_TRUE;
+
+	ddt_log_tree_update(dl, rec);
+}
+
+/*
+ * Write the tree out as a new sorted run and empty the log.  Removals are
+ * kept only if there are older runs for them to hide entries in.
+ */
+static void
+ddt_log_flush(ddt_log_t *dl, dmu_tx_t *tx)
+{
+	ddt_log_phys_t *dlp = &dl->dl_phys;
+	boolean_t keep_removed = (dlp->dlp_nruns != 0);
+	ddt_log_record_t *recs;
+	ddt_log_entry_t *dle;
+	void *cookie = NULL;
+	uint64_t object = 0;
+	uint64_t records = 0;
+	uint64_t n = 0;
+
+	ASSERT(RW_WRITE_HELD(&dl->dl_lock));
+	ASSERT3U(dlp->dlp_nruns, <, DDT_LOG_MAX_RUNS);
+
+	recs = zio_buf_alloc(DDT_LOG_CHUNK * sizeof (ddt_log_record_t));
+
+	for (dle = avl_first(&dl->dl_tree); dle != NULL;
+	    dle = AVL_NEXT(&dl->dl_tree, dle)) {
+		if ((dle->dle_rec.dlr_flags & DDT_LOG_REMOVED) && !keep_removed)
+			continue;
+		if (object == 0) {
+			object = dmu_object_alloc(dl->dl_key.dlk_os,
+			    DMU_OT_UINT64_OTHER, 1 << ddt_log_blockshift,
+			    DMU_OT_NONE, 0, tx);
+		}
+		recs[n++] = dle->dle_rec;
+		if (n == DDT_LOG_CHUNK) {
+			dmu_write(dl->dl_key.dlk_os, object,
+			    records * sizeof (ddt_log_record_t),
+			    n * sizeof (ddt_log_record_t), recs, tx);
+			records += n;
+			n = 0;
+		}
+	}
+
+	if (n != 0) {
+		dmu_write(dl->dl_key.dlk_os, object,
+		    records * sizeof (ddt_log_record_t),
+		    n * sizeof (ddt_log_record_t), recs, tx);
+		records += n;
+	}
+
+	zio_buf_free(recs, DDT_LOG_CHUNK * sizeof (ddt_log_record_t));
+
+	while ((dle = avl_destroy_nodes(&dl->dl_tree, &cookie)) != NULL)
+		kmem_free(dle, sizeof (ddt_log_entry_t));
+
+	if (records != 0) {
+		dlp->dlp_run_object[dlp->dlp_nruns] = object;
+		dlp->dlp_run_records[dlp->dlp_nruns] = records;
+		dlp->dlp_nruns++;
+		dl->dl_gen++;
+	}
+
+	VERIFY(dmu_free_range(dl->dl_key.dlk_os, dl->dl_key.dlk_object, 0,
+	    DMU_OBJECT_END, tx) == 0);
+	dlp->dlp_log_records = 0;
+	dl->dl_dirty = B_TRUE;
+}
+
+static int
+ddt_log_cursor_peek(ddt_log_t *dl, ddt_log_cursor_t *dlc,
+    ddt_log_record_t **recp)
+{
+	uint64_t n;
+	int error;
+
+	*recp = NULL;
+	if (dlc->dlc_pos >= dlc->dlc_end)
+		return (0);
+
+	if (dlc->dlc_pos < dlc->dlc_first ||
+	    dlc->dlc_pos >= dlc->dlc_first + dlc->dlc_count) {
+		n = MIN(DDT_LOG_CHUNK, dlc->dlc_end - dlc->dlc_pos);
+		error = ddt_log_read(dl->dl_key.dlk_os, dlc->dlc_object,
+		    dlc->dlc_pos, n, dlc->dlc_buf);
+		if (error) {
+			dlc->dlc_count = 0;
+			return (error);
+		}
+		dlc->dlc_first = dlc->dlc_pos;
+		dlc->dlc_count = n;
+	}
+
+	*recp = &dlc->dlc_buf[dlc->dlc_pos - dlc->dlc_first];
+	return (0);
+}
+
+/*
+ * Do one batch of the merge of the oldest dlp_merge_nruns runs.  As they
+ * are the oldest, removals have nothing left to hide and are dropped.
+ * When every input is used up, the merged run replaces them.
+ */
+static void
+ddt_log_merge(ddt_log_t *dl, dmu_tx_t *tx)
+{
+	ddt_log_phys_t *dlp = &dl->dl_phys;
+	int nruns = dlp->dlp_merge_nruns;
+	ddt_log_cursor_t *dlc;
+	ddt_log_record_t *out, *rec, *r;
+	ddt_key_t key;
+	uint64_t n, nout = 0;
+	boolean_t done = B_TRUE;
+	int i, j, error = 0;
+
+	ASSERT(RW_WRITE_HELD(&dl->dl_lock));
+	ASSERT(nruns != 0 && nruns <= dlp->dlp_nruns);
+
+	dlc = kmem_zalloc(nruns * sizeof (ddt_log_cursor_t), KM_SLEEP);
+	out = zio_buf_alloc(DDT_LOG_CHUNK * sizeof (ddt_log_record_t));
+
+	for (i = 0; i < nruns; i++) {
+		dlc[i].dlc_object = dlp->dlp_run_object[i];
+		dlc[i].dlc_pos = dlp->dlp_merge_pos[i];
+		dlc[i].dlc_end = dlp->dlp_run_records[i];
+		dlc[i].dlc_buf =
+		    zio_buf_alloc(DDT_LOG_CHUNK * sizeof (ddt_log_record_t));
+	}
+
+	for (n = 0; n < zfs_ddt_log_merge_batch && error == 0; n++) {
+		/*
+		 * Take the smallest key; the newest run's record of it wins.
+		 */
+		rec = NULL;
+		for (i = 0; i < nruns && error == 0; i++) {
+			error = ddt_log_cursor_peek(dl, &dlc[i], &r);
+			if (r != NULL && (rec == NULL || ddt_log_key_compare(
+			    &r->dlr_key, &rec->dlr_key) <= 0))
+				rec = r;
+		}
+		if (rec == NULL || error != 0)
+			break;
+
+		key = rec->dlr_key;
+		if (!(rec->dlr_flags & DDT_LOG_REMOVED)) {
+			out[nout++] = *rec;
+			if (nout == DDT_LOG_CHUNK) {
+				dmu_write(dl->dl_key.dlk_os,
+				    dlp->dlp_merge_object,
+				    dlp->dlp_merge_records *
+				    sizeof (ddt_log_record_t),
+				    nout * sizeof (ddt_log_record_t), out, tx);
+				dlp->dlp_merge_records += nout;
+				nout = 0;
+			}
+		}
+
+		for (i = 0; i < nruns && error == 0; i++) {
+			error = ddt_log_cursor_peek(dl, &dlc[i], &r);
+			if (r != NULL &&
+			    ddt_log_key_compare(&r->dlr_key, &key) == 0)
+				dlc[i].dlc_pos++;
+		}
+	}
+
+	if (nout != 0) {
+		dmu_write(dl->dl_key.dlk_os, dlp->dlp_merge_object,
+		    dlp->dlp_merge_records * sizeof (ddt_log_record_t),
+		    nout * sizeof (ddt_log_record_t), out, tx);
+		dlp->dlp_merge_records += nout;
+	}
+
+	for (i = 0; i < nruns; i++) {
+		dlp->dlp_merge_pos[i] = dlc[i].dlc_pos;
+		if (dlc[i].dlc_pos < dlc[i].dlc_end) {
+			done = B_FALSE;
+			dmu_prefetch(dl->dl_key.dlk_os, dlc[i].dlc_object,
+			    dlc[i].dlc_pos * sizeof (ddt_log_record_t),
+			    MIN(zfs_ddt_log_merge_batch,
+			    dlc[i].dlc_end - dlc[i].dlc_pos) *
+			    sizeof (ddt_log_record_t));
+		}
+		zio_buf_free(dlc[i].dlc_buf,
+		    DDT_LOG_CHUNK * sizeof (ddt_log_record_t));
+	}
+
+	zio_buf_free(out, DDT_LOG_CHUNK * sizeof (ddt_log_record_t));
+	kmem_free(dlc, nruns * sizeof (ddt_log_cursor_t));
+
+	dl->dl_dirty = B_TRUE;
+
+	if (!done)
+		return;
+
+	for (i = 0; i < nruns; i++)
+		VERIFY(dmu_object_free(dl->dl_key.dlk_os,
+		    dlp->dlp_run_object[i], tx) == 0);
+
+	j = 0;
+	if (dlp->dlp_merge_records != 0) {
+		dlp->dlp_run_object[j] = dlp->dlp_merge_object;
+		dlp->dlp_run_records[j] = dlp->dlp_merge_records;
+		j++;
+	} else {
+		VERIFY(dmu_object_free(dl->dl_key.dlk_os,
+		    dlp->dlp_merge_object, tx) == 0);
+	}
+	for (i = nruns; i < dlp->dlp_nruns; i++, j++) {
+		dlp->dlp_run_object[j] = dlp->dlp_run_object[i];
+		dlp->dlp_run_records[j] = dlp->dlp_run_records[i];
+	}
+	for (i = j; i < DDT_LOG_MAX_RUNS; i++) {
+		dlp->dlp_run_object[i] = 0;
+		dlp->dlp_run_records[i] = 0;
+	}
+	dlp->dlp_nruns = j;
+	dl->dl_gen++;
+
+	dlp->dlp_merge_nruns = 0;
+	dlp->dlp_merge_object = 0;
+	dlp->dlp_merge_records = 0;
+	bzero(dlp->dlp_merge_pos, sizeof (dlp->dlp_merge_pos));
+}
+
+/* ARGSUSED */
+static int
+ddt_log_create(objset_t *os, uint64_t *objectp, dmu_tx_t *tx,
+    boolean_t prehash)
+{
+	*objectp = dmu_object_alloc(os, DMU_OT_UINT64_OTHER,
+	    1 << ddt_log_blockshift, DMU_OT_UINT64_OTHER,
+	    sizeof (ddt_log_phys_t), tx);
+
+	return (*objectp == 0 ? ENOTSUP : 0);
+}
+
+static int
+ddt_log_destroy(objset_t *os, uint64_t object, dmu_tx_t *tx)
+{
+	ddt_log_phys_t *dlp;
+	ddt_log_t *dl;
+	int i, error;
+
+	if ((error = ddt_log_hold(os, object, FTAG, &dl)) != 0)
+		return (error);
+
+	rw_enter(&dl->dl_lock, RW_WRITER);
+	dlp = &dl->dl_phys;
+	for (i = 0; i < dlp->dlp_nruns; i++)
+		VERIFY(dmu_object_free(os, dlp->dlp_run_object[i], tx) == 0);
+	if (dlp->dlp_merge_object != 0)
+		VERIFY(dmu_object_free(os, dlp->dlp_merge_object, tx) == 0);
+	rw_exit(&dl->dl_lock);
+
+	ddt_log_close(os, object);
+	ddt_log_rele(dl, FTAG);
+
+	return (dmu_object_free(os, object, tx));
+}
+
+static int
+ddt_log_lookup(objset_t *os, uint64_t object, ddt_entry_t *dde)
+{
+	ddt_log_record_t rec;
+	ddt_log_t *dl;
+	int error;
+
+	if ((error = ddt_log_hold(os, object, FTAG, &dl)) != 0)
+		return (error);
+
+	rw_enter(&dl->dl_lock, RW_READER);
+	error = ddt_log_find(dl, &dde->dde_key, &rec);
+	rw_exit(&dl->dl_lock);
+
+	if (error == 0)
+		bcopy(rec.dlr_phys, dde->dde_phys, sizeof (dde->dde_phys));
+
+	ddt_log_rele(dl, FTAG);
+
+	return (error);
+}
+
+static int
+ddt_log_update(objset_t *os, uint64_t object, ddt_entry_t *dde, dmu_tx_t *tx)
+{
+	ddt_log_record_t rec;
+	ddt_log_t *dl;
+	int error;
+
+	if ((error = ddt_log_hold(os, object, FTAG, &dl)) != 0)
+		return (error);
+
+	rw_enter(&dl->dl_lock, RW_WRITER);
+	error = ddt_log_find(dl, &dde->dde_key, &rec);
+	if (error == ENOENT) {
+		dl->dl_phys.dlp_count++;
+		error = 0;
+	}
+	if (error == 0) {
+		rec.dlr_key = dde->dde_key;
+		bcopy(dde->dde_phys, rec.dlr_phys, sizeof (rec.dlr_phys));
+		rec.dlr_flags = 0;
+		ddt_log_append(dl, &rec, tx);
+	}
+	rw_exit(&dl->dl_lock);
+
+	ddt_log_rele(dl, FTAG);
+
+	return (error);
+}
+
+static int
+ddt_log_remove(objset_t *os, uint64_t object, ddt_entry_t *dde, dmu_tx_t *tx)
+{
+	ddt_log_record_t rec;
+	ddt_log_t *dl;
+	int error;
+
+	if ((error = ddt_log_hold(os, object, FTAG, &dl)) != 0)
+		return (error);
+
+	rw_enter(&dl->dl_lock, RW_WRITER);
+	error = ddt_log_find(dl, &dde->dde_key, &rec);
+	if (error == 0) {
+		ASSERT(dl->dl_phys.dlp_count != 0);
+		dl->dl_phys.dlp_count--;
+		bzero(rec.dlr_phys, sizeof (rec.dlr_phys));
+		rec.dlr_flags = DDT_LOG_REMOVED;
+		ddt_log_append(dl, &rec, tx);
+	}
+	rw_exit(&dl->dl_lock);
+
+	ddt_log_rele(dl, FTAG);
+
+	return (error);
+}
+
+static ddt_log_walker_t *
+ddt_log_walker_get(ddt_log_t *dl, uint64_t walk)
+{
+	ddt_log_walker_t *dlw, *lru;
+	int i;
+
+	mutex_enter(&dl->dl_walk_lock);
+	for (;;) {
+		lru = NULL;
+		for (i = 0; i < DDT_LOG_WALKERS; i++) {
+			dlw = &dl->dl_walkers[i];
+			if (dlw->dlw_busy)
+				continue;
+			if (walk != 0 && dlw->dlw_walk == walk)
+				break;
+			if (lru == NULL || dlw->dlw_used < lru->dlw_used)
+				lru = dlw;
+		}
+		if (i < DDT_LOG_WALKERS)
+			break;
+		if (lru != NULL) {
+			dlw = lru;
+			dlw->dlw_walk = 0;
+			break;
+		}
+		cv_wait(&dl->dl_walk_cv, &dl->dl_walk_lock);
+	}
+	dlw->dlw_busy = B_TRUE;
+	dlw->dlw_used = ++dl->dl_walk_clock;
+	mutex_exit(&dl->dl_walk_lock);
+
+	return (dlw);
+}
+
+static void
+ddt_log_walker_put(ddt_log_t *dl, ddt_log_walker_t *dlw)
+{
+	mutex_enter(&dl->dl_walk_lock);
+	dlw->dlw_busy = B_FALSE;
+	cv_broadcast(&dl->dl_walk_cv);
+	mutex_exit(&dl->dl_walk_lock);
+}
+
+/*
+ * Walk the live entries in key order.  Like a ZAP cursor, *walk is the
+ * first word of the last key returned, with its low bits replaced by the
+ * number of entries returned so far that share the rest of that word.
+ * It stays valid across flushes and merges.  A cookie we just returned
+ * usually still has its walker, and then the runs are simply read on
+ * from where it stopped; otherwise each run is bisected to the cookie's
+ * first key.
+ */
+static int
+ddt_log_walk(objset_t *os, uint64_t object, ddt_entry_t *dde, uint64_t *walk)
+{
+	uint64_t prefix = *walk & ~DDT_LOG_WALK_CD;
+	uint64_t skip = *walk & DDT_LOG_WALK_CD;
+	uint64_t seen = 0, flags, idx;
+	ddt_log_record_t *rec, *r, tmp;
+	ddt_log_walker_t *dlw;
+	ddt_log_cursor_t *dlc;
+	ddt_log_entry_t *dle;
+	ddt_key_t start;
+	avl_index_t where;
+	ddt_log_t *dl;
+	int run, nruns, error;
+
+	if ((error = ddt_log_hold(os, object, FTAG, &dl)) != 0)
+		return (error);
+
+	rw_enter(&dl->dl_lock, RW_READER);
+	nruns = dl->dl_phys.dlp_nruns;
+	dlw = ddt_log_walker_get(dl, *walk);
+
+	if (dlw->dlw_walk != 0 && dlw->dlw_gen == dl->dl_gen) {
+		/*
+		 * The cursors are past the last key returned, and the
+		 * entries before it that share its prefix are behind us.
+		 */
+		seen = skip;
+		dle = avl_find(&dl->dl_tree, &dlw->dlw_key, &where);
+		if (dle != NULL)
+			dle = AVL_NEXT(&dl->dl_tree, dle);
+		else
+			dle = avl_nearest(&dl->dl_tree, where, AVL_AFTER);
+	} else {
+		bzero(&start, sizeof (start));
+		start.ddk_cksum.zc_word[0] = prefix;
+
+		dle = avl_find(&dl->dl_tree, &start, &where);
+		if (dle == NULL)
+			dle = avl_nearest(&dl->dl_tree, where, AVL_AFTER);
+
+		for (run = 0; run < nruns && error == 0; run++) {
+			error = ddt_log_run_search(dl, run, &start, &tmp, &idx);
+			dlc = &dlw->dlw_run[run];
+			dlc->dlc_object = dl->dl_phys.dlp_run_object[run];
+			dlc->dlc_pos = idx;
+			dlc->dlc_end = dl->dl_phys.dlp_run_records[run];
+			dlc->dlc_first = 0;
+			dlc->dlc_count = 0;
+			if (dlc->dlc_buf == NULL)
+				dlc->dlc_buf = zio_buf_alloc(DDT_LOG_CHUNK *
+				    sizeof (ddt_log_record_t));
+		}
+		dlw->dlw_gen = dl->dl_gen;
+	}
+
+	while (error == 0) {
+		/*
+		 * Take the smallest key; the newest record of it wins.
+		 */
+		rec = (dle != NULL) ? &dle->dle_rec : NULL;
+		for (run = nruns - 1; run >= 0 && error == 0; run--) {
+			error = ddt_log_cursor_peek(dl, &dlw->dlw_run[run], &r);
+			if (r != NULL && (rec == NULL || ddt_log_key_compare(
+			    &r->dlr_key, &rec->dlr_key) < 0))
+				rec = r;
+		}
+		if (error != 0)
+			break;
+		if (rec == NULL) {
+			error = ENOENT;
+			break;
+		}
+
+		dde->dde_key = rec->dlr_key;
+		bcopy(rec->dlr_phys, dde->dde_phys, sizeof (dde->dde_phys));
+		flags = rec->dlr_flags;
+
+		/*
+		 * Step past the key.  Each run's current record was just
+		 * peeked at, so this needs no I/O.
+		 */
+		if (dle != NULL &&
+		    ddt_log_key_compare(&dle->dle_rec.dlr_key,
+		    &dde->dde_key) == 0)
+			dle = AVL_NEXT(&dl->dl_tree, dle);
+		for (run = 0; run < nruns && error == 0; run++) {
+			dlc = &dlw->dlw_run[run];
+			error = ddt_log_cursor_peek(dl, dlc, &r);
+			if (r != NULL && ddt_log_key_compare(&r->dlr_key,
+			    &dde->dde_key) == 0)
+				dlc->dlc_pos++;
+		}
+
+		if (flags & DDT_LOG_REMOVED)
+			continue;
+
+		if ((dde->dde_key.ddk_cksum.zc_word[0] & ~DDT_LOG_WALK_CD) !=
+		    prefix) {
+			prefix = dde->dde_key.ddk_cksum.zc_word[0] &
+			    ~DDT_LOG_WALK_CD;
+			skip = 0;
+			seen = 0;
+		}
+		if (seen++ < skip)
+			continue;
+
+		ASSERT3U(seen, <=, DDT_LOG_WALK_CD);
+		*walk = prefix | seen;
+		break;
+	}
+
+	if (error == 0) {
+		dlw->dlw_walk = *walk;
+		dlw->dlw_key = dde->dde_key;
+	} else {
+		dlw->dlw_walk = 0;
+	}
+	ddt_log_walker_put(dl, dlw);
+
+	rw_exit(&dl->dl_lock);
+
+	ddt_log_rele(dl, FTAG);
+
+	return (error);
+}
+
+static uint64_t
+ddt_log_count(objset_t *os, uint64_t object)
+{
+	uint64_t count;
+	ddt_log_t *dl;
+
+	VERIFY(ddt_log_hold(os, object, FTAG, &dl) == 0);
+
+	rw_enter(&dl->dl_lock, RW_READER);
+	count = dl->dl_phys.dlp_count;
+	rw_exit(&dl->dl_lock);
+
+	ddt_log_rele(dl, FTAG);
+
+	return (count);
+}
+
+/*
+ * Called once per sync pass for each log object.  In the first pass,
+ * advance any merge, start one if there are enough runs, and flush the
+ * log if it's full and there's room for another run.
+ */
+static void
+ddt_log_sync(objset_t *os, uint64_t object, dmu_tx_t *tx)
+{
+	ddt_log_phys_t *dlp;
+	ddt_log_t *dl;
+	dmu_buf_t *db;
+
+	VERIFY(ddt_log_hold(os, object, FTAG, &dl) == 0);
+
+	rw_enter(&dl->dl_lock, RW_WRITER);
+	dlp = &dl->dl_phys;
+
+	if (spa_sync_pass(dmu_objset_spa(os)) == 1) {
+		if (dlp->dlp_merge_nruns == 0 &&
+		    dlp->dlp_nruns >= DDT_LOG_MERGE_RUNS) {
+			dlp->dlp_merge_nruns = dlp->dlp_nruns;
+			dlp->dlp_merge_object = dmu_object_alloc(os,
+			    DMU_OT_UINT64_OTHER, 1 << ddt_log_blockshift,
+			    DMU_OT_NONE, 0, tx);
+			dlp->dlp_merge_records = 0;
+			bzero(dlp->dlp_merge_pos, sizeof (dlp->dlp_merge_pos));
+		}
+
+		if (dlp->dlp_merge_nruns != 0)
+			ddt_log_merge(dl, tx);
+
+		if (dlp->dlp_log_records >= zfs_ddt_log_flush &&
+		    dlp->dlp_nruns < DDT_LOG_MAX_RUNS)
+			ddt_log_flush(dl, tx);
+	}
+
+	if (dl->dl_dirty) {
+		VERIFY(dmu_bonus_hold(os, object, FTAG, &db) == 0);
+		dmu_buf_will_dirty(db, tx);
+		ASSERT3U(db->db_size, >=, sizeof (ddt_log_phys_t));
+		bcopy(dlp, db->db_data, sizeof (ddt_log_phys_t));
+		dmu_buf_rele(db, FTAG);
+		dl->dl_dirty = B_FALSE;
+	}
+
+	rw_exit(&dl->dl_lock);
+
+	ddt_log_rele(dl, FTAG);
+}
+
+const ddt_ops_t ddt_log_ops = {
+	"log",
+	ddt_log_create,
+	ddt_log_destroy,
+	ddt_log_lookup,
+	NULL,		/* each bisection step waits for the one before */
+	ddt_log_update,
+	ddt_log_remove,
+	ddt_log_walk,
+	ddt_log_count,
+	ddt_log_sync,
+	ddt_log_close,
+};
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_ddt_log_flush, ulong, 0644);
+MODULE_PARM_DESC(zfs_ddt_log_flush, "DDT log records before a sorted run");
+
+module_param(zfs_ddt_log_merge_batch, ulong, 0644);
+MODULE_PARM_DESC(zfs_ddt_log_merge_batch, "DDT run records merged per txg");
+#endif
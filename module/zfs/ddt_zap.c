@@ -154,4 +154,6 @@ const ddt_ops_t ddt_zap_ops = {
 	ddt_zap_remove,
 	ddt_zap_walk,
 	ddt_zap_count,
+	NULL,
+	NULL,
 };
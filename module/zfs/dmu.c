@@ -911,56 +911,54 @@ xuio_stat_wbuf_nocopy()
 #ifdef _KERNEL
 
 /*
- * Copy up to size bytes between arg_buf and req based on the data direction
- * described by the req.  If an entire req's data cannot be transfered the
- * req's is updated such that it's current index and bv offsets correctly
- * reference any residual data which could not be copied.  The return value
- * is the number of bytes successfully copied to arg_buf.
+ * Copy up to size bytes between arg_buf and the bio, starting bio_off bytes
+ * in to the bio's data, based on the data direction of the bio.  The bio
+ * itself is left untouched since it still belongs to the submitter.  The
+ * return value is the number of bytes copied.
  */
 static int
-dmu_req_copy(void *arg_buf, int size, int *offset, struct request *req)
+dmu_bio_copy(void *arg_buf, int size, struct bio *bio, size_t bio_off)
 {
 	struct bio_vec *bv;
-	struct req_iterator iter;
 	char *bv_buf;
-	int tocpy;
+	int i, tocpy, offset = 0;
 
-	*offset = 0;
-	rq_for_each_segment(bv, req, iter) {
-
-		/* Fully consumed the passed arg_buf */
-		ASSERT3S(*offset, <=, size);
-		if (size == *offset)
-			break;
-
-		/* Skip fully consumed bv's */
-		if (bv->bv_len == 0)
+	bio_for_each_segment(bv, bio, i) {
+		/* Skip the bv's consumed by earlier calls */
+		if (bio_off >= bv->bv_len) {
+			bio_off -= bv->bv_len;
 			continue;
+		}
 
-		tocpy = MIN(bv->bv_len, size - *offset);
+		tocpy = MIN(bv->bv_len - bio_off, size - offset);
 		ASSERT3S(tocpy, >=, 0);
 
-		bv_buf = page_address(bv->bv_page) + bv->bv_offset;
+		bv_buf = page_address(bv->bv_page) + bv->bv_offset + bio_off;
 		ASSERT3P(bv_buf, !=, NULL);
 
-		if (rq_data_dir(req) == WRITE)
-			memcpy(arg_buf + *offset, bv_buf, tocpy);
+		if (bio_data_dir(bio) == WRITE)
+			memcpy(arg_buf + offset, bv_buf, tocpy);
 		else
-			memcpy(bv_buf, arg_buf + *offset, tocpy);
+			memcpy(bv_buf, arg_buf + offset, tocpy);
+
+		offset += tocpy;
+		bio_off = 0;
 
-		*offset += tocpy;
-		bv->bv_offset += tocpy;
-		bv->bv_len -= tocpy;
+		/* Fully consumed the passed arg_buf */
+		ASSERT3S(offset, <=, size);
+		if (offset == size)
+			break;
 	}
 
-	return 0;
+	return (offset);
 }
 
 int
-dmu_read_req(objset_t *os, uint64_t object, struct request *req)
+dmu_read_bio(objset_t *os, uint64_t object, struct bio *bio)
 {
-	uint64_t size = blk_rq_bytes(req);
-	uint64_t offset = blk_rq_pos(req) << 9;
+	uint64_t size = bio->bi_size;
+	uint64_t offset = bio->bi_sector << 9;
+	size_t bio_off = 0;
 	dmu_buf_t **dbp;
 	int numbufs, i, err;
 
@@ -984,17 +982,16 @@ dmu_read_req(objset_t *os, uint64_t object, struct request *req)
 		if (tocpy == 0)
 			break;
 
-		err = dmu_req_copy(db->db_data + bufoff, tocpy, &didcpy, req);
-
-		if (didcpy < tocpy)
+		didcpy = dmu_bio_copy(db->db_data + bufoff, tocpy, bio,
+		    bio_off);
+		if (didcpy < tocpy) {
 			err = EIO;
-
-		if (err)
 			break;
+		}
 
 		size -= tocpy;
 		offset += didcpy;
-		err = 0;
+		bio_off += didcpy;
 	}
 	dmu_buf_rele_array(dbp, numbufs, FTAG);
 
@@ -1002,10 +999,11 @@ dmu_read_req(objset_t *os, uint64_t object, struct request *req)
 }
 
 int
-dmu_write_req(objset_t *os, uint64_t object, struct request *req, dmu_tx_t *tx)
+dmu_write_bio(objset_t *os, uint64_t object, struct bio *bio, dmu_tx_t *tx)
 {
-	uint64_t size = blk_rq_bytes(req);
-	uint64_t offset = blk_rq_pos(req) << 9;
+	uint64_t size = bio->bi_size;
+	uint64_t offset = bio->bi_sector << 9;
+	size_t bio_off = 0;
 	dmu_buf_t **dbp;
 	int numbufs;
 	int err = 0;
@@ -1037,20 +1035,20 @@ dmu_write_req(objset_t *os, uint64_t object, struct request *req, dmu_tx_t *tx)
 		else
 			dmu_buf_will_dirty(db, tx);
 
-		err = dmu_req_copy(db->db_data + bufoff, tocpy, &didcpy, req);
+		didcpy = dmu_bio_copy(db->db_data + bufoff, tocpy, bio,
+		    bio_off);
 
 		if (tocpy == db->db_size)
 			dmu_buf_fill_done(db, tx);
 
-		if (didcpy < tocpy)
+		if (didcpy < tocpy) {
 			err = EIO;
-
-		if (err)
 			break;
+		}
 
 		size -= tocpy;
 		offset += didcpy;
-		err = 0;
+		bio_off += didcpy;
 	}
 
 	dmu_buf_rele_array(dbp, numbufs, FTAG);
@@ -1022,6 +1022,10 @@ restore_object(struct restorearg *ra, objset_t *os, struct drr_object *drro)
 		return (EINVAL);
 	}
 
+	if (drro->drr_compress == ZIO_COMPRESS_LZ4 &&
+	    spa_version(dmu_objset_spa(os)) < SPA_VERSION_LZ4_COMPRESSION)
+		return (ENOTSUP);
+
 	err = dmu_object_info(os, drro->drr_object, NULL);
 
 	if (err != 0 && err != ENOENT)
@@ -52,6 +52,7 @@ dmu_tx_create_dd(dsl_dir_t *dd)
 	    offsetof(dmu_tx_hold_t, txh_node));
 	list_create(&tx->tx_callbacks, sizeof (dmu_tx_callback_t),
 	    offsetof(dmu_tx_callback_t, dcb_node));
+	tx->tx_start = gethrtime();
 #ifdef ZFS_DEBUG
 	refcount_create(&tx->tx_space_written);
 	refcount_create(&tx->tx_space_freed);
@@ -1026,6 +1027,67 @@ dmu_tx_unassign(dmu_tx_t *tx)
 	tx->tx_txg = 0;
 }
 
+/*
+ * How long a tx must wait from its creation before it may be assigned,
+ * in proportion to the amount of dirty data in the pool; see the write
+ * throttle comment in dsl_pool.c.  Zero if it need not be delayed.
+ */
+static hrtime_t
+dmu_tx_min_tx_time(dsl_pool_t *dp)
+{
+	uint64_t delay_min_bytes, dirty;
+	hrtime_t min_tx_time;
+
+	if (zfs_no_write_throttle)
+		return (0);
+
+	delay_min_bytes =
+	    zfs_dirty_data_max * zfs_delay_min_dirty_percent / 100;
+	dirty = dp->dp_dirty_total;
+	if (dirty <= delay_min_bytes)
+		return (0);
+
+	if (dirty >= zfs_dirty_data_max)
+		return (zfs_delay_max_ns);
+
+	min_tx_time = zfs_delay_scale * (dirty - delay_min_bytes) /
+	    (zfs_dirty_data_max - dirty);
+	return (MIN(min_tx_time, zfs_delay_max_ns));
+}
+
+/*
+ * Delay a tx by dmu_tx_min_tx_time().  The delay is counted from when
+ * the tx was created, so time spent setting it up is not charged twice,
+ * and delayed tx's are spaced at least min_tx_time apart so that many
+ * threads arriving at once are released one at a time rather than all
+ * together.  Sleeps are in whole clock ticks; whatever is left over is
+ * carried in dp_last_wakeup and charged to the next tx.
+ */
+static void
+dmu_tx_delay(dmu_tx_t *tx)
+{
+	dsl_pool_t *dp = tx->tx_pool;
+	hrtime_t wakeup, min_tx_time, now;
+	clock_t ticks;
+
+	min_tx_time = dmu_tx_min_tx_time(dp);
+	now = gethrtime();
+	if (min_tx_time == 0 || now > tx->tx_start + min_tx_time)
+		return;
+
+	mutex_enter(&dp->dp_lock);
+	wakeup = MAX(tx->tx_start + min_tx_time,
+	    dp->dp_last_wakeup + min_tx_time);
+	dp->dp_last_wakeup = wakeup;
+	mutex_exit(&dp->dp_lock);
+
+	dsl_pool_delay_stat_add(dp, wakeup - now);
+
+	ticks = (wakeup - now) / (NANOSEC / hz);
+	if (ticks > 0)
+		delay(ticks);
+}
+
 /*
  * Assign tx to a transaction group.  txg_how can be one of:
  *
@@ -1036,9 +1098,14 @@ dmu_tx_unassign(dmu_tx_t *tx)
  * (2)	TXG_NOWAIT.  If we can't assign into the current open txg without
  *	blocking, returns immediately with ERESTART.  This should be used
  *	whenever you're holding locks.  On an ERESTART error, the caller
- *	should drop locks, do a dmu_tx_wait(tx), and try again.
+ *	should drop locks, do a dmu_tx_wait(tx), and try again with
+ *	TXG_WAITED.  A tx that must be throttled also gets ERESTART, and
+ *	is delayed in dmu_tx_wait() once the locks are dropped.
+ *
+ * (3)	TXG_WAITED.  Like TXG_NOWAIT, but the caller has already waited
+ *	in dmu_tx_wait() for this operation, so it is not throttled again.
  *
- * (3)	A specific txg.  Use this if you need to ensure that multiple
+ * (4)	A specific txg.  Use this if you need to ensure that multiple
  *	transactions all sync in the same txg.  Like TXG_NOWAIT, it
  *	returns ERESTART if it can't assign you into the requested txg.
  */
@@ -1051,6 +1118,25 @@ dmu_tx_assign(dmu_tx_t *tx, uint64_t txg_how)
 	ASSERT(txg_how != 0);
 	ASSERT(!dsl_pool_sync_context(tx->tx_pool));
 
+	/*
+	 * Throttle before taking a txg hold, so a delayed tx doesn't hold
+	 * up the quiesce.  TXG_NOWAIT callers may be holding locks, so
+	 * rather than sleep here they are sent to dmu_tx_wait().  Callers
+	 * asking for a specific txg are part of a group that must all get
+	 * into it, so they are not delayed.
+	 */
+	if (txg_how == TXG_WAIT) {
+		dmu_tx_delay(tx);
+	} else if (txg_how == TXG_NOWAIT) {
+		hrtime_t min_tx_time = dmu_tx_min_tx_time(tx->tx_pool);
+
+		if (min_tx_time != 0 &&
+		    gethrtime() <= tx->tx_start + min_tx_time) {
+			tx->tx_wait_delay = B_TRUE;
+			return (ERESTART);
+		}
+	}
+
 	while ((err = dmu_tx_try_assign(tx, txg_how)) != 0) {
 		dmu_tx_unassign(tx);
 
@@ -1069,9 +1155,39 @@ void
 dmu_tx_wait(dmu_tx_t *tx)
 {
 	spa_t *spa = tx->tx_pool->dp_spa;
+	dsl_pool_t *dp = tx->tx_pool;
 
 	ASSERT(tx->tx_txg == 0);
 
+	if (tx->tx_wait_dirty) {
+		/*
+		 * The pool is at zfs_dirty_data_max; wait for txgs to sync
+		 * until this tx fits.  The kick is a no-op while a txg is
+		 * already in flight, so kick again each time one lands.
+		 */
+		for (;;) {
+			txg_kick(dp);
+			mutex_enter(&dp->dp_lock);
+			if (dp->dp_dirty_total == 0 ||
+			    dp->dp_dirty_total + tx->tx_wait_dirty_space <=
+			    zfs_dirty_data_max) {
+				mutex_exit(&dp->dp_lock);
+				break;
+			}
+			cv_wait(&dp->dp_spaceavail_cv, &dp->dp_lock);
+			mutex_exit(&dp->dp_lock);
+		}
+		tx->tx_wait_dirty = B_FALSE;
+		tx->tx_wait_delay = B_FALSE;
+		return;
+	}
+
+	if (tx->tx_wait_delay) {
+		dmu_tx_delay(tx);
+		tx->tx_wait_delay = B_FALSE;
+		return;
+	}
+
 	/*
 	 * It's possible that the pool has become active after this thread
 	 * has tried to obtain a tx. If that's the case then his
@@ -30,6 +30,7 @@
 #include <sys/dmu.h>
 #include <sys/dbuf.h>
 #include <sys/kstat.h>
+#include <sys/spa_impl.h>
 
 /*
  * I'm against tune-ables, but these should probably exist as tweakable globals
@@ -38,23 +39,46 @@
 
 int zfs_prefetch_disable = 0;
 
-/* max # of streams per zfetch */
-uint32_t	zfetch_max_streams = 8;
+/*
+ * A file gets a stream for each reader that is actively working through
+ * it.  Streams idle for zfetch_min_sec_reap are reused for new readers;
+ * beyond that, new streams are allocated up to zfetch_max_streams, or one
+ * per zfetch_max_distance of the file.
+ */
+uint32_t	zfetch_max_streams = 1024;
 /* min time before stream reclaim */
 uint32_t	zfetch_min_sec_reap = 2;
-/* max number of blocks to fetch at a time */
-uint32_t	zfetch_block_cap = 256;
+/*
+ * Past this many streams, streams that no read has continued are recycled,
+ * and only forward sequential reads are matched to streams: backward and
+ * strided access need every stream checked, and the search for new strided
+ * streams is quadratic.
+ */
+uint32_t	zfetch_colinear_streams = 8;
+/*
+ * Each stream prefetches far enough ahead to cover zfetch_lead_ms at the
+ * rate its reader is consuming blocks, and further if the reader catches
+ * up with the prefetch, up to zfetch_max_distance bytes.
+ */
+uint32_t	zfetch_lead_ms = 250;
+uint64_t	zfetch_max_distance = 8 * 1024 * 1024;
+/* prefetch indirect blocks for this many bytes of data ahead of a stream */
+uint64_t	zfetch_max_idistance = 64 * 1024 * 1024;
 /* number of bytes in a array_read at which we stop prefetching (1Mb) */
 uint64_t	zfetch_array_rd_sz = 1024 * 1024;
 
 /* forward decls for static routines */
 static int		dmu_zfetch_colinear(zfetch_t *, zstream_t *);
 static void		dmu_zfetch_dofetch(zfetch_t *, zstream_t *);
+static void		dmu_zfetch_ramp(zfetch_t *, zstream_t *, uint64_t, int);
 static uint64_t		dmu_zfetch_fetch(dnode_t *, uint64_t, uint64_t);
 static uint64_t		dmu_zfetch_fetchsz(dnode_t *, uint64_t, uint64_t);
 static int		dmu_zfetch_find(zfetch_t *, zstream_t *, int);
+static int		dmu_zfetch_stream_compare(const void *, const void *);
+static zstream_t	*dmu_zfetch_stream_after(zfetch_t *, uint64_t);
 static int		dmu_zfetch_stream_insert(zfetch_t *, zstream_t *);
 static zstream_t	*dmu_zfetch_stream_reclaim(zfetch_t *);
+static void		dmu_zfetch_stream_done(zfetch_t *, zstream_t *);
 static void		dmu_zfetch_stream_remove(zfetch_t *, zstream_t *);
 static int		dmu_zfetch_streams_equal(zstream_t *, zstream_t *);
 
@@ -93,6 +117,30 @@ static zfetch_stats_t zfetch_stats = {
 
 kstat_t		*zfetch_ksp;
 
+static zfetch_pool_stats_t zfetch_pool_stats_template = {
+	{ "hits",			KSTAT_DATA_UINT64 },
+	{ "misses",			KSTAT_DATA_UINT64 },
+	{ "blocks",			KSTAT_DATA_UINT64 },
+	{ "indirect_blocks",		KSTAT_DATA_UINT64 },
+	{ "useless_blocks",		KSTAT_DATA_UINT64 },
+	{ "streams",			KSTAT_DATA_UINT64 },
+};
+
+#define	ZFETCH_POOL_INCR(zf, stat, val)					\
+	atomic_add_64(&(zf)->zf_dnode->dn_objset->os_spa->		\
+	    spa_zfetch_stats.stat.value.ui64, (val))
+
+#define	ZFETCH_POOL_BUMP(zf, stat)	ZFETCH_POOL_INCR(zf, stat, 1)
+
+/*
+ * The most blocks a stream of this dnode may prefetch ahead of its reader.
+ */
+static uint64_t
+dmu_zfetch_max_blocks(dnode_t *dn)
+{
+	return (MAX(zfetch_max_distance >> dn->dn_datablkshift, 1));
+}
+
 /*
  * Given a zfetch structure and a zstream structure, determine whether the
  * blocks to be read are part of a co-linear pair of existing prefetch
@@ -112,6 +160,9 @@ dmu_zfetch_colinear(zfetch_t *zf, zstream_t *zh)
 	zstream_t	*z_walk;
 	zstream_t	*z_comp;
 
+	if (zf->zf_stream_cnt > zfetch_colinear_streams)
+		return (0);
+
 	if (! rw_tryenter(&zf->zf_rwlock, RW_WRITER))
 		return (0);
 
@@ -133,12 +184,15 @@ dmu_zfetch_colinear(zfetch_t *zf, zstream_t *zh)
 
 			diff = z_comp->zst_offset - z_walk->zst_offset;
 			if (z_comp->zst_offset + diff == zh->zst_offset) {
+				avl_remove(&zf->zf_stream_next, z_walk);
 				z_walk->zst_offset = zh->zst_offset;
 				z_walk->zst_direction = diff < 0 ? -1 : 1;
 				z_walk->zst_stride =
 				    diff * z_walk->zst_direction;
 				z_walk->zst_ph_offset =
 				    zh->zst_offset + z_walk->zst_stride;
+				z_walk->zst_ipf_offset = 0;
+				avl_add(&zf->zf_stream_next, z_walk);
 				dmu_zfetch_stream_remove(zf, z_comp);
 				mutex_destroy(&z_comp->zst_lock);
 				kmem_free(z_comp, sizeof (zstream_t));
@@ -151,12 +205,15 @@ dmu_zfetch_colinear(zfetch_t *zf, zstream_t *zh)
 
 			diff = z_walk->zst_offset - z_comp->zst_offset;
 			if (z_walk->zst_offset + diff == zh->zst_offset) {
+				avl_remove(&zf->zf_stream_next, z_walk);
 				z_walk->zst_offset = zh->zst_offset;
 				z_walk->zst_direction = diff < 0 ? -1 : 1;
 				z_walk->zst_stride =
 				    diff * z_walk->zst_direction;
 				z_walk->zst_ph_offset =
 				    zh->zst_offset + z_walk->zst_stride;
+				z_walk->zst_ipf_offset = 0;
+				avl_add(&zf->zf_stream_next, z_walk);
 				dmu_zfetch_stream_remove(zf, z_comp);
 				mutex_destroy(&z_comp->zst_lock);
 				kmem_free(z_comp, sizeof (zstream_t));
@@ -180,14 +237,16 @@ dmu_zfetch_colinear(zfetch_t *zf, zstream_t *zh)
 static void
 dmu_zfetch_dofetch(zfetch_t *zf, zstream_t *zs)
 {
+	dnode_t		*dn = zf->zf_dnode;
 	uint64_t	prefetch_tail;
 	uint64_t	prefetch_limit;
 	uint64_t	prefetch_ofst;
 	uint64_t	prefetch_len;
 	uint64_t	blocks_fetched;
+	uint64_t	iblkid, ilimit;
+	int		epbs;
 
 	zs->zst_stride = MAX((int64_t)zs->zst_stride, zs->zst_len);
-	zs->zst_cap = MIN(zfetch_block_cap, 2 * zs->zst_cap);
 
 	prefetch_tail = MAX((int64_t)zs->zst_ph_offset,
 	    (int64_t)(zs->zst_offset + zs->zst_stride));
@@ -217,8 +276,9 @@ dmu_zfetch_dofetch(zfetch_t *zf, zstream_t *zs)
 		if (prefetch_len > zs->zst_len)
 			break;
 
-		blocks_fetched = dmu_zfetch_fetch(zf->zf_dnode,
+		blocks_fetched = dmu_zfetch_fetch(dn,
 		    prefetch_ofst, zs->zst_len);
+		ZFETCH_POOL_INCR(zf, zps_blocks, blocks_fetched);
 
 		prefetch_tail += zs->zst_stride;
 		/* stop if we've run out of stuff to prefetch */
@@ -227,6 +287,79 @@ dmu_zfetch_dofetch(zfetch_t *zf, zstream_t *zs)
 	}
 	zs->zst_ph_offset = prefetch_tail;
 	zs->zst_last = ddi_get_lbolt();
+
+	/*
+	 * Read the indirect blocks for data further ahead, so that the data
+	 * prefetches above don't each have to wait for them.
+	 */
+	if (zs->zst_direction != ZFETCH_FORWARD || dn->dn_nlevels < 2)
+		return;
+
+	epbs = dn->dn_indblkshift - SPA_BLKPTRSHIFT;
+	ilimit = MIN(prefetch_tail +
+	    (zfetch_max_idistance >> dn->dn_datablkshift),
+	    dn->dn_maxblkid + 1);
+	for (iblkid = MAX(zs->zst_ipf_offset, prefetch_tail) >> epbs;
+	    (iblkid << epbs) < ilimit; iblkid++) {
+		dbuf_prefetch_level(dn, 1, iblkid);
+		ZFETCH_POOL_BUMP(zf, zps_indirect_blocks);
+	}
+	zs->zst_ipf_offset = MAX(zs->zst_ipf_offset, iblkid << epbs);
+}
+
+/*
+ * Adjust how far ahead of its reader a stream prefetches, after a read of
+ * nblks blocks that did or did not find its data already prefetched.
+ */
+static void
+dmu_zfetch_ramp(zfetch_t *zf, zstream_t *zs, uint64_t nblks, int prefetched)
+{
+	uint64_t	max_blocks = dmu_zfetch_max_blocks(zf->zf_dnode);
+	clock_t		now = ddi_get_lbolt();
+	clock_t		elapsed = now - zs->zst_rate_start;
+	uint64_t	rate, want;
+
+	ASSERT(MUTEX_HELD(&zs->zst_lock));
+
+	zs->zst_reads++;
+
+	/* keep a moving average of the reader's consumption rate */
+	zs->zst_rate_blocks += nblks;
+	if (elapsed >= MAX(hz / 10, 1)) {
+		rate = zs->zst_rate_blocks * hz / elapsed;
+		zs->zst_rate = zs->zst_rate == 0 ? rate :
+		    (3 * zs->zst_rate + rate) / 4;
+		zs->zst_rate_blocks = 0;
+		zs->zst_rate_start = now;
+	}
+	want = zs->zst_rate * zfetch_lead_ms / 1000;
+
+	if (prefetched) {
+		/* ahead of the reader: fall back to what its rate needs */
+		ZFETCH_POOL_BUMP(zf, zps_hits);
+		zs->zst_hits++;
+		if (zs->zst_cap > want)
+			zs->zst_cap -= MAX(zs->zst_cap / 16, 1);
+	} else {
+		/* the reader caught up with us: get further ahead */
+		ZFETCH_POOL_BUMP(zf, zps_misses);
+		zs->zst_misses++;
+		zs->zst_cap *= 2;
+	}
+
+	/*
+	 * If most reads miss even at the full distance, prefetched blocks
+	 * are being evicted before they're read, and fetching further ahead
+	 * would only make that worse.
+	 */
+	if (zs->zst_hits + zs->zst_misses >= 64) {
+		if (zs->zst_misses > zs->zst_hits && zs->zst_cap >= max_blocks)
+			zs->zst_cap = max_blocks / 2;
+		zs->zst_hits = 0;
+		zs->zst_misses = 0;
+	}
+
+	zs->zst_cap = MAX(MIN(MAX(zs->zst_cap, want), max_blocks), 1);
 }
 
 void
@@ -252,6 +385,32 @@ zfetch_fini(void)
 	}
 }
 
+void
+dmu_zfetch_stat_create(spa_t *spa)
+{
+	char kname[KSTAT_STRLEN];
+
+	spa->spa_zfetch_stats = zfetch_pool_stats_template;
+	(void) snprintf(kname, KSTAT_STRLEN, "zfetchstats-%s",
+	    spa_name(spa));
+	spa->spa_zfetch_kstat = kstat_create("zfs", 0, kname, "misc",
+	    KSTAT_TYPE_NAMED, sizeof (zfetch_pool_stats_t) /
+	    sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+	if (spa->spa_zfetch_kstat != NULL) {
+		spa->spa_zfetch_kstat->ks_data = &spa->spa_zfetch_stats;
+		kstat_install(spa->spa_zfetch_kstat);
+	}
+}
+
+void
+dmu_zfetch_stat_destroy(spa_t *spa)
+{
+	if (spa->spa_zfetch_kstat != NULL) {
+		kstat_delete(spa->spa_zfetch_kstat);
+		spa->spa_zfetch_kstat = NULL;
+	}
+}
+
 /*
  * This takes a pointer to a zfetch structure and a dnode.  It performs the
  * necessary setup for the zfetch structure, grokking data from the
@@ -280,9 +439,12 @@ dmu_zfetch_rele(zfetch_t *zf)
 		zs_next = list_next(&zf->zf_stream, zs);
 
 		list_remove(&zf->zf_stream, zs);
+		avl_remove(&zf->zf_stream_next, zs);
+		dmu_zfetch_stream_done(zf, zs);
 		mutex_destroy(&zs->zst_lock);
 		kmem_free(zs, sizeof (zstream_t));
 	}
+	zf->zf_stream_cnt = 0;
 }
 
 /*
@@ -293,8 +455,11 @@ dmu_zfetch_cons(zfetch_t *zf)
 {
 	list_create(&zf->zf_stream, sizeof (zstream_t),
 	    offsetof(zstream_t, zst_node));
+	avl_create(&zf->zf_stream_next, dmu_zfetch_stream_compare,
+	    sizeof (zstream_t), offsetof(zstream_t, zst_next_node));
 
 	rw_init(&zf->zf_rwlock, NULL, RW_DEFAULT, NULL);
+	mutex_init(&zf->zf_next_lock, NULL, MUTEX_DEFAULT, NULL);
 }
 
 /*
@@ -304,7 +469,9 @@ void
 dmu_zfetch_dest(zfetch_t *zf)
 {
 	list_destroy(&zf->zf_stream);
+	avl_destroy(&zf->zf_stream_next);
 	rw_destroy(&zf->zf_rwlock);
+	mutex_destroy(&zf->zf_next_lock);
 }
 
 /*
@@ -354,6 +521,50 @@ dmu_zfetch_fetchsz(dnode_t *dn, uint64_t blkid, uint64_t nblks)
 	return (fetchsz);
 }
 
+/*
+ * Streams are also kept in zf_stream_next, sorted by the block a forward
+ * sequential read would continue them at, zst_offset + zst_len, so that
+ * such a read finds its stream in O(log n) however many readers the file
+ * has.  A stream is taken out of the tree while that changes, which is
+ * done with zf_next_lock held along with zf_rwlock as reader, or with
+ * zf_rwlock held as writer.
+ */
+static int
+dmu_zfetch_stream_compare(const void *x1, const void *x2)
+{
+	const zstream_t *zs1 = x1;
+	const zstream_t *zs2 = x2;
+	uint64_t next1 = zs1->zst_offset + zs1->zst_len;
+	uint64_t next2 = zs2->zst_offset + zs2->zst_len;
+
+	if (next1 < next2)
+		return (-1);
+	if (next1 > next2)
+		return (1);
+	if (zs1->zst_id < zs2->zst_id)
+		return (-1);
+	if (zs1->zst_id > zs2->zst_id)
+		return (1);
+	return (0);
+}
+
+/*
+ * Return the first stream whose next block is at or after blkid.
+ */
+static zstream_t *
+dmu_zfetch_stream_after(zfetch_t *zf, uint64_t blkid)
+{
+	zstream_t	search;
+	avl_index_t	where;
+
+	/* no stream has zst_id 0, so the search sorts before any match */
+	search.zst_offset = blkid;
+	search.zst_len = 0;
+	search.zst_id = 0;
+	VERIFY(avl_find(&zf->zf_stream_next, &search, &where) == NULL);
+	return (avl_nearest(&zf->zf_stream_next, where, AVL_AFTER));
+}
+
 /*
  * given a zfetch and a zstream structure, see if there is an associated zstream
  * for this block read.  If so, it starts a prefetch for the stream it
@@ -364,20 +575,55 @@ dmu_zfetch_find(zfetch_t *zf, zstream_t *zh, int prefetched)
 {
 	zstream_t	*zs;
 	int64_t		diff;
-	int		reset = !prefetched;
+	int64_t		window = dmu_zfetch_max_blocks(zf->zf_dnode);
 	int		rc = 0;
 
 	if (zh == NULL)
 		return (0);
 
+	rw_enter(&zf->zf_rwlock, RW_READER);
+	mutex_enter(&zf->zf_next_lock);
+
 	/*
-	 * XXX: This locking strategy is a bit coarse; however, it's impact has
-	 * yet to be tested.  If this turns out to be an issue, it can be
-	 * modified in a number of different ways.
+	 * This is the forward sequential read case: we increment len by
+	 * one each time we hit here, so we will enter this case on every
+	 * read.  A read of the blocks a stream has just passed over (such
+	 * as a small read within the same block) lands in that stream.
 	 */
+	zs = dmu_zfetch_stream_after(zf, zh->zst_offset);
+	if (zs != NULL && zh->zst_offset == zs->zst_offset + zs->zst_len) {
+		mutex_enter(&zs->zst_lock);
+		avl_remove(&zf->zf_stream_next, zs);
+		zs->zst_len += zh->zst_len;
+		diff = zs->zst_len - window;
+		if (diff > 0) {
+			zs->zst_offset += diff;
+			zs->zst_len = zs->zst_len > diff ?
+			    zs->zst_len - diff : 0;
+		}
+		zs->zst_direction = ZFETCH_FORWARD;
+		avl_add(&zf->zf_stream_next, zs);
+		goto found;
+	}
 
-	rw_enter(&zf->zf_rwlock, RW_READER);
-top:
+	/*
+	 * Backward and strided access are only looked for while the file
+	 * has a few streams, as every one has to be checked.  Past that, a
+	 * read within the stream found above is the only stride case seen.
+	 */
+	if (zf->zf_stream_cnt > zfetch_colinear_streams) {
+		if (zs != NULL && zh->zst_offset >= zs->zst_offset) {
+			if (prefetched) {
+				/* already fetched */
+				ZFETCHSTAT_BUMP(zfetchstat_stride_hits);
+				rc = 1;
+				goto out;
+			}
+			ZFETCHSTAT_BUMP(zfetchstat_stride_misses);
+		}
+		zs = NULL;
+		goto found;
+	}
 
 	for (zs = list_head(&zf->zf_stream); zs;
 	    zs = list_next(&zf->zf_stream, zs)) {
@@ -407,46 +653,11 @@ top:
 			}
 		}
 
-		/*
-		 * This is the forward sequential read case: we increment
-		 * len by one each time we hit here, so we will enter this
-		 * case on every read.
-		 */
-		if (zh->zst_offset == zs->zst_offset + zs->zst_len) {
-
-			reset = !prefetched && zs->zst_len > 1;
-
-			mutex_enter(&zs->zst_lock);
-
-			if (zh->zst_offset != zs->zst_offset + zs->zst_len) {
-				mutex_exit(&zs->zst_lock);
-				goto top;
-			}
-			zs->zst_len += zh->zst_len;
-			diff = zs->zst_len - zfetch_block_cap;
-			if (diff > 0) {
-				zs->zst_offset += diff;
-				zs->zst_len = zs->zst_len > diff ?
-				    zs->zst_len - diff : 0;
-			}
-			zs->zst_direction = ZFETCH_FORWARD;
-
-			break;
-
-		/*
-		 * Same as above, but reading backwards through the file.
-		 */
-		} else if (zh->zst_offset == zs->zst_offset - zh->zst_len) {
+		if (zh->zst_offset == zs->zst_offset - zh->zst_len) {
 			/* backwards sequential access */
 
-			reset = !prefetched && zs->zst_len > 1;
-
 			mutex_enter(&zs->zst_lock);
-
-			if (zh->zst_offset != zs->zst_offset - zh->zst_len) {
-				mutex_exit(&zs->zst_lock);
-				goto top;
-			}
+			avl_remove(&zf->zf_stream_next, zs);
 
 			zs->zst_offset = zs->zst_offset > zh->zst_len ?
 			    zs->zst_offset - zh->zst_len : 0;
@@ -454,7 +665,7 @@ top:
 			    zs->zst_ph_offset - zh->zst_len : 0;
 			zs->zst_len += zh->zst_len;
 
-			diff = zs->zst_len - zfetch_block_cap;
+			diff = zs->zst_len - window;
 			if (diff > 0) {
 				zs->zst_ph_offset = zs->zst_ph_offset > diff ?
 				    zs->zst_ph_offset - diff : 0;
@@ -463,6 +674,7 @@ top:
 			}
 			zs->zst_direction = ZFETCH_BACKWARD;
 
+			avl_add(&zf->zf_stream_next, zs);
 			break;
 
 		} else if ((zh->zst_offset - zs->zst_offset - zs->zst_stride <
@@ -470,16 +682,12 @@ top:
 			/* strided forward access */
 
 			mutex_enter(&zs->zst_lock);
-
-			if ((zh->zst_offset - zs->zst_offset - zs->zst_stride >=
-			    zs->zst_len) || (zs->zst_len == zs->zst_stride)) {
-				mutex_exit(&zs->zst_lock);
-				goto top;
-			}
+			avl_remove(&zf->zf_stream_next, zs);
 
 			zs->zst_offset += zs->zst_stride;
 			zs->zst_direction = ZFETCH_FORWARD;
 
+			avl_add(&zf->zf_stream_next, zs);
 			break;
 
 		} else if ((zh->zst_offset - zs->zst_offset + zs->zst_stride <
@@ -487,12 +695,7 @@ top:
 			/* strided reverse access */
 
 			mutex_enter(&zs->zst_lock);
-
-			if ((zh->zst_offset - zs->zst_offset + zs->zst_stride >=
-			    zs->zst_len) || (zs->zst_len == zs->zst_stride)) {
-				mutex_exit(&zs->zst_lock);
-				goto top;
-			}
+			avl_remove(&zf->zf_stream_next, zs);
 
 			zs->zst_offset = zs->zst_offset > zs->zst_stride ?
 			    zs->zst_offset - zs->zst_stride : 0;
@@ -501,40 +704,30 @@ top:
 			    (zs->zst_ph_offset - (2 * zs->zst_stride)) : 0;
 			zs->zst_direction = ZFETCH_BACKWARD;
 
+			avl_add(&zf->zf_stream_next, zs);
 			break;
 		}
 	}
 
+found:
+	mutex_exit(&zf->zf_next_lock);
+
+	/*
+	 * A read that missed doesn't reset the stream any more: it means we
+	 * weren't far enough ahead, and dmu_zfetch_ramp() deals with that.
+	 */
 	if (zs) {
-		if (reset) {
-			zstream_t *remove = zs;
-
-			ZFETCHSTAT_BUMP(zfetchstat_stream_resets);
-			rc = 0;
-			mutex_exit(&zs->zst_lock);
-			rw_exit(&zf->zf_rwlock);
-			rw_enter(&zf->zf_rwlock, RW_WRITER);
-			/*
-			 * Relocate the stream, in case someone removes
-			 * it while we were acquiring the WRITER lock.
-			 */
-			for (zs = list_head(&zf->zf_stream); zs;
-			    zs = list_next(&zf->zf_stream, zs)) {
-				if (zs == remove) {
-					dmu_zfetch_stream_remove(zf, zs);
-					mutex_destroy(&zs->zst_lock);
-					kmem_free(zs, sizeof (zstream_t));
-					break;
-				}
-			}
-		} else {
-			ZFETCHSTAT_BUMP(zfetchstat_stream_noresets);
-			rc = 1;
-			dmu_zfetch_dofetch(zf, zs);
-			mutex_exit(&zs->zst_lock);
-		}
+		ZFETCHSTAT_BUMP(zfetchstat_stream_noresets);
+		rc = 1;
+		dmu_zfetch_ramp(zf, zs, zh->zst_len, prefetched);
+		dmu_zfetch_dofetch(zf, zs);
+		mutex_exit(&zs->zst_lock);
 	}
+	rw_exit(&zf->zf_rwlock);
+	return (rc);
+
 out:
+	mutex_exit(&zf->zf_next_lock);
 	rw_exit(&zf->zf_rwlock);
 	return (rc);
 }
@@ -551,20 +744,23 @@ static int
 dmu_zfetch_stream_insert(zfetch_t *zf, zstream_t *zs)
 {
 	zstream_t	*zs_walk;
-	zstream_t	*zs_next;
+	uint64_t	next = zs->zst_offset + zs->zst_len;
 
 	ASSERT(RW_WRITE_HELD(&zf->zf_rwlock));
 
-	for (zs_walk = list_head(&zf->zf_stream); zs_walk; zs_walk = zs_next) {
-		zs_next = list_next(&zf->zf_stream, zs_walk);
-
+	for (zs_walk = dmu_zfetch_stream_after(zf, next); zs_walk != NULL &&
+	    zs_walk->zst_offset + zs_walk->zst_len == next;
+	    zs_walk = AVL_NEXT(&zf->zf_stream_next, zs_walk)) {
 		if (dmu_zfetch_streams_equal(zs_walk, zs)) {
 			return (0);
 		}
 	}
 
+	zs->zst_id = ++zf->zf_stream_id;
+	avl_add(&zf->zf_stream_next, zs);
 	list_insert_head(&zf->zf_stream, zs);
 	zf->zf_stream_cnt++;
+	ZFETCH_POOL_BUMP(zf, zps_streams);
 	return (1);
 }
 
@@ -588,6 +784,20 @@ dmu_zfetch_stream_reclaim(zfetch_t *zf)
 			break;
 	}
 
+	/*
+	 * Random reads start streams that are never continued.  Once a file
+	 * has a few streams, recycle the oldest such stream rather than
+	 * letting them pile up, so that the number of streams follows the
+	 * number of sequential readers.
+	 */
+	if (zs == NULL && zf->zf_stream_cnt >= zfetch_colinear_streams) {
+		for (zs = list_tail(&zf->zf_stream); zs;
+		    zs = list_prev(&zf->zf_stream, zs)) {
+			if (zs->zst_reads == 0)
+				break;
+		}
+	}
+
 	if (zs) {
 		dmu_zfetch_stream_remove(zf, zs);
 		mutex_destroy(&zs->zst_lock);
@@ -610,7 +820,27 @@ dmu_zfetch_stream_remove(zfetch_t *zf, zstream_t *zs)
 	ASSERT(RW_WRITE_HELD(&zf->zf_rwlock));
 
 	list_remove(&zf->zf_stream, zs);
+	avl_remove(&zf->zf_stream_next, zs);
 	zf->zf_stream_cnt--;
+	dmu_zfetch_stream_done(zf, zs);
+}
+
+/*
+ * Account for a stream going away.  Blocks a sequential stream prefetched
+ * beyond the last one its reader asked for were (most likely) wasted.
+ */
+static void
+dmu_zfetch_stream_done(zfetch_t *zf, zstream_t *zs)
+{
+	dnode_t		*dn = zf->zf_dnode;
+	uint64_t	end = zs->zst_offset + zs->zst_len;
+	uint64_t	ph = MIN(zs->zst_ph_offset, dn->dn_maxblkid + 1);
+
+	if (zs->zst_direction == ZFETCH_FORWARD &&
+	    zs->zst_stride == zs->zst_len && ph > end)
+		ZFETCH_POOL_INCR(zf, zps_useless_blocks, ph - end);
+
+	ZFETCH_POOL_INCR(zf, zps_streams, -1);
 }
 
 static int
@@ -697,8 +927,8 @@ dmu_zfetch(zfetch_t *zf, uint64_t offset, uint64_t size, int prefetched)
 			cur_streams = zf->zf_stream_cnt;
 			maxblocks = zf->zf_dnode->dn_maxblkid;
 
-			max_streams = MIN(zfetch_max_streams,
-			    (maxblocks / zfetch_block_cap));
+			max_streams = MIN(zfetch_max_streams, maxblocks /
+			    dmu_zfetch_max_blocks(zf->zf_dnode));
 			if (max_streams == 0) {
 				max_streams++;
 			}
@@ -716,6 +946,7 @@ dmu_zfetch(zfetch_t *zf, uint64_t offset, uint64_t size, int prefetched)
 		newstream->zst_cap = zst.zst_len;
 		newstream->zst_direction = ZFETCH_FORWARD;
 		newstream->zst_last = ddi_get_lbolt();
+		newstream->zst_rate_start = newstream->zst_last;
 
 		mutex_init(&newstream->zst_lock, NULL, MUTEX_DEFAULT, NULL);
 
@@ -733,5 +964,17 @@ dmu_zfetch(zfetch_t *zf, uint64_t offset, uint64_t size, int prefetched)
 #if defined(_KERNEL) && defined(HAVE_SPL)
 module_param(zfs_prefetch_disable, int, 0644);
 MODULE_PARM_DESC(zfs_prefetch_disable, "Disable all ZFS prefetching");
+
+module_param(zfetch_max_streams, uint, 0644);
+MODULE_PARM_DESC(zfetch_max_streams, "Max prefetch streams per file");
+
+module_param(zfetch_lead_ms, uint, 0644);
+MODULE_PARM_DESC(zfetch_lead_ms, "Time a prefetch stream should stay ahead");
+
+module_param(zfetch_max_distance, ulong, 0644);
+MODULE_PARM_DESC(zfetch_max_distance, "Max bytes to prefetch per stream");
+
+module_param(zfetch_max_idistance, ulong, 0644);
+MODULE_PARM_DESC(zfetch_max_idistance, "Bytes ahead to prefetch indirects");
 #endif
 
@@ -842,10 +842,13 @@ dsl_dir_tempreserve_space(dsl_dir_t *dd, uint64_t lsize, uint64_t asize,
 		err = dsl_pool_tempreserve_space(dd->dd_pool, asize, tx);
 	} else {
 		if (err == EAGAIN) {
-			txg_delay(dd->dd_pool, tx->tx_txg, 1);
+			/*
+			 * The ARC is short of memory for dirty data; get
+			 * what we have written out so it can be evicted.
+			 */
+			txg_kick(dd->dd_pool);
 			err = ERESTART;
 		}
-		dsl_pool_memory_pressure(dd->dd_pool);
 	}
 
 	if (err == 0) {
@@ -40,18 +40,41 @@
 #include <sys/spa_impl.h>
 #include <sys/dsl_deadlist.h>
 
+/*
+ * The write throttle.  Dirty data is the space charged by
+ * dsl_pool_willuse_space() to txgs that have not synced yet, and is
+ * tracked in dp_dirty_total.
+ *
+ * - Once the open txg has zfs_dirty_data_sync bytes of dirty data, it is
+ *   pushed out to quiesce and sync rather than waiting for
+ *   zfs_txg_timeout.
+ *
+ * - Once dp_dirty_total exceeds zfs_delay_min_dirty_percent of
+ *   zfs_dirty_data_max, every tx is delayed before it is assigned by
+ *
+ *	zfs_delay_scale * (dirty - min) / (zfs_dirty_data_max - dirty)
+ *
+ *   nanoseconds, up to zfs_delay_max_ns.  The delay starts at zero and
+ *   grows without bound as dirty data approaches the maximum, so writers
+ *   settle at the rate the pool can sync instead of alternating between
+ *   running flat out and stalling for a whole txg.  zfs_delay_scale is
+ *   the delay at the midpoint; its inverse is roughly the tx rate the
+ *   throttle settles at there.
+ *
+ * - At zfs_dirty_data_max, tx's wait for dirty data to be synced.
+ *
+ * zfs_dirty_data_max defaults to zfs_dirty_data_max_percent of physical
+ * memory, capped at zfs_dirty_data_max_max; see arc_init().  Setting
+ * zfs_no_write_throttle disables the delay and the wait.
+ */
 int zfs_no_write_throttle = 0;
-int zfs_write_limit_shift = 3;			/* 1/8th of physical memory */
-int zfs_txg_synctime_ms = 5000;		/* target millisecs to sync a txg */
-
-uint64_t zfs_write_limit_min = 32 << 20;	/* min write limit is 32MB */
-uint64_t zfs_write_limit_max = 0;		/* max data payload per txg */
-uint64_t zfs_write_limit_inflated = 0;
-uint64_t zfs_write_limit_override = 0;
-
-kmutex_t zfs_write_limit_lock;
-
-static pgcnt_t old_physmem = 0;
+uint64_t zfs_dirty_data_max = 0;
+uint64_t zfs_dirty_data_max_max = 4ULL << 30;
+int zfs_dirty_data_max_percent = 10;
+uint64_t zfs_dirty_data_sync = 64 << 20;
+int zfs_delay_min_dirty_percent = 60;
+uint64_t zfs_delay_scale = NANOSEC / 2000;
+uint64_t zfs_delay_max_ns = 100 * (NANOSEC / MILLISEC);
 
 int
 dsl_pool_open_special_dir(dsl_pool_t *dp, const char *name, dsl_dir_t **ddp)
@@ -68,6 +91,49 @@ dsl_pool_open_special_dir(dsl_pool_t *dp, const char *name, dsl_dir_t **ddp)
 	return (dsl_dir_open_obj(dp, obj, name, dp, ddp));
 }
 
+static void
+dsl_pool_delay_stat_init(dsl_pool_t *dp)
+{
+	char kname[KSTAT_STRLEN];
+	int i;
+
+	for (i = 0; i < DSL_POOL_DELAY_BUCKETS; i++) {
+		kstat_named_t *ks = &dp->dp_delay_hist[i];
+
+		(void) snprintf(ks->name, KSTAT_STRLEN, "%lluus",
+		    (u_longlong_t)1 << i);
+		ks->data_type = KSTAT_DATA_UINT64;
+		ks->value.ui64 = 0;
+	}
+
+	(void) snprintf(kname, KSTAT_STRLEN, "dmu_tx_delay-%s",
+	    spa_name(dp->dp_spa));
+	dp->dp_delay_ksp = kstat_create("zfs", 0, kname, "misc",
+	    KSTAT_TYPE_NAMED, DSL_POOL_DELAY_BUCKETS, KSTAT_FLAG_VIRTUAL);
+	if (dp->dp_delay_ksp != NULL) {
+		dp->dp_delay_ksp->ks_data = dp->dp_delay_hist;
+		kstat_install(dp->dp_delay_ksp);
+	}
+}
+
+static void
+dsl_pool_delay_stat_fini(dsl_pool_t *dp)
+{
+	if (dp->dp_delay_ksp != NULL) {
+		kstat_delete(dp->dp_delay_ksp);
+		dp->dp_delay_ksp = NULL;
+	}
+}
+
+void
+dsl_pool_delay_stat_add(dsl_pool_t *dp, hrtime_t delay)
+{
+	uint64_t us = delay / (NANOSEC / MICROSEC);
+	int bucket = MIN(MAX(highbit(us), 1), DSL_POOL_DELAY_BUCKETS) - 1;
+
+	atomic_add_64(&dp->dp_delay_hist[bucket].value.ui64, 1);
+}
+
 static dsl_pool_t *
 dsl_pool_open_impl(spa_t *spa, uint64_t txg)
 {
@@ -78,7 +144,6 @@ dsl_pool_open_impl(spa_t *spa, uint64_t txg)
 	dp->dp_spa = spa;
 	dp->dp_meta_rootbp = *bp;
 	rw_init(&dp->dp_config_rwlock, NULL, RW_DEFAULT, NULL);
-	dp->dp_write_limit = zfs_write_limit_min;
 	txg_init(dp, txg);
 
 	txg_list_create(&dp->dp_dirty_datasets,
@@ -91,6 +156,9 @@ dsl_pool_open_impl(spa_t *spa, uint64_t txg)
 	    offsetof(dsl_dataset_t, ds_synced_link));
 
 	mutex_init(&dp->dp_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&dp->dp_spaceavail_cv, NULL, CV_DEFAULT, NULL);
+
+	dsl_pool_delay_stat_init(dp);
 
 	dp->dp_vnrele_taskq = taskq_create("zfs_vn_rele_taskq", 1, minclsyspri,
 	    1, 4, 0);
@@ -213,6 +281,8 @@ dsl_pool_close(dsl_pool_t *dp)
 	txg_fini(dp);
 	dsl_scan_fini(dp);
 	rw_destroy(&dp->dp_config_rwlock);
+	dsl_pool_delay_stat_fini(dp);
+	cv_destroy(&dp->dp_spaceavail_cv);
 	mutex_destroy(&dp->dp_lock);
 	taskq_destroy(dp->dp_vnrele_taskq);
 	if (dp->dp_blkstats)
@@ -305,17 +375,8 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 	dsl_sync_task_group_t *dstg;
 	objset_t *mos = dp->dp_meta_objset;
 	hrtime_t start, write_time;
-	uint64_t data_written;
 	int err;
 
-	/*
-	 * We need to copy dp_space_towrite() before doing
-	 * dsl_sync_task_group_sync(), because
-	 * dsl_dataset_snapshot_reserve_space() will increase
-	 * dp_space_towrite but not actually write anything.
-	 */
-	data_written = dp->dp_space_towrite[txg & TXG_MASK];
-
 	tx = dmu_tx_create_assigned(dp, txg);
 
 	dp->dp_read_overhead = 0;
@@ -395,51 +456,19 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 	write_time += gethrtime() - start;
 	DTRACE_PROBE2(pool_sync__4io, hrtime_t, write_time,
 	    hrtime_t, dp->dp_read_overhead);
-	write_time -= dp->dp_read_overhead;
 
 	dmu_tx_commit(tx);
 
-	dp->dp_space_towrite[txg & TXG_MASK] = 0;
-	ASSERT(dp->dp_tempreserved[txg & TXG_MASK] == 0);
-
 	/*
-	 * If the write limit max has not been explicitly set, set it
-	 * to a fraction of available physical memory (default 1/8th).
-	 * Note that we must inflate the limit because the spa
-	 * inflates write sizes to account for data replication.
-	 * Check this each sync phase to catch changing memory size.
-	 */
-	if (physmem != old_physmem && zfs_write_limit_shift) {
-		mutex_enter(&zfs_write_limit_lock);
-		old_physmem = physmem;
-		zfs_write_limit_max = ptob(physmem) >> zfs_write_limit_shift;
-		zfs_write_limit_inflated = MAX(zfs_write_limit_min,
-		    spa_get_asize(dp->dp_spa, zfs_write_limit_max));
-		mutex_exit(&zfs_write_limit_lock);
-	}
-
-	/*
-	 * Attempt to keep the sync time consistent by adjusting the
-	 * amount of write traffic allowed into each transaction group.
-	 * Weight the throughput calculation towards the current value:
-	 * 	thru = 3/4 old_thru + 1/4 new_thru
-	 *
-	 * Note: write_time is in nanosecs, so write_time/MICROSEC
-	 * yields millisecs
+	 * This txg's dirty data is on disk now; let throttled writers in.
 	 */
-	ASSERT(zfs_write_limit_min > 0);
-	if (data_written > zfs_write_limit_min / 8 && write_time > MICROSEC) {
-		uint64_t throughput = data_written / (write_time / MICROSEC);
-
-		if (dp->dp_throughput)
-			dp->dp_throughput = throughput / 4 +
-			    3 * dp->dp_throughput / 4;
-		else
-			dp->dp_throughput = throughput;
-		dp->dp_write_limit = MIN(zfs_write_limit_inflated,
-		    MAX(zfs_write_limit_min,
-		    dp->dp_throughput * zfs_txg_synctime_ms));
-	}
+	mutex_enter(&dp->dp_lock);
+	ASSERT3U(dp->dp_dirty_total, >=, dp->dp_space_towrite[txg & TXG_MASK]);
+	dp->dp_dirty_total -= dp->dp_space_towrite[txg & TXG_MASK];
+	dp->dp_space_towrite[txg & TXG_MASK] = 0;
+	cv_broadcast(&dp->dp_spaceavail_cv);
+	mutex_exit(&dp->dp_lock);
+	ASSERT(dp->dp_tempreserved[txg & TXG_MASK] == 0);
 }
 
 void
@@ -495,42 +524,24 @@ dsl_pool_adjustedsize(dsl_pool_t *dp, boolean_t netfree)
 int
 dsl_pool_tempreserve_space(dsl_pool_t *dp, uint64_t space, dmu_tx_t *tx)
 {
-	uint64_t reserved = 0;
-	uint64_t write_limit = (zfs_write_limit_override ?
-	    zfs_write_limit_override : dp->dp_write_limit);
-
-	if (zfs_no_write_throttle) {
-		atomic_add_64(&dp->dp_tempreserved[tx->tx_txg & TXG_MASK],
-		    space);
-		return (0);
-	}
-
 	/*
-	 * Check to see if we have exceeded the maximum allowed IO for
-	 * this transaction group.  We can do this without locks since
-	 * a little slop here is ok.  Note that we do the reserved check
-	 * with only half the requested reserve: this is because the
-	 * reserve requests are worst-case, and we really don't want to
-	 * throttle based off of worst-case estimates.
+	 * If this tx's dirty data would take the pool past
+	 * zfs_dirty_data_max, wait in dmu_tx_wait() for a txg to sync.  The
+	 * space isn't in dp_dirty_total until the tx dirties its buffers, so
+	 * count it here; a tx bigger than the limit still goes through on
+	 * its own once everything else has synced.  Below the limit, the
+	 * throttle delays tx's before they are assigned; see dmu_tx_delay().
+	 * We can do this check without locks since a little slop here is ok.
 	 */
-	if (write_limit > 0) {
-		reserved = dp->dp_space_towrite[tx->tx_txg & TXG_MASK]
-		    + dp->dp_tempreserved[tx->tx_txg & TXG_MASK] / 2;
-
-		if (reserved && reserved > write_limit)
-			return (ERESTART);
+	if (!zfs_no_write_throttle && dp->dp_dirty_total != 0 &&
+	    dp->dp_dirty_total + space > zfs_dirty_data_max) {
+		tx->tx_wait_dirty = B_TRUE;
+		tx->tx_wait_dirty_space = space;
+		return (ERESTART);
 	}
 
 	atomic_add_64(&dp->dp_tempreserved[tx->tx_txg & TXG_MASK], space);
 
-	/*
-	 * If this transaction group is over 7/8ths capacity, delay
-	 * the caller 1 clock tick.  This will slow down the "fill"
-	 * rate until the sync process can catch up with us.
-	 */
-	if (reserved && reserved > (write_limit - (write_limit >> 3)))
-		txg_delay(dp, tx->tx_txg, 1);
-
 	return (0);
 }
 
@@ -541,33 +552,41 @@ dsl_pool_tempreserve_clear(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx)
 	atomic_add_64(&dp->dp_tempreserved[tx->tx_txg & TXG_MASK], -space);
 }
 
-void
-dsl_pool_memory_pressure(dsl_pool_t *dp)
-{
-	uint64_t space_inuse = 0;
-	int i;
-
-	if (dp->dp_write_limit == zfs_write_limit_min)
-		return;
-
-	for (i = 0; i < TXG_SIZE; i++) {
-		space_inuse += dp->dp_space_towrite[i];
-		space_inuse += dp->dp_tempreserved[i];
-	}
-	dp->dp_write_limit = MAX(zfs_write_limit_min,
-	    MIN(dp->dp_write_limit, space_inuse / 4));
-}
-
 void
 dsl_pool_willuse_space(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx)
 {
+	boolean_t kick;
+
 	if (space > 0) {
 		mutex_enter(&dp->dp_lock);
 		dp->dp_space_towrite[tx->tx_txg & TXG_MASK] += space;
+		dp->dp_dirty_total += space;
+		kick = (dp->dp_space_towrite[tx->tx_txg & TXG_MASK] >=
+		    zfs_dirty_data_sync && !dsl_pool_sync_context(dp));
 		mutex_exit(&dp->dp_lock);
+
+		/*
+		 * Don't wait for zfs_txg_timeout once the open txg holds
+		 * enough dirty data to be worth syncing.
+		 */
+		if (kick)
+			txg_kick(dp);
 	}
 }
 
+/*
+ * Dirty data in all txgs that haven't synced, as a percentage of
+ * zfs_dirty_data_max.  Racy, but only used as a scheduling hint.
+ */
+uint64_t
+dsl_pool_dirty_percent(dsl_pool_t *dp)
+{
+	if (zfs_dirty_data_max == 0)
+		return (0);
+
+	return (dp->dp_dirty_total * 100 / zfs_dirty_data_max);
+}
+
 /* ARGSUSED */
 static int
 upgrade_clones_cb(spa_t *spa, uint64_t dsobj, const char *dsname, void *arg)
@@ -847,3 +866,29 @@ dsl_pool_user_release(dsl_pool_t *dp, uint64_t dsobj, const char *tag,
 	return (dsl_pool_user_hold_rele_impl(dp, dsobj, tag, NULL,
 	    tx, B_FALSE));
 }
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_no_write_throttle, int, 0644);
+MODULE_PARM_DESC(zfs_no_write_throttle, "Disable the write throttle");
+
+module_param(zfs_dirty_data_max, ulong, 0644);
+MODULE_PARM_DESC(zfs_dirty_data_max, "Maximum dirty data in bytes, 0 to size from memory");
+
+module_param(zfs_dirty_data_max_max, ulong, 0444);
+MODULE_PARM_DESC(zfs_dirty_data_max_max, "Upper bound of the default zfs_dirty_data_max");
+
+module_param(zfs_dirty_data_max_percent, int, 0444);
+MODULE_PARM_DESC(zfs_dirty_data_max_percent, "Default zfs_dirty_data_max as percent of memory");
+
+module_param(zfs_dirty_data_sync, ulong, 0644);
+MODULE_PARM_DESC(zfs_dirty_data_sync, "Dirty data in the open txg that forces a sync");
+
+module_param(zfs_delay_min_dirty_percent, int, 0644);
+MODULE_PARM_DESC(zfs_delay_min_dirty_percent, "Percent of zfs_dirty_data_max at which tx delays start");
+
+module_param(zfs_delay_scale, ulong, 0644);
+MODULE_PARM_DESC(zfs_delay_scale, "Tx delay in ns at the midpoint of the delay curve");
+
+module_param(zfs_delay_max_ns, ulong, 0644);
+MODULE_PARM_DESC(zfs_delay_max_ns, "Maximum tx delay in ns");
+#endif
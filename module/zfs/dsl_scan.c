@@ -53,6 +53,9 @@ typedef int (scan_cb_t)(dsl_pool_t *, const blkptr_t *, const zbookmark_t *);
 static scan_cb_t dsl_scan_scrub_cb;
 static dsl_syncfunc_t dsl_scan_cancel_sync;
 static void dsl_scan_sync_state(dsl_scan_t *, dmu_tx_t *tx);
+static void dsl_scan_queues_create(dsl_scan_t *scn);
+static void dsl_scan_queues_destroy(dsl_scan_t *scn);
+static boolean_t dsl_scan_queues_issue(dsl_scan_t *scn, boolean_t bounded);
 
 int zfs_scan_min_time_ms = 1000; /* min millisecs to scrub per txg */
 int zfs_free_min_time_ms = 1000; /* min millisecs to free per txg */
@@ -62,6 +65,39 @@ boolean_t zfs_no_scrub_prefetch = B_FALSE; /* set to disable srub prefetching */
 enum ddt_class zfs_scrub_ddt_class_max = DDT_CLASS_DUPLICATE;
 int dsl_scan_delay_completion = B_FALSE; /* set to delay scan completion */
 
+/*
+ * Scrub and resilver reads are not issued in the order the traversal finds
+ * the blocks, which on a fragmented pool is close to random.  Instead they
+ * are gathered in a queue per top-level vdev sorted by offset, and issued
+ * in that order whenever the traversal pauses or the queues hold more than
+ * zfs_scan_sort_mem bytes of block pointers or zfs_scan_sort_bytes bytes
+ * of data to read.  The vdev queue can then aggregate neighbouring blocks
+ * into large reads.
+ *
+ * The queues are issued a round at a time, with the same time limits as
+ * the traversal checked after every round, so a txg doesn't run long on
+ * them.  Reads still queued when time runs out are issued first thing in
+ * the next txg, before the traversal moves on, and unconditionally in the
+ * txg after that, before their blocks could be freed and reallocated.
+ *
+ * While reads are queued, scn_phys is past them, so it's scn_phys_issued,
+ * a copy taken the last time the queues were empty, that is synced; a scan
+ * interrupted then resumes from there.  The queue of datasets in the MOS
+ * isn't rolled back with it, so the queues are emptied and a new copy is
+ * taken whenever the traversal moves from one dataset to the next.
+ */
+int zfs_scan_sorted = 1;
+uint64_t zfs_scan_sort_mem = 16ULL << 20;
+uint64_t zfs_scan_sort_bytes = 512ULL << 20;
+
+typedef struct scan_io {
+	avl_node_t	sio_node;
+	blkptr_t	sio_bp;
+	zbookmark_t	sio_zb;
+	int		sio_flags;
+	int		sio_priority;
+} scan_io_t;
+
 #define	DSL_SCAN_IS_SCRUB_RESILVER(scn) \
 	((scn)->scn_phys.scn_func == POOL_SCAN_SCRUB || \
 	(scn)->scn_phys.scn_func == POOL_SCAN_RESILVER)
@@ -138,6 +174,8 @@ void
 dsl_scan_fini(dsl_pool_t *dp)
 {
 	if (dp->dp_scan) {
+		if (dp->dp_scan->scn_queues != NULL)
+			dsl_scan_queues_destroy(dp->dp_scan);
 		kmem_free(dp->dp_scan, sizeof (dsl_scan_t));
 		dp->dp_scan = NULL;
 	}
@@ -244,6 +282,11 @@ dsl_scan_done(dsl_scan_t *scn, boolean_t complete, dmu_tx_t *tx)
 	spa_t *spa = dp->dp_spa;
 	int i;
 
+	/* Reads still queued for a cancelled scan are dropped. */
+	if (scn->scn_queues != NULL)
+		dsl_scan_queues_destroy(scn);
+	scn->scn_visit_done = B_FALSE;
+
 	/* Remove any remnants of an old-style scrub. */
 	for (i = 0; old_names[i]; i++) {
 		(void) zap_remove(dp->dp_meta_objset,
@@ -440,7 +483,33 @@ dsl_scan_sync_state(dsl_scan_t *scn, dmu_tx_t *tx)
 	VERIFY(0 == zap_update(scn->scn_dp->dp_meta_objset,
 	    DMU_POOL_DIRECTORY_OBJECT,
 	    DMU_POOL_SCAN, sizeof (uint64_t), SCAN_PHYS_NUMINTS,
-	    &scn->scn_phys, tx));
+	    scn->scn_queued_mem != 0 ? &scn->scn_phys_issued : &scn->scn_phys,
+	    tx));
+}
+
+/*
+ * Every block visited so far has been issued: record the scan's state,
+ * with the bookmark zb if given, as the one to sync while reads are next
+ * queued.
+ */
+static void
+dsl_scan_checkpoint(dsl_scan_t *scn, const zbookmark_t *zb)
+{
+	ASSERT(scn->scn_queued_mem == 0);
+
+	scn->scn_phys_issued = scn->scn_phys;
+	if (zb != NULL)
+		scn->scn_phys_issued.scn_bookmark = *zb;
+}
+
+/*
+ * Issue every queued read, so that scn_phys can be synced as it is.
+ */
+static void
+dsl_scan_queues_drain(dsl_scan_t *scn)
+{
+	if (scn->scn_queues != NULL)
+		VERIFY(dsl_scan_queues_issue(scn, B_FALSE));
 }
 
 static boolean_t
@@ -886,6 +955,12 @@ dsl_scan_ds_destroyed(dsl_dataset_t *ds, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_state != DSS_SCANNING)
 		return;
 
+	/*
+	 * The bookmark and the queue of datasets are fixed up below; do it
+	 * to a scn_phys that can be synced.
+	 */
+	dsl_scan_queues_drain(scn);
+
 	if (scn->scn_phys.scn_bookmark.zb_objset == ds->ds_object) {
 		if (dsl_dataset_is_snapshot(ds)) {
 			/* Note, scn_cur_{min,max}_txg stays the same. */
@@ -947,6 +1022,8 @@ dsl_scan_ds_snapshotted(dsl_dataset_t *ds, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_state != DSS_SCANNING)
 		return;
 
+	dsl_scan_queues_drain(scn);
+
 	ASSERT(ds->ds_phys->ds_prev_snap_obj != 0);
 
 	if (scn->scn_phys.scn_bookmark.zb_objset == ds->ds_object) {
@@ -981,6 +1058,8 @@ dsl_scan_ds_clone_swapped(dsl_dataset_t *ds1, dsl_dataset_t *ds2, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_state != DSS_SCANNING)
 		return;
 
+	dsl_scan_queues_drain(scn);
+
 	if (scn->scn_phys.scn_bookmark.zb_objset == ds1->ds_object) {
 		scn->scn_phys.scn_bookmark.zb_objset = ds2->ds_object;
 		zfs_dbgmsg("clone_swap ds %llu; currently traversing; "
@@ -1076,10 +1155,22 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 {
 	dsl_pool_t *dp = scn->scn_dp;
 	dsl_dataset_t *ds;
+	zbookmark_t zb;
 	char *dsname;
 
 	VERIFY3U(0, ==, dsl_dataset_hold_obj(dp, dsobj, FTAG, &ds));
 
+	/*
+	 * Unless we're resuming in this ds, it has just been taken off the
+	 * queue of datasets; a scan interrupted from here on starts it over.
+	 */
+	if (scn->scn_phys.scn_bookmark.zb_objset != dsobj) {
+		dsl_scan_queues_drain(scn);
+		SET_BOOKMARK(&zb, dsobj, ZB_ROOT_OBJECT, ZB_ROOT_LEVEL,
+		    ZB_ROOT_BLKID);
+		dsl_scan_checkpoint(scn, &zb);
+	}
+
 	/*
 	 * Iterate over the bps in this ds.
 	 */
@@ -1100,8 +1191,10 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 		goto out;
 
 	/*
-	 * We've finished this pass over this dataset.
+	 * We've finished this pass over this dataset.  Issue its reads
+	 * before the queue of datasets changes.
 	 */
+	dsl_scan_queues_drain(scn);
 
 	/*
 	 * If we did not completely visit this dataset, do another pass.
@@ -1112,7 +1205,7 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 		VERIFY(zap_add_int_key(dp->dp_meta_objset,
 		    scn->scn_phys.scn_queue_obj, ds->ds_object,
 		    scn->scn_phys.scn_cur_max_txg, tx) == 0);
-		goto out;
+		goto done;
 	}
 
 	/*
@@ -1156,6 +1249,14 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 		}
 	}
 
+done:
+	/*
+	 * A scan interrupted from here on carries on with the next dataset
+	 * on the queue.
+	 */
+	SET_BOOKMARK(&zb, ZB_DESTROYED_OBJSET, 0, 0, 0);
+	dsl_scan_checkpoint(scn, &zb);
+
 out:
 	dsl_dataset_rele(ds, FTAG);
 }
@@ -1328,8 +1429,13 @@ dsl_scan_visit(dsl_scan_t *scn, dmu_tx_t *tx)
 			return;
 
 		if (spa_version(dp->dp_spa) < SPA_VERSION_DSL_SCRUB) {
+			zbookmark_t zb;
+
+			dsl_scan_queues_drain(scn);
 			VERIFY(0 == dmu_objset_find_spa(dp->dp_spa,
 			    NULL, enqueue_cb, tx, DS_FIND_CHILDREN));
+			SET_BOOKMARK(&zb, ZB_DESTROYED_OBJSET, 0, 0, 0);
+			dsl_scan_checkpoint(scn, &zb);
 		} else {
 			dsl_scan_visitds(scn,
 			    dp->dp_origin_snap->ds_object, tx);
@@ -1455,13 +1561,29 @@ dsl_scan_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 	}
 
 
-	if (!dsl_scan_active(scn) ||
-	    spa_sync_pass(dp->dp_spa) > 1)
+	if (spa_sync_pass(dp->dp_spa) > 1)
+		return;
+
+	scn->scn_sync_start_time = gethrtime();
+
+	/*
+	 * Reads left queued by an earlier txg come first, and the traversal
+	 * doesn't move on until they're all issued.  If they were queued two
+	 * txgs ago, or the pool is going away, issue all of them now.
+	 */
+	if (scn->scn_queued_mem != 0) {
+		boolean_t all = spa_shutting_down(spa) ||
+		    tx->tx_txg >= scn->scn_queued_txg + 2;
+
+		if (!dsl_scan_queues_issue(scn, !all) || spa_shutting_down(spa))
+			goto out;
+	}
+
+	if (!dsl_scan_active(scn))
 		return;
 
 	scn->scn_visited_this_txg = 0;
 	scn->scn_pausing = B_FALSE;
-	scn->scn_sync_start_time = gethrtime();
 	spa->spa_scrub_active = B_TRUE;
 
 	/*
@@ -1497,6 +1619,8 @@ dsl_scan_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_state != DSS_SCANNING)
 		return;
 
+	if (scn->scn_visit_done)
+		goto done;
 
 	if (scn->scn_phys.scn_ddt_bookmark.ddb_class <=
 	    scn->scn_phys.scn_ddt_class_max) {
@@ -1520,22 +1644,40 @@ dsl_scan_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 		    (longlong_t)scn->scn_phys.scn_bookmark.zb_blkid);
 	}
 
+	if (zfs_scan_sorted && DSL_SCAN_IS_SCRUB_RESILVER(scn) &&
+	    scn->scn_queues == NULL)
+		dsl_scan_queues_create(scn);
+	dsl_scan_checkpoint(scn, NULL);
+
 	scn->scn_zio_root = zio_root(dp->dp_spa, NULL,
 	    NULL, ZIO_FLAG_CANFAIL);
 	dsl_scan_visit(scn, tx);
 	(void) zio_wait(scn->scn_zio_root);
 	scn->scn_zio_root = NULL;
 
+	if (!scn->scn_pausing)
+		scn->scn_visit_done = B_TRUE;
+
+	if (scn->scn_queues != NULL)
+		(void) dsl_scan_queues_issue(scn, B_TRUE);
+
 	zfs_dbgmsg("visited %llu blocks in %llums",
 	    (longlong_t)scn->scn_visited_this_txg,
 	    (longlong_t)(gethrtime() - scn->scn_sync_start_time) / MICROSEC);
 
-	if (!scn->scn_pausing) {
+done:
+	if (scn->scn_visit_done && scn->scn_queued_mem == 0) {
 		/* finished with scan. */
 		zfs_dbgmsg("finished scan txg %llu", (longlong_t)tx->tx_txg);
 		dsl_scan_done(scn, B_TRUE, tx);
 	}
 
+out:
+	if (scn->scn_queues != NULL && scn->scn_queued_mem == 0)
+		dsl_scan_queues_destroy(scn);
+	else if (scn->scn_queues != NULL && scn->scn_queued_txg == 0)
+		scn->scn_queued_txg = tx->tx_txg;
+
 	if (DSL_SCAN_IS_SCRUB_RESILVER(scn)) {
 		mutex_enter(&spa->spa_scrub_lock);
 		while (spa->spa_scrub_inflight > 0) {
@@ -1643,12 +1785,178 @@ dsl_scan_scrub_done(zio_t *zio)
 	mutex_exit(&spa->spa_scrub_lock);
 }
 
+static void
+dsl_scan_scrub_issue(spa_t *spa, const blkptr_t *bp, const zbookmark_t *zb,
+    int zio_flags, int zio_priority)
+{
+	size_t size = BP_GET_PSIZE(bp);
+	void *data = zio_data_buf_alloc(size);
+
+	mutex_enter(&spa->spa_scrub_lock);
+	while (spa->spa_scrub_inflight >= spa->spa_scrub_maxinflight)
+		cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
+	spa->spa_scrub_inflight++;
+	mutex_exit(&spa->spa_scrub_lock);
+
+	zio_nowait(zio_read(NULL, spa, bp, data, size,
+	    dsl_scan_scrub_done, NULL, zio_priority,
+	    zio_flags, zb));
+}
+
+static int
+scan_io_compare(const void *x1, const void *x2)
+{
+	const scan_io_t *s1 = x1;
+	const scan_io_t *s2 = x2;
+	uint64_t o1 = DVA_GET_OFFSET(&s1->sio_bp.blk_dva[0]);
+	uint64_t o2 = DVA_GET_OFFSET(&s2->sio_bp.blk_dva[0]);
+
+	if (o1 < o2)
+		return (-1);
+	if (o1 > o2)
+		return (1);
+
+	/* The same block may be queued more than once */
+	if ((uintptr_t)s1 < (uintptr_t)s2)
+		return (-1);
+	if ((uintptr_t)s1 > (uintptr_t)s2)
+		return (1);
+
+	return (0);
+}
+
+static void
+dsl_scan_queues_create(dsl_scan_t *scn)
+{
+	vdev_t *rvd = scn->scn_dp->dp_spa->spa_root_vdev;
+	uint64_t q;
+
+	ASSERT(scn->scn_queues == NULL);
+
+	scn->scn_nqueues = rvd->vdev_children;
+	scn->scn_queues = kmem_alloc(scn->scn_nqueues * sizeof (avl_tree_t),
+	    KM_SLEEP);
+	for (q = 0; q < scn->scn_nqueues; q++)
+		avl_create(&scn->scn_queues[q], scan_io_compare,
+		    sizeof (scan_io_t), offsetof(scan_io_t, sio_node));
+	scn->scn_queued_mem = 0;
+	scn->scn_queued_bytes = 0;
+}
+
+/*
+ * Destroy the queues, dropping any reads still queued.
+ */
+static void
+dsl_scan_queues_destroy(dsl_scan_t *scn)
+{
+	scan_io_t *sio;
+	uint64_t q;
+
+	for (q = 0; q < scn->scn_nqueues; q++) {
+		void *cookie = NULL;
+
+		while ((sio = avl_destroy_nodes(&scn->scn_queues[q],
+		    &cookie)) != NULL)
+			kmem_free(sio, sizeof (scan_io_t));
+		avl_destroy(&scn->scn_queues[q]);
+	}
+	kmem_free(scn->scn_queues, scn->scn_nqueues * sizeof (avl_tree_t));
+	scn->scn_queues = NULL;
+	scn->scn_nqueues = 0;
+	scn->scn_queued_mem = 0;
+	scn->scn_queued_bytes = 0;
+	scn->scn_queued_txg = 0;
+}
+
+/*
+ * Has this txg spent its time on the scan?  These are the time limits of
+ * dsl_scan_check_pause(), for the queued reads.
+ */
+static boolean_t
+dsl_scan_issue_pause(dsl_scan_t *scn)
+{
+	uint64_t elapsed_nanosecs;
+	int mintime;
+
+	mintime = (scn->scn_phys.scn_func == POOL_SCAN_RESILVER) ?
+	    zfs_resilver_min_time_ms : zfs_scan_min_time_ms;
+	elapsed_nanosecs = gethrtime() - scn->scn_sync_start_time;
+	return (elapsed_nanosecs / NANOSEC > zfs_txg_timeout ||
+	    (elapsed_nanosecs / MICROSEC > mintime &&
+	    txg_sync_waiting(scn->scn_dp)));
+}
+
+/*
+ * Issue the queued reads.  Each vdev's queue is read in offset order, and
+ * the queues are taken in turn, a read from each per round, so that every
+ * vdev is kept busy.  If bounded, stop after the round in which the txg's
+ * time runs out.  Returns B_TRUE if no reads are left queued.
+ */
+static boolean_t
+dsl_scan_queues_issue(dsl_scan_t *scn, boolean_t bounded)
+{
+	spa_t *spa = scn->scn_dp->dp_spa;
+	boolean_t more;
+	uint64_t q;
+
+	do {
+		more = B_FALSE;
+		for (q = 0; q < scn->scn_nqueues; q++) {
+			avl_tree_t *t = &scn->scn_queues[q];
+			scan_io_t *sio = avl_first(t);
+
+			if (sio == NULL)
+				continue;
+
+			avl_remove(t, sio);
+			dsl_scan_scrub_issue(spa, &sio->sio_bp, &sio->sio_zb,
+			    sio->sio_flags, sio->sio_priority);
+			scn->scn_queued_mem -= sizeof (scan_io_t);
+			scn->scn_queued_bytes -= BP_GET_PSIZE(&sio->sio_bp);
+			kmem_free(sio, sizeof (scan_io_t));
+			more = B_TRUE;
+		}
+	} while (more && !(bounded && dsl_scan_issue_pause(scn)));
+
+	if (scn->scn_queued_mem != 0)
+		return (B_FALSE);
+
+	scn->scn_queued_txg = 0;
+	return (B_TRUE);
+}
+
+static void
+dsl_scan_enqueue(dsl_scan_t *scn, const blkptr_t *bp, const zbookmark_t *zb,
+    int zio_flags, int zio_priority)
+{
+	uint64_t q = DVA_GET_VDEV(&bp->blk_dva[0]);
+	scan_io_t *sio;
+
+	if (scn->scn_queues == NULL || q >= scn->scn_nqueues) {
+		dsl_scan_scrub_issue(scn->scn_dp->dp_spa, bp, zb,
+		    zio_flags, zio_priority);
+		return;
+	}
+
+	sio = kmem_alloc(sizeof (scan_io_t), KM_SLEEP);
+	sio->sio_bp = *bp;
+	sio->sio_zb = *zb;
+	sio->sio_flags = zio_flags;
+	sio->sio_priority = zio_priority;
+	avl_add(&scn->scn_queues[q], sio);
+
+	scn->scn_queued_mem += sizeof (scan_io_t);
+	scn->scn_queued_bytes += BP_GET_PSIZE(bp);
+	if (scn->scn_queued_mem >= zfs_scan_sort_mem ||
+	    scn->scn_queued_bytes >= zfs_scan_sort_bytes)
+		(void) dsl_scan_queues_issue(scn, B_TRUE);
+}
+
 static int
 dsl_scan_scrub_cb(dsl_pool_t *dp,
     const blkptr_t *bp, const zbookmark_t *zb)
 {
 	dsl_scan_t *scn = dp->dp_scan;
-	size_t size = BP_GET_PSIZE(bp);
 	spa_t *spa = dp->dp_spa;
 	uint64_t phys_birth = BP_PHYSICAL_BIRTH(bp);
 	boolean_t needs_io = B_FALSE;
@@ -1707,19 +2015,8 @@ dsl_scan_scrub_cb(dsl_pool_t *dp,
 		}
 	}
 
-	if (needs_io && !zfs_no_scrub_io) {
-		void *data = zio_data_buf_alloc(size);
-
-		mutex_enter(&spa->spa_scrub_lock);
-		while (spa->spa_scrub_inflight >= spa->spa_scrub_maxinflight)
-			cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
-		spa->spa_scrub_inflight++;
-		mutex_exit(&spa->spa_scrub_lock);
-
-		zio_nowait(zio_read(NULL, spa, bp, data, size,
-		    dsl_scan_scrub_done, NULL, zio_priority,
-		    zio_flags, zb));
-	}
+	if (needs_io && !zfs_no_scrub_io)
+		dsl_scan_enqueue(scn, bp, zb, zio_flags, zio_priority);
 
 	/* do not relocate this block */
 	return (0);
@@ -1746,3 +2043,14 @@ dsl_scan(dsl_pool_t *dp, pool_scan_func_t func)
 	return (dsl_sync_task_do(dp, dsl_scan_setup_check,
 	    dsl_scan_setup_sync, dp->dp_scan, &func, 0));
 }
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_scan_sorted, int, 0644);
+MODULE_PARM_DESC(zfs_scan_sorted, "Issue scrub and resilver reads sorted by offset");
+
+module_param(zfs_scan_sort_mem, ulong, 0644);
+MODULE_PARM_DESC(zfs_scan_sort_mem, "Max memory of queued scan reads");
+
+module_param(zfs_scan_sort_bytes, ulong, 0644);
+MODULE_PARM_DESC(zfs_scan_sort_bytes, "Max bytes of queued scan reads");
+#endif
@@ -202,6 +202,21 @@ struct req_iterator {
 		bio_for_each_segment(bvl, _iter.bio, _iter.i)
 #endif /* HAVE_RQ_FOR_EACH_SEGMENT */
 
+/*
+ * 2.6.33 API change
+ * Discard requests are passed to a make_request() function as bios with
+ * BIO_RW_DISCARD set, and only if the queue advertises QUEUE_FLAG_DISCARD.
+ */
+static inline int
+bio_is_discard(struct bio *bio)
+{
+#ifdef HAVE_BLK_QUEUE_DISCARD
+	return (bio->bi_rw & (1 << BIO_RW_DISCARD));
+#else
+	return (0);
+#endif /* HAVE_BLK_QUEUE_DISCARD */
+}
+
 #ifndef DISK_NAME_LEN
 #define DISK_NAME_LEN	32
 #endif /* DISK_NAME_LEN */
@@ -223,13 +223,38 @@ typedef struct dmu_buf_impl {
 	uint8_t db_dirtycnt;
 } dmu_buf_impl_t;
 
-/* Note: the dbuf hash table is exposed only for the mdb module */
-#define	DBUF_MUTEXES 256
-#define	DBUF_HASH_MUTEX(h, idx) (&(h)->hash_mutexes[(idx) & (DBUF_MUTEXES-1)])
+/*
+ * Note: the dbuf hash table is exposed only for the mdb module.
+ *
+ * Buckets are protected by a striped array of locks chosen by the low bits
+ * of the hash value, and the table is never smaller than the lock array,
+ * so every bucket a dbuf can hash to under any table size is covered by
+ * the same lock.  That lets the table be resized one lock at a time: each
+ * lock records which table its buckets currently live in.
+ */
+#define	DBUF_LOCK_ALIGN	64
+#define	DBUF_LOCK_PAD	(P2NPHASE(sizeof (kmutex_t) + \
+	sizeof (uint64_t) + sizeof (void *), DBUF_LOCK_ALIGN))
+
+typedef struct dbuf_hash_lock {
+	kmutex_t hl_lock;
+	uint64_t hl_mask;
+	struct dmu_buf_impl **hl_table;
+#ifdef _KERNEL
+	unsigned char hl_pad[DBUF_LOCK_PAD];
+#endif
+} dbuf_hash_lock_t;
+
+#define	DBUF_HASH_LOCK(h, hv) (&(h)->hash_locks[(hv) & (h)->hash_lock_mask])
+
 typedef struct dbuf_hash_table {
 	uint64_t hash_table_mask;
 	dmu_buf_impl_t **hash_table;
-	kmutex_t hash_mutexes[DBUF_MUTEXES];
+	uint64_t hash_lock_mask;
+	dbuf_hash_lock_t *hash_locks;
+	kmutex_t hash_resize_lock;
+	kcondvar_t hash_resize_cv;
+	boolean_t hash_resizing;
 } dbuf_hash_table_t;
 
 
@@ -249,6 +274,7 @@ int dbuf_hold_impl(struct dnode *dn, uint8_t level, uint64_t blkid, int create,
     void *tag, dmu_buf_impl_t **dbp);
 
 void dbuf_prefetch(struct dnode *dn, uint64_t blkid);
+void dbuf_prefetch_level(struct dnode *dn, int level, uint64_t blkid);
 
 void dbuf_add_ref(dmu_buf_impl_t *db, void *tag);
 uint64_t dbuf_refcount(dmu_buf_impl_t *db);
@@ -40,6 +40,7 @@ extern "C" {
  */
 enum ddt_type {
 	DDT_TYPE_ZAP = 0,
+	DDT_TYPE_LOG,
 	DDT_TYPES
 };
 
@@ -53,8 +54,6 @@ enum ddt_class {
 	DDT_CLASSES
 };
 
-#define	DDT_TYPE_CURRENT		0
-
 #define	DDT_COMPRESS_BYTEORDER_MASK	0x80
 #define	DDT_COMPRESS_FUNCTION_MASK	0x7f
 
@@ -118,6 +117,59 @@ struct ddt_entry {
 	avl_node_t	dde_node;
 };
 
+/*
+ * In-core index of the on-disk DDT.  It holds a fingerprint of the key of
+ * every entry in the DDT objects, tagged with the object it's in, in an
+ * open-addressed table of uint64_t slots.  A key whose fingerprint isn't
+ * in a READY index is certainly not on disk, so ddt_lookup() can skip the
+ * object lookups.  A fingerprint that is present only says the key may be
+ * there; the tag is a hint of where to look first.  The index may hold
+ * extra fingerprints, but never misses one: while it is BUILDING, stale
+ * slots are kept rather than risk dropping a live one.  An index that
+ * would grow past zfs_ddt_index_max is DISABLED and freed.
+ */
+typedef enum ddt_index_state {
+	DDT_INDEX_BUILDING,	/* being filled from the DDT objects */
+	DDT_INDEX_READY,	/* complete, can prove misses */
+	DDT_INDEX_DISABLED	/* not used */
+} ddt_index_state_t;
+
+/*
+ * Bloom filter of the keys in a DDT's objects.  Unlike the index it takes
+ * a few bits per entry, and it's kept on disk in the MOS object named by
+ * DMU_POOL_DDT_BLOOM, with this header in the bonus buffer, so it can be
+ * used as soon as the pool is opened.  Bits are never cleared, so removed
+ * entries leave stale bits behind until the filter is rebuilt.  The
+ * on-disk copy is only written out now and then; a zero dbp_txg means
+ * keys were added since, and the filter must be rebuilt.
+ */
+typedef struct ddt_bloom_phys {
+	uint64_t	dbp_bits;	/* size of the filter, power of 2 */
+	uint64_t	dbp_hashes;	/* bits set per key */
+	uint64_t	dbp_keys;	/* keys added */
+	uint64_t	dbp_txg;	/* txg the filter was synced, or 0 */
+} ddt_bloom_phys_t;
+
+/*
+ * Per-DDT statistics, exported as the "ddt-<checksum>-<pool>" kstat.
+ */
+typedef struct ddt_stats {
+	kstat_named_t	dds_lookups;		/* entries read from disk */
+	kstat_named_t	dds_index_misses;	/* object lookups skipped */
+	kstat_named_t	dds_index_hits;		/* index hits found on disk */
+	kstat_named_t	dds_index_false_hits;	/* index hits not on disk */
+	kstat_named_t	dds_index_bypassed;	/* lookups without the index */
+	kstat_named_t	dds_index_entries;	/* fingerprints in the index */
+	kstat_named_t	dds_index_bytes;	/* memory used by the index */
+	kstat_named_t	dds_index_state;	/* ddt_index_state_t */
+	kstat_named_t	dds_bloom_misses;	/* object lookups skipped */
+	kstat_named_t	dds_bloom_false_hits;	/* bloom hits not on disk */
+	kstat_named_t	dds_bloom_bytes;	/* memory used by the filter */
+} ddt_stats_t;
+
+#define	DDT_STAT_BUMP(ddt, stat)	\
+	atomic_add_64(&(ddt)->ddt_stats.stat.value.ui64, 1)
+
 /*
  * In-core ddt
  */
@@ -134,6 +186,27 @@ struct ddt {
 	ddt_histogram_t	ddt_histogram_cache[DDT_TYPES][DDT_CLASSES];
 	ddt_object_t	ddt_object_stats[DDT_TYPES][DDT_CLASSES];
 	avl_node_t	ddt_node;
+	krwlock_t	ddt_index_lock;	/* protects the index below */
+	uint64_t	*ddt_index;	/* fingerprint slots */
+	uint64_t	ddt_index_size;	/* number of slots, power of 2 */
+	uint64_t	ddt_index_count; /* slots in use */
+	ddt_index_state_t ddt_index_state;
+	boolean_t	ddt_index_building; /* builder running; ddt_lock */
+	boolean_t	ddt_index_cancel; /* builder should stop; ddt_lock */
+	kcondvar_t	ddt_index_cv;	/* builder done */
+	krwlock_t	ddt_bloom_lock;	/* protects the filter below */
+	uint64_t	*ddt_bloom;	/* filter bits */
+	uint8_t		*ddt_bloom_dirty; /* filter blocks to sync */
+	ddt_bloom_phys_t ddt_bloom_phys;
+	boolean_t	ddt_bloom_valid; /* holds every key on disk */
+	uint64_t	ddt_bloom_object; /* on-disk filter */
+	uint64_t	ddt_bloom_object_bits; /* its dbp_bits */
+	uint64_t	ddt_bloom_synced_txg; /* when it was written out */
+	boolean_t	ddt_bloom_stale; /* its header says it's stale */
+	boolean_t	ddt_bloom_changed; /* keys added this txg; syncing */
+	boolean_t	ddt_bloom_persist; /* write it out next txg */
+	kstat_t		*ddt_kstat;
+	ddt_stats_t	ddt_stats;
 };
 
 /*
@@ -164,6 +237,8 @@ typedef struct ddt_ops {
 	int (*ddt_op_walk)(objset_t *os, uint64_t object, ddt_entry_t *dde,
 	    uint64_t *walk);
 	uint64_t (*ddt_op_count)(objset_t *os, uint64_t object);
+	void (*ddt_op_sync)(objset_t *os, uint64_t object, dmu_tx_t *tx);
+	void (*ddt_op_close)(objset_t *os, uint64_t object);
 } ddt_ops_t;
 
 #define	DDT_NAMELEN	80
@@ -203,6 +278,7 @@ extern boolean_t ddt_histogram_empty(const ddt_histogram_t *ddh);
 extern void ddt_get_dedup_object_stats(spa_t *spa, ddt_object_t *ddo);
 extern void ddt_get_dedup_histogram(spa_t *spa, ddt_histogram_t *ddh);
 extern void ddt_get_dedup_stats(spa_t *spa, ddt_stat_t *dds_total);
+extern void ddt_get_dedup_bloom_stats(spa_t *spa, ddt_bloom_stat_t *dbs);
 
 extern uint64_t ddt_get_dedup_dspace(spa_t *spa);
 extern uint64_t ddt_get_pool_dedup_ratio(spa_t *spa);
@@ -229,15 +305,23 @@ extern void ddt_repair_done(ddt_t *ddt, ddt_entry_t *dde);
 
 extern int ddt_entry_compare(const void *x1, const void *x2);
 
+extern void ddt_init(void);
+extern void ddt_fini(void);
 extern void ddt_create(spa_t *spa);
 extern int ddt_load(spa_t *spa);
 extern void ddt_unload(spa_t *spa);
+extern void ddt_index_stop(spa_t *spa);
+extern void ddt_bloom_persist(spa_t *spa);
 extern void ddt_sync(spa_t *spa, uint64_t txg);
 extern int ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde);
 extern int ddt_object_update(ddt_t *ddt, enum ddt_type type,
     enum ddt_class class, ddt_entry_t *dde, dmu_tx_t *tx);
 
 extern const ddt_ops_t ddt_zap_ops;
+extern const ddt_ops_t ddt_log_ops;
+
+extern void ddt_log_init(void);
+extern void ddt_log_fini(void);
 
 #ifdef	__cplusplus
 }
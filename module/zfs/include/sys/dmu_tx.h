@@ -60,6 +60,16 @@ struct dmu_tx {
 	list_t tx_callbacks; /* list of dmu_tx_callback_t on this dmu_tx */
 	uint8_t tx_anyobj;
 	int tx_err;
+
+	/* time this tx was created, for the write throttle */
+	hrtime_t tx_start;
+
+	/* over zfs_dirty_data_max; dmu_tx_wait() waits for a sync */
+	boolean_t tx_wait_dirty;
+	uint64_t tx_wait_dirty_space;
+
+	/* TXG_NOWAIT tx to be throttled; dmu_tx_wait() delays it */
+	boolean_t tx_wait_delay;
 #ifdef ZFS_DEBUG
 	uint64_t tx_space_towrite;
 	uint64_t tx_space_tofree;
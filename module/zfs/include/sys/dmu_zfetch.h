@@ -47,23 +47,52 @@ typedef struct zstream {
 	zfetch_dirn_t	zst_direction;	/* direction of prefetch */
 	uint64_t	zst_stride;	/* length of stride, in blocks */
 	uint64_t	zst_ph_offset;	/* prefetch offset, in blocks */
-	uint64_t	zst_cap;	/* prefetch limit (cap), in blocks */
+	uint64_t	zst_cap;	/* prefetch distance, in blocks */
+	uint64_t	zst_ipf_offset;	/* indirect prefetch offset, in blks */
+	uint64_t	zst_reads;	/* reads that continued the stream */
+	uint64_t	zst_hits;	/* reads that found prefetched data */
+	uint64_t	zst_misses;	/* reads that outran the prefetch */
+	uint64_t	zst_rate;	/* consumption rate, in blocks/sec */
+	uint64_t	zst_rate_blocks; /* blocks read since zst_rate_start */
+	clock_t		zst_rate_start;	/* lbolt rate sample began */
 	kmutex_t	zst_lock;	/* protects stream */
 	clock_t		zst_last;	/* lbolt of last prefetch */
 	avl_node_t	zst_node;	/* embed avl node here */
+	avl_node_t	zst_next_node;	/* zf_stream_next linkage */
+	uint64_t	zst_id;		/* orders streams with the same next */
 } zstream_t;
 
 typedef struct zfetch {
 	krwlock_t	zf_rwlock;	/* protects zfetch structure */
 	list_t		zf_stream;	/* AVL tree of zstream_t's */
+	kmutex_t	zf_next_lock;	/* zf_stream_next, with zf_rwlock */
+	avl_tree_t	zf_stream_next;	/* streams by next block expected */
+	uint64_t	zf_stream_id;	/* last zst_id given out */
 	struct dnode	*zf_dnode;	/* dnode that owns this zfetch */
 	uint32_t	zf_stream_cnt;	/* # of active streams */
 	uint64_t	zf_alloc_fail;	/* # of failed attempts to alloc strm */
 } zfetch_t;
 
+/*
+ * Per-pool prefetch statistics, kept in the spa_t.
+ */
+typedef struct zfetch_pool_stats {
+	kstat_named_t	zps_hits;	/* stream reads of prefetched data */
+	kstat_named_t	zps_misses;	/* stream reads that outran prefetch */
+	kstat_named_t	zps_blocks;	/* data blocks prefetched */
+	kstat_named_t	zps_indirect_blocks; /* indirect blocks prefetched */
+	kstat_named_t	zps_useless_blocks; /* prefetched but never read */
+	kstat_named_t	zps_streams;	/* active streams */
+} zfetch_pool_stats_t;
+
+struct spa;
+
 void		zfetch_init(void);
 void		zfetch_fini(void);
 
+void		dmu_zfetch_stat_create(struct spa *);
+void		dmu_zfetch_stat_destroy(struct spa *);
+
 void		dmu_zfetch_init(zfetch_t *, struct dnode *);
 void		dmu_zfetch_rele(zfetch_t *);
 void		dmu_zfetch_cons(zfetch_t *);
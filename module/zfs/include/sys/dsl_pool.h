@@ -66,6 +66,14 @@ typedef struct zfs_all_blkstats {
 } zfs_all_blkstats_t;
 
 
+/*
+ * Histogram of the delays the write throttle imposed on tx's, exported
+ * per pool as the "dmu_tx_delay-<pool>" kstat.  Bucket n counts delays
+ * of at least 2^n microseconds (the first also counts shorter ones, the
+ * last all longer ones).
+ */
+#define	DSL_POOL_DELAY_BUCKETS	18
+
 typedef struct dsl_pool {
 	/* Immutable */
 	spa_t *dp_spa;
@@ -81,8 +89,6 @@ typedef struct dsl_pool {
 	blkptr_t dp_meta_rootbp;
 	list_t dp_synced_datasets;
 	hrtime_t dp_read_overhead;
-	uint64_t dp_throughput; /* bytes per millisec */
-	uint64_t dp_write_limit;
 	uint64_t dp_tmp_userrefs_obj;
 	bpobj_t dp_free_bpobj;
 
@@ -92,6 +98,13 @@ typedef struct dsl_pool {
 	kmutex_t dp_lock;
 	uint64_t dp_space_towrite[TXG_SIZE];
 	uint64_t dp_tempreserved[TXG_SIZE];
+	uint64_t dp_dirty_total;	/* sum of dp_space_towrite[] */
+	kcondvar_t dp_spaceavail_cv;	/* dp_dirty_total went down */
+	hrtime_t dp_last_wakeup;	/* end of the last throttle delay */
+
+	/* Updated atomically */
+	kstat_named_t dp_delay_hist[DSL_POOL_DELAY_BUCKETS];
+	kstat_t *dp_delay_ksp;
 
 	/* Has its own locking */
 	tx_state_t dp_tx;
@@ -110,6 +123,15 @@ typedef struct dsl_pool {
 	zfs_all_blkstats_t *dp_blkstats;
 } dsl_pool_t;
 
+extern int zfs_no_write_throttle;
+extern uint64_t zfs_dirty_data_max;
+extern uint64_t zfs_dirty_data_max_max;
+extern int zfs_dirty_data_max_percent;
+extern uint64_t zfs_dirty_data_sync;
+extern int zfs_delay_min_dirty_percent;
+extern uint64_t zfs_delay_scale;
+extern uint64_t zfs_delay_max_ns;
+
 int dsl_pool_open(spa_t *spa, uint64_t txg, dsl_pool_t **dpp);
 void dsl_pool_close(dsl_pool_t *dp);
 dsl_pool_t *dsl_pool_create(spa_t *spa, nvlist_t *zplprops, uint64_t txg);
@@ -120,8 +142,9 @@ uint64_t dsl_pool_adjustedsize(dsl_pool_t *dp, boolean_t netfree);
 uint64_t dsl_pool_adjustedfree(dsl_pool_t *dp, boolean_t netfree);
 int dsl_pool_tempreserve_space(dsl_pool_t *dp, uint64_t space, dmu_tx_t *tx);
 void dsl_pool_tempreserve_clear(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx);
-void dsl_pool_memory_pressure(dsl_pool_t *dp);
 void dsl_pool_willuse_space(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx);
+uint64_t dsl_pool_dirty_percent(dsl_pool_t *dp);
+void dsl_pool_delay_stat_add(dsl_pool_t *dp, hrtime_t delay);
 void dsl_free(dsl_pool_t *dp, uint64_t txg, const blkptr_t *bpp);
 void dsl_free_sync(zio_t *pio, dsl_pool_t *dp, uint64_t txg,
     const blkptr_t *bpp);
@@ -82,6 +82,15 @@ typedef struct dsl_scan {
 	/* for debugging / information */
 	uint64_t scn_visited_this_txg;
 
+	/* per top-level vdev queues of reads sorted by offset */
+	avl_tree_t *scn_queues;
+	uint64_t scn_nqueues;
+	uint64_t scn_queued_mem;
+	uint64_t scn_queued_bytes;
+	uint64_t scn_queued_txg;	/* txg that left reads queued */
+	boolean_t scn_visit_done;	/* only queued reads are left */
+	dsl_scan_phys_t scn_phys_issued; /* synced while reads are queued */
+
 	dsl_scan_phys_t scn_phys;
 } dsl_scan_t;
 
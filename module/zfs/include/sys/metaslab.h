@@ -41,7 +41,8 @@ extern metaslab_t *metaslab_init(metaslab_group_t *mg, space_map_obj_t *smo,
     uint64_t start, uint64_t size, uint64_t txg);
 extern void metaslab_fini(metaslab_t *msp);
 extern void metaslab_sync(metaslab_t *msp, uint64_t txg);
-extern void metaslab_sync_done(metaslab_t *msp, uint64_t txg);
+extern void metaslab_sync_done(metaslab_t *msp, uint64_t txg, zio_t *zio,
+    uint64_t *trim_limit);
 extern void metaslab_sync_reassess(metaslab_group_t *mg);
 
 #define	METASLAB_HINTBP_FAVOR	0x0
@@ -55,7 +56,7 @@ extern void metaslab_free(spa_t *spa, const blkptr_t *bp, uint64_t txg,
 extern int metaslab_claim(spa_t *spa, const blkptr_t *bp, uint64_t txg);
 
 extern metaslab_class_t *metaslab_class_create(spa_t *spa,
-    space_map_ops_t *ops);
+    space_map_ops_t *ops, const char *name);
 extern void metaslab_class_destroy(metaslab_class_t *mc);
 extern int metaslab_class_validate(metaslab_class_t *mc);
 
@@ -72,6 +73,7 @@ extern metaslab_group_t *metaslab_group_create(metaslab_class_t *mc,
 extern void metaslab_group_destroy(metaslab_group_t *mg);
 extern void metaslab_group_activate(metaslab_group_t *mg);
 extern void metaslab_group_passivate(metaslab_group_t *mg);
+extern void metaslab_group_preload_wait(metaslab_group_t *mg);
 
 #ifdef	__cplusplus
 }
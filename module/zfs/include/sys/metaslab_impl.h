@@ -36,15 +36,49 @@
 extern "C" {
 #endif
 
+/*
+ * Allocation statistics of a metaslab class, exported as the
+ * "metaslab-<class>-<pool>" kstat.
+ */
+typedef struct metaslab_class_stats {
+	kstat_named_t	mcs_allocs;		/* DVAs allocated */
+	kstat_named_t	mcs_alloc_failures;	/* DVA allocations failed */
+	kstat_named_t	mcs_group_misses;	/* groups passed over */
+	kstat_named_t	mcs_retries;		/* metaslab picks retried */
+	kstat_named_t	mcs_lock_waits;		/* contended mg/ms locks */
+	kstat_named_t	mcs_lock_wait_ns;	/* time waiting for them */
+} metaslab_class_stats_t;
+
+#define	METASLAB_STAT_INCR(mc, stat, val) \
+	atomic_add_64(&(mc)->mc_stats.stat.value.ui64, (val))
+#define	METASLAB_STAT_BUMP(mc, stat)	METASLAB_STAT_INCR(mc, stat, 1)
+
+/*
+ * Concurrent allocations start from one of mc_ncursors cursors, picked
+ * by CPU, instead of all following mc_rotor.  The cursors are spread
+ * around the ring of groups, so allocations from different CPUs mostly
+ * land on different groups, and so on different metaslab locks.  Like
+ * mc_rotor, they are updated without locking; a lost update only makes
+ * the allocation a little less even.  mc_rotor itself still anchors the
+ * ring of active groups.
+ */
+typedef struct metaslab_cursor {
+	metaslab_group_t	*mcc_rotor;	/* group to allocate from */
+	uint64_t		mcc_aliquot;	/* allocated from mcc_rotor */
+} __attribute__((aligned(64))) metaslab_cursor_t;
+
 struct metaslab_class {
 	spa_t			*mc_spa;
 	metaslab_group_t	*mc_rotor;
 	space_map_ops_t		*mc_ops;
-	uint64_t		mc_aliquot;
+	metaslab_cursor_t	*mc_cursors;	/* per-CPU allocation cursors */
+	int			mc_ncursors;
 	uint64_t		mc_alloc;	/* total allocated space */
 	uint64_t		mc_deferred;	/* total deferred frees */
 	uint64_t		mc_space;	/* total space (alloc + free) */
 	uint64_t		mc_dspace;	/* total deflated space */
+	kstat_t			*mc_kstat;
+	metaslab_class_stats_t	mc_stats;
 };
 
 struct metaslab_group {
@@ -58,6 +92,7 @@ struct metaslab_group {
 	vdev_t			*mg_vd;
 	metaslab_group_t	*mg_prev;
 	metaslab_group_t	*mg_next;
+	taskq_t			*mg_taskq;	/* metaslab preloads */
 };
 
 /*
@@ -66,6 +101,14 @@ struct metaslab_group {
  * we append the allocs and frees from that txg to the space map object.
  * When the txg is done syncing, metaslab_sync_done() updates ms_smo
  * to ms_smo_syncing.  Everything in ms_smo is always safe to allocate.
+ *
+ * ms_histogram is the free segment histogram stored with the space map
+ * object.  It lets metaslab_weight() judge fragmentation without loading
+ * the map; while the map is loaded, its live sm_histogram is used instead.
+ *
+ * ms_trimmap holds the deferred frees whose TRIM was issued when they
+ * left ms_defermap[]; they rejoin ms_map one txg later, once the TRIM
+ * is known to have completed.
  */
 struct metaslab {
 	kmutex_t	ms_lock;	/* metaslab lock		*/
@@ -74,9 +117,12 @@ struct metaslab {
 	space_map_t	ms_allocmap[TXG_SIZE];  /* allocated this txg	*/
 	space_map_t	ms_freemap[TXG_SIZE];	/* freed this txg	*/
 	space_map_t	ms_defermap[TXG_DEFER_SIZE]; /* deferred frees	*/
+	space_map_t	ms_trimmap;	/* deferred frees being trimmed	*/
 	space_map_t	ms_map;		/* in-core free space map	*/
-	int64_t		ms_deferspace;	/* sum of ms_defermap[] space	*/
+	int64_t		ms_deferspace;	/* defermap[] + trimmap space	*/
 	uint64_t	ms_weight;	/* weight vs. others in group	*/
+	uint64_t	ms_access_txg;	/* keep map loaded through txg	*/
+	uint64_t	ms_histogram[SPACE_MAP_HISTOGRAM_SIZE]; /* synced */
 	metaslab_group_t *ms_group;	/* metaslab group		*/
 	avl_node_t	ms_group_node;	/* node in metaslab group tree	*/
 	txg_node_t	ms_txg_node;	/* per-txg dirty metaslab links	*/
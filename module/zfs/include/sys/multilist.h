@@ -0,0 +1,90 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef	_SYS_MULTILIST_H
+#define	_SYS_MULTILIST_H
+
+#include <sys/zfs_context.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * A multilist is a list split into a number of sublists, each with its
+ * own lock. An object always lives in the sublist chosen for it by the
+ * index function, so lookups, insertions and removals of different
+ * objects usually take different locks. There is no ordering between
+ * sublists; each one is ordered by insertion like a plain list_t.
+ *
+ * Fields of the multilist_sublist_t structure:
+ * - mls_lock: protects mls_list
+ * - mls_list: the objects hashed to this sublist
+ * - mls_contended: number of times mls_lock was found held by another
+ *   thread; not protected by anything
+ * The structure is padded so that sublists do not share cache lines.
+ */
+typedef struct multilist_sublist {
+	kmutex_t	mls_lock;
+	list_t		mls_list;
+	uint64_t	mls_contended;
+} __attribute__((aligned(64))) multilist_sublist_t;
+
+typedef struct multilist multilist_t;
+
+typedef unsigned int multilist_sublist_index_func_t(multilist_t *, void *);
+
+struct multilist {
+	size_t				ml_offset;
+	uint64_t			ml_num_sublists;
+	multilist_sublist_t		*ml_sublists;
+	multilist_sublist_index_func_t	*ml_index_func;
+};
+
+void multilist_create(multilist_t *ml, size_t size, size_t offset,
+    unsigned int num, multilist_sublist_index_func_t *index_func);
+void multilist_destroy(multilist_t *ml);
+
+void multilist_insert(multilist_t *ml, void *obj);
+void multilist_remove(multilist_t *ml, void *obj);
+int multilist_is_empty(multilist_t *ml);
+
+unsigned int multilist_get_num_sublists(multilist_t *ml);
+unsigned int multilist_get_random_index(multilist_t *ml);
+uint64_t multilist_get_contended(multilist_t *ml);
+
+multilist_sublist_t *multilist_sublist_lock(multilist_t *ml,
+    unsigned int sublist_idx);
+void multilist_sublist_unlock(multilist_sublist_t *mls);
+
+void multilist_sublist_insert_head(multilist_sublist_t *mls, void *obj);
+void multilist_sublist_remove(multilist_sublist_t *mls, void *obj);
+int multilist_sublist_is_empty(multilist_sublist_t *mls);
+void *multilist_sublist_head(multilist_sublist_t *mls);
+void *multilist_sublist_tail(multilist_sublist_t *mls);
+void *multilist_sublist_next(multilist_sublist_t *mls, void *obj);
+void *multilist_sublist_prev(multilist_sublist_t *mls, void *obj);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_MULTILIST_H */
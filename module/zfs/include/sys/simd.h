@@ -0,0 +1,106 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 2005, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+#ifndef _SYS_SIMD_H
+#define	_SYS_SIMD_H
+
+#include <sys/types.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Support for the vectorized checksum and RAID-Z code.
+ *
+ * The vector register file must be saved and restored around its use in
+ * the kernel. No sleeping allocations may be made between kfpu_begin() and
+ * kfpu_end().
+ */
+#if defined(_KERNEL) && defined(__x86_64__)
+#include <asm/i387.h>
+#define	kfpu_begin()	kernel_fpu_begin()
+#define	kfpu_end()	kernel_fpu_end()
+#else
+#define	kfpu_begin()	((void)0)
+#define	kfpu_end()	((void)0)
+#endif
+
+#if defined(__x86_64__)
+
+static inline void
+zfs_cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx,
+    uint32_t *edx)
+{
+	__asm__ __volatile__("cpuid"
+	    : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+	    : "a" (leaf), "c" (0));
+}
+
+static inline boolean_t
+zfs_sse2_available(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	zfs_cpuid(1, &eax, &ebx, &ecx, &edx);
+	return ((edx & (1U << 26)) != 0);
+}
+
+static inline boolean_t
+zfs_ssse3_available(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	zfs_cpuid(1, &eax, &ebx, &ecx, &edx);
+	return ((edx & (1U << 26)) != 0 && (ecx & (1U << 9)) != 0);
+}
+
+static inline boolean_t
+zfs_avx2_available(void)
+{
+	uint32_t eax, ebx, ecx, edx, xcr0;
+
+	zfs_cpuid(0, &eax, &ebx, &ecx, &edx);
+	if (eax < 7)
+		return (B_FALSE);
+
+	/* the OS must save the YMM state (OSXSAVE, then XCR0 bits 1 and 2) */
+	zfs_cpuid(1, &eax, &ebx, &ecx, &edx);
+	if ((ecx & (1U << 27)) == 0 || (ecx & (1U << 28)) == 0)
+		return (B_FALSE);
+	__asm__ __volatile__("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+	if ((xcr0 & 0x6) != 0x6)
+		return (B_FALSE);
+
+	zfs_cpuid(7, &eax, &ebx, &ecx, &edx);
+	return ((ebx & (1U << 5)) != 0);
+}
+
+#endif /* __x86_64__ */
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_SIMD_H */
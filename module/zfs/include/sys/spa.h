@@ -670,6 +670,8 @@ extern void spa_get_errlists(spa_t *spa, avl_tree_t *last, avl_tree_t *scrub);
 /* vdev cache */
 extern void vdev_cache_stat_init(void);
 extern void vdev_cache_stat_fini(void);
+extern void vdev_queue_stat_init(void);
+extern void vdev_queue_stat_fini(void);
 
 /* Initialization and termination */
 extern void spa_init(int flags);
@@ -35,6 +35,13 @@ extern "C" {
 
 typedef struct space_map_ops space_map_ops_t;
 
+/*
+ * A loaded space map keeps a histogram of its segments by size: bucket
+ * n counts segments of [2^n, 2^(n+1)) units of (1 << sm_shift) bytes,
+ * and the last bucket also counts everything larger.
+ */
+#define	SPACE_MAP_HISTOGRAM_SIZE	32
+
 typedef struct space_map {
 	avl_tree_t	sm_root;	/* AVL tree of map segments */
 	uint64_t	sm_space;	/* sum of all segments in the map */
@@ -49,6 +56,7 @@ typedef struct space_map {
 	avl_tree_t	*sm_pp_root;	/* picker-private AVL tree */
 	void		*sm_ppd;	/* picker-private data */
 	kmutex_t	*sm_lock;	/* pointer to lock that protects map */
+	uint64_t	*sm_histogram;	/* segment sizes, NULL if not loaded */
 } space_map_t;
 
 typedef struct space_seg {
@@ -134,8 +142,19 @@ struct space_map_ops {
  */
 #define	SPACE_MAP_BLOCKSHIFT	12
 
+/*
+ * Metaslab space map objects carry the metaslab's free segment histogram
+ * in their bonus buffer, right after the space_map_obj_t.  Objects written
+ * by older code have a bonus of just sizeof (space_map_obj_t).
+ */
+#define	SPACE_MAP_BONUS_SIZE	\
+	(sizeof (space_map_obj_t) + SPACE_MAP_HISTOGRAM_SIZE * sizeof (uint64_t))
+
 typedef void space_map_func_t(space_map_t *sm, uint64_t start, uint64_t size);
 
+extern void space_map_init(void);
+extern void space_map_fini(void);
+
 extern void space_map_create(space_map_t *sm, uint64_t start, uint64_t size,
     uint8_t shift, kmutex_t *lp);
 extern void space_map_destroy(space_map_t *sm);
@@ -157,6 +176,9 @@ extern uint64_t space_map_alloc(space_map_t *sm, uint64_t size);
 extern void space_map_claim(space_map_t *sm, uint64_t start, uint64_t size);
 extern void space_map_free(space_map_t *sm, uint64_t start, uint64_t size);
 extern uint64_t space_map_maxsize(space_map_t *sm);
+extern void space_map_histogram_add(space_map_t *sm, uint64_t *histogram);
+extern boolean_t space_map_should_condense(space_map_t *sm,
+    space_map_obj_t *smo);
 
 extern void space_map_sync(space_map_t *sm, uint8_t maptype,
     space_map_obj_t *smo, objset_t *os, dmu_tx_t *tx);
@@ -44,10 +44,12 @@ extern "C" {
 
 #define	TXG_WAIT		1ULL
 #define	TXG_NOWAIT		2ULL
+#define	TXG_WAITED		3ULL
 
 typedef struct tx_cpu tx_cpu_t;
 
 typedef struct txg_handle {
+	struct tx_state	*th_tx;
 	tx_cpu_t	*th_cpu;
 	uint64_t	th_txg;
 } txg_handle_t;
@@ -75,12 +77,11 @@ extern void txg_rele_to_sync(txg_handle_t *txghp);
 extern void txg_register_callbacks(txg_handle_t *txghp, list_t *tx_callbacks);
 
 /*
- * Delay the caller by the specified number of ticks or until
- * the txg closes (whichever comes first).  This is intended
- * to be used to throttle writers when the system nears its
- * capacity.
+ * Start quiescing and syncing the open txg now rather than when
+ * zfs_txg_timeout expires, unless an earlier txg is already in flight.
+ * Used by the write throttle once enough dirty data has accumulated.
  */
-extern void txg_delay(struct dsl_pool *dp, uint64_t txg, int ticks);
+extern void txg_kick(struct dsl_pool *dp);
 
 /*
  * Wait until the given transaction group has finished syncing.
@@ -107,6 +108,35 @@ extern boolean_t txg_stalled(struct dsl_pool *dp);
 /* returns TRUE if someone is waiting for the next txg to sync */
 extern boolean_t txg_sync_waiting(struct dsl_pool *dp);
 
+/*
+ * Per-txg history.  The last zfs_txg_history txgs are kept in a ring,
+ * one set of these named stats per txg, and exported as the
+ * "txgs-<pool>" kstat.  Times are in nanoseconds: birth is when the txg
+ * opened, and the four phases are the time it was open, quiescing,
+ * quiesced but waiting for the sync thread, and syncing.
+ */
+typedef enum txg_history_stat {
+	TXG_HIST_TXG,
+	TXG_HIST_BIRTH,
+	TXG_HIST_OPEN,
+	TXG_HIST_QUIESCE,
+	TXG_HIST_WAIT,
+	TXG_HIST_SYNC,
+	TXG_HIST_DIRTY,		/* bytes of dirty data when sync began */
+	TXG_HIST_DBUFS,		/* dirty records created in the txg */
+	TXG_HIST_READS,		/* I/Os issued to the pool during sync */
+	TXG_HIST_WRITES,
+	TXG_HIST_NREAD,		/* bytes read and written during sync */
+	TXG_HIST_NWRITTEN,
+	TXG_HIST_PASSES,	/* spa_sync() passes */
+	TXG_HIST_STATS
+} txg_history_stat_t;
+
+extern boolean_t txg_history_enabled(struct dsl_pool *dp);
+extern void txg_history_set(struct dsl_pool *dp, uint64_t txg,
+    txg_history_stat_t stat, uint64_t value);
+extern void txg_history_dirty_dbuf(struct dsl_pool *dp, uint64_t txg);
+
 /*
  * Per-txg object lists.
  */
@@ -33,16 +33,24 @@
 extern "C" {
 #endif
 
+/*
+ * Per-CPU transaction hold counts.  txg_hold_open() bumps the count for
+ * the open txg on the caller's CPU without taking any lock, and
+ * txg_quiesce() closes a txg by advancing tx_open_txg and then waiting
+ * for its counts to drain.  tc_lock protects tc_callbacks and is used to
+ * sleep on tc_cv; it is only taken when the last hold on a closed txg is
+ * released.  The structure is padded so that CPUs do not share cache
+ * lines.
+ */
 struct tx_cpu {
 	kmutex_t	tc_lock;
 	kcondvar_t	tc_cv[TXG_SIZE];
 	uint64_t	tc_count[TXG_SIZE];
 	list_t		tc_callbacks[TXG_SIZE]; /* commit cb list */
-	char		tc_pad[16];
-};
+} __attribute__((aligned(64)));
 
 typedef struct tx_state {
-	tx_cpu_t	*tx_cpu;	/* protects right to enter txg	*/
+	tx_cpu_t	*tx_cpu;	/* per-CPU holds on each txg	*/
 	kmutex_t	tx_sync_lock;	/* protects tx_state_t */
 	uint64_t	tx_open_txg;	/* currently open txg id */
 	uint64_t	tx_quiesced_txg; /* quiesced txg waiting for sync */
@@ -66,6 +74,14 @@ typedef struct tx_state {
 	kthread_t	*tx_quiesce_thread;
 
 	taskq_t		*tx_commit_cb_taskq; /* commit callback taskq */
+
+	/*
+	 * Per-txg history, exported as the "txgs-<pool>" kstat; NULL when
+	 * zfs_txg_history was 0 at pool open.  tx_dirty_dbufs counts the
+	 * dirty records created in each txg while it is enabled.
+	 */
+	struct txg_history *tx_history;
+	uint64_t	tx_dirty_dbufs[TXG_SIZE];
 } tx_state_t;
 
 #ifdef	__cplusplus
@@ -52,10 +52,12 @@ extern int vdev_disk_read_rootlabel(char *, char *, nvlist_t **);
 #ifdef HAVE_2ARGS_BIO_END_IO_T
 # define BIO_END_IO_PROTO(fn, x, y, z)	static void fn(struct bio *x, int z)
 # define BIO_END_IO_RETURN(rc)		return
+# define BIO_END_IO(bio, error)		bio_endio(bio, error)
 #else
 # define BIO_END_IO_PROTO(fn, x, y, z)	static int fn(struct bio *x, \
 					              unsigned int y, int z)
 # define BIO_END_IO_RETURN(rc)		return rc
+# define BIO_END_IO(bio, error)		bio_endio(bio, (bio)->bi_size, error)
 #endif /* HAVE_2ARGS_BIO_END_IO_T */
 
 /* 2.6.29 API change */
@@ -38,6 +38,10 @@
 extern "C" {
 #endif
 
+#ifndef DKIOCFREE
+#define	DKIOCFREE		(DKIOC|50)	/* free space on the medium */
+#endif
+
 /*
  * Virtual device descriptors.
  *
@@ -97,11 +101,18 @@ struct vdev_cache {
 	kmutex_t	vc_lock;
 };
 
+typedef struct vdev_queue_class {
+	avl_tree_t	vqc_queued_tree;	/* waiting, by deadline */
+	uint32_t	vqc_active;		/* issued to the device */
+} vdev_queue_class_t;
+
 struct vdev_queue {
-	avl_tree_t	vq_deadline_tree;
+	vdev_queue_class_t vq_class[ZIO_QUEUE_CLASSES];
 	avl_tree_t	vq_read_tree;
 	avl_tree_t	vq_write_tree;
 	avl_tree_t	vq_pending_tree;
+	uint64_t	vq_lastoffset;	/* end of last I/O issued	*/
+	hrtime_t	vq_latency;	/* moving average service time	*/
 	kmutex_t	vq_lock;
 };
 
@@ -148,6 +159,7 @@ struct vdev {
 	metaslab_t	**vdev_ms;	/* metaslab array		*/
 	txg_list_t	vdev_ms_list;	/* per-txg dirty metaslab lists	*/
 	txg_list_t	vdev_dtl_list;	/* per-txg dirty DTL lists	*/
+	zio_t		*vdev_trim_zio;	/* last txg's trims		*/
 	txg_node_t	vdev_txg_node;	/* per-txg dirty vdev linkage	*/
 	boolean_t	vdev_remove_wanted; /* async remove wanted?	*/
 	boolean_t	vdev_probe_wanted; /* async probe wanted?	*/
@@ -178,6 +190,8 @@ struct vdev {
 	uint64_t	vdev_unspare;	/* unspare when resilvering done */
 	hrtime_t	vdev_last_try;	/* last reopen time		*/
 	boolean_t	vdev_nowritecache; /* true if flushwritecache failed */
+	boolean_t	vdev_notrim;	/* true if DKIOCFREE failed	*/
+	boolean_t	vdev_nonrot;	/* true if device doesn't seek	*/
 	boolean_t	vdev_checkremove; /* temporary online test	*/
 	boolean_t	vdev_forcefault; /* force online fault		*/
 	boolean_t	vdev_splitting;	/* split or repair in progress  */
@@ -0,0 +1,84 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 2005, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+#ifndef _SYS_VDEV_RAIDZ_H
+#define	_SYS_VDEV_RAIDZ_H
+
+#include <sys/types.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Galois field math used by RAID-Z parity generation and reconstruction.
+ *
+ * Each implementation operates on whole column buffers. All sizes are in
+ * bytes; the vectorized implementations process RAIDZ_MATH_CHUNK bytes per
+ * iteration and hand any remainder to the scalar implementation.
+ *
+ *   rzo_gen_p	p ^= d
+ *   rzo_gen_q	q = 2 * q + d over dsize bytes, q = 2 * q over the rest of qsize
+ *   rzo_gen_pq	the above for P and Q in a single pass over d
+ *   rzo_gen_pqr	the above for P, Q and R (R uses a factor of 4)
+ *   rzo_mul	dst = c * dst
+ *   rzo_mul_add	dst = dst + c * src
+ */
+#define	RAIDZ_MATH_CHUNK	64
+
+typedef struct raidz_impl_ops {
+	void (*rzo_gen_p)(void *p, const void *d, size_t dsize);
+	void (*rzo_gen_q)(void *q, const void *d, size_t dsize, size_t qsize);
+	void (*rzo_gen_pq)(void *p, void *q, const void *d, size_t dsize,
+	    size_t psize);
+	void (*rzo_gen_pqr)(void *p, void *q, void *r, const void *d,
+	    size_t dsize, size_t psize);
+	void (*rzo_mul)(void *dst, size_t size, uint8_t c);
+	void (*rzo_mul_add)(void *dst, const void *src, size_t size,
+	    uint8_t c);
+	boolean_t (*rzo_is_supported)(void);
+	const char *rzo_name;
+} raidz_impl_ops_t;
+
+extern const uint8_t vdev_raidz_pow2[256];
+extern const uint8_t vdev_raidz_log2[256];
+
+extern const raidz_impl_ops_t vdev_raidz_scalar_impl;
+#if defined(__x86_64__)
+extern const raidz_impl_ops_t vdev_raidz_sse2_impl;
+extern const raidz_impl_ops_t vdev_raidz_ssse3_impl;
+extern const raidz_impl_ops_t vdev_raidz_avx2_impl;
+#endif
+
+extern char *zfs_vdev_raidz_impl;
+
+extern const raidz_impl_ops_t *vdev_raidz_math_get_ops(void);
+extern void vdev_raidz_math_init(void);
+extern void vdev_raidz_math_fini(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_VDEV_RAIDZ_H */
@@ -34,6 +34,28 @@
 extern "C" {
 #endif
 
+/*
+ * Log write buffer states.  An lwb is OPENED while the log writer fills
+ * it, ISSUED once its write (and then the cache flushes it needs) are in
+ * flight, FLUSHED when those have completed, and DONE once every earlier
+ * lwb in the chain is DONE too, at which point its records are stable
+ * and its commit waiters have been notified.
+ *
+ * An lwb whose write completes while a later lwb is still being written
+ * leaves the cache flush to that lwb (lwb_flush_deferred), so one flush
+ * per vdev covers a whole batch of concurrent commits.  Such an lwb can
+ * only become DONE once zl_flushed_gen has reached its lwb_flush_gen.
+ * Flushes can complete out of order, so the lwbs that issue them are kept
+ * on zl_lwb_flushing in generation order, and zl_flushed_gen only moves
+ * past a generation once every earlier one is done as well.
+ */
+typedef enum {
+	LWB_STATE_OPENED,
+	LWB_STATE_ISSUED,
+	LWB_STATE_FLUSHED,
+	LWB_STATE_DONE
+} lwb_state_t;
+
 /*
  * Log write buffer.
  */
@@ -44,21 +66,65 @@ typedef struct lwb {
 	int		lwb_sz;		/* size of block and buffer */
 	char		*lwb_buf;	/* log write buffer */
 	zio_t		*lwb_zio;	/* zio for this buffer */
+	zio_t		*lwb_root_zio;	/* parent of write and flush zios */
 	dmu_tx_t	*lwb_tx;	/* tx for log block allocation */
 	uint64_t	lwb_max_txg;	/* highest txg in this lwb */
+	lwb_state_t	lwb_state;	/* see above */
+	boolean_t	lwb_flush_deferred; /* a later lwb flushes for us */
+	uint64_t	lwb_flush_gen;	/* flush generation we need */
+	hrtime_t	lwb_issued;	/* time the write was issued */
+	int		lwb_error;	/* error writing this lwb */
+	uint64_t	lwb_commit_seq;	/* itx seq committed when DONE */
+	uint64_t	lwb_lr_seq;	/* highest lr seq in this lwb */
+	list_t		lwb_waiters;	/* zil_commit_waiter_t's */
 	list_node_t	lwb_node;	/* zilog->zl_lwb_list linkage */
+	list_node_t	lwb_issue_node;	/* zilog->zl_lwb_issued linkage */
+	list_node_t	lwb_flush_node;	/* zilog->zl_lwb_flushing linkage */
 } lwb_t;
 
 /*
- * Vdev flushing: during a zil_commit(), we build up an AVL tree of the vdevs
- * we've touched so we know which ones need a write cache flush at the end.
+ * A zil_commit() caller waiting for the lwb holding its records to be
+ * DONE.  Lives on the caller's stack; protected by zl_lock.
+ */
+typedef struct zil_commit_waiter {
+	kcondvar_t	zcw_cv;		/* signalled when zcw_done is set */
+	list_node_t	zcw_node;	/* lwb->lwb_waiters linkage */
+	boolean_t	zcw_done;	/* lwb has reached LWB_STATE_DONE */
+	int		zcw_error;	/* this or an earlier lwb failed */
+	uint64_t	zcw_commit_seq;	/* lwb_commit_seq of the lwb */
+	uint64_t	zcw_errors;	/* zl_lwb_errors when notified */
+} zil_commit_waiter_t;
+
+/*
+ * Vdev flushing: as log blocks and dmu_sync()'d data blocks are written,
+ * we build up an AVL tree of the vdevs we've touched.  Each lwb flushes
+ * the vdevs collected by the time its write completes.
  */
 typedef struct zil_vdev_node {
 	uint64_t	zv_vdev;	/* vdev to be flushed */
 	avl_node_t	zv_node;	/* AVL tree linkage */
 } zil_vdev_node_t;
 
-#define	ZIL_PREV_BLKS 16
+/*
+ * Per-dataset intent log statistics, exported as the "zil-<objset>-<pool>"
+ * kstat while the log is open.
+ */
+typedef struct zil_stats {
+	kstat_named_t	zs_commits;		/* zil_commit() calls */
+	kstat_named_t	zs_commit_writers;	/* commits that filled lwbs */
+	kstat_named_t	zs_lwbs;		/* log blocks written */
+	kstat_named_t	zs_lwb_bytes_used;	/* record bytes written */
+	kstat_named_t	zs_lwb_bytes_alloc;	/* log blk bytes allocated */
+	kstat_named_t	zs_flushes;		/* vdev cache flushes issued */
+	kstat_named_t	zs_flushes_coalesced;	/* flushes left to later lwb */
+	kstat_named_t	zs_alloc_slog;		/* log blocks on a slog */
+	kstat_named_t	zs_alloc_normal;	/* log blocks in main pool */
+	kstat_named_t	zs_alloc_failed;	/* log blk alloc failures */
+} zil_stats_t;
+
+#define	ZIL_STAT_INCR(zilog, stat, val) \
+	atomic_add_64(&(zilog)->zl_stats.stat.value.ui64, (val))
+#define	ZIL_STAT_BUMP(zilog, stat)	ZIL_STAT_INCR(zilog, stat, 1)
 
 /*
  * Stable storage intent log management structure.  One per dataset.
@@ -70,7 +136,6 @@ struct zilog {
 	const zil_header_t *zl_header;	/* log header buffer */
 	objset_t	*zl_os;		/* object set we're logging */
 	zil_get_data_t	*zl_get_data;	/* callback to get object content */
-	zio_t		*zl_root_zio;	/* log writer root zio */
 	uint64_t	zl_itx_seq;	/* next in-core itx sequence number */
 	uint64_t	zl_lr_seq;	/* on-disk log record sequence number */
 	uint64_t	zl_commit_seq;	/* committed upto this number */
@@ -85,7 +150,7 @@ struct zilog {
 	uint8_t		zl_keep_first;	/* keep first log block in destroy */
 	uint8_t		zl_replay;	/* replaying records while set */
 	uint8_t		zl_stop_sync;	/* for debugging */
-	uint8_t		zl_writer;	/* boolean: write setup in progress */
+	uint8_t		zl_writer;	/* boolean: filling lwbs */
 	uint8_t		zl_logbias;	/* latency or throughput */
 	uint8_t		zl_sync;	/* synchronous or asynchronous */
 	int		zl_parse_error;	/* last zil_parse() error */
@@ -98,15 +163,24 @@ struct zilog {
 	uint64_t	zl_cur_used;	/* current commit log size used */
 	uint64_t	zl_prev_used;	/* previous commit log size used */
 	list_t		zl_lwb_list;	/* in-flight log write list */
-	kmutex_t	zl_vdev_lock;	/* protects zl_vdev_tree */
+	list_t		zl_lwb_issued;	/* ISSUED/FLUSHED lwbs, chain order */
+	list_t		zl_lwb_flushing; /* lwbs flushing, generation order */
+	uint64_t	zl_flush_gen;	/* last flush generation issued */
+	uint64_t	zl_flushed_gen;	/* generations done, all up to here */
+	uint64_t	zl_commit_rate;	/* avg bytes committed per second */
+	hrtime_t	zl_commit_time;	/* time of the last log writer pass */
+	hrtime_t	zl_lwb_latency;	/* avg lwb write and flush time */
+	uint64_t	zl_lwb_errors;	/* number of failed lwb writes */
+	uint64_t	zl_lwb_healed;	/* failures fixed by txg sync */
+	kmutex_t	zl_vdev_lock;	/* zl_vdev_tree; nests in zl_lock */
 	avl_tree_t	zl_vdev_tree;	/* vdevs to flush in zil_commit() */
 	taskq_t		*zl_clean_taskq; /* runs lwb and itx clean tasks */
 	avl_tree_t	zl_bp_tree;	/* track bps during log parse */
 	clock_t		zl_replay_time;	/* lbolt of when replay started */
 	uint64_t	zl_replay_blks;	/* number of log blocks replayed */
 	zil_header_t	zl_old_header;	/* debugging aid */
-	uint_t		zl_prev_blks[ZIL_PREV_BLKS]; /* size - sector rounded */
-	uint_t		zl_prev_rotor;	/* rotor for zl_prev[] */
+	zil_stats_t	zl_stats;	/* see zil_stats_t */
+	kstat_t		*zl_kstat;	/* zl_stats kstat, while open */
 };
 
 typedef struct zil_bp_node {
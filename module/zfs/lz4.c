@@ -0,0 +1,361 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2005, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * LZ4 compression.  This is a fast byte-oriented LZ77 coder producing the
+ * standard LZ4 block format: a sequence of
+ *
+ *	token, [literal length], literals, offset, [match length]
+ *
+ * where the high nibble of the token is the literal length and the low
+ * nibble the match length minus MINMATCH.  A nibble of 15 is followed by
+ * further length bytes, each adding up to 255, terminated by a byte that
+ * is not 255.  The offset is a 16-bit little-endian distance back into the
+ * output.  The last sequence consists of literals only, and holds at least
+ * LASTLITERALS bytes.
+ *
+ * The compressed block is preceded by its length as a 32-bit big-endian
+ * integer, since the sector padding added by zio_compress_data() cannot
+ * otherwise be told apart from the data.
+ *
+ * Incompressible data is cheap to reject: the match search skips ahead
+ * faster the longer it goes without finding a match, and compression stops
+ * as soon as the output grows beyond d_len, which zio_compress_data() sets
+ * to the smallest saving worth storing.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/byteorder.h>
+#include <sys/zio_compress.h>
+
+#define	LZ4_MINMATCH		4
+#define	LZ4_LASTLITERALS	5
+#define	LZ4_MFLIMIT		12
+#define	LZ4_MAX_DISTANCE	65535
+#define	LZ4_RUN_MASK		15
+#define	LZ4_ML_MASK		15
+
+/*
+ * 2^LZ4_HASH_LOG entries in the match finder's hash table.
+ */
+#define	LZ4_HASH_LOG		12
+#define	LZ4_HASH_SIZE		(1 << LZ4_HASH_LOG)
+
+/*
+ * After 2^LZ4_SKIP_STRENGTH consecutive failed match attempts the search
+ * steps forward two bytes at a time, then three, and so on.
+ */
+#define	LZ4_SKIP_STRENGTH	6
+
+/*
+ * The hash table is too large for the kernel stack.
+ */
+static kmem_cache_t *lz4_cache;
+
+typedef struct {
+	uint32_t v;
+} __attribute__((packed)) lz4_unaligned32_t;
+
+typedef struct {
+	uint64_t v;
+} __attribute__((packed)) lz4_unaligned64_t;
+
+#define	LZ4_READ32(p)	(((const lz4_unaligned32_t *)(p))->v)
+#define	LZ4_READ64(p)	(((const lz4_unaligned64_t *)(p))->v)
+#define	LZ4_HASH(p)	\
+	((LZ4_READ32(p) * 2654435761U) >> (32 - LZ4_HASH_LOG))
+
+/*
+ * Append a length continuation (len >= 15 has already been put in the
+ * token). The caller has checked that there is room.
+ */
+static uint8_t *
+lz4_put_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)len;
+	return (op);
+}
+
+/*
+ * Compress isize bytes of src into at most osize bytes of dst. Returns the
+ * compressed size, or 0 if it would not fit.
+ */
+static size_t
+lz4_compress_block(const uint8_t *src, uint8_t *dst, size_t isize,
+    size_t osize, uint32_t *htab)
+{
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + isize;
+	const uint8_t *mflimit = iend - LZ4_MFLIMIT;
+	const uint8_t *matchlimit = iend - LZ4_LASTLITERALS;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + osize;
+	uint8_t *token;
+	const uint8_t *ref;
+	size_t len;
+
+	if (isize < LZ4_MFLIMIT + 1)
+		goto last_literals;
+
+	bzero(htab, LZ4_HASH_SIZE * sizeof (uint32_t));
+	htab[LZ4_HASH(ip)] = 0;
+	ip++;
+
+	for (;;) {
+		uint32_t attempts = 1 << LZ4_SKIP_STRENGTH;
+		uint32_t h;
+
+		/* find a match */
+		for (;;) {
+			h = LZ4_HASH(ip);
+			ref = src + htab[h];
+			htab[h] = ip - src;
+			if (ip - ref <= LZ4_MAX_DISTANCE &&
+			    LZ4_READ32(ref) == LZ4_READ32(ip) && ref < ip)
+				break;
+			ip += attempts++ >> LZ4_SKIP_STRENGTH;
+			if (ip > mflimit)
+				goto last_literals;
+		}
+
+		/* extend it backwards */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* literals; leave room for the offset and last literals */
+		len = ip - anchor;
+		if (op + 1 + len + len / 255 + 2 + 1 + LZ4_LASTLITERALS > oend)
+			return (0);
+		token = op++;
+		if (len >= LZ4_RUN_MASK) {
+			*token = LZ4_RUN_MASK << 4;
+			op = lz4_put_length(op, len - LZ4_RUN_MASK);
+		} else {
+			*token = (uint8_t)(len << 4);
+		}
+		bcopy(anchor, op, len);
+		op += len;
+
+		/* offset */
+		*op++ = (uint8_t)(ip - ref);
+		*op++ = (uint8_t)((ip - ref) >> 8);
+
+		/* match length */
+		ip += LZ4_MINMATCH;
+		ref += LZ4_MINMATCH;
+		anchor = ip;
+		while (ip < matchlimit - 7) {
+			uint64_t diff = LZ4_READ64(ip) ^ LZ4_READ64(ref);
+			if (diff != 0) {
+#if defined(_BIG_ENDIAN)
+				ip += __builtin_clzll(diff) >> 3;
+#else
+				ip += __builtin_ctzll(diff) >> 3;
+#endif
+				goto match_end;
+			}
+			ip += 8;
+			ref += 8;
+		}
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+match_end:
+		len = ip - anchor;
+		if (op + len / 255 + 1 + LZ4_LASTLITERALS > oend)
+			return (0);
+		if (len >= LZ4_ML_MASK) {
+			*token += LZ4_ML_MASK;
+			op = lz4_put_length(op, len - LZ4_ML_MASK);
+		} else {
+			*token += (uint8_t)len;
+		}
+		anchor = ip;
+
+		if (ip > mflimit)
+			break;
+		htab[LZ4_HASH(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	len = iend - anchor;
+	if (op + 1 + len + len / 255 > oend)
+		return (0);
+	if (len >= LZ4_RUN_MASK) {
+		*op++ = LZ4_RUN_MASK << 4;
+		op = lz4_put_length(op, len - LZ4_RUN_MASK);
+	} else {
+		*op++ = (uint8_t)(len << 4);
+	}
+	bcopy(anchor, op, len);
+	op += len;
+
+	return (op - dst);
+}
+
+/*
+ * Read a length continuation. Returns B_FALSE if it runs past the input.
+ */
+static boolean_t
+lz4_get_length(const uint8_t **ipp, const uint8_t *iend, size_t *lenp)
+{
+	const uint8_t *ip = *ipp;
+	uint8_t s;
+
+	do {
+		if (ip >= iend)
+			return (B_FALSE);
+		s = *ip++;
+		*lenp += s;
+	} while (s == 255);
+
+	*ipp = ip;
+	return (B_TRUE);
+}
+
+/*
+ * Decompress isize bytes of src into at most osize bytes of dst. Every
+ * length and offset is checked, so corrupt input cannot cause reads or
+ * writes outside the buffers. Returns the decompressed size, or -1.
+ */
+static int
+lz4_decompress_block(const uint8_t *src, uint8_t *dst, size_t isize,
+    size_t osize)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + isize;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + osize;
+	const uint8_t *ref;
+	size_t len, off;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* literals */
+		len = token >> 4;
+		if (len == LZ4_RUN_MASK && !lz4_get_length(&ip, iend, &len))
+			return (-1);
+		if (len > iend - ip || len > oend - op)
+			return (-1);
+		bcopy(ip, op, len);
+		ip += len;
+		op += len;
+
+		if (ip == iend)
+			break;
+
+		/* match */
+		if (iend - ip < 2)
+			return (-1);
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > op - dst)
+			return (-1);
+		ref = op - off;
+
+		len = token & LZ4_ML_MASK;
+		if (len == LZ4_ML_MASK && !lz4_get_length(&ip, iend, &len))
+			return (-1);
+		len += LZ4_MINMATCH;
+		if (len > oend - op)
+			return (-1);
+
+		if (off >= 8) {
+			for (; len >= 8; len -= 8, op += 8, ref += 8)
+				((lz4_unaligned64_t *)op)->v = LZ4_READ64(ref);
+		}
+		while (len-- != 0)
+			*op++ = *ref++;
+	}
+
+	return (op - dst);
+}
+
+/*ARGSUSED*/
+size_t
+lz4_compress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
+{
+	uint8_t *dst = d_start;
+	uint32_t *htab;
+	size_t bufsiz;
+
+	if (d_len <= sizeof (uint32_t))
+		return (s_len);
+
+	htab = kmem_cache_alloc(lz4_cache, KM_SLEEP);
+	bufsiz = lz4_compress_block(s_start, dst + sizeof (uint32_t), s_len,
+	    d_len - sizeof (uint32_t), htab);
+	kmem_cache_free(lz4_cache, htab);
+
+	if (bufsiz == 0)
+		return (s_len);
+
+	*(uint32_t *)dst = BE_32((uint32_t)bufsiz);
+
+	return (bufsiz + sizeof (uint32_t));
+}
+
+/*ARGSUSED*/
+int
+lz4_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
+{
+	const uint8_t *src = s_start;
+	uint32_t bufsiz;
+
+	if (s_len < sizeof (uint32_t))
+		return (-1);
+
+	bufsiz = BE_IN32(src);
+	if (bufsiz > s_len - sizeof (uint32_t))
+		return (-1);
+
+	return (lz4_decompress_block(src + sizeof (uint32_t), d_start,
+	    bufsiz, d_len) < 0 ? -1 : 0);
+}
+
+void
+lz4_init(void)
+{
+	lz4_cache = kmem_cache_create("lz4_cache",
+	    LZ4_HASH_SIZE * sizeof (uint32_t), 0, NULL, NULL, NULL, NULL,
+	    NULL, 0);
+}
+
+void
+lz4_fini(void)
+{
+	if (lz4_cache != NULL) {
+		kmem_cache_destroy(lz4_cache);
+		lz4_cache = NULL;
+	}
+}
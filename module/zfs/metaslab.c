@@ -63,30 +63,76 @@ int metaslab_df_free_pct = 4;
 uint64_t metaslab_min_alloc_size = DMU_MAX_ACCESS;
 
 /*
- * Max number of space_maps to prefetch.
+ * Load the space maps of the best metaslabs of each group in the
+ * background, so that allocations don't have to wait for space_map_load().
  */
-int metaslab_prefetch_limit = SPA_DVAS_PER_BP;
+int metaslab_preload_enabled = B_TRUE;
+
+/*
+ * Max number of metaslabs per group to preload.
+ */
+int metaslab_preload_limit = SPA_DVAS_PER_BP;
+
+/*
+ * Number of txgs a preloaded space map stays loaded without being used.
+ */
+int metaslab_unload_delay = TXG_SIZE * 2;
 
 /*
  * Percentage bonus multiplier for metaslabs that are in the bonus area.
  */
 int metaslab_smo_bonus_pct = 150;
 
+/*
+ * Freed extents smaller than this are not worth a TRIM.
+ */
+uint64_t zfs_trim_min_extent = 32ULL << 10;
+
+/*
+ * Max number of allocation cursors per metaslab class; each class gets
+ * one per CPU up to this limit.
+ */
+int metaslab_alloc_cursors = 16;
+
+static metaslab_class_stats_t metaslab_class_stats_template = {
+	{ "allocs",			KSTAT_DATA_UINT64 },
+	{ "alloc_failures",		KSTAT_DATA_UINT64 },
+	{ "group_misses",		KSTAT_DATA_UINT64 },
+	{ "retries",			KSTAT_DATA_UINT64 },
+	{ "lock_waits",			KSTAT_DATA_UINT64 },
+	{ "lock_wait_ns",		KSTAT_DATA_UINT64 },
+};
+
 /*
  * ==========================================================================
  * Metaslab classes
  * ==========================================================================
  */
 metaslab_class_t *
-metaslab_class_create(spa_t *spa, space_map_ops_t *ops)
+metaslab_class_create(spa_t *spa, space_map_ops_t *ops, const char *name)
 {
 	metaslab_class_t *mc;
+	char kname[KSTAT_STRLEN];
 
 	mc = kmem_zalloc(sizeof (metaslab_class_t), KM_SLEEP);
 
 	mc->mc_spa = spa;
 	mc->mc_rotor = NULL;
 	mc->mc_ops = ops;
+	mc->mc_ncursors = MAX(1, MIN(max_ncpus, metaslab_alloc_cursors));
+	mc->mc_cursors = kmem_zalloc(mc->mc_ncursors *
+	    sizeof (metaslab_cursor_t), KM_SLEEP);
+
+	mc->mc_stats = metaslab_class_stats_template;
+	(void) snprintf(kname, KSTAT_STRLEN, "metaslab-%s-%s",
+	    name, spa_name(spa));
+	mc->mc_kstat = kstat_create("zfs", 0, kname, "misc",
+	    KSTAT_TYPE_NAMED, sizeof (metaslab_class_stats_t) /
+	    sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+	if (mc->mc_kstat != NULL) {
+		mc->mc_kstat->ks_data = &mc->mc_stats;
+		kstat_install(mc->mc_kstat);
+	}
 
 	return (mc);
 }
@@ -100,9 +146,44 @@ metaslab_class_destroy(metaslab_class_t *mc)
 	ASSERT(mc->mc_space == 0);
 	ASSERT(mc->mc_dspace == 0);
 
+	if (mc->mc_kstat != NULL)
+		kstat_delete(mc->mc_kstat);
+	kmem_free(mc->mc_cursors, mc->mc_ncursors * sizeof (metaslab_cursor_t));
 	kmem_free(mc, sizeof (metaslab_class_t));
 }
 
+/*
+ * Space the allocation cursors evenly around the ring of active groups.
+ * Called with SCL_ALLOC held as writer whenever the ring changes, so no
+ * allocation is looking at the cursors.
+ */
+static void
+metaslab_class_spread_cursors(metaslab_class_t *mc)
+{
+	metaslab_group_t *mg;
+	int ngroups = 0;
+	int c, g;
+
+	ASSERT(spa_config_held(mc->mc_spa, SCL_ALLOC, RW_WRITER));
+
+	if ((mg = mc->mc_rotor) != NULL) {
+		do {
+			ngroups++;
+		} while ((mg = mg->mg_next) != mc->mc_rotor);
+	}
+
+	for (c = 0, g = 0, mg = mc->mc_rotor; c < mc->mc_ncursors; c++) {
+		metaslab_cursor_t *mcc = &mc->mc_cursors[c];
+
+		while (mg != NULL && g < c * ngroups / mc->mc_ncursors) {
+			mg = mg->mg_next;
+			g++;
+		}
+		mcc->mcc_rotor = mg;
+		mcc->mcc_aliquot = 0;
+	}
+}
+
 int
 metaslab_class_validate(metaslab_class_t *mc)
 {
@@ -204,6 +285,8 @@ metaslab_group_create(metaslab_class_t *mc, vdev_t *vd)
 	mg->mg_vd = vd;
 	mg->mg_class = mc;
 	mg->mg_activation_count = 0;
+	mg->mg_taskq = taskq_create("metaslab_group_taskq",
+	    metaslab_preload_limit, minclsyspri, 1, INT_MAX, 0);
 
 	return (mg);
 }
@@ -220,6 +303,7 @@ metaslab_group_destroy(metaslab_group_t *mg)
 	 */
 	ASSERT(mg->mg_activation_count <= 0);
 
+	taskq_destroy(mg->mg_taskq);
 	avl_destroy(&mg->mg_metaslab_tree);
 	mutex_destroy(&mg->mg_lock);
 	kmem_free(mg, sizeof (metaslab_group_t));
@@ -254,6 +338,7 @@ metaslab_group_activate(metaslab_group_t *mg)
 		mgnext->mg_prev = mg;
 	}
 	mc->mc_rotor = mg;
+	metaslab_class_spread_cursors(mc);
 }
 
 void
@@ -285,6 +370,7 @@ metaslab_group_passivate(metaslab_group_t *mg)
 
 	mg->mg_prev = NULL;
 	mg->mg_next = NULL;
+	metaslab_class_spread_cursors(mc);
 }
 
 static void
@@ -698,6 +784,24 @@ space_map_ops_t *zfs_metaslab_ops = &metaslab_ndf_ops;
  * Metaslabs
  * ==========================================================================
  */
+static void
+metaslab_histogram_load(metaslab_t *msp, objset_t *mos)
+{
+	dmu_object_info_t doi;
+	dmu_buf_t *db;
+
+	if (dmu_bonus_hold(mos, msp->ms_smo_syncing.smo_object,
+	    FTAG, &db) != 0)
+		return;
+
+	dmu_object_info_from_db(db, &doi);
+	if (doi.doi_bonus_size >= SPACE_MAP_BONUS_SIZE) {
+		bcopy((char *)db->db_data + sizeof (space_map_obj_t),
+		    msp->ms_histogram, sizeof (msp->ms_histogram));
+	}
+	dmu_buf_rele(db, FTAG);
+}
+
 metaslab_t *
 metaslab_init(metaslab_group_t *mg, space_map_obj_t *smo,
 	uint64_t start, uint64_t size, uint64_t txg)
@@ -710,6 +814,9 @@ metaslab_init(metaslab_group_t *mg, space_map_obj_t *smo,
 
 	msp->ms_smo_syncing = *smo;
 
+	if (smo->smo_object != 0)
+		metaslab_histogram_load(msp, spa_meta_objset(vd->vdev_spa));
+
 	/*
 	 * We create the main space map here, but we don't create the
 	 * allocmaps and freemaps until metaslab_sync_done().  This serves
@@ -736,7 +843,7 @@ metaslab_init(metaslab_group_t *mg, space_map_obj_t *smo,
 	 * does not become available until after this txg has synced.
 	 */
 	if (txg <= TXG_INITIAL)
-		metaslab_sync_done(msp, 0);
+		metaslab_sync_done(msp, 0, NULL, NULL);
 
 	if (txg != 0) {
 		vdev_dirty(vd, 0, NULL, txg);
@@ -770,6 +877,18 @@ metaslab_fini(metaslab_t *msp)
 	for (t = 0; t < TXG_DEFER_SIZE; t++)
 		space_map_destroy(&msp->ms_defermap[t]);
 
+	/*
+	 * The final txgs may have left trimmed extents waiting for one
+	 * more metaslab_sync_done(); they're free on disk, so just drop them.
+	 */
+	if (msp->ms_trimmap.sm_space != 0) {
+		vdev_space_update(mg->mg_vd, -msp->ms_trimmap.sm_space,
+		    -msp->ms_trimmap.sm_space, 0);
+		msp->ms_deferspace -= msp->ms_trimmap.sm_space;
+		space_map_vacate(&msp->ms_trimmap, NULL, NULL);
+	}
+	space_map_destroy(&msp->ms_trimmap);
+
 	ASSERT3S(msp->ms_deferspace, ==, 0);
 
 	mutex_exit(&msp->ms_lock);
@@ -783,6 +902,32 @@ metaslab_fini(metaslab_t *msp)
 #define	METASLAB_ACTIVE_MASK		\
 	(METASLAB_WEIGHT_PRIMARY | METASLAB_WEIGHT_SECONDARY)
 
+/*
+ * Return an upper bound on the largest free segment of the metaslab,
+ * taken from its free segment histogram, or 0 if it has no histogram.
+ */
+static uint64_t
+metaslab_segment_maxsize(metaslab_t *msp)
+{
+	space_map_t *sm = &msp->ms_map;
+	uint64_t *histogram;
+	int i;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	histogram = sm->sm_loaded ? sm->sm_histogram : msp->ms_histogram;
+
+	for (i = SPACE_MAP_HISTOGRAM_SIZE - 1; i >= 0; i--) {
+		if (histogram[i] == 0)
+			continue;
+		if (i == SPACE_MAP_HISTOGRAM_SIZE - 1)
+			return (UINT64_MAX);
+		return (1ULL << (i + 1 + sm->sm_shift));
+	}
+
+	return (0);
+}
+
 static uint64_t
 metaslab_weight(metaslab_t *msp)
 {
@@ -790,7 +935,7 @@ metaslab_weight(metaslab_t *msp)
 	space_map_t *sm = &msp->ms_map;
 	space_map_obj_t *smo = &msp->ms_smo;
 	vdev_t *vd = mg->mg_vd;
-	uint64_t weight, space;
+	uint64_t weight, space, maxsize;
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
 
@@ -822,6 +967,17 @@ metaslab_weight(metaslab_t *msp)
 	ASSERT(weight >= space &&
 	    weight <= 2 * (metaslab_smo_bonus_pct / 100) * space);
 
+	/*
+	 * Free space overstates a metaslab which has been chopped up into
+	 * small segments: it would be picked, loaded, and then fail the
+	 * allocation.  If its largest segment is smaller than
+	 * metaslab_min_alloc_size, weigh it by that segment instead, which
+	 * also keeps it from being tried for anything bigger.
+	 */
+	maxsize = metaslab_segment_maxsize(msp);
+	if (maxsize != 0 && maxsize < metaslab_min_alloc_size)
+		weight = MIN(weight, maxsize);
+
 	if (sm->sm_loaded && !sm->sm_ops->smop_fragmented(sm)) {
 		/*
 		 * If this metaslab is one we're actively using, adjust its
@@ -833,61 +989,107 @@ metaslab_weight(metaslab_t *msp)
 	return (weight);
 }
 
+static int
+metaslab_load(metaslab_t *msp)
+{
+	space_map_t *sm = &msp->ms_map;
+	space_map_ops_t *sm_ops = msp->ms_group->mg_class->mc_ops;
+	int error, t;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	error = space_map_load(sm, sm_ops, SM_FREE, &msp->ms_smo,
+	    spa_meta_objset(msp->ms_group->mg_vd->vdev_spa));
+	if (error)
+		return (error);
+
+	for (t = 0; t < TXG_DEFER_SIZE; t++)
+		space_map_walk(&msp->ms_defermap[t], space_map_claim, sm);
+	space_map_walk(&msp->ms_trimmap, space_map_claim, sm);
+
+	return (0);
+}
+
+static void
+metaslab_preload(void *arg)
+{
+	metaslab_t *msp = arg;
+	spa_t *spa = msp->ms_group->mg_vd->vdev_spa;
+
+	mutex_enter(&msp->ms_lock);
+	space_map_load_wait(&msp->ms_map);
+	if (!msp->ms_map.sm_loaded)
+		(void) metaslab_load(msp);
+
+	/*
+	 * Keep the map loaded long enough for the allocator to get to it.
+	 */
+	msp->ms_access_txg = spa_syncing_txg(spa) + metaslab_unload_delay + 1;
+	mutex_exit(&msp->ms_lock);
+}
+
+/*
+ * Load the space maps of the next metaslabs we're likely to allocate
+ * from, so that metaslab_activate() finds them already loaded.
+ */
 static void
-metaslab_prefetch(metaslab_group_t *mg)
+metaslab_group_preload(metaslab_group_t *mg)
 {
 	spa_t *spa = mg->mg_vd->vdev_spa;
 	metaslab_t *msp;
 	avl_tree_t *t = &mg->mg_metaslab_tree;
-	int m;
+	int m = 0;
+
+	if (!metaslab_preload_enabled || spa_shutting_down(spa))
+		return;
 
 	mutex_enter(&mg->mg_lock);
 
 	/*
-	 * Prefetch the next potential metaslabs
+	 * A passivated group is about to go away; don't start work on it.
 	 */
-	for (msp = avl_first(t), m = 0; msp; msp = AVL_NEXT(t, msp), m++) {
-		space_map_t *sm = &msp->ms_map;
-		space_map_obj_t *smo = &msp->ms_smo;
+	if (mg->mg_activation_count <= 0) {
+		mutex_exit(&mg->mg_lock);
+		return;
+	}
 
-		/* If we have reached our prefetch limit then we're done */
-		if (m >= metaslab_prefetch_limit)
+	for (msp = avl_first(t); msp; msp = AVL_NEXT(t, msp)) {
+		/* If we have reached our preload limit then we're done */
+		if (++m > metaslab_preload_limit)
 			break;
 
-		if (!sm->sm_loaded && smo->smo_object != 0) {
-			mutex_exit(&mg->mg_lock);
-			dmu_prefetch(spa_meta_objset(spa), smo->smo_object,
-			    0ULL, smo->smo_objsize);
-			mutex_enter(&mg->mg_lock);
-		}
+		VERIFY(taskq_dispatch(mg->mg_taskq, metaslab_preload,
+		    msp, TQ_SLEEP) != 0);
 	}
 	mutex_exit(&mg->mg_lock);
 }
 
+/*
+ * Wait for the preloads of a group to finish.  The preloads read the MOS,
+ * so this must be called without holding any of the spa config locks.
+ */
+void
+metaslab_group_preload_wait(metaslab_group_t *mg)
+{
+	taskq_wait(mg->mg_taskq);
+}
+
 static int
 metaslab_activate(metaslab_t *msp, uint64_t activation_weight, uint64_t size)
 {
 	metaslab_group_t *mg = msp->ms_group;
 	space_map_t *sm = &msp->ms_map;
-	space_map_ops_t *sm_ops = msp->ms_group->mg_class->mc_ops;
-	int t;
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
 
 	if ((msp->ms_weight & METASLAB_ACTIVE_MASK) == 0) {
 		space_map_load_wait(sm);
 		if (!sm->sm_loaded) {
-			int error = space_map_load(sm, sm_ops, SM_FREE,
-			    &msp->ms_smo,
-			    spa_meta_objset(msp->ms_group->mg_vd->vdev_spa));
+			int error = metaslab_load(msp);
 			if (error)  {
 				metaslab_group_sort(msp->ms_group, msp, 0);
 				return (error);
 			}
-			for (t = 0; t < TXG_DEFER_SIZE; t++)
-				space_map_walk(&msp->ms_defermap[t],
-				    space_map_claim, sm);
-
 		}
 
 		/*
@@ -942,6 +1144,7 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 	space_map_t *freed_map = &msp->ms_freemap[TXG_CLEAN(txg) & TXG_MASK];
 	space_map_t *sm = &msp->ms_map;
 	space_map_obj_t *smo = &msp->ms_smo_syncing;
+	dmu_object_info_t doi;
 	dmu_buf_t *db;
 	dmu_tx_t *tx;
 	int t;
@@ -967,7 +1170,7 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 		ASSERT(smo->smo_alloc == 0);
 		smo->smo_object = dmu_object_alloc(mos,
 		    DMU_OT_SPACE_MAP, 1 << SPACE_MAP_BLOCKSHIFT,
-		    DMU_OT_SPACE_MAP_HEADER, sizeof (*smo), tx);
+		    DMU_OT_SPACE_MAP_HEADER, SPACE_MAP_BONUS_SIZE, tx);
 		ASSERT(smo->smo_object != 0);
 		dmu_write(mos, vd->vdev_ms_array, sizeof (uint64_t) *
 		    (sm->sm_start >> vd->vdev_ms_shift),
@@ -978,17 +1181,17 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 
 	space_map_walk(freemap, space_map_add, freed_map);
 
-	if (sm->sm_loaded && spa_sync_pass(spa) == 1 && smo->smo_objsize >=
-	    2 * sizeof (uint64_t) * avl_numnodes(&sm->sm_root)) {
+	if (spa_sync_pass(spa) == 1 && space_map_should_condense(sm, smo)) {
 		/*
-		 * The in-core space map representation is twice as compact
-		 * as the on-disk one, so it's time to condense the latter
-		 * by generating a pure allocmap from first principles.
+		 * The on-disk space map has grown well past what it would
+		 * take to write out the in-core one (see zfs_condense_pct),
+		 * so it's time to condense it by generating a pure allocmap
+		 * from first principles.
 		 *
 		 * This metaslab is 100% allocated,
 		 * minus the content of the in-core map (sm),
 		 * minus what's been freed this txg (freed_map),
-		 * minus deferred frees (ms_defermap[]),
+		 * minus deferred frees (ms_defermap[] and ms_trimmap),
 		 * minus allocations from txgs in the future
 		 * (because they haven't been committed yet).
 		 */
@@ -1003,6 +1206,7 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 		for (t = 0; t < TXG_DEFER_SIZE; t++)
 			space_map_walk(&msp->ms_defermap[t],
 			    space_map_remove, allocmap);
+		space_map_walk(&msp->ms_trimmap, space_map_remove, allocmap);
 
 		for (t = 1; t < TXG_CONCURRENT_STATES; t++)
 			space_map_walk(&msp->ms_allocmap[(txg + t) & TXG_MASK],
@@ -1013,6 +1217,19 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 		mutex_enter(&msp->ms_lock);
 	}
 
+	/*
+	 * Refresh the histogram stored with the space map.  A loaded map
+	 * has an exact one.  Otherwise this txg's frees are counted as new
+	 * segments; any merging they do with existing free space only makes
+	 * the real segments larger than what we record.  Only this function
+	 * changes ms_histogram, so it can be read below without ms_lock.
+	 */
+	if (sm->sm_loaded)
+		bcopy(sm->sm_histogram, msp->ms_histogram,
+		    sizeof (msp->ms_histogram));
+	else if (metaslab_segment_maxsize(msp) != 0)
+		space_map_histogram_add(freemap, msp->ms_histogram);
+
 	space_map_sync(allocmap, SM_ALLOC, smo, mos, tx);
 	space_map_sync(freemap, SM_FREE, smo, mos, tx);
 
@@ -1020,29 +1237,94 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 
 	VERIFY(0 == dmu_bonus_hold(mos, smo->smo_object, FTAG, &db));
 	dmu_buf_will_dirty(db, tx);
-	ASSERT3U(db->db_size, >=, sizeof (*smo));
+	dmu_object_info_from_db(db, &doi);
+	if (doi.doi_bonus_size < SPACE_MAP_BONUS_SIZE)
+		VERIFY(0 == dmu_set_bonus(db, SPACE_MAP_BONUS_SIZE, tx));
+	ASSERT3U(db->db_size, >=, SPACE_MAP_BONUS_SIZE);
 	bcopy(smo, db->db_data, sizeof (*smo));
+	bcopy(msp->ms_histogram, (char *)db->db_data + sizeof (*smo),
+	    sizeof (msp->ms_histogram));
 	dmu_buf_rele(db, FTAG);
 
 	dmu_tx_commit(tx);
 }
 
+/*
+ * Move the oldest deferred frees worth a TRIM, at most *limit bytes of
+ * them, from defer_map to ms_trimmap.  Adjacent frees have already been
+ * merged into a single extent by the space map.  Returns the extents,
+ * which the caller trims once it has dropped ms_lock.
+ */
+static space_seg_t *
+metaslab_trim_hold(metaslab_t *msp, space_map_t *defer_map, uint64_t *limit,
+    int *nsegs)
+{
+	avl_tree_t *avl = &defer_map->sm_root;
+	space_seg_t *segs, *ss, *next;
+	uint64_t left = *limit;
+	int i, n = 0;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+	ASSERT(msp->ms_trimmap.sm_space == 0);
+
+	for (ss = avl_first(avl); ss != NULL; ss = AVL_NEXT(avl, ss)) {
+		uint64_t size = ss->ss_end - ss->ss_start;
+
+		if (size < zfs_trim_min_extent)
+			continue;
+		if (size > left)
+			break;
+		left -= size;
+		n++;
+	}
+
+	*nsegs = n;
+	if (n == 0)
+		return (NULL);
+
+	segs = kmem_alloc(n * sizeof (space_seg_t), KM_SLEEP);
+
+	for (ss = avl_first(avl), i = 0; i < n; ss = next) {
+		uint64_t size = ss->ss_end - ss->ss_start;
+
+		next = AVL_NEXT(avl, ss);
+
+		if (size < zfs_trim_min_extent)
+			continue;
+
+		segs[i].ss_start = ss->ss_start;
+		segs[i].ss_end = ss->ss_end;
+		space_map_remove(defer_map, segs[i].ss_start, size);
+		space_map_add(&msp->ms_trimmap, segs[i].ss_start, size);
+		*limit -= size;
+		i++;
+	}
+
+	return (segs);
+}
+
 /*
  * Called after a transaction group has completely synced to mark
- * all of the metaslab's free space as usable.
+ * all of the metaslab's free space as usable.  If zio is non-NULL, the
+ * oldest deferred frees are trimmed as its children and held out of the
+ * allocator until the next txg, which must not call us until they have
+ * completed; see vdev_sync_done().
  */
 void
-metaslab_sync_done(metaslab_t *msp, uint64_t txg)
+metaslab_sync_done(metaslab_t *msp, uint64_t txg, zio_t *zio,
+    uint64_t *trim_limit)
 {
 	space_map_obj_t *smo = &msp->ms_smo;
 	space_map_obj_t *smosync = &msp->ms_smo_syncing;
 	space_map_t *sm = &msp->ms_map;
 	space_map_t *freed_map = &msp->ms_freemap[TXG_CLEAN(txg) & TXG_MASK];
 	space_map_t *defer_map = &msp->ms_defermap[txg % TXG_DEFER_SIZE];
+	space_map_t *trim_map = &msp->ms_trimmap;
 	metaslab_group_t *mg = msp->ms_group;
 	vdev_t *vd = mg->mg_vd;
+	space_seg_t *trims = NULL;
 	int64_t alloc_delta, defer_delta;
-	int t;
+	int t, ntrims = 0;
 
 	ASSERT(!vd->vdev_ishole);
 
@@ -1064,27 +1346,39 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 			space_map_create(&msp->ms_defermap[t], sm->sm_start,
 			    sm->sm_size, sm->sm_shift, sm->sm_lock);
 
+		space_map_create(trim_map, sm->sm_start, sm->sm_size,
+		    sm->sm_shift, sm->sm_lock);
+
 		vdev_space_update(vd, 0, 0, sm->sm_size);
 	}
 
-	alloc_delta = smosync->smo_alloc - smo->smo_alloc;
-	defer_delta = freed_map->sm_space - defer_map->sm_space;
-
-	vdev_space_update(vd, alloc_delta + defer_delta, defer_delta, 0);
-
 	ASSERT(msp->ms_allocmap[txg & TXG_MASK].sm_space == 0);
 	ASSERT(msp->ms_freemap[txg & TXG_MASK].sm_space == 0);
 
 	/*
 	 * If there's a space_map_load() in progress, wait for it to complete
 	 * so that we have a consistent view of the in-core space map.
-	 * Then, add defer_map (oldest deferred frees) to this map and
-	 * transfer freed_map (this txg's frees) to defer_map.
+	 * Then, add trim_map (last txg's trimmed frees, whose TRIMs are done)
+	 * and what's left of defer_map (oldest deferred frees) once the
+	 * extents to trim now are held back, to this map, and transfer
+	 * freed_map (this txg's frees) to defer_map.
 	 */
 	space_map_load_wait(sm);
+
+	alloc_delta = smosync->smo_alloc - smo->smo_alloc;
+	defer_delta = freed_map->sm_space - defer_map->sm_space -
+	    trim_map->sm_space;
+
+	space_map_vacate(trim_map, sm->sm_loaded ? space_map_free : NULL, sm);
+	if (zio != NULL && defer_map->sm_space != 0) {
+		trims = metaslab_trim_hold(msp, defer_map, trim_limit, &ntrims);
+		defer_delta += trim_map->sm_space;
+	}
 	space_map_vacate(defer_map, sm->sm_loaded ? space_map_free : NULL, sm);
 	space_map_vacate(freed_map, space_map_add, defer_map);
 
+	vdev_space_update(vd, alloc_delta + defer_delta, defer_delta, 0);
+
 	*smo = *smosync;
 
 	msp->ms_deferspace += defer_delta;
@@ -1110,6 +1404,9 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 			if (msp->ms_allocmap[(txg + t) & TXG_MASK].sm_space)
 				evictable = 0;
 
+		if (msp->ms_access_txg >= txg)
+			evictable = 0;
+
 		if (evictable && !metaslab_debug)
 			space_map_unload(sm);
 	}
@@ -1117,6 +1414,14 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	metaslab_group_sort(mg, msp, metaslab_weight(msp));
 
 	mutex_exit(&msp->ms_lock);
+
+	for (t = 0; t < ntrims; t++)
+		zio_nowait(zio_trim(zio, vd->vdev_spa, vd, trims[t].ss_start,
+		    trims[t].ss_end - trims[t].ss_start, ZIO_FLAG_CANFAIL |
+		    ZIO_FLAG_DONT_PROPAGATE | ZIO_FLAG_DONT_RETRY));
+
+	if (trims != NULL)
+		kmem_free(trims, ntrims * sizeof (space_seg_t));
 }
 
 void
@@ -1141,9 +1446,9 @@ metaslab_sync_reassess(metaslab_group_t *mg)
 	}
 
 	/*
-	 * Prefetch the next potential metaslabs
+	 * Preload the next potential metaslabs
 	 */
-	metaslab_prefetch(mg);
+	metaslab_group_preload(mg);
 }
 
 static uint64_t
@@ -1163,10 +1468,29 @@ metaslab_distance(metaslab_t *msp, dva_t *dva)
 	return (0);
 }
 
+/*
+ * Take a lock on the allocation path, accounting for the time spent
+ * waiting for it if it is contended.
+ */
+static void
+metaslab_lock_enter(metaslab_class_t *mc, kmutex_t *lock)
+{
+	hrtime_t start;
+
+	if (mutex_tryenter(lock))
+		return;
+
+	start = gethrtime();
+	mutex_enter(lock);
+	METASLAB_STAT_BUMP(mc, mcs_lock_waits);
+	METASLAB_STAT_INCR(mc, mcs_lock_wait_ns, gethrtime() - start);
+}
+
 static uint64_t
 metaslab_group_alloc(metaslab_group_t *mg, uint64_t size, uint64_t txg,
     uint64_t min_distance, dva_t *dva, int d)
 {
+	metaslab_class_t *mc = mg->mg_class;
 	metaslab_t *msp = NULL;
 	uint64_t offset = -1ULL;
 	avl_tree_t *t = &mg->mg_metaslab_tree;
@@ -1185,7 +1509,11 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t size, uint64_t txg,
 	for (;;) {
 		boolean_t was_active;
 
-		mutex_enter(&mg->mg_lock);
+		/* Every pass after the first retries a lost race */
+		if (msp != NULL)
+			METASLAB_STAT_BUMP(mc, mcs_retries);
+
+		metaslab_lock_enter(mc, &mg->mg_lock);
 		for (msp = avl_first(t); msp; msp = AVL_NEXT(t, msp)) {
 			if (msp->ms_weight < size) {
 				mutex_exit(&mg->mg_lock);
@@ -1210,7 +1538,7 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t size, uint64_t txg,
 		if (msp == NULL)
 			return (-1ULL);
 
-		mutex_enter(&msp->ms_lock);
+		metaslab_lock_enter(mc, &msp->ms_lock);
 
 		/*
 		 * Ensure that the metaslab we have selected is still
@@ -1263,6 +1591,7 @@ static int
 metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
     dva_t *dva, int d, dva_t *hintdva, uint64_t txg, int flags)
 {
+	metaslab_cursor_t *mcc;
 	metaslab_group_t *mg, *rotor;
 	vdev_t *vd;
 	int dshift = 3;
@@ -1282,10 +1611,11 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 		return (ENOSPC);
 
 	/*
-	 * Start at the rotor and loop through all mgs until we find something.
-	 * Note that there's no locking on mc_rotor or mc_aliquot because
-	 * nothing actually breaks if we miss a few updates -- we just won't
-	 * allocate quite as evenly.  It all balances out over time.
+	 * Start at this CPU's cursor and loop through all mgs until we find
+	 * something.  Note that there's no locking on mcc_rotor or
+	 * mcc_aliquot because nothing actually breaks if we miss a few
+	 * updates -- we just won't allocate quite as evenly.  It all
+	 * balances out over time.
 	 *
 	 * If we are doing ditto or log blocks, try to spread them across
 	 * consecutive vdevs.  If we're forced to reuse a vdev before we've
@@ -1303,6 +1633,9 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 	 * way, we can hope for locality in vdev_cache, plus it makes our
 	 * fault domains something tractable.
 	 */
+	mcc = &mc->mc_cursors[CPU_SEQID % mc->mc_ncursors];
+	ASSERT(mcc->mcc_rotor != NULL);
+
 	if (hintdva) {
 		vd = vdev_lookup_top(spa, DVA_GET_VDEV(&hintdva[d]));
 
@@ -1318,13 +1651,13 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 			    mg->mg_next != NULL)
 				mg = mg->mg_next;
 		} else {
-			mg = mc->mc_rotor;
+			mg = mcc->mcc_rotor;
 		}
 	} else if (d != 0) {
 		vd = vdev_lookup_top(spa, DVA_GET_VDEV(&dva[d - 1]));
 		mg = vd->vdev_mg->mg_next;
 	} else {
-		mg = mc->mc_rotor;
+		mg = mcc->mcc_rotor;
 	}
 
 	/*
@@ -1332,7 +1665,7 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 	 * metaslab group that has been passivated, just follow the rotor.
 	 */
 	if (mg->mg_class != mc || mg->mg_activation_count <= 0)
-		mg = mc->mc_rotor;
+		mg = mcc->mcc_rotor;
 
 	rotor = mg;
 top:
@@ -1384,7 +1717,7 @@ top:
 			 * over- or under-used relative to the pool,
 			 * and set an allocation bias to even it out.
 			 */
-			if (mc->mc_aliquot == 0) {
+			if (mcc->mcc_aliquot == 0) {
 				vdev_stat_t *vs = &vd->vdev_stat;
 				int64_t vu, cu;
 
@@ -1402,12 +1735,14 @@ top:
 				    (int64_t)mg->mg_aliquot) / (1024 * 4);
 			}
 
-			if (atomic_add_64_nv(&mc->mc_aliquot, asize) >=
+			if (atomic_add_64_nv(&mcc->mcc_aliquot, asize) >=
 			    mg->mg_aliquot + mg->mg_bias) {
-				mc->mc_rotor = mg->mg_next;
-				mc->mc_aliquot = 0;
+				mcc->mcc_rotor = mg->mg_next;
+				mcc->mcc_aliquot = 0;
 			}
 
+			METASLAB_STAT_BUMP(mc, mcs_allocs);
+
 			DVA_SET_VDEV(&dva[d], vd->vdev_id);
 			DVA_SET_OFFSET(&dva[d], offset);
 			DVA_SET_GANG(&dva[d], !!(flags & METASLAB_GANG_HEADER));
@@ -1416,8 +1751,9 @@ top:
 			return (0);
 		}
 next:
-		mc->mc_rotor = mg->mg_next;
-		mc->mc_aliquot = 0;
+		METASLAB_STAT_BUMP(mc, mcs_group_misses);
+		mcc->mcc_rotor = mg->mg_next;
+		mcc->mcc_aliquot = 0;
 	} while ((mg = mg->mg_next) != rotor);
 
 	if (!all_zero) {
@@ -1434,6 +1770,8 @@ next:
 
 	bzero(&dva[d], sizeof (dva_t));
 
+	METASLAB_STAT_BUMP(mc, mcs_alloc_failures);
+
 	return (ENOSPC);
 }
 
@@ -1627,3 +1965,20 @@ metaslab_claim(spa_t *spa, const blkptr_t *bp, uint64_t txg)
 
 	return (error);
 }
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_trim_min_extent, ulong, 0644);
+MODULE_PARM_DESC(zfs_trim_min_extent, "Min freed extent worth a TRIM");
+
+module_param(metaslab_preload_enabled, int, 0644);
+MODULE_PARM_DESC(metaslab_preload_enabled, "Preload potential metaslabs");
+
+module_param(metaslab_preload_limit, int, 0644);
+MODULE_PARM_DESC(metaslab_preload_limit, "Max metaslabs preloaded per group");
+
+module_param(metaslab_unload_delay, int, 0644);
+MODULE_PARM_DESC(metaslab_unload_delay, "Txgs a preloaded map stays loaded");
+
+module_param(metaslab_alloc_cursors, int, 0644);
+MODULE_PARM_DESC(metaslab_alloc_cursors, "Max allocation cursors per class");
+#endif
@@ -0,0 +1,248 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/multilist.h>
+
+/*
+ * See multilist.h for an overview.
+ *
+ * multilist_insert() and multilist_remove() take the sublist lock
+ * themselves, unless the caller already holds it. This lets a caller
+ * that is walking one multilist under a sublist lock move objects to and
+ * from it, as the ARC does when it evicts a buffer to a ghost state.
+ * When two sublist locks are held at once, they must belong to different
+ * multilists, and every caller must take them in the same order.
+ */
+
+static multilist_sublist_t *
+multilist_sublist_for(multilist_t *ml, void *obj)
+{
+	unsigned int idx = ml->ml_index_func(ml, obj);
+
+	ASSERT3U(idx, <, ml->ml_num_sublists);
+	return (&ml->ml_sublists[idx]);
+}
+
+static void
+multilist_sublist_enter(multilist_sublist_t *mls)
+{
+	if (!mutex_tryenter(&mls->mls_lock)) {
+		mls->mls_contended++;
+		mutex_enter(&mls->mls_lock);
+	}
+}
+
+void
+multilist_create(multilist_t *ml, size_t size, size_t offset,
+    unsigned int num, multilist_sublist_index_func_t *index_func)
+{
+	int i;
+
+	ASSERT3U(num, >, 0);
+	ASSERT3P(index_func, !=, NULL);
+
+	ml->ml_offset = offset;
+	ml->ml_num_sublists = num;
+	ml->ml_index_func = index_func;
+	ml->ml_sublists = kmem_zalloc(sizeof (multilist_sublist_t) * num,
+	    KM_SLEEP);
+
+	for (i = 0; i < num; i++) {
+		multilist_sublist_t *mls = &ml->ml_sublists[i];
+		mutex_init(&mls->mls_lock, NULL, MUTEX_DEFAULT, NULL);
+		list_create(&mls->mls_list, size, offset);
+	}
+}
+
+void
+multilist_destroy(multilist_t *ml)
+{
+	int i;
+
+	ASSERT(multilist_is_empty(ml));
+
+	for (i = 0; i < ml->ml_num_sublists; i++) {
+		multilist_sublist_t *mls = &ml->ml_sublists[i];
+		list_destroy(&mls->mls_list);
+		mutex_destroy(&mls->mls_lock);
+	}
+
+	kmem_free(ml->ml_sublists,
+	    sizeof (multilist_sublist_t) * ml->ml_num_sublists);
+	ml->ml_sublists = NULL;
+	ml->ml_num_sublists = 0;
+}
+
+/*
+ * Insert obj at the head of its sublist.
+ */
+void
+multilist_insert(multilist_t *ml, void *obj)
+{
+	multilist_sublist_t *mls = multilist_sublist_for(ml, obj);
+	boolean_t need_lock = !MUTEX_HELD(&mls->mls_lock);
+
+	if (need_lock)
+		multilist_sublist_enter(mls);
+	list_insert_head(&mls->mls_list, obj);
+	if (need_lock)
+		mutex_exit(&mls->mls_lock);
+}
+
+void
+multilist_remove(multilist_t *ml, void *obj)
+{
+	multilist_sublist_t *mls = multilist_sublist_for(ml, obj);
+	boolean_t need_lock = !MUTEX_HELD(&mls->mls_lock);
+
+	if (need_lock)
+		multilist_sublist_enter(mls);
+	list_remove(&mls->mls_list, obj);
+	if (need_lock)
+		mutex_exit(&mls->mls_lock);
+}
+
+/*
+ * Unless the caller holds every sublist lock, the answer may be stale by
+ * the time it is returned.
+ */
+int
+multilist_is_empty(multilist_t *ml)
+{
+	int i;
+
+	for (i = 0; i < ml->ml_num_sublists; i++) {
+		multilist_sublist_t *mls = &ml->ml_sublists[i];
+		boolean_t need_lock = !MUTEX_HELD(&mls->mls_lock);
+		int empty;
+
+		if (need_lock)
+			mutex_enter(&mls->mls_lock);
+		empty = list_is_empty(&mls->mls_list);
+		if (need_lock)
+			mutex_exit(&mls->mls_lock);
+
+		if (!empty)
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
+unsigned int
+multilist_get_num_sublists(multilist_t *ml)
+{
+	return (ml->ml_num_sublists);
+}
+
+/*
+ * A starting point for walking the sublists, so that repeated walks do
+ * not always favour the first ones.
+ */
+unsigned int
+multilist_get_random_index(multilist_t *ml)
+{
+	return (spa_get_random(ml->ml_num_sublists));
+}
+
+/*
+ * Total number of contended sublist lock acquisitions.
+ */
+uint64_t
+multilist_get_contended(multilist_t *ml)
+{
+	uint64_t contended = 0;
+	int i;
+
+	for (i = 0; i < ml->ml_num_sublists; i++)
+		contended += ml->ml_sublists[i].mls_contended;
+
+	return (contended);
+}
+
+multilist_sublist_t *
+multilist_sublist_lock(multilist_t *ml, unsigned int sublist_idx)
+{
+	multilist_sublist_t *mls;
+
+	ASSERT3U(sublist_idx, <, ml->ml_num_sublists);
+	mls = &ml->ml_sublists[sublist_idx];
+	multilist_sublist_enter(mls);
+
+	return (mls);
+}
+
+void
+multilist_sublist_unlock(multilist_sublist_t *mls)
+{
+	mutex_exit(&mls->mls_lock);
+}
+
+void
+multilist_sublist_insert_head(multilist_sublist_t *mls, void *obj)
+{
+	ASSERT(MUTEX_HELD(&mls->mls_lock));
+	list_insert_head(&mls->mls_list, obj);
+}
+
+void
+multilist_sublist_remove(multilist_sublist_t *mls, void *obj)
+{
+	ASSERT(MUTEX_HELD(&mls->mls_lock));
+	list_remove(&mls->mls_list, obj);
+}
+
+int
+multilist_sublist_is_empty(multilist_sublist_t *mls)
+{
+	ASSERT(MUTEX_HELD(&mls->mls_lock));
+	return (list_is_empty(&mls->mls_list));
+}
+
+void *
+multilist_sublist_head(multilist_sublist_t *mls)
+{
+	ASSERT(MUTEX_HELD(&mls->mls_lock));
+	return (list_head(&mls->mls_list));
+}
+
+void *
+multilist_sublist_tail(multilist_sublist_t *mls)
+{
+	ASSERT(MUTEX_HELD(&mls->mls_lock));
+	return (list_tail(&mls->mls_list));
+}
+
+void *
+multilist_sublist_next(multilist_sublist_t *mls, void *obj)
+{
+	ASSERT(MUTEX_HELD(&mls->mls_lock));
+	return (list_next(&mls->mls_list, obj));
+}
+
+void *
+multilist_sublist_prev(multilist_sublist_t *mls, void *obj)
+{
+	ASSERT(MUTEX_HELD(&mls->mls_lock));
+	return (list_prev(&mls->mls_list, obj));
+}
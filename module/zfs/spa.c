@@ -353,7 +353,8 @@ spa_prop_validate(spa_t *spa, nvlist_t *props)
 		case ZPOOL_PROP_VERSION:
 			error = nvpair_value_uint64(elem, &intval);
 			if (!error &&
-			    (intval < spa_version(spa) || intval > SPA_VERSION))
+			    (intval < spa_version(spa) ||
+			    !SPA_VERSION_IS_SUPPORTED(intval)))
 				error = EINVAL;
 			break;
 
@@ -753,8 +754,11 @@ spa_activate(spa_t *spa, int mode)
 	spa->spa_state = POOL_STATE_ACTIVE;
 	spa->spa_mode = mode;
 
-	spa->spa_normal_class = metaslab_class_create(spa, zfs_metaslab_ops);
-	spa->spa_log_class = metaslab_class_create(spa, zfs_metaslab_ops);
+	spa->spa_normal_class = metaslab_class_create(spa, zfs_metaslab_ops,
+	    "normal");
+	spa->spa_log_class = metaslab_class_create(spa, zfs_metaslab_ops,
+	    "log");
+	dmu_zfetch_stat_create(spa);
 
 	/* Try to create a covering process */
 	mutex_enter(&spa->spa_proc_lock);
@@ -840,6 +844,8 @@ spa_deactivate(spa_t *spa)
 	metaslab_class_destroy(spa->spa_log_class);
 	spa->spa_log_class = NULL;
 
+	dmu_zfetch_stat_destroy(spa);
+
 	/*
 	 * If this was part of an import or the open otherwise failed, we may
 	 * still have errors left in the queues.  Empty them just in case.
@@ -948,6 +954,24 @@ spa_unload(spa_t *spa)
 		spa->spa_sync_on = B_FALSE;
 	}
 
+	/*
+	 * Wait for metaslab preloads, which were started by spa_sync() and
+	 * read the MOS, before tearing the pool down underneath them.
+	 */
+	if (spa->spa_root_vdev != NULL) {
+		vdev_t *rvd = spa->spa_root_vdev;
+
+		for (i = 0; i < rvd->vdev_children; i++)
+			if (rvd->vdev_child[i]->vdev_mg != NULL)
+				metaslab_group_preload_wait(
+				    rvd->vdev_child[i]->vdev_mg);
+	}
+
+	/*
+	 * Stop building the in-core DDT indexes.
+	 */
+	ddt_index_stop(spa);
+
 	/*
 	 * Wait for any outstanding async I/O to complete.
 	 */
@@ -1779,7 +1803,7 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 	/*
 	 * If the pool is newer than the code, we can't open it.
 	 */
-	if (ub->ub_version > SPA_VERSION)
+	if (!SPA_VERSION_IS_SUPPORTED(ub->ub_version))
 		return (spa_vdev_err(rvd, VDEV_AUX_VERSION_NEWER, ENOTSUP));
 
 	/*
@@ -2747,7 +2771,7 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	if (nvlist_lookup_uint64(props, zpool_prop_to_name(ZPOOL_PROP_VERSION),
 	    &version) != 0)
 		version = SPA_VERSION;
-	ASSERT(version <= SPA_VERSION);
+	ASSERT(SPA_VERSION_IS_SUPPORTED(version));
 
 	spa->spa_first_txg = txg;
 	spa->spa_uberblock.ub_txg = txg - 1;
@@ -3455,7 +3479,10 @@ spa_export_common(char *pool, int new_state, nvlist_t **oldconfig,
 		/*
 		 * Objsets may be open only because they're dirty, so we
 		 * have to force it to sync before checking spa_refcnt.
+		 * Have that sync write out the DDT bloom filters too.
 		 */
+		if (new_state != POOL_STATE_DESTROYED)
+			ddt_bloom_persist(spa);
 		txg_wait_synced(spa->spa_dsl_pool, 0);
 
 		/*
@@ -4577,6 +4604,12 @@ spa_vdev_remove(spa_t *spa, uint64_t guid, boolean_t unspare)
 		 */
 		error = spa_vdev_remove_evacuate(spa, vd);
 
+		/*
+		 * The group is passivated, so no new preloads will start;
+		 * let the ones in flight finish while we hold no config locks.
+		 */
+		metaslab_group_preload_wait(mg);
+
 		txg = spa_vdev_config_enter(spa);
 
 		/*
@@ -5126,7 +5159,7 @@ spa_sync_props(void *arg1, void *arg2, dmu_tx_t *tx)
 			if (tx->tx_txg != TXG_INITIAL) {
 				VERIFY(nvpair_value_uint64(elem,
 				    &intval) == 0);
-				ASSERT(intval <= SPA_VERSION);
+				ASSERT(SPA_VERSION_IS_SUPPORTED(intval));
 				ASSERT(intval >= spa_version(spa));
 				spa->spa_uberblock.ub_version = intval;
 				vdev_config_dirty(spa->spa_root_vdev);
@@ -5259,6 +5292,33 @@ spa_sync_upgrades(spa_t *spa, dmu_tx_t *tx)
 	}
 }
 
+/*
+ * Sum the I/O counts of the top-level vdevs, for the txg history.
+ */
+static void
+spa_sync_io_totals(spa_t *spa, uint64_t *ops, uint64_t *bytes)
+{
+	vdev_t *rvd = spa->spa_root_vdev;
+	int c;
+
+	ASSERT(spa_config_held(spa, SCL_CONFIG, RW_READER));
+
+	ops[ZIO_TYPE_READ] = ops[ZIO_TYPE_WRITE] = 0;
+	bytes[ZIO_TYPE_READ] = bytes[ZIO_TYPE_WRITE] = 0;
+
+	for (c = 0; c < rvd->vdev_children; c++) {
+		vdev_t *vd = rvd->vdev_child[c];
+		vdev_stat_t *vs = &vd->vdev_stat;
+
+		mutex_enter(&vd->vdev_stat_lock);
+		ops[ZIO_TYPE_READ] += vs->vs_ops[ZIO_TYPE_READ];
+		ops[ZIO_TYPE_WRITE] += vs->vs_ops[ZIO_TYPE_WRITE];
+		bytes[ZIO_TYPE_READ] += vs->vs_bytes[ZIO_TYPE_READ];
+		bytes[ZIO_TYPE_WRITE] += vs->vs_bytes[ZIO_TYPE_WRITE];
+		mutex_exit(&vd->vdev_stat_lock);
+	}
+}
+
 /*
  * Sync the specified transaction group.  New blocks may be dirtied as
  * part of the process, so we iterate until it converges.
@@ -5273,6 +5333,9 @@ spa_sync(spa_t *spa, uint64_t txg)
 	vdev_t *rvd = spa->spa_root_vdev;
 	vdev_t *vd;
 	dmu_tx_t *tx;
+	uint64_t ops[ZIO_TYPES], bytes[ZIO_TYPES];
+	uint64_t ops_end[ZIO_TYPES], bytes_end[ZIO_TYPES];
+	boolean_t history = txg_history_enabled(dp);
 	int error;
 	int c;
 
@@ -5284,6 +5347,9 @@ spa_sync(spa_t *spa, uint64_t txg)
 	spa->spa_syncing_txg = txg;
 	spa->spa_sync_pass = 0;
 
+	if (history)
+		spa_sync_io_totals(spa, ops, bytes);
+
 	/*
 	 * If there are any pending vdev state changes, convert them
 	 * into config changes that go out with this transaction group.
@@ -5471,6 +5537,26 @@ spa_sync(spa_t *spa, uint64_t txg)
 	ASSERT(txg_list_empty(&dp->dp_dirty_dirs, txg));
 	ASSERT(txg_list_empty(&spa->spa_vdev_txg_list, txg));
 
+	if (history) {
+		/*
+		 * The counts only grow, unless a log device went away
+		 * during the sync; don't report garbage in that case.
+		 */
+		spa_sync_io_totals(spa, ops_end, bytes_end);
+		for (c = ZIO_TYPE_READ; c <= ZIO_TYPE_WRITE; c++) {
+			ops[c] = (ops_end[c] >= ops[c] ?
+			    ops_end[c] - ops[c] : 0);
+			bytes[c] = (bytes_end[c] >= bytes[c] ?
+			    bytes_end[c] - bytes[c] : 0);
+		}
+		txg_history_set(dp, txg, TXG_HIST_READS, ops[ZIO_TYPE_READ]);
+		txg_history_set(dp, txg, TXG_HIST_WRITES, ops[ZIO_TYPE_WRITE]);
+		txg_history_set(dp, txg, TXG_HIST_NREAD, bytes[ZIO_TYPE_READ]);
+		txg_history_set(dp, txg, TXG_HIST_NWRITTEN,
+		    bytes[ZIO_TYPE_WRITE]);
+		txg_history_set(dp, txg, TXG_HIST_PASSES, spa->spa_sync_pass);
+	}
+
 	spa->spa_sync_pass = 0;
 
 	spa_config_exit(spa, SCL_CONFIG, FTAG);
@@ -5581,7 +5667,7 @@ spa_upgrade(spa_t *spa, uint64_t version)
 	 * future version would result in an unopenable pool, this shouldn't be
 	 * possible.
 	 */
-	ASSERT(spa->spa_uberblock.ub_version <= SPA_VERSION);
+	ASSERT(SPA_VERSION_IS_SUPPORTED(spa->spa_uberblock.ub_version));
 	ASSERT(version >= spa->spa_uberblock.ub_version);
 
 	spa->spa_uberblock.ub_version = version;
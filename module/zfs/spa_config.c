@@ -426,6 +426,7 @@ spa_config_generate(spa_t *spa, vdev_t *vd, uint64_t txg, int getstats)
 		ddt_histogram_t *ddh;
 		ddt_stat_t *dds;
 		ddt_object_t *ddo;
+		ddt_bloom_stat_t *dbs;
 
 		ddh = kmem_zalloc(sizeof (ddt_histogram_t), KM_SLEEP);
 		ddt_get_dedup_histogram(spa, ddh);
@@ -447,6 +448,13 @@ spa_config_generate(spa_t *spa, vdev_t *vd, uint64_t txg, int getstats)
 		    ZPOOL_CONFIG_DDT_STATS,
 		    (uint64_t *)dds, sizeof (*dds) / sizeof (uint64_t)) == 0);
 		kmem_free(dds, sizeof (ddt_stat_t));
+
+		dbs = kmem_zalloc(sizeof (ddt_bloom_stat_t), KM_SLEEP);
+		ddt_get_dedup_bloom_stats(spa, dbs);
+		VERIFY(nvlist_add_uint64_array(config,
+		    ZPOOL_CONFIG_DDT_BLOOM_STATS,
+		    (uint64_t *)dbs, sizeof (*dbs) / sizeof (uint64_t)) == 0);
+		kmem_free(dbs, sizeof (ddt_bloom_stat_t));
 	}
 
 	spa_rewind_data_to_nvlist(spa, config);
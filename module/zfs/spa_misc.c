@@ -32,6 +32,7 @@
 #include <sys/zap.h>
 #include <sys/zil.h>
 #include <sys/vdev_impl.h>
+#include <sys/vdev_raidz.h>
 #include <sys/metaslab.h>
 #include <sys/uberblock_impl.h>
 #include <sys/txg.h>
@@ -1530,9 +1531,13 @@ spa_init(int mode)
 	refcount_init();
 	unique_init();
 	zio_init();
+	space_map_init();
+	ddt_init();
+	vdev_raidz_math_init();
 	dmu_init();
 	zil_init();
 	vdev_cache_stat_init();
+	vdev_queue_stat_init();
 	zfs_prop_init();
 	zpool_prop_init();
 	spa_config_load();
@@ -1546,9 +1551,13 @@ spa_fini(void)
 
 	spa_evict_all();
 
+	vdev_queue_stat_fini();
 	vdev_cache_stat_fini();
 	zil_fini();
 	dmu_fini();
+	vdev_raidz_math_fini();
+	ddt_fini();
+	space_map_fini();
 	zio_fini();
 	unique_fini();
 	refcount_fini();
@@ -29,6 +29,30 @@
 #include <sys/zio.h>
 #include <sys/space_map.h>
 
+/*
+ * Condense a space map object once it is more than this percentage of
+ * the size needed to write out the in-core map from scratch.  Every load
+ * of the map has to replay the whole object, so this bounds the cost of
+ * loading a metaslab at a constant factor of its in-core size.
+ */
+int zfs_condense_pct = 200;
+
+static kmem_cache_t *space_seg_cache;
+
+void
+space_map_init(void)
+{
+	space_seg_cache = kmem_cache_create("space_seg_cache",
+	    sizeof (space_seg_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+}
+
+void
+space_map_fini(void)
+{
+	kmem_cache_destroy(space_seg_cache);
+	space_seg_cache = NULL;
+}
+
 /*
  * Space map routines.
  * NOTE: caller is responsible for all locking.
@@ -52,6 +76,31 @@ space_map_seg_compare(const void *x1, const void *x2)
 	return (0);
 }
 
+static int
+space_map_hist_index(space_map_t *sm, space_seg_t *ss)
+{
+	uint64_t size = (ss->ss_end - ss->ss_start) >> sm->sm_shift;
+
+	ASSERT(size != 0);
+	return (MIN(highbit(size) - 1, SPACE_MAP_HISTOGRAM_SIZE - 1));
+}
+
+static void
+space_map_hist_update(space_map_t *sm, space_seg_t *ss, int64_t delta)
+{
+	int idx;
+
+	if (sm->sm_histogram == NULL)
+		return;
+
+	idx = space_map_hist_index(sm, ss);
+	ASSERT(delta > 0 || sm->sm_histogram[idx] != 0);
+	sm->sm_histogram[idx] += delta;
+}
+
+#define	SPACE_MAP_HIST_ADD(sm, ss)	space_map_hist_update(sm, ss, 1)
+#define	SPACE_MAP_HIST_REMOVE(sm, ss)	space_map_hist_update(sm, ss, -1)
+
 void
 space_map_create(space_map_t *sm, uint64_t start, uint64_t size, uint8_t shift,
 	kmutex_t *lp)
@@ -73,6 +122,7 @@ void
 space_map_destroy(space_map_t *sm)
 {
 	ASSERT(!sm->sm_loaded && !sm->sm_loading);
+	ASSERT(sm->sm_histogram == NULL);
 	VERIFY3U(sm->sm_space, ==, 0);
 	avl_destroy(&sm->sm_root);
 	cv_destroy(&sm->sm_load_cv);
@@ -120,21 +170,25 @@ space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 			avl_remove(sm->sm_pp_root, ss_before);
 			avl_remove(sm->sm_pp_root, ss_after);
 		}
+		SPACE_MAP_HIST_REMOVE(sm, ss_before);
+		SPACE_MAP_HIST_REMOVE(sm, ss_after);
 		ss_after->ss_start = ss_before->ss_start;
-		kmem_free(ss_before, sizeof (*ss_before));
+		kmem_cache_free(space_seg_cache, ss_before);
 		ss = ss_after;
 	} else if (merge_before) {
+		SPACE_MAP_HIST_REMOVE(sm, ss_before);
 		ss_before->ss_end = end;
 		if (sm->sm_pp_root)
 			avl_remove(sm->sm_pp_root, ss_before);
 		ss = ss_before;
 	} else if (merge_after) {
+		SPACE_MAP_HIST_REMOVE(sm, ss_after);
 		ss_after->ss_start = start;
 		if (sm->sm_pp_root)
 			avl_remove(sm->sm_pp_root, ss_after);
 		ss = ss_after;
 	} else {
-		ss = kmem_alloc(sizeof (*ss), KM_SLEEP);
+		ss = kmem_cache_alloc(space_seg_cache, KM_SLEEP);
 		ss->ss_start = start;
 		ss->ss_end = end;
 		avl_insert(&sm->sm_root, ss, where);
@@ -142,6 +196,7 @@ space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 
 	if (sm->sm_pp_root)
 		avl_add(sm->sm_pp_root, ss);
+	SPACE_MAP_HIST_ADD(sm, ss);
 
 	sm->sm_space += size;
 }
@@ -179,27 +234,32 @@ space_map_remove(space_map_t *sm, uint64_t start, uint64_t size)
 
 	if (sm->sm_pp_root)
 		avl_remove(sm->sm_pp_root, ss);
+	SPACE_MAP_HIST_REMOVE(sm, ss);
 
 	if (left_over && right_over) {
-		newseg = kmem_alloc(sizeof (*newseg), KM_SLEEP);
+		newseg = kmem_cache_alloc(space_seg_cache, KM_SLEEP);
 		newseg->ss_start = end;
 		newseg->ss_end = ss->ss_end;
 		ss->ss_end = start;
 		avl_insert_here(&sm->sm_root, newseg, ss, AVL_AFTER);
 		if (sm->sm_pp_root)
 			avl_add(sm->sm_pp_root, newseg);
+		SPACE_MAP_HIST_ADD(sm, newseg);
 	} else if (left_over) {
 		ss->ss_end = start;
 	} else if (right_over) {
 		ss->ss_start = end;
 	} else {
 		avl_remove(&sm->sm_root, ss);
-		kmem_free(ss, sizeof (*ss));
+		kmem_cache_free(space_seg_cache, ss);
 		ss = NULL;
 	}
 
-	if (sm->sm_pp_root && ss != NULL)
-		avl_add(sm->sm_pp_root, ss);
+	if (ss != NULL) {
+		if (sm->sm_pp_root)
+			avl_add(sm->sm_pp_root, ss);
+		SPACE_MAP_HIST_ADD(sm, ss);
+	}
 
 	sm->sm_space -= size;
 }
@@ -234,9 +294,12 @@ space_map_vacate(space_map_t *sm, space_map_func_t *func, space_map_t *mdest)
 	while ((ss = avl_destroy_nodes(&sm->sm_root, &cookie)) != NULL) {
 		if (func != NULL)
 			func(mdest, ss->ss_start, ss->ss_end - ss->ss_start);
-		kmem_free(ss, sizeof (*ss));
+		kmem_cache_free(space_seg_cache, ss);
 	}
 	sm->sm_space = 0;
+	if (sm->sm_histogram != NULL)
+		bzero(sm->sm_histogram,
+		    SPACE_MAP_HISTOGRAM_SIZE * sizeof (uint64_t));
 }
 
 void
@@ -288,6 +351,10 @@ space_map_load(space_map_t *sm, space_map_ops_t *ops, uint8_t maptype,
 	ASSERT(sm->sm_ops == NULL);
 	VERIFY3U(sm->sm_space, ==, 0);
 
+	ASSERT(sm->sm_histogram == NULL);
+	sm->sm_histogram = kmem_zalloc(SPACE_MAP_HISTOGRAM_SIZE *
+	    sizeof (uint64_t), KM_SLEEP);
+
 	if (maptype == SM_FREE) {
 		space_map_add(sm, sm->sm_start, sm->sm_size);
 		space = sm->sm_size - space;
@@ -339,6 +406,9 @@ space_map_load(space_map_t *sm, space_map_ops_t *ops, uint8_t maptype,
 			ops->smop_load(sm);
 	} else {
 		space_map_vacate(sm, NULL, NULL);
+		kmem_free(sm->sm_histogram,
+		    SPACE_MAP_HISTOGRAM_SIZE * sizeof (uint64_t));
+		sm->sm_histogram = NULL;
 	}
 
 	zio_buf_free(entry_map, bufsize);
@@ -362,6 +432,12 @@ space_map_unload(space_map_t *sm)
 	sm->sm_ops = NULL;
 
 	space_map_vacate(sm, NULL, NULL);
+
+	if (sm->sm_histogram != NULL) {
+		kmem_free(sm->sm_histogram,
+		    SPACE_MAP_HISTOGRAM_SIZE * sizeof (uint64_t));
+		sm->sm_histogram = NULL;
+	}
 }
 
 uint64_t
@@ -371,6 +447,54 @@ space_map_maxsize(space_map_t *sm)
 	return (sm->sm_ops->smop_max(sm));
 }
 
+/*
+ * Add the segments of sm to a histogram laid out like sm_histogram.
+ */
+void
+space_map_histogram_add(space_map_t *sm, uint64_t *histogram)
+{
+	space_seg_t *ss;
+
+	ASSERT(MUTEX_HELD(sm->sm_lock));
+
+	for (ss = avl_first(&sm->sm_root); ss; ss = AVL_NEXT(&sm->sm_root, ss))
+		histogram[space_map_hist_index(sm, ss)]++;
+}
+
+/*
+ * Is the on-disk space map object so much larger than the loaded in-core
+ * map that it should be rewritten from scratch?  Condensing writes one
+ * allocation run over the whole map and then frees each in-core segment,
+ * and a run longer than SM_RUN_MAX units takes one entry per SM_RUN_MAX.
+ * The histogram puts a segment of at least 2^n units in bucket n, so the
+ * segments in that bucket take at least 2^n / SM_RUN_MAX entries each.
+ */
+boolean_t
+space_map_should_condense(space_map_t *sm, space_map_obj_t *smo)
+{
+	uint64_t entries, units, optimal_size;
+	int i;
+
+	ASSERT(MUTEX_HELD(sm->sm_lock));
+
+	if (!sm->sm_loaded || sm->sm_histogram == NULL ||
+	    zfs_condense_pct == 0)
+		return (B_FALSE);
+
+	/* a debug entry for each of the two syncs, and the allocation */
+	units = sm->sm_size >> sm->sm_shift;
+	entries = 2 + (units + SM_RUN_MAX - 1) / SM_RUN_MAX;
+
+	for (i = 0; i < SPACE_MAP_HISTOGRAM_SIZE; i++) {
+		units = 1ULL << i;
+		entries += sm->sm_histogram[i] * MAX(units / SM_RUN_MAX, 1);
+	}
+	optimal_size = entries * sizeof (uint64_t);
+
+	return (smo->smo_objsize >= optimal_size * zfs_condense_pct / 100 &&
+	    smo->smo_objsize > (1ULL << SPACE_MAP_BLOCKSHIFT));
+}
+
 uint64_t
 space_map_alloc(space_map_t *sm, uint64_t size)
 {
@@ -461,7 +585,7 @@ space_map_sync(space_map_t *sm, uint8_t maptype,
 			start += run_len;
 			size -= run_len;
 		}
-		kmem_free(ss, sizeof (*ss));
+		kmem_cache_free(space_seg_cache, ss);
 	}
 
 	if (entry != entry_map) {
@@ -614,3 +738,8 @@ space_map_ref_generate_map(avl_tree_t *t, space_map_t *sm, int64_t minref)
 	ASSERT(refcnt == 0);
 	ASSERT(start == -1ULL);
 }
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_condense_pct, int, 0644);
+MODULE_PARM_DESC(zfs_condense_pct, "Condense a space map at this percent of its in-core size");
+#endif
@@ -38,6 +38,154 @@ static void txg_sync_thread(dsl_pool_t *dp);
 static void txg_quiesce_thread(dsl_pool_t *dp);
 
 int zfs_txg_timeout = 30;	/* max seconds worth of delta per txg */
+int zfs_txg_history = 0;	/* number of txgs in the txg history */
+
+typedef struct txg_history {
+	kstat_t		*th_ksp;
+	int		th_size;	/* number of txgs kept */
+	kstat_named_t	*th_stats;	/* th_size sets of TXG_HIST_STATS */
+} txg_history_t;
+
+static const char *txg_history_names[TXG_HIST_STATS] = {
+	"txg", "birth", "open_ns", "quiesce_ns", "wait_ns", "sync_ns",
+	"dirty", "dbufs", "reads", "writes", "nread", "nwritten", "passes"
+};
+
+static kstat_named_t *
+txg_history_slot(txg_history_t *th, uint64_t txg)
+{
+	kstat_named_t *ks;
+
+	ks = &th->th_stats[(txg % th->th_size) * TXG_HIST_STATS];
+
+	/* The slot may have been reused by a later txg already. */
+	return (ks[TXG_HIST_TXG].value.ui64 == txg ? ks : NULL);
+}
+
+/*
+ * Start the history entry for a newly opened txg, reusing the slot of
+ * the txg zfs_txg_history before it.
+ */
+static void
+txg_history_open(tx_state_t *tx, uint64_t txg)
+{
+	txg_history_t *th = tx->tx_history;
+	kstat_named_t *ks;
+	int s;
+
+	if (th == NULL)
+		return;
+
+	ks = &th->th_stats[(txg % th->th_size) * TXG_HIST_STATS];
+	for (s = 0; s < TXG_HIST_STATS; s++)
+		ks[s].value.ui64 = 0;
+	ks[TXG_HIST_BIRTH].value.ui64 = gethrtime();
+	ks[TXG_HIST_TXG].value.ui64 = txg;
+	tx->tx_dirty_dbufs[txg & TXG_MASK] = 0;
+}
+
+/*
+ * Record that txg has finished a phase.  Each phase starts where the
+ * previous one ended, so only the durations need to be kept.
+ */
+static void
+txg_history_phase(tx_state_t *tx, uint64_t txg, txg_history_stat_t phase)
+{
+	txg_history_t *th = tx->tx_history;
+	kstat_named_t *ks;
+	hrtime_t start;
+	int s;
+
+	if (th == NULL || (ks = txg_history_slot(th, txg)) == NULL)
+		return;
+
+	start = ks[TXG_HIST_BIRTH].value.ui64;
+	for (s = TXG_HIST_OPEN; s < phase; s++)
+		start += ks[s].value.ui64;
+	ks[phase].value.ui64 = gethrtime() - start;
+}
+
+static void
+txg_history_init(dsl_pool_t *dp, uint64_t txg)
+{
+	tx_state_t *tx = &dp->dp_tx;
+	txg_history_t *th;
+	char kname[KSTAT_STRLEN];
+	int i, s;
+
+	if (zfs_txg_history <= 0)
+		return;
+
+	/* Keep at least the txgs that can be in flight at once. */
+	th = kmem_zalloc(sizeof (txg_history_t), KM_SLEEP);
+	th->th_size = MAX(zfs_txg_history, TXG_SIZE);
+	th->th_stats = vmem_zalloc(th->th_size * TXG_HIST_STATS *
+	    sizeof (kstat_named_t), KM_SLEEP);
+
+	for (i = 0; i < th->th_size; i++) {
+		for (s = 0; s < TXG_HIST_STATS; s++) {
+			kstat_named_t *ks;
+
+			ks = &th->th_stats[i * TXG_HIST_STATS + s];
+			(void) snprintf(ks->name, KSTAT_STRLEN, "%d.%s", i,
+			    txg_history_names[s]);
+			ks->data_type = KSTAT_DATA_UINT64;
+		}
+	}
+
+	(void) snprintf(kname, KSTAT_STRLEN, "txgs-%s", spa_name(dp->dp_spa));
+	th->th_ksp = kstat_create("zfs", 0, kname, "misc", KSTAT_TYPE_NAMED,
+	    th->th_size * TXG_HIST_STATS, KSTAT_FLAG_VIRTUAL);
+	if (th->th_ksp != NULL) {
+		th->th_ksp->ks_data = th->th_stats;
+		kstat_install(th->th_ksp);
+	}
+
+	tx->tx_history = th;
+	txg_history_open(tx, txg);
+}
+
+static void
+txg_history_fini(dsl_pool_t *dp)
+{
+	txg_history_t *th = dp->dp_tx.tx_history;
+
+	if (th == NULL)
+		return;
+
+	if (th->th_ksp != NULL)
+		kstat_delete(th->th_ksp);
+	vmem_free(th->th_stats,
+	    th->th_size * TXG_HIST_STATS * sizeof (kstat_named_t));
+	kmem_free(th, sizeof (txg_history_t));
+	dp->dp_tx.tx_history = NULL;
+}
+
+boolean_t
+txg_history_enabled(dsl_pool_t *dp)
+{
+	return (dp->dp_tx.tx_history != NULL);
+}
+
+void
+txg_history_set(dsl_pool_t *dp, uint64_t txg, txg_history_stat_t stat,
+    uint64_t value)
+{
+	txg_history_t *th = dp->dp_tx.tx_history;
+	kstat_named_t *ks;
+
+	if (th == NULL || (ks = txg_history_slot(th, txg)) == NULL)
+		return;
+
+	ks[stat].value.ui64 = value;
+}
+
+void
+txg_history_dirty_dbuf(dsl_pool_t *dp, uint64_t txg)
+{
+	if (dp->dp_tx.tx_history != NULL)
+		atomic_inc_64(&dp->dp_tx.tx_dirty_dbufs[txg & TXG_MASK]);
+}
 
 /*
  * Prepare the txg subsystem.
@@ -73,6 +221,8 @@ txg_init(dsl_pool_t *dp, uint64_t txg)
 	cv_init(&tx->tx_exit_cv, NULL, CV_DEFAULT, NULL);
 
 	tx->tx_open_txg = txg;
+
+	txg_history_init(dp, txg);
 }
 
 /*
@@ -86,6 +236,8 @@ txg_fini(dsl_pool_t *dp)
 
 	ASSERT(tx->tx_threads == 0);
 
+	txg_history_fini(dp);
+
 	mutex_destroy(&tx->tx_sync_lock);
 
 	cv_destroy(&tx->tx_sync_more_cv);
@@ -214,6 +366,37 @@ txg_sync_stop(dsl_pool_t *dp)
 	mutex_exit(&tx->tx_sync_lock);
 }
 
+/*
+ * Drop a hold on txg.  txg_quiesce() only waits for the holds on a txg
+ * after closing it, so it only needs waking when the last hold on a
+ * closed txg goes away.  The _nv atomics are full memory barriers, so
+ * either we see the new tx_open_txg here or txg_quiesce() sees our
+ * decrement; see txg_hold_open().
+ */
+static void
+txg_rele(tx_state_t *tx, tx_cpu_t *tc, uint64_t txg)
+{
+	int g = txg & TXG_MASK;
+	uint64_t count;
+
+	count = atomic_dec_64_nv(&tc->tc_count[g]);
+	ASSERT3S((int64_t)count, >=, 0);
+
+	if (count == 0 && tx->tx_open_txg != txg) {
+		mutex_enter(&tc->tc_lock);
+		cv_broadcast(&tc->tc_cv[g]);
+		mutex_exit(&tc->tc_lock);
+	}
+}
+
+/*
+ * Take a hold on the open txg.  This is lock-free: we bump our CPU's
+ * count for the txg we think is open, then check that it still is.  If
+ * txg_quiesce() closed it in the meantime it may have missed our hold,
+ * so drop it and try the new open txg.  Since the increment is a full
+ * memory barrier, and so is the tx_open_txg update in txg_quiesce(),
+ * either we see the txg closed or txg_quiesce() sees our hold.
+ */
 uint64_t
 txg_hold_open(dsl_pool_t *dp, txg_handle_t *th)
 {
@@ -221,23 +404,29 @@ txg_hold_open(dsl_pool_t *dp, txg_handle_t *th)
 	tx_cpu_t *tc = &tx->tx_cpu[CPU_SEQID];
 	uint64_t txg;
 
-	mutex_enter(&tc->tc_lock);
-
-	txg = tx->tx_open_txg;
-	tc->tc_count[txg & TXG_MASK]++;
+	for (;;) {
+		txg = tx->tx_open_txg;
+		(void) atomic_inc_64_nv(&tc->tc_count[txg & TXG_MASK]);
+		if (tx->tx_open_txg == txg)
+			break;
+		txg_rele(tx, tc, txg);
+	}
 
+	th->th_tx = tx;
 	th->th_cpu = tc;
 	th->th_txg = txg;
 
 	return (txg);
 }
 
+/*
+ * The hold taken by txg_hold_open() no longer keeps other threads out of
+ * the txg, so there is nothing left to release before txg_rele_to_sync().
+ */
+/* ARGSUSED */
 void
 txg_rele_to_quiesce(txg_handle_t *th)
 {
-	tx_cpu_t *tc = th->th_cpu;
-
-	mutex_exit(&tc->tc_lock);
 }
 
 void
@@ -254,14 +443,7 @@ txg_register_callbacks(txg_handle_t *th, list_t *tx_callbacks)
 void
 txg_rele_to_sync(txg_handle_t *th)
 {
-	tx_cpu_t *tc = th->th_cpu;
-	int g = th->th_txg & TXG_MASK;
-
-	mutex_enter(&tc->tc_lock);
-	ASSERT(tc->tc_count[g] != 0);
-	if (--tc->tc_count[g] == 0)
-		cv_broadcast(&tc->tc_cv[g]);
-	mutex_exit(&tc->tc_lock);
+	txg_rele(th->th_tx, th->th_cpu, th->th_txg);
 
 	th->th_cpu = NULL;	/* defensive */
 }
@@ -274,26 +456,22 @@ txg_quiesce(dsl_pool_t *dp, uint64_t txg)
 	int c;
 
 	/*
-	 * Grab all tx_cpu locks so nobody else can get into this txg.
+	 * Close the txg.  New holds go to the next transaction group, and
+	 * any thread that raced with us will see the new tx_open_txg and
+	 * back out; see txg_hold_open().
 	 */
-	for (c = 0; c < max_ncpus; c++)
-		mutex_enter(&tx->tx_cpu[c].tc_lock);
-
 	ASSERT(txg == tx->tx_open_txg);
-	tx->tx_open_txg++;
-
-	/*
-	 * Now that we've incremented tx_open_txg, we can let threads
-	 * enter the next transaction group.
-	 */
-	for (c = 0; c < max_ncpus; c++)
-		mutex_exit(&tx->tx_cpu[c].tc_lock);
+	txg_history_open(tx, txg + 1);
+	(void) atomic_inc_64_nv(&tx->tx_open_txg);
+	txg_history_phase(tx, txg, TXG_HIST_OPEN);
 
 	/*
 	 * Quiesce the transaction group by waiting for everyone to txg_exit().
 	 */
 	for (c = 0; c < max_ncpus; c++) {
 		tx_cpu_t *tc = &tx->tx_cpu[c];
+		if (tc->tc_count[g] == 0)
+			continue;
 		mutex_enter(&tc->tc_lock);
 		while (tc->tc_count[g] != 0)
 			cv_wait(&tc->tc_cv[g], &tc->tc_lock);
@@ -368,13 +546,18 @@ txg_sync_thread(dsl_pool_t *dp)
 		/*
 		 * We sync when we're scanning, there's someone waiting
 		 * on us, or the quiesce thread has handed off a txg to
-		 * us, or we have reached our timeout.
+		 * us, or the open txg has zfs_dirty_data_sync worth of
+		 * dirty data, or we have reached our timeout.  The dirty
+		 * check catches the txg_kick()s that were dropped while
+		 * the last txg was syncing.
 		 */
 		timer = (delta >= timeout ? 0 : timeout - delta);
 		while (!dsl_scan_active(dp->dp_scan) &&
 		    !tx->tx_exiting && timer > 0 &&
 		    tx->tx_synced_txg >= tx->tx_sync_txg_waiting &&
-		    tx->tx_quiesced_txg == 0) {
+		    tx->tx_quiesced_txg == 0 &&
+		    dp->dp_space_towrite[tx->tx_open_txg & TXG_MASK] <
+		    zfs_dirty_data_sync) {
 			dprintf("waiting; tx_synced=%llu waiting=%llu dp=%p\n",
 			    tx->tx_synced_txg, tx->tx_sync_txg_waiting, dp);
 			txg_thread_wait(tx, &cpr, &tx->tx_sync_more_cv, timer);
@@ -410,10 +593,18 @@ txg_sync_thread(dsl_pool_t *dp)
 		    txg, tx->tx_quiesce_txg_waiting, tx->tx_sync_txg_waiting);
 		mutex_exit(&tx->tx_sync_lock);
 
+		txg_history_phase(tx, txg, TXG_HIST_WAIT);
+		txg_history_set(dp, txg, TXG_HIST_DIRTY,
+		    dp->dp_space_towrite[txg & TXG_MASK]);
+
 		start = ddi_get_lbolt();
 		spa_sync(spa, txg);
 		delta = ddi_get_lbolt() - start;
 
+		txg_history_phase(tx, txg, TXG_HIST_SYNC);
+		txg_history_set(dp, txg, TXG_HIST_DBUFS,
+		    tx->tx_dirty_dbufs[txg & TXG_MASK]);
+
 		mutex_enter(&tx->tx_sync_lock);
 		tx->tx_synced_txg = txg;
 		tx->tx_syncing_txg = 0;
@@ -458,6 +649,7 @@ txg_quiesce_thread(dsl_pool_t *dp)
 		    tx->tx_sync_txg_waiting);
 		mutex_exit(&tx->tx_sync_lock);
 		txg_quiesce(dp, txg);
+		txg_history_phase(tx, txg, TXG_HIST_QUIESCE);
 		mutex_enter(&tx->tx_sync_lock);
 
 		/*
@@ -471,32 +663,24 @@ txg_quiesce_thread(dsl_pool_t *dp)
 }
 
 /*
- * Delay this thread by 'ticks' if we are still in the open transaction
- * group and there is already a waiting txg quiesing or quiesced.  Abort
- * the delay if this txg stalls or enters the quiesing state.
+ * Push the open txg out to quiesce and sync now instead of waiting for
+ * zfs_txg_timeout.  This is a no-op while an earlier txg is still being
+ * quiesced or synced, since the sync thread will pick up the open txg as
+ * soon as it is done with that one.
  */
 void
-txg_delay(dsl_pool_t *dp, uint64_t txg, int ticks)
+txg_kick(dsl_pool_t *dp)
 {
 	tx_state_t *tx = &dp->dp_tx;
-	int timeout = ddi_get_lbolt() + ticks;
-
-	/* don't delay if this txg could transition to quiesing immediately */
-	if (tx->tx_open_txg > txg ||
-	    tx->tx_syncing_txg == txg-1 || tx->tx_synced_txg == txg-1)
-		return;
 
 	mutex_enter(&tx->tx_sync_lock);
-	if (tx->tx_open_txg > txg || tx->tx_synced_txg == txg-1) {
-		mutex_exit(&tx->tx_sync_lock);
-		return;
+	if (tx->tx_syncing_txg == 0 &&
+	    tx->tx_quiesce_txg_waiting <= tx->tx_open_txg &&
+	    tx->tx_sync_txg_waiting <= tx->tx_synced_txg &&
+	    tx->tx_quiesced_txg == 0) {
+		tx->tx_quiesce_txg_waiting = tx->tx_open_txg + 1;
+		cv_broadcast(&tx->tx_quiesce_more_cv);
 	}
-
-	while (ddi_get_lbolt() < timeout &&
-	    tx->tx_syncing_txg < txg-1 && !txg_stalled(dp))
-		(void) cv_timedwait(&tx->tx_quiesce_more_cv, &tx->tx_sync_lock,
-		    timeout);
-
 	mutex_exit(&tx->tx_sync_lock);
 }
 
@@ -732,9 +916,15 @@ EXPORT_SYMBOL(txg_hold_open);
 EXPORT_SYMBOL(txg_rele_to_quiesce);
 EXPORT_SYMBOL(txg_rele_to_sync);
 EXPORT_SYMBOL(txg_register_callbacks);
-EXPORT_SYMBOL(txg_delay);
+EXPORT_SYMBOL(txg_kick);
 EXPORT_SYMBOL(txg_wait_synced);
 EXPORT_SYMBOL(txg_wait_open);
 EXPORT_SYMBOL(txg_stalled);
 EXPORT_SYMBOL(txg_sync_waiting);
+EXPORT_SYMBOL(txg_history_enabled);
+EXPORT_SYMBOL(txg_history_set);
+EXPORT_SYMBOL(txg_history_dirty_dbuf);
+
+module_param(zfs_txg_history, int, 0644);
+MODULE_PARM_DESC(zfs_txg_history, "Number of txgs in the txg history kstat, 0 to disable; read at pool open");
 #endif
@@ -61,6 +61,15 @@ static vdev_ops_t *vdev_ops_table[] = {
 /* maximum scrub/resilver I/O queue per leaf vdev */
 int zfs_scrub_limit = 10;
 
+/*
+ * TRIM freed space as it comes back into circulation.  At most
+ * zfs_trim_limit bytes are trimmed per top-level vdev per txg; frees
+ * beyond that are simply left untrimmed.  Trimmed space is held out of
+ * the allocator for one more txg, while its TRIMs complete.
+ */
+int zfs_trim = 1;
+uint64_t zfs_trim_limit = 128ULL << 20;
+
 /*
  * Given a vdev type, return the appropriate ops vector.
  */
@@ -893,6 +902,11 @@ vdev_metaslab_fini(vdev_t *vd)
 	uint64_t m;
 	uint64_t count = vd->vdev_ms_count;
 
+	if (vd->vdev_trim_zio != NULL) {
+		(void) zio_wait(vd->vdev_trim_zio);
+		vd->vdev_trim_zio = NULL;
+	}
+
 	if (vd->vdev_ms != NULL) {
 		metaslab_group_passivate(vd->vdev_mg);
 		for (m = 0; m < count; m++)
@@ -1980,7 +1994,7 @@ vdev_validate_aux(vdev_t *vd)
 	}
 
 	if (nvlist_lookup_uint64(label, ZPOOL_CONFIG_VERSION, &version) != 0 ||
-	    version > SPA_VERSION ||
+	    !SPA_VERSION_IS_SUPPORTED(version) ||
 	    nvlist_lookup_uint64(label, ZPOOL_CONFIG_GUID, &guid) != 0 ||
 	    guid != vd->vdev_guid ||
 	    nvlist_lookup_uint64(label, ZPOOL_CONFIG_POOL_STATE, &state) != 0) {
@@ -2035,16 +2049,50 @@ vdev_remove(vdev_t *vd, uint64_t txg)
 	dmu_tx_commit(tx);
 }
 
+/*
+ * The trims of a txg hold the config lock until they're done, so that
+ * the vdevs can't change under them, but no longer: vdev_sync_done()
+ * only waits for them in the next txg.
+ */
+static void
+vdev_trim_done(zio_t *zio)
+{
+	spa_config_exit(zio->io_spa, SCL_STATE, zio);
+}
+
 void
 vdev_sync_done(vdev_t *vd, uint64_t txg)
 {
+	spa_t *spa = vd->vdev_spa;
 	metaslab_t *msp;
 	boolean_t reassess = !txg_list_empty(&vd->vdev_ms_list, TXG_CLEAN(txg));
+	uint64_t trim_limit = zfs_trim_limit;
+	zio_t *zio = NULL;
 
 	ASSERT(!vd->vdev_ishole);
 
+	/*
+	 * metaslab_sync_done() is about to hand last txg's trimmed extents
+	 * back to the allocator, so their TRIMs must be done by now; they
+	 * were issued a whole txg ago, so this normally doesn't block.
+	 */
+	if (vd->vdev_trim_zio != NULL) {
+		(void) zio_wait(vd->vdev_trim_zio);
+		vd->vdev_trim_zio = NULL;
+	}
+
+	if (zfs_trim && reassess) {
+		vd->vdev_trim_zio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
+		zio = zio_null(vd->vdev_trim_zio, spa, NULL, vdev_trim_done,
+		    NULL, ZIO_FLAG_CANFAIL);
+		spa_config_enter(spa, SCL_STATE, zio, RW_READER);
+	}
+
 	while ((msp = txg_list_remove(&vd->vdev_ms_list, TXG_CLEAN(txg))))
-		metaslab_sync_done(msp, txg);
+		metaslab_sync_done(msp, txg, zio, &trim_limit);
+
+	if (zio != NULL)
+		zio_nowait(zio);
 
 	if (reassess)
 		metaslab_sync_reassess(vd->vdev_mg);
@@ -3144,4 +3192,10 @@ EXPORT_SYMBOL(vdev_degrade);
 EXPORT_SYMBOL(vdev_online);
 EXPORT_SYMBOL(vdev_offline);
 EXPORT_SYMBOL(vdev_clear);
+
+module_param(zfs_trim, int, 0644);
+MODULE_PARM_DESC(zfs_trim, "TRIM freed space");
+
+module_param(zfs_trim_limit, ulong, 0644);
+MODULE_PARM_DESC(zfs_trim_limit, "Max bytes to TRIM per vdev per txg");
 #endif
@@ -137,8 +137,17 @@ vdev_disk_open(vdev_t *v, uint64_t *psize, uint64_t *ashift)
 	 * bdev we have a whole device and not simply a partition. */
 	v->vdev_wholedisk = !!(bdev->bd_contains == bdev);
 
-	/* Clear the nowritecache bit, causes vdev_reopen() to try again. */
+	/* Clear the nowritecache and notrim bits, causes vdev_reopen()
+	 * to try again. */
 	v->vdev_nowritecache = B_FALSE;
+	v->vdev_notrim = B_FALSE;
+
+#ifdef HAVE_BLK_QUEUE_NONROT
+	/* Inform the mirror read balancing whether the device seeks */
+	v->vdev_nonrot = blk_queue_nonrot(bdev_get_queue(bdev));
+#else
+	v->vdev_nonrot = B_FALSE;
+#endif /* HAVE_BLK_QUEUE_NONROT */
 
 	/* Physical volume size in bytes */
 	*psize = bdev_capacity(bdev) * block_size;
@@ -458,6 +467,55 @@ vdev_disk_io_flush(struct block_device *bdev, zio_t *zio)
 }
 #endif /* HAVE_BIO_EMPTY_BARRIER */
 
+/* 2.6.33 API change */
+#ifdef HAVE_BLK_QUEUE_DISCARD
+/*
+ * blkdev_issue_discard() splits the range into as many discard bios as
+ * the queue requires and sleeps until they complete, so it is called from
+ * the system taskq rather than the zio pipeline.
+ */
+static void
+vdev_disk_io_trim_task(void *arg)
+{
+	zio_t *zio = arg;
+	vdev_disk_t *vd = zio->io_vd->vdev_tsd;
+	int rc;
+
+	rc = blkdev_issue_discard(vd->vd_bdev, zio->io_offset >> 9,
+				  zio->io_size >> 9, GFP_NOFS, DISCARD_FL_WAIT);
+	zio->io_error = -rc;
+	if (rc && (rc == -EOPNOTSUPP))
+		zio->io_vd->vdev_notrim = B_TRUE;
+
+	zio_interrupt(zio);
+}
+
+static int
+vdev_disk_io_trim(struct block_device *bdev, zio_t *zio)
+{
+	struct request_queue *q;
+
+	q = bdev_get_queue(bdev);
+	if (!q)
+		return ENXIO;
+
+	if (!blk_queue_discard(q))
+		return ENOTSUP;
+
+	if (taskq_dispatch(system_taskq, vdev_disk_io_trim_task,
+			   zio, TQ_SLEEP) == 0)
+		return ENOMEM;
+
+	return 0;
+}
+#else
+static int
+vdev_disk_io_trim(struct block_device *bdev, zio_t *zio)
+{
+	return ENOTSUP;
+}
+#endif /* HAVE_BLK_QUEUE_DISCARD */
+
 static int
 vdev_disk_io_start(zio_t *zio)
 {
@@ -494,6 +552,23 @@ vdev_disk_io_start(zio_t *zio)
 
 			break;
 
+		case DKIOCFREE:
+
+			if (v->vdev_notrim) {
+				zio->io_error = ENOTSUP;
+				break;
+			}
+
+			error = vdev_disk_io_trim(vd->vd_bdev, zio);
+			if (error == 0)
+				return ZIO_PIPELINE_STOP;
+
+			zio->io_error = error;
+			if (error == ENOTSUP)
+				v->vdev_notrim = B_TRUE;
+
+			break;
+
 		default:
 			zio->io_error = ENOTSUP;
 		}
@@ -102,6 +102,12 @@ vdev_file_open(vdev_t *vd, uint64_t *psize, uint64_t *ashift)
 #endif
 
 skip_open:
+	/* Clear the notrim bit, causes vdev_reopen() to try again. */
+	vd->vdev_notrim = B_FALSE;
+
+	/* Files are assumed to be backed by rotating media. */
+	vd->vdev_nonrot = B_FALSE;
+
 	/*
 	 * Determine the physical size of the file.
 	 */
@@ -157,6 +163,17 @@ vdev_file_io_start(zio_t *zio)
 			zio->io_error = VOP_FSYNC(vf->vf_vnode, FSYNC | FDSYNC,
 			    kcred, NULL);
 			break;
+		case DKIOCFREE:
+#ifdef _KERNEL
+			/* The SPL vnode layer has no way to free space */
+			zio->io_error = ENOTSUP;
+#else
+			zio->io_error = vn_trim(vf->vf_vnode, zio->io_offset,
+			    zio->io_size);
+#endif
+			if (zio->io_error == ENOTSUP)
+				vd->vdev_notrim = B_TRUE;
+			break;
 		default:
 			zio->io_error = ENOTSUP;
 		}
@@ -52,6 +52,26 @@ typedef struct mirror_map {
 
 int vdev_mirror_shift = 21;
 
+/*
+ * Reads from a mirror go to the child with the lowest load, an estimate
+ * of how long the read would take there: the child's average service
+ * time from vdev_queue times the number of I/Os ahead of the read, plus
+ * one for the read itself, plus a seek increment.  On rotating media the
+ * increment is zfs_vdev_mirror_rotating_inc for a read that starts where
+ * the last I/O issued to the device ended, half of
+ * zfs_vdev_mirror_rotating_seek_inc within
+ * zfs_vdev_mirror_rotating_seek_offset bytes of it, and the full seek
+ * increment otherwise.  Non-rotating media only distinguish sequential
+ * reads from the rest.  Ties go to a child the read is sequential on,
+ * so that a sequential stream sticks to one child, and then to the child
+ * derived from the offset.
+ */
+int zfs_vdev_mirror_rotating_inc = 0;
+int zfs_vdev_mirror_rotating_seek_inc = 5;
+int zfs_vdev_mirror_rotating_seek_offset = 1 * 1024 * 1024;
+int zfs_vdev_mirror_non_rotating_inc = 0;
+int zfs_vdev_mirror_non_rotating_seek_inc = 1;
+
 static void
 vdev_mirror_map_free(zio_t *zio)
 {
@@ -140,6 +160,8 @@ vdev_mirror_open(vdev_t *vd, uint64_t *asize, uint64_t *ashift)
 
 	vdev_open_children(vd);
 
+	vd->vdev_nonrot = B_TRUE;
+
 	for (c = 0; c < vd->vdev_children; c++) {
 		vdev_t *cvd = vd->vdev_child[c];
 
@@ -151,6 +173,7 @@ vdev_mirror_open(vdev_t *vd, uint64_t *asize, uint64_t *ashift)
 
 		*asize = MIN(*asize - 1, cvd->vdev_asize - 1) + 1;
 		*ashift = MAX(*ashift, cvd->vdev_ashift);
+		vd->vdev_nonrot &= cvd->vdev_nonrot;
 	}
 
 	if (numerrors == vd->vdev_children) {
@@ -205,6 +228,46 @@ vdev_mirror_scrub_done(zio_t *zio)
 	mc->mc_skipped = 0;
 }
 
+/*
+ * Returns the load of reading from mc, and whether the read starts where
+ * the last I/O issued to the child ended.
+ */
+static uint64_t
+vdev_mirror_load(mirror_child_t *mc, boolean_t *sequential)
+{
+	vdev_t *vd = mc->mc_vd;
+	uint64_t lastoffset, distance;
+	int inc;
+
+	*sequential = B_FALSE;
+
+	/*
+	 * Only leaves have a queue to measure.  Rank anything else, such
+	 * as a replacing vdev below the mirror, behind every leaf.
+	 */
+	if (!vd->vdev_ops->vdev_op_leaf)
+		return (UINT64_MAX - 1);
+
+	lastoffset = vdev_queue_lastoffset(vd);
+	distance = (mc->mc_offset > lastoffset) ?
+	    mc->mc_offset - lastoffset : lastoffset - mc->mc_offset;
+	*sequential = (distance == 0);
+
+	if (vd->vdev_nonrot) {
+		inc = (distance == 0) ? zfs_vdev_mirror_non_rotating_inc :
+		    zfs_vdev_mirror_non_rotating_seek_inc;
+	} else if (distance == 0) {
+		inc = zfs_vdev_mirror_rotating_inc;
+	} else if (distance < zfs_vdev_mirror_rotating_seek_offset) {
+		inc = zfs_vdev_mirror_rotating_seek_inc / 2;
+	} else {
+		inc = zfs_vdev_mirror_rotating_seek_inc;
+	}
+
+	return ((vdev_queue_length(vd) + 1 + inc) *
+	    (vdev_queue_latency(vd) / 1000 + 1));
+}
+
 /*
  * Try to find a child whose DTL doesn't contain the block we want to read.
  * If we can't, try the read on any vdev we haven't already tried.
@@ -215,14 +278,18 @@ vdev_mirror_child_select(zio_t *zio)
 	mirror_map_t *mm = zio->io_vsd;
 	mirror_child_t *mc;
 	uint64_t txg = zio->io_txg;
-	int i, c;
+	uint64_t load, best_load = UINT64_MAX;
+	boolean_t sequential;
+	int i, c, best = -1;
 
 	ASSERT(zio->io_bp == NULL || BP_PHYSICAL_BIRTH(zio->io_bp) == txg);
 
 	/*
 	 * Try to find a child whose DTL doesn't contain the block to read.
 	 * If a child is known to be completely inaccessible (indicated by
-	 * vdev_readable() returning B_FALSE), don't even try.
+	 * vdev_readable() returning B_FALSE), don't even try.  Among the
+	 * children of a plain mirror, pick the least loaded; ditto blocks
+	 * and replacing or spare vdevs keep their preferred order.
 	 */
 	for (i = 0, c = mm->mm_preferred; i < mm->mm_children; i++, c++) {
 		if (c >= mm->mm_children)
@@ -236,20 +303,46 @@ vdev_mirror_child_select(zio_t *zio)
 			mc->mc_skipped = 1;
 			continue;
 		}
-		if (!vdev_dtl_contains(mc->mc_vd, DTL_MISSING, txg, 1))
-			return (c);
-		mc->mc_error = ESTALE;
-		mc->mc_skipped = 1;
-		mc->mc_speculative = 1;
+		if (vdev_dtl_contains(mc->mc_vd, DTL_MISSING, txg, 1)) {
+			mc->mc_error = ESTALE;
+			mc->mc_skipped = 1;
+			mc->mc_speculative = 1;
+			continue;
+		}
+		if (mm->mm_root || mm->mm_replacing) {
+			best = c;
+			break;
+		}
+		/*
+		 * A sequential stream only leaves its child for one that
+		 * is strictly less loaded.
+		 */
+		load = vdev_mirror_load(mc, &sequential);
+		if (load < best_load || (load == best_load && sequential)) {
+			best = c;
+			best_load = load;
+		}
 	}
 
-	/*
-	 * Every device is either missing or has this txg in its DTL.
-	 * Look for any child we haven't already tried before giving up.
-	 */
-	for (c = 0; c < mm->mm_children; c++)
-		if (!mm->mm_child[c].mc_tried)
-			return (c);
+	if (best == -1) {
+		/*
+		 * Every device is either missing or has this txg in its
+		 * DTL.  Look for any child we haven't already tried before
+		 * giving up.
+		 */
+		for (c = 0; c < mm->mm_children; c++) {
+			if (!mm->mm_child[c].mc_tried) {
+				best = c;
+				break;
+			}
+		}
+	}
+
+	if (best != -1) {
+		atomic_add_64(
+		    &mm->mm_child[best].mc_vd->vdev_stat.vs_mirror_selected, 1);
+		return (best);
+	}
 
 	/*
 	 * Every child failed.  There's no place left to look.
@@ -486,3 +579,20 @@ vdev_ops_t vdev_spare_ops = {
 	VDEV_TYPE_SPARE,	/* name of this vdev type */
 	B_FALSE			/* not a leaf vdev */
 };
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_vdev_mirror_rotating_inc, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_mirror_rotating_inc, "Rotating media load increment for sequential reads");
+
+module_param(zfs_vdev_mirror_rotating_seek_inc, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_mirror_rotating_seek_inc, "Rotating media load increment for seeking reads");
+
+module_param(zfs_vdev_mirror_rotating_seek_offset, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_mirror_rotating_seek_offset, "Offset within which rotating media reads pay half the seek increment");
+
+module_param(zfs_vdev_mirror_non_rotating_inc, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_mirror_non_rotating_inc, "Non-rotating media load increment for sequential reads");
+
+module_param(zfs_vdev_mirror_non_rotating_seek_inc, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_mirror_non_rotating_seek_inc, "Non-rotating media load increment for seeking reads");
+#endif
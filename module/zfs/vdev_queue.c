@@ -27,24 +27,50 @@
 #include <sys/vdev_impl.h>
 #include <sys/zio.h>
 #include <sys/avl.h>
+#include <sys/dsl_pool.h>
+#include <sys/kstat.h>
 
 /*
- * These tunables are for performance analysis.
- */
-/*
- * zfs_vdev_max_pending is the maximum number of i/os concurrently
- * pending to each device.  zfs_vdev_min_pending is the initial number
- * of i/os pending to each device (before it starts ramping up to
- * max_pending).
+ * Each leaf vdev queues its I/O in one of the classes of zio_queue_class_t:
+ * synchronous reads and writes (someone is waiting for them), asynchronous
+ * reads (prefetch, cache fill) and writes (txg sync, frees), and scrub and
+ * resilver I/O.  Every class has a minimum and a maximum number of I/Os it
+ * may have active on the device.  When choosing the next I/O to issue, we
+ * first serve any class that is below its minimum, in class order, then
+ * any class that is below its maximum.  zfs_vdev_max_pending caps the
+ * total number of I/Os active on the device across all classes.
+ *
+ * Within a class, I/Os are issued in deadline order; see vdev_queue_io().
+ *
+ * The maximum for async writes scales with the amount of dirty data in
+ * the pool.  Below zfs_vdev_async_write_active_min_dirty_percent of the
+ * write limit we issue zfs_vdev_async_write_min_active writes, above
+ * zfs_vdev_async_write_active_max_dirty_percent we allow
+ * zfs_vdev_async_write_max_active, and in between we interpolate
+ * linearly.  This lets txg sync run with a shallow queue, and so stay
+ * out of the way of sync reads, unless writers are about to be throttled.
  */
-int zfs_vdev_max_pending = 10;
-int zfs_vdev_min_pending = 4;
+int zfs_vdev_max_pending = 1000;
+
+int zfs_vdev_sync_read_min_active = 10;
+int zfs_vdev_sync_read_max_active = 10;
+int zfs_vdev_sync_write_min_active = 10;
+int zfs_vdev_sync_write_max_active = 10;
+int zfs_vdev_async_read_min_active = 1;
+int zfs_vdev_async_read_max_active = 3;
+int zfs_vdev_async_write_min_active = 1;
+int zfs_vdev_async_write_max_active = 10;
+int zfs_vdev_scrub_min_active = 1;
+int zfs_vdev_scrub_max_active = 2;
+
+int zfs_vdev_async_write_active_min_dirty_percent = 30;
+int zfs_vdev_async_write_active_max_dirty_percent = 60;
 
 /* deadline = pri + ddi_get_lbolt64() >> time_shift) */
 int zfs_vdev_time_shift = 6;
 
-/* exponential I/O issue ramp-up rate */
-int zfs_vdev_ramp_rate = 2;
+/* weight of a new sample in the average service time is 2^-latency_shift */
+int zfs_vdev_latency_shift = 3;
 
 /*
  * To reduce IOPs, we aggregate small adjacent I/Os into one large I/O.
@@ -56,6 +82,70 @@ int zfs_vdev_aggregation_limit = SPA_MAXBLOCKSIZE;
 int zfs_vdev_read_gap_limit = 32 << 10;
 int zfs_vdev_write_gap_limit = 4 << 10;
 
+/*
+ * Per-class statistics, summed over all leaf vdevs.  "queued" and "active"
+ * are the I/Os currently waiting and on the device.  "issued" counts the
+ * I/Os that have left the queue and "wait_time" the nanoseconds they spent
+ * in it; "completed" counts the I/Os the device finished, aggregates
+ * counting once, and "service_time" the nanoseconds they were active.
+ */
+typedef struct vdev_queue_class_stats {
+	kstat_named_t	vqs_queued;
+	kstat_named_t	vqs_active;
+	kstat_named_t	vqs_issued;
+	kstat_named_t	vqs_wait_time;
+	kstat_named_t	vqs_completed;
+	kstat_named_t	vqs_service_time;
+} vdev_queue_class_stats_t;
+
+static vdev_queue_class_stats_t vdev_queue_stats[ZIO_QUEUE_CLASSES] = {
+	{
+		{ "sync_read_queued",		KSTAT_DATA_UINT64 },
+		{ "sync_read_active",		KSTAT_DATA_UINT64 },
+		{ "sync_read_issued",		KSTAT_DATA_UINT64 },
+		{ "sync_read_wait_time",	KSTAT_DATA_UINT64 },
+		{ "sync_read_completed",	KSTAT_DATA_UINT64 },
+		{ "sync_read_service_time",	KSTAT_DATA_UINT64 }
+	},
+	{
+		{ "sync_write_queued",		KSTAT_DATA_UINT64 },
+		{ "sync_write_active",		KSTAT_DATA_UINT64 },
+		{ "sync_write_issued",		KSTAT_DATA_UINT64 },
+		{ "sync_write_wait_time",	KSTAT_DATA_UINT64 },
+		{ "sync_write_completed",	KSTAT_DATA_UINT64 },
+		{ "sync_write_service_time",	KSTAT_DATA_UINT64 }
+	},
+	{
+		{ "async_read_queued",		KSTAT_DATA_UINT64 },
+		{ "async_read_active",		KSTAT_DATA_UINT64 },
+		{ "async_read_issued",		KSTAT_DATA_UINT64 },
+		{ "async_read_wait_time",	KSTAT_DATA_UINT64 },
+		{ "async_read_completed",	KSTAT_DATA_UINT64 },
+		{ "async_read_service_time",	KSTAT_DATA_UINT64 }
+	},
+	{
+		{ "async_write_queued",		KSTAT_DATA_UINT64 },
+		{ "async_write_active",		KSTAT_DATA_UINT64 },
+		{ "async_write_issued",		KSTAT_DATA_UINT64 },
+		{ "async_write_wait_time",	KSTAT_DATA_UINT64 },
+		{ "async_write_completed",	KSTAT_DATA_UINT64 },
+		{ "async_write_service_time",	KSTAT_DATA_UINT64 }
+	},
+	{
+		{ "scrub_queued",		KSTAT_DATA_UINT64 },
+		{ "scrub_active",		KSTAT_DATA_UINT64 },
+		{ "scrub_issued",		KSTAT_DATA_UINT64 },
+		{ "scrub_wait_time",		KSTAT_DATA_UINT64 },
+		{ "scrub_completed",		KSTAT_DATA_UINT64 },
+		{ "scrub_service_time",		KSTAT_DATA_UINT64 }
+	}
+};
+
+#define	VQSTAT_ADD(class, stat, val)					\
+	atomic_add_64(&vdev_queue_stats[(class)].stat.value.ui64, (val))
+
+kstat_t *vdev_queue_ksp = NULL;
+
 /*
  * Virtual device vector for disk I/O scheduling.
  */
@@ -106,11 +196,16 @@ void
 vdev_queue_init(vdev_t *vd)
 {
 	vdev_queue_t *vq = &vd->vdev_queue;
+	int c;
 
 	mutex_init(&vq->vq_lock, NULL, MUTEX_DEFAULT, NULL);
 
-	avl_create(&vq->vq_deadline_tree, vdev_queue_deadline_compare,
-	    sizeof (zio_t), offsetof(struct zio, io_deadline_node));
+	for (c = 0; c < ZIO_QUEUE_CLASSES; c++) {
+		avl_create(&vq->vq_class[c].vqc_queued_tree,
+		    vdev_queue_deadline_compare, sizeof (zio_t),
+		    offsetof(struct zio, io_deadline_node));
+		vq->vq_class[c].vqc_active = 0;
+	}
 
 	avl_create(&vq->vq_read_tree, vdev_queue_offset_compare,
 	    sizeof (zio_t), offsetof(struct zio, io_offset_node));
@@ -126,8 +221,10 @@ void
 vdev_queue_fini(vdev_t *vd)
 {
 	vdev_queue_t *vq = &vd->vdev_queue;
+	int c;
 
-	avl_destroy(&vq->vq_deadline_tree);
+	for (c = 0; c < ZIO_QUEUE_CLASSES; c++)
+		avl_destroy(&vq->vq_class[c].vqc_queued_tree);
 	avl_destroy(&vq->vq_read_tree);
 	avl_destroy(&vq->vq_write_tree);
 	avl_destroy(&vq->vq_pending_tree);
@@ -135,18 +232,225 @@ vdev_queue_fini(vdev_t *vd)
 	mutex_destroy(&vq->vq_lock);
 }
 
+/*
+ * Load hints for the mirror read balancing.  These are read without the
+ * queue lock and may be slightly stale.
+ */
+int
+vdev_queue_length(vdev_t *vd)
+{
+	vdev_queue_t *vq = &vd->vdev_queue;
+	int c, length = avl_numnodes(&vq->vq_pending_tree);
+
+	for (c = 0; c < ZIO_QUEUE_CLASSES; c++)
+		length += avl_numnodes(&vq->vq_class[c].vqc_queued_tree);
+
+	return (length);
+}
+
+/*
+ * The end of the last I/O issued, as an offset past the front labels like
+ * the offsets the vdevs above the leaf work with.  Label I/O counts as
+ * offset 0.
+ */
+uint64_t
+vdev_queue_lastoffset(vdev_t *vd)
+{
+	uint64_t offset = vd->vdev_queue.vq_lastoffset;
+
+	return (offset > VDEV_LABEL_START_SIZE ?
+	    offset - VDEV_LABEL_START_SIZE : 0);
+}
+
+hrtime_t
+vdev_queue_latency(vdev_t *vd)
+{
+	return (vd->vdev_queue.vq_latency);
+}
+
+void
+vdev_queue_stat_init(void)
+{
+	vdev_queue_ksp = kstat_create("zfs", 0, "vdev_queue_stats", "misc",
+	    KSTAT_TYPE_NAMED, ZIO_QUEUE_CLASSES *
+	    sizeof (vdev_queue_class_stats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (vdev_queue_ksp != NULL) {
+		vdev_queue_ksp->ks_data = &vdev_queue_stats;
+		kstat_install(vdev_queue_ksp);
+	}
+}
+
+void
+vdev_queue_stat_fini(void)
+{
+	if (vdev_queue_ksp != NULL) {
+		kstat_delete(vdev_queue_ksp);
+		vdev_queue_ksp = NULL;
+	}
+}
+
+static zio_queue_class_t
+vdev_queue_class(zio_t *zio)
+{
+	if (zio->io_flags & (ZIO_FLAG_SCRUB | ZIO_FLAG_RESILVER))
+		return (ZIO_QUEUE_SCRUB);
+
+	if (zio->io_type == ZIO_TYPE_READ)
+		return (zio->io_priority > ZIO_PRIORITY_SYNC_READ ?
+		    ZIO_QUEUE_ASYNC_READ : ZIO_QUEUE_SYNC_READ);
+
+	return (zio->io_priority > ZIO_PRIORITY_SYNC_WRITE ?
+	    ZIO_QUEUE_ASYNC_WRITE : ZIO_QUEUE_SYNC_WRITE);
+}
+
+static int
+vdev_queue_class_min_active(zio_queue_class_t c)
+{
+	switch (c) {
+	case ZIO_QUEUE_SYNC_READ:
+		return (zfs_vdev_sync_read_min_active);
+	case ZIO_QUEUE_SYNC_WRITE:
+		return (zfs_vdev_sync_write_min_active);
+	case ZIO_QUEUE_ASYNC_READ:
+		return (zfs_vdev_async_read_min_active);
+	case ZIO_QUEUE_ASYNC_WRITE:
+		return (zfs_vdev_async_write_min_active);
+	case ZIO_QUEUE_SCRUB:
+		return (zfs_vdev_scrub_min_active);
+	default:
+		panic("invalid vdev queue class %d", c);
+		return (0);
+	}
+}
+
+static int
+vdev_queue_max_async_writes(spa_t *spa)
+{
+	dsl_pool_t *dp = spa_get_dsl(spa);
+	uint64_t min_pct = zfs_vdev_async_write_active_min_dirty_percent;
+	uint64_t max_pct = zfs_vdev_async_write_active_max_dirty_percent;
+	uint64_t dirty;
+
+	/*
+	 * Writes issued while the pool is being opened are not covered
+	 * by the write limit; don't hold them back.
+	 */
+	if (dp == NULL)
+		return (zfs_vdev_async_write_max_active);
+
+	dirty = dsl_pool_dirty_percent(dp);
+	if (dirty <= min_pct)
+		return (zfs_vdev_async_write_min_active);
+	if (dirty >= max_pct)
+		return (zfs_vdev_async_write_max_active);
+
+	return (zfs_vdev_async_write_min_active + (dirty - min_pct) *
+	    (zfs_vdev_async_write_max_active -
+	    zfs_vdev_async_write_min_active) / (max_pct - min_pct));
+}
+
+static int
+vdev_queue_class_max_active(spa_t *spa, zio_queue_class_t c)
+{
+	switch (c) {
+	case ZIO_QUEUE_SYNC_READ:
+		return (zfs_vdev_sync_read_max_active);
+	case ZIO_QUEUE_SYNC_WRITE:
+		return (zfs_vdev_sync_write_max_active);
+	case ZIO_QUEUE_ASYNC_READ:
+		return (zfs_vdev_async_read_max_active);
+	case ZIO_QUEUE_ASYNC_WRITE:
+		return (vdev_queue_max_async_writes(spa));
+	case ZIO_QUEUE_SCRUB:
+		return (zfs_vdev_scrub_max_active);
+	default:
+		panic("invalid vdev queue class %d", c);
+		return (0);
+	}
+}
+
+/*
+ * Return the class of the next I/O to issue, or ZIO_QUEUE_CLASSES if
+ * nothing may be issued right now.
+ */
+static zio_queue_class_t
+vdev_queue_class_to_issue(vdev_queue_t *vq, spa_t *spa)
+{
+	zio_queue_class_t c;
+
+	ASSERT(MUTEX_HELD(&vq->vq_lock));
+
+	if (avl_numnodes(&vq->vq_pending_tree) >= zfs_vdev_max_pending)
+		return (ZIO_QUEUE_CLASSES);
+
+	for (c = 0; c < ZIO_QUEUE_CLASSES; c++) {
+		if (avl_numnodes(&vq->vq_class[c].vqc_queued_tree) > 0 &&
+		    vq->vq_class[c].vqc_active <
+		    vdev_queue_class_min_active(c))
+			return (c);
+	}
+
+	for (c = 0; c < ZIO_QUEUE_CLASSES; c++) {
+		if (avl_numnodes(&vq->vq_class[c].vqc_queued_tree) > 0 &&
+		    vq->vq_class[c].vqc_active <
+		    vdev_queue_class_max_active(spa, c))
+			return (c);
+	}
+
+	return (ZIO_QUEUE_CLASSES);
+}
+
 static void
 vdev_queue_io_add(vdev_queue_t *vq, zio_t *zio)
 {
-	avl_add(&vq->vq_deadline_tree, zio);
+	zio_queue_class_t c = zio->io_queue_class;
+
+	zio->io_queued = gethrtime();
+	avl_add(&vq->vq_class[c].vqc_queued_tree, zio);
 	avl_add(zio->io_vdev_tree, zio);
+	VQSTAT_ADD(c, vqs_queued, 1);
 }
 
 static void
 vdev_queue_io_remove(vdev_queue_t *vq, zio_t *zio)
 {
-	avl_remove(&vq->vq_deadline_tree, zio);
+	zio_queue_class_t c = zio->io_queue_class;
+
+	avl_remove(&vq->vq_class[c].vqc_queued_tree, zio);
 	avl_remove(zio->io_vdev_tree, zio);
+	VQSTAT_ADD(c, vqs_queued, -1);
+	VQSTAT_ADD(c, vqs_issued, 1);
+	VQSTAT_ADD(c, vqs_wait_time, gethrtime() - zio->io_queued);
+}
+
+static void
+vdev_queue_pending_add(vdev_queue_t *vq, zio_t *zio)
+{
+	zio_queue_class_t c = zio->io_queue_class;
+
+	zio->io_dispatched = gethrtime();
+	avl_add(&vq->vq_pending_tree, zio);
+	vq->vq_class[c].vqc_active++;
+	VQSTAT_ADD(c, vqs_active, 1);
+
+	vq->vq_lastoffset = zio->io_offset + zio->io_size;
+}
+
+static void
+vdev_queue_pending_remove(vdev_queue_t *vq, zio_t *zio)
+{
+	zio_queue_class_t c = zio->io_queue_class;
+	hrtime_t delta = gethrtime() - zio->io_dispatched;
+
+	avl_remove(&vq->vq_pending_tree, zio);
+	ASSERT(vq->vq_class[c].vqc_active > 0);
+	vq->vq_class[c].vqc_active--;
+	VQSTAT_ADD(c, vqs_active, -1);
+	VQSTAT_ADD(c, vqs_completed, 1);
+	VQSTAT_ADD(c, vqs_service_time, delta);
+
+	vq->vq_latency += (delta - vq->vq_latency) >> zfs_vdev_latency_shift;
 }
 
 static void
@@ -172,9 +476,10 @@ vdev_queue_agg_io_done(zio_t *aio)
 #define	IO_GAP(fio, lio) (-IO_SPAN(lio, fio))
 
 static zio_t *
-vdev_queue_io_to_issue(vdev_queue_t *vq, uint64_t pending_limit)
+vdev_queue_io_to_issue(vdev_queue_t *vq, spa_t *spa)
 {
 	zio_t *fio, *lio, *aio, *dio, *nio, *mio;
+	zio_queue_class_t c;
 	avl_tree_t *t;
 	int flags;
 	uint64_t maxspan = zfs_vdev_aggregation_limit;
@@ -184,11 +489,15 @@ vdev_queue_io_to_issue(vdev_queue_t *vq, uint64_t pending_limit)
 again:
 	ASSERT(MUTEX_HELD(&vq->vq_lock));
 
-	if (avl_numnodes(&vq->vq_pending_tree) >= pending_limit ||
-	    avl_numnodes(&vq->vq_deadline_tree) == 0)
+	c = vdev_queue_class_to_issue(vq, spa);
+	if (c == ZIO_QUEUE_CLASSES)
 		return (NULL);
 
-	fio = lio = avl_first(&vq->vq_deadline_tree);
+	/*
+	 * The aggregate below may pull in adjacent I/Os of other classes;
+	 * it counts against the class of the I/O that started it.
+	 */
+	fio = lio = avl_first(&vq->vq_class[c].vqc_queued_tree);
 
 	t = fio->io_vdev_tree;
 	flags = fio->io_flags & ZIO_FLAG_AGG_INHERIT;
@@ -288,6 +597,7 @@ again:
 		    zio_buf_alloc(size), size, fio->io_type, ZIO_PRIORITY_AGG,
 		    flags | ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_QUEUE,
 		    vdev_queue_agg_io_done, NULL);
+		aio->io_queue_class = c;
 
 		nio = fio;
 		do {
@@ -312,7 +622,7 @@ again:
 			zio_execute(dio);
 		} while (dio != lio);
 
-		avl_add(&vq->vq_pending_tree, aio);
+		vdev_queue_pending_add(vq, aio);
 
 		return (aio);
 	}
@@ -334,7 +644,7 @@ again:
 		goto again;
 	}
 
-	avl_add(&vq->vq_pending_tree, fio);
+	vdev_queue_pending_add(vq, fio);
 
 	return (fio);
 }
@@ -356,6 +666,7 @@ vdev_queue_io(zio_t *zio)
 		zio->io_vdev_tree = &vq->vq_read_tree;
 	else
 		zio->io_vdev_tree = &vq->vq_write_tree;
+	zio->io_queue_class = vdev_queue_class(zio);
 
 	mutex_enter(&vq->vq_lock);
 
@@ -364,7 +675,7 @@ vdev_queue_io(zio_t *zio)
 
 	vdev_queue_io_add(vq, zio);
 
-	nio = vdev_queue_io_to_issue(vq, zfs_vdev_min_pending);
+	nio = vdev_queue_io_to_issue(vq, zio->io_spa);
 
 	mutex_exit(&vq->vq_lock);
 
@@ -383,16 +694,13 @@ void
 vdev_queue_io_done(zio_t *zio)
 {
 	vdev_queue_t *vq = &zio->io_vd->vdev_queue;
-	int i;
+	zio_t *nio;
 
 	mutex_enter(&vq->vq_lock);
 
-	avl_remove(&vq->vq_pending_tree, zio);
+	vdev_queue_pending_remove(vq, zio);
 
-	for (i = 0; i < zfs_vdev_ramp_rate; i++) {
-		zio_t *nio = vdev_queue_io_to_issue(vq, zfs_vdev_max_pending);
-		if (nio == NULL)
-			break;
+	while ((nio = vdev_queue_io_to_issue(vq, zio->io_spa)) != NULL) {
 		mutex_exit(&vq->vq_lock);
 		if (nio->io_done == vdev_queue_agg_io_done) {
 			zio_nowait(nio);
@@ -410,8 +718,41 @@ vdev_queue_io_done(zio_t *zio)
 module_param(zfs_vdev_max_pending, int, 0644);
 MODULE_PARM_DESC(zfs_vdev_max_pending, "Maximum pending VDEV IO");
 
-module_param(zfs_vdev_min_pending, int, 0644);
-MODULE_PARM_DESC(zfs_vdev_min_pending, "Minimum pending VDEV IO");
+module_param(zfs_vdev_sync_read_min_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_sync_read_min_active, "Min active sync read IOs per VDEV");
+
+module_param(zfs_vdev_sync_read_max_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_sync_read_max_active, "Max active sync read IOs per VDEV");
+
+module_param(zfs_vdev_sync_write_min_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_sync_write_min_active, "Min active sync write IOs per VDEV");
+
+module_param(zfs_vdev_sync_write_max_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_sync_write_max_active, "Max active sync write IOs per VDEV");
+
+module_param(zfs_vdev_async_read_min_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_async_read_min_active, "Min active async read IOs per VDEV");
+
+module_param(zfs_vdev_async_read_max_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_async_read_max_active, "Max active async read IOs per VDEV");
+
+module_param(zfs_vdev_async_write_min_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_async_write_min_active, "Min active async write IOs per VDEV");
+
+module_param(zfs_vdev_async_write_max_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_async_write_max_active, "Max active async write IOs per VDEV");
+
+module_param(zfs_vdev_scrub_min_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_scrub_min_active, "Min active scrub/resilver IOs per VDEV");
+
+module_param(zfs_vdev_scrub_max_active, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_scrub_max_active, "Max active scrub/resilver IOs per VDEV");
+
+module_param(zfs_vdev_async_write_active_min_dirty_percent, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_async_write_active_min_dirty_percent, "Dirty data percent below which async writes use min active");
+
+module_param(zfs_vdev_async_write_active_max_dirty_percent, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_async_write_active_max_dirty_percent, "Dirty data percent above which async writes use max active");
 
 module_param(zfs_vdev_aggregation_limit, int, 0644);
 MODULE_PARM_DESC(zfs_vdev_aggregation_limit, "Maximum VDEV IO aggregation");
@@ -26,6 +26,7 @@
 #include <sys/zfs_context.h>
 #include <sys/spa.h>
 #include <sys/vdev_impl.h>
+#include <sys/vdev_raidz.h>
 #include <sys/zio.h>
 #include <sys/zio_checksum.h>
 #include <sys/fs/zfs.h>
@@ -132,26 +133,6 @@ typedef struct raidz_map {
 #define	VDEV_RAIDZ_MUL_2(x)	(((x) << 1) ^ (((x) & 0x80) ? 0x1d : 0))
 #define	VDEV_RAIDZ_MUL_4(x)	(VDEV_RAIDZ_MUL_2(VDEV_RAIDZ_MUL_2(x)))
 
-/*
- * We provide a mechanism to perform the field multiplication operation on a
- * 64-bit value all at once rather than a byte at a time. This works by
- * creating a mask from the top bit in each byte and using that to
- * conditionally apply the XOR of 0x1d.
- */
-#define	VDEV_RAIDZ_64MUL_2(x, mask) \
-{ \
-	(mask) = (x) & 0x8080808080808080ULL; \
-	(mask) = ((mask) << 1) - ((mask) >> 7); \
-	(x) = (((x) << 1) & 0xfefefefefefefefeULL) ^ \
-	    ((mask) & 0x1d1d1d1d1d1d1d1dULL); \
-}
-
-#define	VDEV_RAIDZ_64MUL_4(x, mask) \
-{ \
-	VDEV_RAIDZ_64MUL_2((x), mask); \
-	VDEV_RAIDZ_64MUL_2((x), mask); \
-}
-
 /*
  * Force reconstruction to use the general purpose method.
  */
@@ -161,7 +142,7 @@ int vdev_raidz_default_to_general;
  * These two tables represent powers and logs of 2 in the Galois field defined
  * above. These values were computed by repeatedly multiplying by 2 as above.
  */
-static const uint8_t vdev_raidz_pow2[256] = {
+const uint8_t vdev_raidz_pow2[256] = {
 	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
 	0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
 	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9,
@@ -195,7 +176,7 @@ static const uint8_t vdev_raidz_pow2[256] = {
 	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83,
 	0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01
 };
-static const uint8_t vdev_raidz_log2[256] = {
+const uint8_t vdev_raidz_log2[256] = {
 	0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6,
 	0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
 	0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81,
@@ -555,26 +536,23 @@ vdev_raidz_map_alloc(zio_t *zio, uint64_t unit_shift, uint64_t dcols,
 static void
 vdev_raidz_generate_parity_p(raidz_map_t *rm)
 {
-	uint64_t *p, *src, pcount, ccount, i;
+	const raidz_impl_ops_t *ops = vdev_raidz_math_get_ops();
+	uint64_t csize;
+	void *p, *src;
 	int c;
 
-	pcount = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
+	p = rm->rm_col[VDEV_RAIDZ_P].rc_data;
 
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
 		src = rm->rm_col[c].rc_data;
-		p = rm->rm_col[VDEV_RAIDZ_P].rc_data;
-		ccount = rm->rm_col[c].rc_size / sizeof (src[0]);
+		csize = rm->rm_col[c].rc_size;
 
 		if (c == rm->rm_firstdatacol) {
-			ASSERT(ccount == pcount);
-			for (i = 0; i < ccount; i++, src++, p++) {
-				*p = *src;
-			}
+			ASSERT3U(csize, ==, rm->rm_col[VDEV_RAIDZ_P].rc_size);
+			bcopy(src, p, csize);
 		} else {
-			ASSERT(ccount <= pcount);
-			for (i = 0; i < ccount; i++, src++, p++) {
-				*p ^= *src;
-			}
+			ASSERT3U(csize, <=, rm->rm_col[VDEV_RAIDZ_P].rc_size);
+			ops->rzo_gen_p(p, src, csize);
 		}
 	}
 }
@@ -582,51 +560,36 @@ vdev_raidz_generate_parity_p(raidz_map_t *rm)
 static void
 vdev_raidz_generate_parity_pq(raidz_map_t *rm)
 {
-	uint64_t *p, *q, *src, pcnt, ccnt, mask, i;
+	const raidz_impl_ops_t *ops = vdev_raidz_math_get_ops();
+	uint64_t psize, csize;
+	char *p, *q, *src;
 	int c;
 
-	pcnt = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
+	psize = rm->rm_col[VDEV_RAIDZ_P].rc_size;
 	ASSERT(rm->rm_col[VDEV_RAIDZ_P].rc_size ==
 	    rm->rm_col[VDEV_RAIDZ_Q].rc_size);
+	p = rm->rm_col[VDEV_RAIDZ_P].rc_data;
+	q = rm->rm_col[VDEV_RAIDZ_Q].rc_data;
 
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
 		src = rm->rm_col[c].rc_data;
-		p = rm->rm_col[VDEV_RAIDZ_P].rc_data;
-		q = rm->rm_col[VDEV_RAIDZ_Q].rc_data;
-
-		ccnt = rm->rm_col[c].rc_size / sizeof (src[0]);
+		csize = rm->rm_col[c].rc_size;
 
 		if (c == rm->rm_firstdatacol) {
-			ASSERT(ccnt == pcnt || ccnt == 0);
-			for (i = 0; i < ccnt; i++, src++, p++, q++) {
-				*p = *src;
-				*q = *src;
-			}
-			for (; i < pcnt; i++, src++, p++, q++) {
-				*p = 0;
-				*q = 0;
-			}
+			ASSERT(csize == psize || csize == 0);
+			bcopy(src, p, csize);
+			bcopy(src, q, csize);
+			bzero(p + csize, psize - csize);
+			bzero(q + csize, psize - csize);
 		} else {
-			ASSERT(ccnt <= pcnt);
-
 			/*
 			 * Apply the algorithm described above by multiplying
 			 * the previous result and adding in the new value.
+			 * Short columns are treated as though they are full
+			 * of 0s.
 			 */
-			for (i = 0; i < ccnt; i++, src++, p++, q++) {
-				*p ^= *src;
-
-				VDEV_RAIDZ_64MUL_2(*q, mask);
-				*q ^= *src;
-			}
-
-			/*
-			 * Treat short columns as though they are full of 0s.
-			 * Note that there's therefore nothing needed for P.
-			 */
-			for (; i < pcnt; i++, q++) {
-				VDEV_RAIDZ_64MUL_2(*q, mask);
-			}
+			ASSERT(csize <= psize);
+			ops->rzo_gen_pq(p, q, src, csize, psize);
 		}
 	}
 }
@@ -634,60 +597,35 @@ vdev_raidz_generate_parity_pq(raidz_map_t *rm)
 static void
 vdev_raidz_generate_parity_pqr(raidz_map_t *rm)
 {
-	uint64_t *p, *q, *r, *src, pcnt, ccnt, mask, i;
+	const raidz_impl_ops_t *ops = vdev_raidz_math_get_ops();
+	uint64_t psize, csize;
+	char *p, *q, *r, *src;
 	int c;
 
-	pcnt = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
+	psize = rm->rm_col[VDEV_RAIDZ_P].rc_size;
 	ASSERT(rm->rm_col[VDEV_RAIDZ_P].rc_size ==
 	    rm->rm_col[VDEV_RAIDZ_Q].rc_size);
 	ASSERT(rm->rm_col[VDEV_RAIDZ_P].rc_size ==
 	    rm->rm_col[VDEV_RAIDZ_R].rc_size);
+	p = rm->rm_col[VDEV_RAIDZ_P].rc_data;
+	q = rm->rm_col[VDEV_RAIDZ_Q].rc_data;
+	r = rm->rm_col[VDEV_RAIDZ_R].rc_data;
 
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
 		src = rm->rm_col[c].rc_data;
-		p = rm->rm_col[VDEV_RAIDZ_P].rc_data;
-		q = rm->rm_col[VDEV_RAIDZ_Q].rc_data;
-		r = rm->rm_col[VDEV_RAIDZ_R].rc_data;
-
-		ccnt = rm->rm_col[c].rc_size / sizeof (src[0]);
+		csize = rm->rm_col[c].rc_size;
 
 		if (c == rm->rm_firstdatacol) {
-			ASSERT(ccnt == pcnt || ccnt == 0);
-			for (i = 0; i < ccnt; i++, src++, p++, q++, r++) {
-				*p = *src;
-				*q = *src;
-				*r = *src;
-			}
-			for (; i < pcnt; i++, src++, p++, q++, r++) {
-				*p = 0;
-				*q = 0;
-				*r = 0;
-			}
+			ASSERT(csize == psize || csize == 0);
+			bcopy(src, p, csize);
+			bcopy(src, q, csize);
+			bcopy(src, r, csize);
+			bzero(p + csize, psize - csize);
+			bzero(q + csize, psize - csize);
+			bzero(r + csize, psize - csize);
 		} else {
-			ASSERT(ccnt <= pcnt);
-
-			/*
-			 * Apply the algorithm described above by multiplying
-			 * the previous result and adding in the new value.
-			 */
-			for (i = 0; i < ccnt; i++, src++, p++, q++, r++) {
-				*p ^= *src;
-
-				VDEV_RAIDZ_64MUL_2(*q, mask);
-				*q ^= *src;
-
-				VDEV_RAIDZ_64MUL_4(*r, mask);
-				*r ^= *src;
-			}
-
-			/*
-			 * Treat short columns as though they are full of 0s.
-			 * Note that there's therefore nothing needed for P.
-			 */
-			for (; i < pcnt; i++, q++, r++) {
-				VDEV_RAIDZ_64MUL_2(*q, mask);
-				VDEV_RAIDZ_64MUL_4(*r, mask);
-			}
+			ASSERT(csize <= psize);
+			ops->rzo_gen_pqr(p, q, r, src, csize, psize);
 		}
 	}
 }
@@ -717,7 +655,9 @@ vdev_raidz_generate_parity(raidz_map_t *rm)
 static int
 vdev_raidz_reconstruct_p(raidz_map_t *rm, int *tgts, int ntgts)
 {
-	uint64_t *dst, *src, xcount, ccount, count, i;
+	const raidz_impl_ops_t *ops = vdev_raidz_math_get_ops();
+	uint64_t xsize, csize;
+	void *dst;
 	int x = tgts[0];
 	int c;
 
@@ -725,29 +665,19 @@ vdev_raidz_reconstruct_p(raidz_map_t *rm, int *tgts, int ntgts)
 	ASSERT(x >= rm->rm_firstdatacol);
 	ASSERT(x < rm->rm_cols);
 
-	xcount = rm->rm_col[x].rc_size / sizeof (src[0]);
-	ASSERT(xcount <= rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]));
-	ASSERT(xcount > 0);
+	xsize = rm->rm_col[x].rc_size;
+	ASSERT(xsize <= rm->rm_col[VDEV_RAIDZ_P].rc_size);
+	ASSERT(xsize > 0);
 
-	src = rm->rm_col[VDEV_RAIDZ_P].rc_data;
 	dst = rm->rm_col[x].rc_data;
-	for (i = 0; i < xcount; i++, dst++, src++) {
-		*dst = *src;
-	}
+	bcopy(rm->rm_col[VDEV_RAIDZ_P].rc_data, dst, xsize);
 
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
-		src = rm->rm_col[c].rc_data;
-		dst = rm->rm_col[x].rc_data;
-
 		if (c == x)
 			continue;
 
-		ccount = rm->rm_col[c].rc_size / sizeof (src[0]);
-		count = MIN(ccount, xcount);
-
-		for (i = 0; i < count; i++, dst++, src++) {
-			*dst ^= *src;
-		}
+		csize = rm->rm_col[c].rc_size;
+		ops->rzo_gen_p(dst, rm->rm_col[c].rc_data, MIN(csize, xsize));
 	}
 
 	return (1 << VDEV_RAIDZ_P);
@@ -756,57 +686,40 @@ vdev_raidz_reconstruct_p(raidz_map_t *rm, int *tgts, int ntgts)
 static int
 vdev_raidz_reconstruct_q(raidz_map_t *rm, int *tgts, int ntgts)
 {
-	uint64_t *dst, *src, xcount, ccount, count, mask, i;
-	uint8_t *b;
+	const raidz_impl_ops_t *ops = vdev_raidz_math_get_ops();
+	uint64_t xsize, csize, size;
+	char *dst, *src;
 	int x = tgts[0];
-	int c, j, exp;
+	int c, exp;
 
 	ASSERT(ntgts == 1);
 
-	xcount = rm->rm_col[x].rc_size / sizeof (src[0]);
-	ASSERT(xcount <= rm->rm_col[VDEV_RAIDZ_Q].rc_size / sizeof (src[0]));
+	xsize = rm->rm_col[x].rc_size;
+	ASSERT(xsize <= rm->rm_col[VDEV_RAIDZ_Q].rc_size);
 
+	dst = rm->rm_col[x].rc_data;
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
 		src = rm->rm_col[c].rc_data;
-		dst = rm->rm_col[x].rc_data;
 
 		if (c == x)
-			ccount = 0;
+			csize = 0;
 		else
-			ccount = rm->rm_col[c].rc_size / sizeof (src[0]);
+			csize = rm->rm_col[c].rc_size;
 
-		count = MIN(ccount, xcount);
+		size = MIN(csize, xsize);
 
 		if (c == rm->rm_firstdatacol) {
-			for (i = 0; i < count; i++, dst++, src++) {
-				*dst = *src;
-			}
-			for (; i < xcount; i++, dst++) {
-				*dst = 0;
-			}
-
+			bcopy(src, dst, size);
+			bzero(dst + size, xsize - size);
 		} else {
-			for (i = 0; i < count; i++, dst++, src++) {
-				VDEV_RAIDZ_64MUL_2(*dst, mask);
-				*dst ^= *src;
-			}
-
-			for (; i < xcount; i++, dst++) {
-				VDEV_RAIDZ_64MUL_2(*dst, mask);
-			}
+			ops->rzo_gen_q(dst, src, size, xsize);
 		}
 	}
 
-	src = rm->rm_col[VDEV_RAIDZ_Q].rc_data;
-	dst = rm->rm_col[x].rc_data;
 	exp = 255 - (rm->rm_cols - 1 - x);
 
-	for (i = 0; i < xcount; i++, dst++, src++) {
-		*dst ^= *src;
-		for (j = 0, b = (uint8_t *)dst; j < 8; j++, b++) {
-			*b = vdev_raidz_exp2(*b, exp);
-		}
-	}
+	ops->rzo_gen_p(dst, rm->rm_col[VDEV_RAIDZ_Q].rc_data, xsize);
+	ops->rzo_mul(dst, xsize, vdev_raidz_pow2[exp]);
 
 	return (1 << VDEV_RAIDZ_Q);
 }
@@ -814,9 +727,10 @@ vdev_raidz_reconstruct_q(raidz_map_t *rm, int *tgts, int ntgts)
 static int
 vdev_raidz_reconstruct_pq(raidz_map_t *rm, int *tgts, int ntgts)
 {
-	uint8_t *p, *q, *pxy, *qxy, *xd, *yd, tmp, a, b, aexp, bexp;
+	const raidz_impl_ops_t *ops = vdev_raidz_math_get_ops();
+	uint8_t *pxy, *qxy, *xd, *yd, tmp, a, b;
 	void *pdata, *qdata;
-	uint64_t xsize, ysize, i;
+	uint64_t xsize, ysize;
 	int x = tgts[0];
 	int y = tgts[1];
 
@@ -851,8 +765,6 @@ vdev_raidz_reconstruct_pq(raidz_map_t *rm, int *tgts, int ntgts)
 	rm->rm_col[x].rc_size = xsize;
 	rm->rm_col[y].rc_size = ysize;
 
-	p = pdata;
-	q = qdata;
 	pxy = rm->rm_col[VDEV_RAIDZ_P].rc_data;
 	qxy = rm->rm_col[VDEV_RAIDZ_Q].rc_data;
 	xd = rm->rm_col[x].rc_data;
@@ -877,16 +789,21 @@ vdev_raidz_reconstruct_pq(raidz_map_t *rm, int *tgts, int ntgts)
 	b = vdev_raidz_pow2[255 - (rm->rm_cols - 1 - x)];
 	tmp = 255 - vdev_raidz_log2[a ^ 1];
 
-	aexp = vdev_raidz_log2[vdev_raidz_exp2(a, tmp)];
-	bexp = vdev_raidz_log2[vdev_raidz_exp2(b, tmp)];
+	a = vdev_raidz_exp2(a, tmp);
+	b = vdev_raidz_exp2(b, tmp);
 
-	for (i = 0; i < xsize; i++, p++, q++, pxy++, qxy++, xd++, yd++) {
-		*xd = vdev_raidz_exp2(*p ^ *pxy, aexp) ^
-		    vdev_raidz_exp2(*q ^ *qxy, bexp);
+	/*
+	 * Compute P + Pxy and Q + Qxy in place in the scratch buffers.
+	 */
+	ops->rzo_gen_p(pxy, pdata, xsize);
+	ops->rzo_gen_p(qxy, qdata, xsize);
 
-		if (i < ysize)
-			*yd = *p ^ *pxy ^ *xd;
-	}
+	bcopy(pxy, xd, xsize);
+	ops->rzo_mul(xd, xsize, a);
+	ops->rzo_mul_add(xd, qxy, xsize, b);
+
+	bcopy(pxy, yd, ysize);
+	ops->rzo_gen_p(yd, xd, ysize);
 
 	zio_buf_free(rm->rm_col[VDEV_RAIDZ_P].rc_data,
 	    rm->rm_col[VDEV_RAIDZ_P].rc_size);
@@ -1184,75 +1101,44 @@ static void
 vdev_raidz_matrix_reconstruct(raidz_map_t *rm, int n, int nmissing,
     int *missing, uint8_t **invrows, const uint8_t *used)
 {
-	int i, j, x, cc, c;
+	const raidz_impl_ops_t *ops = vdev_raidz_math_get_ops();
+	int i, j, cc, c;
 	uint8_t *src;
 	uint64_t ccount;
 	uint8_t *dst[VDEV_RAIDZ_MAXPARITY];
 	uint64_t dcount[VDEV_RAIDZ_MAXPARITY];
-	uint8_t log = 0, val;
-	int ll;
-	uint8_t *invlog[VDEV_RAIDZ_MAXPARITY];
-	uint8_t *p, *pp;
-	size_t psize;
-
-	psize = sizeof (invlog[0][0]) * n * nmissing;
-	p = kmem_alloc(psize, KM_SLEEP);
 
-	for (pp = p, i = 0; i < nmissing; i++) {
-		invlog[i] = pp;
-		pp += n;
-	}
+	for (j = 0; j < nmissing; j++) {
+		cc = missing[j] + rm->rm_firstdatacol;
+		ASSERT3U(cc, >=, rm->rm_firstdatacol);
+		ASSERT3U(cc, <, rm->rm_cols);
 
-	for (i = 0; i < nmissing; i++) {
-		for (j = 0; j < n; j++) {
-			ASSERT3U(invrows[i][j], !=, 0);
-			invlog[i][j] = vdev_raidz_log2[invrows[i][j]];
-		}
+		dst[j] = rm->rm_col[cc].rc_data;
+		dcount[j] = rm->rm_col[cc].rc_size;
+		bzero(dst[j], dcount[j]);
 	}
 
+	/*
+	 * Each missing column is the sum of the used columns multiplied by
+	 * the corresponding coefficients of its row of the inverted matrix.
+	 */
 	for (i = 0; i < n; i++) {
 		c = used[i];
 		ASSERT3U(c, <, rm->rm_cols);
 
 		src = rm->rm_col[c].rc_data;
 		ccount = rm->rm_col[c].rc_size;
-		for (j = 0; j < nmissing; j++) {
-			cc = missing[j] + rm->rm_firstdatacol;
-			ASSERT3U(cc, >=, rm->rm_firstdatacol);
-			ASSERT3U(cc, <, rm->rm_cols);
-			ASSERT3U(cc, !=, c);
-
-			dst[j] = rm->rm_col[cc].rc_data;
-			dcount[j] = rm->rm_col[cc].rc_size;
-		}
 
 		ASSERT(ccount >= rm->rm_col[missing[0]].rc_size || i > 0);
 
-		for (x = 0; x < ccount; x++, src++) {
-			if (*src != 0)
-				log = vdev_raidz_log2[*src];
-
-			for (cc = 0; cc < nmissing; cc++) {
-				if (x >= dcount[cc])
-					continue;
-
-				if (*src == 0) {
-					val = 0;
-				} else {
-					if ((ll = log + invlog[cc][i]) >= 255)
-						ll -= 255;
-					val = vdev_raidz_pow2[ll];
-				}
+		for (j = 0; j < nmissing; j++) {
+			ASSERT3U(missing[j] + rm->rm_firstdatacol, !=, c);
+			ASSERT3U(invrows[j][i], !=, 0);
 
-				if (i == 0)
-					dst[cc][x] = val;
-				else
-					dst[cc][x] ^= val;
-			}
+			ops->rzo_mul_add(dst[j], src, MIN(ccount, dcount[j]),
+			    invrows[j][i]);
 		}
 	}
-
-	kmem_free(p, psize);
 }
 
 static int
@@ -0,0 +1,478 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 2005, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/vdev_raidz.h>
+#include <sys/kstat.h>
+
+/*
+ * RAID-Z math implementations.
+ *
+ * The parity generation and reconstruction code in vdev_raidz.c is written in
+ * terms of the column operations in raidz_impl_ops_t. The scalar
+ * implementation below is always available; the vectorized implementations
+ * are only used when the CPU supports them. At initialization time every
+ * supported implementation is verified against the scalar implementation and
+ * timed; the fastest generation and reconstruction routines are combined
+ * into the "fastest" implementation which is used by default.
+ *
+ * The zfs_vdev_raidz_impl tunable may be set to the name of a specific
+ * implementation ("scalar", "sse2", "ssse3", "avx2") to pin it, or to
+ * "fastest" for the default behavior.
+ */
+
+char *zfs_vdev_raidz_impl = "fastest";
+
+/*
+ * We provide a mechanism to perform the field multiplication operation on a
+ * 64-bit value all at once rather than a byte at a time. This works by
+ * creating a mask from the top bit in each byte and using that to
+ * conditionally apply the XOR of 0x1d.
+ */
+#define	VDEV_RAIDZ_64MUL_2(x, mask) \
+{ \
+	(mask) = (x) & 0x8080808080808080ULL; \
+	(mask) = ((mask) << 1) - ((mask) >> 7); \
+	(x) = (((x) << 1) & 0xfefefefefefefefeULL) ^ \
+	    ((mask) & 0x1d1d1d1d1d1d1d1dULL); \
+}
+
+#define	VDEV_RAIDZ_64MUL_4(x, mask) \
+{ \
+	VDEV_RAIDZ_64MUL_2((x), mask); \
+	VDEV_RAIDZ_64MUL_2((x), mask); \
+}
+
+static void
+raidz_scalar_gen_p(void *pbuf, const void *dbuf, size_t dsize)
+{
+	uint64_t *p = pbuf;
+	const uint64_t *d = dbuf;
+	size_t i, cnt = dsize / sizeof (uint64_t);
+
+	for (i = 0; i < cnt; i++)
+		p[i] ^= d[i];
+}
+
+static void
+raidz_scalar_gen_q(void *qbuf, const void *dbuf, size_t dsize, size_t qsize)
+{
+	uint64_t *q = qbuf, mask;
+	const uint64_t *d = dbuf;
+	size_t i, dcnt, qcnt;
+
+	ASSERT3U(dsize, <=, qsize);
+	dcnt = dsize / sizeof (uint64_t);
+	qcnt = qsize / sizeof (uint64_t);
+
+	for (i = 0; i < dcnt; i++) {
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+		q[i] ^= d[i];
+	}
+
+	/*
+	 * Treat short columns as though they are full of 0s.
+	 */
+	for (; i < qcnt; i++) {
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+	}
+}
+
+static void
+raidz_scalar_gen_pq(void *pbuf, void *qbuf, const void *dbuf, size_t dsize,
+    size_t psize)
+{
+	uint64_t *p = pbuf, *q = qbuf, mask;
+	const uint64_t *d = dbuf;
+	size_t i, dcnt, pcnt;
+
+	ASSERT3U(dsize, <=, psize);
+	dcnt = dsize / sizeof (uint64_t);
+	pcnt = psize / sizeof (uint64_t);
+
+	for (i = 0; i < dcnt; i++) {
+		p[i] ^= d[i];
+
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+		q[i] ^= d[i];
+	}
+
+	/*
+	 * Treat short columns as though they are full of 0s.
+	 * Note that there's therefore nothing needed for P.
+	 */
+	for (; i < pcnt; i++) {
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+	}
+}
+
+static void
+raidz_scalar_gen_pqr(void *pbuf, void *qbuf, void *rbuf, const void *dbuf,
+    size_t dsize, size_t psize)
+{
+	uint64_t *p = pbuf, *q = qbuf, *r = rbuf, mask;
+	const uint64_t *d = dbuf;
+	size_t i, dcnt, pcnt;
+
+	ASSERT3U(dsize, <=, psize);
+	dcnt = dsize / sizeof (uint64_t);
+	pcnt = psize / sizeof (uint64_t);
+
+	for (i = 0; i < dcnt; i++) {
+		p[i] ^= d[i];
+
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+		q[i] ^= d[i];
+
+		VDEV_RAIDZ_64MUL_4(r[i], mask);
+		r[i] ^= d[i];
+	}
+
+	for (; i < pcnt; i++) {
+		VDEV_RAIDZ_64MUL_2(q[i], mask);
+		VDEV_RAIDZ_64MUL_4(r[i], mask);
+	}
+}
+
+/*
+ * Build a table of the products of c with every element of the field so
+ * that the per-byte work in the multiplication routines is a single lookup.
+ */
+static void
+raidz_scalar_mul_table(uint8_t c, uint8_t *tbl)
+{
+	int v, l;
+
+	tbl[0] = 0;
+	for (v = 1; v < 256; v++) {
+		if (c == 0) {
+			tbl[v] = 0;
+			continue;
+		}
+		l = vdev_raidz_log2[v] + vdev_raidz_log2[c];
+		if (l >= 255)
+			l -= 255;
+		tbl[v] = vdev_raidz_pow2[l];
+	}
+}
+
+static void
+raidz_scalar_mul(void *dbuf, size_t size, uint8_t c)
+{
+	uint8_t tbl[256], *dst = dbuf;
+	size_t i;
+
+	if (c == 1)
+		return;
+
+	raidz_scalar_mul_table(c, tbl);
+	for (i = 0; i < size; i++)
+		dst[i] = tbl[dst[i]];
+}
+
+static void
+raidz_scalar_mul_add(void *dbuf, const void *sbuf, size_t size, uint8_t c)
+{
+	uint8_t tbl[256], *dst = dbuf;
+	const uint8_t *src = sbuf;
+	size_t i;
+
+	if (c == 1) {
+		raidz_scalar_gen_p(dbuf, sbuf, size);
+		return;
+	}
+
+	raidz_scalar_mul_table(c, tbl);
+	for (i = 0; i < size; i++)
+		dst[i] ^= tbl[src[i]];
+}
+
+static boolean_t
+raidz_scalar_is_supported(void)
+{
+	return (B_TRUE);
+}
+
+const raidz_impl_ops_t vdev_raidz_scalar_impl = {
+	raidz_scalar_gen_p,
+	raidz_scalar_gen_q,
+	raidz_scalar_gen_pq,
+	raidz_scalar_gen_pqr,
+	raidz_scalar_mul,
+	raidz_scalar_mul_add,
+	raidz_scalar_is_supported,
+	"scalar"
+};
+
+static const raidz_impl_ops_t *const raidz_all_impls[] = {
+	&vdev_raidz_scalar_impl,
+#if defined(__x86_64__)
+	&vdev_raidz_sse2_impl,
+	&vdev_raidz_ssse3_impl,
+	&vdev_raidz_avx2_impl,
+#endif
+};
+
+#define	RAIDZ_IMPL_COUNT \
+	(sizeof (raidz_all_impls) / sizeof (raidz_all_impls[0]))
+
+/*
+ * The composite implementation assembled from the fastest generation and
+ * reconstruction routines found by vdev_raidz_math_init().
+ */
+static raidz_impl_ops_t raidz_fastest_impl;
+
+static const raidz_impl_ops_t *raidz_curr_impl = &vdev_raidz_scalar_impl;
+
+/*
+ * Benchmark parameters: RAIDZ_BENCH_NCOLS data columns of RAIDZ_BENCH_SIZE
+ * bytes each (a 128K block on a 8+3 RAID-Z3), each test repeated for at
+ * least RAIDZ_BENCH_NS nanoseconds.
+ */
+#define	RAIDZ_BENCH_NCOLS	8
+#define	RAIDZ_BENCH_SIZE	(16 << 10)
+#define	RAIDZ_BENCH_NS		(NANOSEC / 500)
+
+/*
+ * Throughput in MB/s of each implementation, exported in the
+ * vdev_raidz_bench kstat.
+ */
+static kstat_named_t raidz_bench_stats[RAIDZ_IMPL_COUNT * 2];
+static kstat_t *raidz_bench_ksp;
+
+typedef struct raidz_bench {
+	uint8_t	*rb_data[RAIDZ_BENCH_NCOLS];
+	uint8_t	*rb_parity[3];
+	uint8_t	*rb_ref[3];
+} raidz_bench_t;
+
+static void
+raidz_bench_gen(const raidz_impl_ops_t *ops, raidz_bench_t *rb, uint8_t **par)
+{
+	int c;
+
+	bzero(par[0], RAIDZ_BENCH_SIZE);
+	bzero(par[1], RAIDZ_BENCH_SIZE);
+	bzero(par[2], RAIDZ_BENCH_SIZE);
+	for (c = 0; c < RAIDZ_BENCH_NCOLS; c++) {
+		ops->rzo_gen_pqr(par[0], par[1], par[2], rb->rb_data[c],
+		    RAIDZ_BENCH_SIZE - (c & 1) * 512, RAIDZ_BENCH_SIZE);
+	}
+}
+
+static void
+raidz_bench_rec(const raidz_impl_ops_t *ops, raidz_bench_t *rb, uint8_t **par)
+{
+	int c;
+
+	bzero(par[0], RAIDZ_BENCH_SIZE);
+	bzero(par[1], RAIDZ_BENCH_SIZE);
+	for (c = 0; c < RAIDZ_BENCH_NCOLS; c++) {
+		ops->rzo_mul_add(par[0], rb->rb_data[c], RAIDZ_BENCH_SIZE,
+		    vdev_raidz_pow2[c + 1]);
+	}
+	ops->rzo_gen_q(par[1], par[0], RAIDZ_BENCH_SIZE, RAIDZ_BENCH_SIZE);
+	ops->rzo_mul(par[1], RAIDZ_BENCH_SIZE, 0x8e);
+}
+
+/*
+ * Run either the generation or the reconstruction test repeatedly and
+ * return the throughput in MB/s.
+ */
+static uint64_t
+raidz_bench_run(const raidz_impl_ops_t *ops, raidz_bench_t *rb,
+    boolean_t gen)
+{
+	hrtime_t start, delta;
+	uint64_t iters = 0;
+
+	start = gethrtime();
+	do {
+		if (gen)
+			raidz_bench_gen(ops, rb, rb->rb_parity);
+		else
+			raidz_bench_rec(ops, rb, rb->rb_parity);
+		iters++;
+		delta = gethrtime() - start;
+	} while (delta < RAIDZ_BENCH_NS);
+
+	return (((iters * RAIDZ_BENCH_NCOLS * RAIDZ_BENCH_SIZE) >> 10) *
+	    (NANOSEC >> 10) / delta);
+}
+
+/*
+ * Verify that an implementation produces exactly the results of the scalar
+ * implementation before it is allowed to be used.
+ */
+static boolean_t
+raidz_bench_verify(const raidz_impl_ops_t *ops, raidz_bench_t *rb)
+{
+	int i;
+
+	raidz_bench_gen(ops, rb, rb->rb_parity);
+	for (i = 0; i < 3; i++) {
+		if (bcmp(rb->rb_parity[i], rb->rb_ref[i], RAIDZ_BENCH_SIZE))
+			return (B_FALSE);
+	}
+
+	raidz_bench_rec(&vdev_raidz_scalar_impl, rb, rb->rb_ref);
+	raidz_bench_rec(ops, rb, rb->rb_parity);
+	for (i = 0; i < 2; i++) {
+		if (bcmp(rb->rb_parity[i], rb->rb_ref[i], RAIDZ_BENCH_SIZE))
+			return (B_FALSE);
+	}
+
+	/* restore the reference parity for the next implementation */
+	raidz_bench_gen(&vdev_raidz_scalar_impl, rb, rb->rb_ref);
+
+	return (B_TRUE);
+}
+
+static const raidz_impl_ops_t *
+raidz_impl_lookup(const char *name)
+{
+	int i;
+
+	if (name == NULL || strcmp(name, "fastest") == 0)
+		return (&raidz_fastest_impl);
+
+	for (i = 0; i < RAIDZ_IMPL_COUNT; i++) {
+		if (strcmp(name, raidz_all_impls[i]->rzo_name) == 0 &&
+		    raidz_all_impls[i]->rzo_is_supported())
+			return (raidz_all_impls[i]);
+	}
+
+	return (NULL);
+}
+
+const raidz_impl_ops_t *
+vdev_raidz_math_get_ops(void)
+{
+	return (raidz_curr_impl);
+}
+
+void
+vdev_raidz_math_init(void)
+{
+	const raidz_impl_ops_t *ops, *best_gen, *best_rec;
+	uint64_t gen_bw, rec_bw, best_gen_bw = 0, best_rec_bw = 0;
+	raidz_bench_t rb;
+	kstat_named_t *ks;
+	int c, i;
+
+	for (c = 0; c < RAIDZ_BENCH_NCOLS; c++) {
+		rb.rb_data[c] = kmem_alloc(RAIDZ_BENCH_SIZE, KM_SLEEP);
+		(void) random_get_pseudo_bytes(rb.rb_data[c],
+		    RAIDZ_BENCH_SIZE);
+	}
+	for (i = 0; i < 3; i++) {
+		rb.rb_parity[i] = kmem_alloc(RAIDZ_BENCH_SIZE, KM_SLEEP);
+		rb.rb_ref[i] = kmem_alloc(RAIDZ_BENCH_SIZE, KM_SLEEP);
+	}
+	raidz_bench_gen(&vdev_raidz_scalar_impl, &rb, rb.rb_ref);
+
+	best_gen = best_rec = &vdev_raidz_scalar_impl;
+	for (i = 0; i < RAIDZ_IMPL_COUNT; i++) {
+		ops = raidz_all_impls[i];
+		gen_bw = rec_bw = 0;
+
+		if (ops->rzo_is_supported()) {
+			if (raidz_bench_verify(ops, &rb)) {
+				gen_bw = raidz_bench_run(ops, &rb, B_TRUE);
+				rec_bw = raidz_bench_run(ops, &rb, B_FALSE);
+			} else {
+				cmn_err(CE_WARN, "RAID-Z %s implementation "
+				    "failed verification, disabled",
+				    ops->rzo_name);
+			}
+		}
+
+		if (gen_bw > best_gen_bw) {
+			best_gen_bw = gen_bw;
+			best_gen = ops;
+		}
+		if (rec_bw > best_rec_bw) {
+			best_rec_bw = rec_bw;
+			best_rec = ops;
+		}
+
+		ks = &raidz_bench_stats[i * 2];
+		(void) snprintf(ks[0].name, KSTAT_STRLEN, "%s_gen",
+		    ops->rzo_name);
+		ks[0].data_type = KSTAT_DATA_UINT64;
+		ks[0].value.ui64 = gen_bw;
+		(void) snprintf(ks[1].name, KSTAT_STRLEN, "%s_rec",
+		    ops->rzo_name);
+		ks[1].data_type = KSTAT_DATA_UINT64;
+		ks[1].value.ui64 = rec_bw;
+	}
+
+	for (c = 0; c < RAIDZ_BENCH_NCOLS; c++)
+		kmem_free(rb.rb_data[c], RAIDZ_BENCH_SIZE);
+	for (i = 0; i < 3; i++) {
+		kmem_free(rb.rb_parity[i], RAIDZ_BENCH_SIZE);
+		kmem_free(rb.rb_ref[i], RAIDZ_BENCH_SIZE);
+	}
+
+	raidz_fastest_impl.rzo_gen_p = best_gen->rzo_gen_p;
+	raidz_fastest_impl.rzo_gen_q = best_gen->rzo_gen_q;
+	raidz_fastest_impl.rzo_gen_pq = best_gen->rzo_gen_pq;
+	raidz_fastest_impl.rzo_gen_pqr = best_gen->rzo_gen_pqr;
+	raidz_fastest_impl.rzo_mul = best_rec->rzo_mul;
+	raidz_fastest_impl.rzo_mul_add = best_rec->rzo_mul_add;
+	raidz_fastest_impl.rzo_is_supported = raidz_scalar_is_supported;
+	raidz_fastest_impl.rzo_name = "fastest";
+
+	ops = raidz_impl_lookup(zfs_vdev_raidz_impl);
+	if (ops == NULL) {
+		cmn_err(CE_WARN, "unknown or unsupported RAID-Z implementation "
+		    "'%s', using 'fastest'", zfs_vdev_raidz_impl);
+		ops = &raidz_fastest_impl;
+	}
+	raidz_curr_impl = ops;
+
+	raidz_bench_ksp = kstat_create("zfs", 0, "vdev_raidz_bench", "misc",
+	    KSTAT_TYPE_NAMED, RAIDZ_IMPL_COUNT * 2, KSTAT_FLAG_VIRTUAL);
+	if (raidz_bench_ksp != NULL) {
+		raidz_bench_ksp->ks_data = raidz_bench_stats;
+		kstat_install(raidz_bench_ksp);
+	}
+}
+
+void
+vdev_raidz_math_fini(void)
+{
+	if (raidz_bench_ksp != NULL) {
+		kstat_delete(raidz_bench_ksp);
+		raidz_bench_ksp = NULL;
+	}
+
+	raidz_curr_impl = &vdev_raidz_scalar_impl;
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_vdev_raidz_impl, charp, 0444);
+MODULE_PARM_DESC(zfs_vdev_raidz_impl, "RAID-Z implementation "
+	"(fastest, scalar, sse2, ssse3, avx2)");
+#endif
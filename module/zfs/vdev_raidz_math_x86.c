@@ -0,0 +1,731 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 2005, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/vdev_raidz.h>
+#include <sys/simd.h>
+
+#if defined(__x86_64__)
+
+/*
+ * SSE2, SSSE3 and AVX2 implementations of the RAID-Z math.
+ *
+ * Multiplication by 2 is done on 16 or 32 bytes at once exactly as in the
+ * 64-bit scalar code: a mask is built from the top bit of each byte (here
+ * with a signed compare against zero), the bytes are doubled, and 0x1d is
+ * XORed into each byte whose top bit was set.
+ *
+ * Multiplication by an arbitrary constant c uses the identity
+ * c * x = c * (x & 0x0f) + c * (x & 0xf0). With SSSE3 and AVX2 the two
+ * products are looked up in 16-entry tables with pshufb. SSE2 has no byte
+ * shuffle, so x is repeatedly doubled and the powers selected by the bits of
+ * c are accumulated.
+ *
+ * Each asm statement below is a complete loop over a multiple of
+ * RAIDZ_MATH_CHUNK bytes; callers run the scalar code on any remainder.
+ * Loads and stores are unaligned since columns may start anywhere within the
+ * zio buffer.
+ */
+
+static const uint8_t raidz_x86_1d[16] __attribute__((aligned(16))) = {
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d,
+	0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d, 0x1d
+};
+
+static const uint8_t raidz_x86_0f[16] __attribute__((aligned(16))) = {
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+	0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f
+};
+
+#define	RAIDZ_X86_CLOBBERS						\
+	"cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",	\
+	"xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12",	\
+	"xmm13", "xmm14", "xmm15"
+
+/*
+ * Build the low and high nibble product tables for multiplication by c.
+ */
+static void
+raidz_x86_mul_tables(uint8_t c, uint8_t *tbl)
+{
+	int i, l;
+
+	for (i = 0; i < 16; i++) {
+		tbl[i] = tbl[16 + i] = 0;
+		if (c == 0 || i == 0)
+			continue;
+
+		l = vdev_raidz_log2[i] + vdev_raidz_log2[c];
+		tbl[i] = vdev_raidz_pow2[l >= 255 ? l - 255 : l];
+
+		l = vdev_raidz_log2[i << 4] + vdev_raidz_log2[c];
+		tbl[16 + i] = vdev_raidz_pow2[l >= 255 ? l - 255 : l];
+	}
+}
+
+/*
+ * Generic wrappers which split each operation into the part handled by the
+ * vector kernels and a scalar remainder.
+ */
+typedef void (*raidz_x86_gen_f)(uint8_t *, uint8_t *, uint8_t *,
+    const uint8_t *, size_t, size_t);
+typedef void (*raidz_x86_mul_f)(uint8_t *, const uint8_t *, size_t,
+    uint8_t);
+
+enum raidz_x86_gen_type { RAIDZ_X86_P, RAIDZ_X86_Q, RAIDZ_X86_PQ,
+    RAIDZ_X86_PQR };
+
+static void
+raidz_x86_gen(raidz_x86_gen_f kern, enum raidz_x86_gen_type type,
+    uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d, size_t dsize,
+    size_t psize)
+{
+	const raidz_impl_ops_t *sops = &vdev_raidz_scalar_impl;
+	size_t dn, tn, off, drem;
+
+	dn = P2ALIGN(dsize, RAIDZ_MATH_CHUNK);
+	tn = (dn == dsize) ? P2ALIGN(psize - dsize, RAIDZ_MATH_CHUNK) : 0;
+
+	if (dn + tn != 0) {
+		kfpu_begin();
+		kern(p, q, r, d, dn, tn);
+		kfpu_end();
+	}
+
+	off = dn + tn;
+	if (off == psize)
+		return;
+
+	drem = (dsize > off) ? dsize - off : 0;
+	switch (type) {
+	case RAIDZ_X86_P:
+		sops->rzo_gen_p(p + off, d + off, drem);
+		break;
+	case RAIDZ_X86_Q:
+		sops->rzo_gen_q(q + off, d + off, drem, psize - off);
+		break;
+	case RAIDZ_X86_PQ:
+		sops->rzo_gen_pq(p + off, q + off, d + off, drem, psize - off);
+		break;
+	case RAIDZ_X86_PQR:
+		sops->rzo_gen_pqr(p + off, q + off, r + off, d + off, drem,
+		    psize - off);
+		break;
+	}
+}
+
+static void
+raidz_x86_mul(raidz_x86_mul_f kern, uint8_t *dst, const uint8_t *src,
+    size_t size, uint8_t c)
+{
+	size_t n = P2ALIGN(size, RAIDZ_MATH_CHUNK);
+
+	if (n != 0) {
+		kfpu_begin();
+		kern(dst, src, n, c);
+		kfpu_end();
+	}
+
+	if (n == size)
+		return;
+
+	if (src == NULL)
+		vdev_raidz_scalar_impl.rzo_mul(dst + n, size - n, c);
+	else
+		vdev_raidz_scalar_impl.rzo_mul_add(dst + n, src + n,
+		    size - n, c);
+}
+
+/*
+ * SSE2
+ */
+#define	SSE2_MUL2(x, t)							\
+	"pxor	%%" #t ", %%" #t "\n"					\
+	"pcmpgtb	%%" #x ", %%" #t "\n"				\
+	"pand	%%xmm15, %%" #t "\n"					\
+	"paddb	%%" #x ", %%" #x "\n"					\
+	"pxor	%%" #t ", %%" #x "\n"
+
+#define	SSE2_MUL2_4							\
+	SSE2_MUL2(xmm4, xmm8)						\
+	SSE2_MUL2(xmm5, xmm9)						\
+	SSE2_MUL2(xmm6, xmm10)						\
+	SSE2_MUL2(xmm7, xmm11)
+
+#define	SSE2_LOAD4(ptr, a, b, c, d)					\
+	"movdqu	0x00(%[" ptr "]), %%" #a "\n"				\
+	"movdqu	0x10(%[" ptr "]), %%" #b "\n"				\
+	"movdqu	0x20(%[" ptr "]), %%" #c "\n"				\
+	"movdqu	0x30(%[" ptr "]), %%" #d "\n"
+
+#define	SSE2_STORE4(ptr, a, b, c, d)					\
+	"movdqu	%%" #a ", 0x00(%[" ptr "])\n"				\
+	"movdqu	%%" #b ", 0x10(%[" ptr "])\n"				\
+	"movdqu	%%" #c ", 0x20(%[" ptr "])\n"				\
+	"movdqu	%%" #d ", 0x30(%[" ptr "])\n"
+
+#define	SSE2_XOR4							\
+	"pxor	%%xmm0, %%xmm4\n"					\
+	"pxor	%%xmm1, %%xmm5\n"					\
+	"pxor	%%xmm2, %%xmm6\n"					\
+	"pxor	%%xmm3, %%xmm7\n"
+
+/*
+ * Q (or R when applied twice): work = 2 * work + d
+ */
+#define	SSE2_DATA_LOOP(body)						\
+	__asm__ __volatile__(						\
+	    "movdqa	(%[k]), %%xmm15\n"				\
+	    "1:\n"							\
+	    SSE2_LOAD4("d", xmm0, xmm1, xmm2, xmm3)			\
+	    body							\
+	    "add	$64, %[d]\n"					\
+	    "add	$64, %[p]\n"					\
+	    "add	$64, %[q]\n"					\
+	    "add	$64, %[r]\n"					\
+	    "sub	$64, %[n]\n"					\
+	    "jnz	1b\n"						\
+	    : [p] "+r" (p), [q] "+r" (q), [r] "+r" (r), [d] "+r" (d),	\
+	    [n] "+r" (dn)						\
+	    : [k] "r" (raidz_x86_1d)					\
+	    : RAIDZ_X86_CLOBBERS)
+
+#define	SSE2_TAIL_LOOP(body)						\
+	__asm__ __volatile__(						\
+	    "movdqa	(%[k]), %%xmm15\n"				\
+	    "1:\n"							\
+	    body							\
+	    "add	$64, %[q]\n"					\
+	    "add	$64, %[r]\n"					\
+	    "sub	$64, %[n]\n"					\
+	    "jnz	1b\n"						\
+	    : [q] "+r" (q), [r] "+r" (r), [n] "+r" (tn)		\
+	    : [k] "r" (raidz_x86_1d)					\
+	    : RAIDZ_X86_CLOBBERS)
+
+#define	SSE2_P_BODY							\
+	SSE2_LOAD4("p", xmm4, xmm5, xmm6, xmm7)				\
+	SSE2_XOR4							\
+	SSE2_STORE4("p", xmm4, xmm5, xmm6, xmm7)
+
+#define	SSE2_Q_BODY(ptr)						\
+	SSE2_LOAD4(ptr, xmm4, xmm5, xmm6, xmm7)				\
+	SSE2_MUL2_4							\
+	SSE2_XOR4							\
+	SSE2_STORE4(ptr, xmm4, xmm5, xmm6, xmm7)
+
+#define	SSE2_R_BODY(ptr)						\
+	SSE2_LOAD4(ptr, xmm4, xmm5, xmm6, xmm7)				\
+	SSE2_MUL2_4							\
+	SSE2_MUL2_4							\
+	SSE2_XOR4							\
+	SSE2_STORE4(ptr, xmm4, xmm5, xmm6, xmm7)
+
+#define	SSE2_QT_BODY(ptr)						\
+	SSE2_LOAD4(ptr, xmm4, xmm5, xmm6, xmm7)				\
+	SSE2_MUL2_4							\
+	SSE2_STORE4(ptr, xmm4, xmm5, xmm6, xmm7)
+
+#define	SSE2_RT_BODY(ptr)						\
+	SSE2_LOAD4(ptr, xmm4, xmm5, xmm6, xmm7)				\
+	SSE2_MUL2_4							\
+	SSE2_MUL2_4							\
+	SSE2_STORE4(ptr, xmm4, xmm5, xmm6, xmm7)
+
+static void
+raidz_sse2_gen_p_kern(uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d,
+    size_t dn, size_t tn)
+{
+	if (dn != 0)
+		SSE2_DATA_LOOP(SSE2_P_BODY);
+}
+
+static void
+raidz_sse2_gen_q_kern(uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d,
+    size_t dn, size_t tn)
+{
+	if (dn != 0)
+		SSE2_DATA_LOOP(SSE2_Q_BODY("q"));
+	if (tn != 0)
+		SSE2_TAIL_LOOP(SSE2_QT_BODY("q"));
+}
+
+static void
+raidz_sse2_gen_pq_kern(uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d,
+    size_t dn, size_t tn)
+{
+	if (dn != 0)
+		SSE2_DATA_LOOP(SSE2_P_BODY SSE2_Q_BODY("q"));
+	if (tn != 0)
+		SSE2_TAIL_LOOP(SSE2_QT_BODY("q"));
+}
+
+static void
+raidz_sse2_gen_pqr_kern(uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d,
+    size_t dn, size_t tn)
+{
+	if (dn != 0)
+		SSE2_DATA_LOOP(SSE2_P_BODY SSE2_Q_BODY("q") SSE2_R_BODY("r"));
+	if (tn != 0)
+		SSE2_TAIL_LOOP(SSE2_QT_BODY("q") SSE2_RT_BODY("r"));
+}
+
+/*
+ * dst (+)= c * src, 16 bytes at a time. xmm8-xmm15 hold a mask per bit of c,
+ * xmm7 holds the 0x1d constant.
+ */
+static void
+raidz_sse2_mul_kern(uint8_t *dst, const uint8_t *src, size_t n, uint8_t c)
+{
+	uint8_t masks[8][16] __attribute__((aligned(16)));
+	const uint8_t *s = (src != NULL) ? src : dst;
+	uint64_t add = (src != NULL);
+	int b;
+
+	for (b = 0; b < 8; b++)
+		(void) memset(masks[b], (c & (1 << b)) ? 0xff : 0, 16);
+
+#define	SSE2_MUL_BIT(m)							\
+	"pxor	%%xmm2, %%xmm2\n"					\
+	"pcmpgtb	%%xmm0, %%xmm2\n"				\
+	"pand	%%xmm7, %%xmm2\n"					\
+	"paddb	%%xmm0, %%xmm0\n"					\
+	"pxor	%%xmm2, %%xmm0\n"					\
+	"movdqa	%%xmm0, %%xmm3\n"					\
+	"pand	%%" #m ", %%xmm3\n"					\
+	"pxor	%%xmm3, %%xmm1\n"
+
+	__asm__ __volatile__(
+	    "movdqa	(%[k]), %%xmm7\n"
+	    "movdqa	0x00(%[m]), %%xmm8\n"
+	    "movdqa	0x10(%[m]), %%xmm9\n"
+	    "movdqa	0x20(%[m]), %%xmm10\n"
+	    "movdqa	0x30(%[m]), %%xmm11\n"
+	    "movdqa	0x40(%[m]), %%xmm12\n"
+	    "movdqa	0x50(%[m]), %%xmm13\n"
+	    "movdqa	0x60(%[m]), %%xmm14\n"
+	    "movdqa	0x70(%[m]), %%xmm15\n"
+	    "1:\n"
+	    "movdqu	(%[s]), %%xmm0\n"
+	    "movdqa	%%xmm0, %%xmm1\n"
+	    "pand	%%xmm8, %%xmm1\n"
+	    SSE2_MUL_BIT(xmm9)
+	    SSE2_MUL_BIT(xmm10)
+	    SSE2_MUL_BIT(xmm11)
+	    SSE2_MUL_BIT(xmm12)
+	    SSE2_MUL_BIT(xmm13)
+	    SSE2_MUL_BIT(xmm14)
+	    SSE2_MUL_BIT(xmm15)
+	    "test	%[a], %[a]\n"
+	    "jz	2f\n"
+	    "movdqu	(%[d]), %%xmm4\n"
+	    "pxor	%%xmm4, %%xmm1\n"
+	    "2:\n"
+	    "movdqu	%%xmm1, (%[d])\n"
+	    "add	$16, %[s]\n"
+	    "add	$16, %[d]\n"
+	    "sub	$16, %[n]\n"
+	    "jnz	1b\n"
+	    : [d] "+r" (dst), [s] "+r" (s), [n] "+r" (n)
+	    : [k] "r" (raidz_x86_1d), [m] "r" (masks), [a] "r" (add)
+	    : RAIDZ_X86_CLOBBERS);
+
+#undef	SSE2_MUL_BIT
+}
+
+static void
+raidz_sse2_gen_p(void *p, const void *d, size_t dsize)
+{
+	raidz_x86_gen(raidz_sse2_gen_p_kern, RAIDZ_X86_P, p, NULL, NULL, d,
+	    dsize, dsize);
+}
+
+static void
+raidz_sse2_gen_q(void *q, const void *d, size_t dsize, size_t qsize)
+{
+	raidz_x86_gen(raidz_sse2_gen_q_kern, RAIDZ_X86_Q, NULL, q, NULL, d,
+	    dsize, qsize);
+}
+
+static void
+raidz_sse2_gen_pq(void *p, void *q, const void *d, size_t dsize, size_t psize)
+{
+	raidz_x86_gen(raidz_sse2_gen_pq_kern, RAIDZ_X86_PQ, p, q, NULL, d,
+	    dsize, psize);
+}
+
+static void
+raidz_sse2_gen_pqr(void *p, void *q, void *r, const void *d, size_t dsize,
+    size_t psize)
+{
+	raidz_x86_gen(raidz_sse2_gen_pqr_kern, RAIDZ_X86_PQR, p, q, r, d,
+	    dsize, psize);
+}
+
+static void
+raidz_sse2_mul(void *dst, size_t size, uint8_t c)
+{
+	if (c != 1)
+		raidz_x86_mul(raidz_sse2_mul_kern, dst, NULL, size, c);
+}
+
+static void
+raidz_sse2_mul_add(void *dst, const void *src, size_t size, uint8_t c)
+{
+	if (c == 1)
+		raidz_sse2_gen_p(dst, src, size);
+	else
+		raidz_x86_mul(raidz_sse2_mul_kern, dst, src, size, c);
+}
+
+const raidz_impl_ops_t vdev_raidz_sse2_impl = {
+	raidz_sse2_gen_p,
+	raidz_sse2_gen_q,
+	raidz_sse2_gen_pq,
+	raidz_sse2_gen_pqr,
+	raidz_sse2_mul,
+	raidz_sse2_mul_add,
+	zfs_sse2_available,
+	"sse2"
+};
+
+/*
+ * SSSE3: parity generation is the same as SSE2, multiplication by a
+ * constant uses pshufb table lookups. xmm12/xmm13 hold the low/high nibble
+ * tables, xmm14 the 0x0f mask.
+ */
+static void
+raidz_ssse3_mul_kern(uint8_t *dst, const uint8_t *src, size_t n, uint8_t c)
+{
+	uint8_t tbl[32] __attribute__((aligned(16)));
+	const uint8_t *s = (src != NULL) ? src : dst;
+	uint64_t add = (src != NULL);
+
+	raidz_x86_mul_tables(c, tbl);
+
+	__asm__ __volatile__(
+	    "movdqa	0x00(%[t]), %%xmm12\n"
+	    "movdqa	0x10(%[t]), %%xmm13\n"
+	    "movdqa	(%[f]), %%xmm14\n"
+	    "1:\n"
+	    "movdqu	(%[s]), %%xmm0\n"
+	    "movdqu	0x10(%[s]), %%xmm4\n"
+	    "movdqa	%%xmm0, %%xmm1\n"
+	    "movdqa	%%xmm4, %%xmm5\n"
+	    "psrlw	$4, %%xmm1\n"
+	    "psrlw	$4, %%xmm5\n"
+	    "pand	%%xmm14, %%xmm0\n"
+	    "pand	%%xmm14, %%xmm4\n"
+	    "pand	%%xmm14, %%xmm1\n"
+	    "pand	%%xmm14, %%xmm5\n"
+	    "movdqa	%%xmm12, %%xmm2\n"
+	    "movdqa	%%xmm12, %%xmm6\n"
+	    "movdqa	%%xmm13, %%xmm3\n"
+	    "movdqa	%%xmm13, %%xmm7\n"
+	    "pshufb	%%xmm0, %%xmm2\n"
+	    "pshufb	%%xmm4, %%xmm6\n"
+	    "pshufb	%%xmm1, %%xmm3\n"
+	    "pshufb	%%xmm5, %%xmm7\n"
+	    "pxor	%%xmm3, %%xmm2\n"
+	    "pxor	%%xmm7, %%xmm6\n"
+	    "test	%[a], %[a]\n"
+	    "jz	2f\n"
+	    "movdqu	(%[d]), %%xmm0\n"
+	    "movdqu	0x10(%[d]), %%xmm4\n"
+	    "pxor	%%xmm0, %%xmm2\n"
+	    "pxor	%%xmm4, %%xmm6\n"
+	    "2:\n"
+	    "movdqu	%%xmm2, (%[d])\n"
+	    "movdqu	%%xmm6, 0x10(%[d])\n"
+	    "add	$32, %[s]\n"
+	    "add	$32, %[d]\n"
+	    "sub	$32, %[n]\n"
+	    "jnz	1b\n"
+	    : [d] "+r" (dst), [s] "+r" (s), [n] "+r" (n)
+	    : [t] "r" (tbl), [f] "r" (raidz_x86_0f), [a] "r" (add)
+	    : RAIDZ_X86_CLOBBERS);
+}
+
+static void
+raidz_ssse3_mul(void *dst, size_t size, uint8_t c)
+{
+	if (c != 1)
+		raidz_x86_mul(raidz_ssse3_mul_kern, dst, NULL, size, c);
+}
+
+static void
+raidz_ssse3_mul_add(void *dst, const void *src, size_t size, uint8_t c)
+{
+	if (c == 1)
+		raidz_sse2_gen_p(dst, src, size);
+	else
+		raidz_x86_mul(raidz_ssse3_mul_kern, dst, src, size, c);
+}
+
+const raidz_impl_ops_t vdev_raidz_ssse3_impl = {
+	raidz_sse2_gen_p,
+	raidz_sse2_gen_q,
+	raidz_sse2_gen_pq,
+	raidz_sse2_gen_pqr,
+	raidz_ssse3_mul,
+	raidz_ssse3_mul_add,
+	zfs_ssse3_available,
+	"ssse3"
+};
+
+/*
+ * AVX2: 64 bytes are two ymm registers. ymm14 is kept zero for the sign
+ * compare and ymm15 holds the 0x1d constant.
+ */
+#define	AVX2_MUL2(x, t)							\
+	"vpcmpgtb	%%" #x ", %%ymm14, %%" #t "\n"			\
+	"vpand	%%ymm15, %%" #t ", %%" #t "\n"				\
+	"vpaddb	%%" #x ", %%" #x ", %%" #x "\n"				\
+	"vpxor	%%" #t ", %%" #x ", %%" #x "\n"
+
+#define	AVX2_MUL2_2							\
+	AVX2_MUL2(ymm2, ymm4)						\
+	AVX2_MUL2(ymm3, ymm5)
+
+#define	AVX2_LOAD2(ptr, a, b)						\
+	"vmovdqu	0x00(%[" ptr "]), %%" #a "\n"			\
+	"vmovdqu	0x20(%[" ptr "]), %%" #b "\n"
+
+#define	AVX2_STORE2(ptr, a, b)						\
+	"vmovdqu	%%" #a ", 0x00(%[" ptr "])\n"			\
+	"vmovdqu	%%" #b ", 0x20(%[" ptr "])\n"
+
+#define	AVX2_XOR2							\
+	"vpxor	%%ymm0, %%ymm2, %%ymm2\n"				\
+	"vpxor	%%ymm1, %%ymm3, %%ymm3\n"
+
+#define	AVX2_SETUP							\
+	"vpxor	%%ymm14, %%ymm14, %%ymm14\n"				\
+	"vbroadcasti128	(%[k]), %%ymm15\n"
+
+#define	AVX2_DATA_LOOP(body)						\
+	__asm__ __volatile__(						\
+	    AVX2_SETUP							\
+	    "1:\n"							\
+	    AVX2_LOAD2("d", ymm0, ymm1)					\
+	    body							\
+	    "add	$64, %[d]\n"					\
+	    "add	$64, %[p]\n"					\
+	    "add	$64, %[q]\n"					\
+	    "add	$64, %[r]\n"					\
+	    "sub	$64, %[n]\n"					\
+	    "jnz	1b\n"						\
+	    "vzeroupper\n"						\
+	    : [p] "+r" (p), [q] "+r" (q), [r] "+r" (r), [d] "+r" (d),	\
+	    [n] "+r" (dn)						\
+	    : [k] "r" (raidz_x86_1d)					\
+	    : RAIDZ_X86_CLOBBERS)
+
+#define	AVX2_TAIL_LOOP(body)						\
+	__asm__ __volatile__(						\
+	    AVX2_SETUP							\
+	    "1:\n"							\
+	    body							\
+	    "add	$64, %[q]\n"					\
+	    "add	$64, %[r]\n"					\
+	    "sub	$64, %[n]\n"					\
+	    "jnz	1b\n"						\
+	    "vzeroupper\n"						\
+	    : [q] "+r" (q), [r] "+r" (r), [n] "+r" (tn)		\
+	    : [k] "r" (raidz_x86_1d)					\
+	    : RAIDZ_X86_CLOBBERS)
+
+#define	AVX2_P_BODY							\
+	AVX2_LOAD2("p", ymm2, ymm3)					\
+	AVX2_XOR2							\
+	AVX2_STORE2("p", ymm2, ymm3)
+
+#define	AVX2_Q_BODY(ptr)						\
+	AVX2_LOAD2(ptr, ymm2, ymm3)					\
+	AVX2_MUL2_2							\
+	AVX2_XOR2							\
+	AVX2_STORE2(ptr, ymm2, ymm3)
+
+#define	AVX2_R_BODY(ptr)						\
+	AVX2_LOAD2(ptr, ymm2, ymm3)					\
+	AVX2_MUL2_2							\
+	AVX2_MUL2_2							\
+	AVX2_XOR2							\
+	AVX2_STORE2(ptr, ymm2, ymm3)
+
+#define	AVX2_QT_BODY(ptr)						\
+	AVX2_LOAD2(ptr, ymm2, ymm3)					\
+	AVX2_MUL2_2							\
+	AVX2_STORE2(ptr, ymm2, ymm3)
+
+#define	AVX2_RT_BODY(ptr)						\
+	AVX2_LOAD2(ptr, ymm2, ymm3)					\
+	AVX2_MUL2_2							\
+	AVX2_MUL2_2							\
+	AVX2_STORE2(ptr, ymm2, ymm3)
+
+static void
+raidz_avx2_gen_p_kern(uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d,
+    size_t dn, size_t tn)
+{
+	if (dn != 0)
+		AVX2_DATA_LOOP(AVX2_P_BODY);
+}
+
+static void
+raidz_avx2_gen_q_kern(uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d,
+    size_t dn, size_t tn)
+{
+	if (dn != 0)
+		AVX2_DATA_LOOP(AVX2_Q_BODY("q"));
+	if (tn != 0)
+		AVX2_TAIL_LOOP(AVX2_QT_BODY("q"));
+}
+
+static void
+raidz_avx2_gen_pq_kern(uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d,
+    size_t dn, size_t tn)
+{
+	if (dn != 0)
+		AVX2_DATA_LOOP(AVX2_P_BODY AVX2_Q_BODY("q"));
+	if (tn != 0)
+		AVX2_TAIL_LOOP(AVX2_QT_BODY("q"));
+}
+
+static void
+raidz_avx2_gen_pqr_kern(uint8_t *p, uint8_t *q, uint8_t *r, const uint8_t *d,
+    size_t dn, size_t tn)
+{
+	if (dn != 0)
+		AVX2_DATA_LOOP(AVX2_P_BODY AVX2_Q_BODY("q") AVX2_R_BODY("r"));
+	if (tn != 0)
+		AVX2_TAIL_LOOP(AVX2_QT_BODY("q") AVX2_RT_BODY("r"));
+}
+
+/*
+ * dst (+)= c * src, 64 bytes at a time using vpshufb. ymm12/ymm13 hold the
+ * low/high nibble tables broadcast to both lanes, ymm14 the 0x0f mask.
+ */
+static void
+raidz_avx2_mul_kern(uint8_t *dst, const uint8_t *src, size_t n, uint8_t c)
+{
+	uint8_t tbl[32] __attribute__((aligned(16)));
+	const uint8_t *s = (src != NULL) ? src : dst;
+	uint64_t add = (src != NULL);
+
+	raidz_x86_mul_tables(c, tbl);
+
+	__asm__ __volatile__(
+	    "vbroadcasti128	0x00(%[t]), %%ymm12\n"
+	    "vbroadcasti128	0x10(%[t]), %%ymm13\n"
+	    "vbroadcasti128	(%[f]), %%ymm14\n"
+	    "1:\n"
+	    "vmovdqu	0x00(%[s]), %%ymm0\n"
+	    "vmovdqu	0x20(%[s]), %%ymm4\n"
+	    "vpsrlw	$4, %%ymm0, %%ymm1\n"
+	    "vpsrlw	$4, %%ymm4, %%ymm5\n"
+	    "vpand	%%ymm14, %%ymm0, %%ymm0\n"
+	    "vpand	%%ymm14, %%ymm4, %%ymm4\n"
+	    "vpand	%%ymm14, %%ymm1, %%ymm1\n"
+	    "vpand	%%ymm14, %%ymm5, %%ymm5\n"
+	    "vpshufb	%%ymm0, %%ymm12, %%ymm2\n"
+	    "vpshufb	%%ymm4, %%ymm12, %%ymm6\n"
+	    "vpshufb	%%ymm1, %%ymm13, %%ymm3\n"
+	    "vpshufb	%%ymm5, %%ymm13, %%ymm7\n"
+	    "vpxor	%%ymm3, %%ymm2, %%ymm2\n"
+	    "vpxor	%%ymm7, %%ymm6, %%ymm6\n"
+	    "test	%[a], %[a]\n"
+	    "jz	2f\n"
+	    "vpxor	0x00(%[d]), %%ymm2, %%ymm2\n"
+	    "vpxor	0x20(%[d]), %%ymm6, %%ymm6\n"
+	    "2:\n"
+	    "vmovdqu	%%ymm2, 0x00(%[d])\n"
+	    "vmovdqu	%%ymm6, 0x20(%[d])\n"
+	    "add	$64, %[s]\n"
+	    "add	$64, %[d]\n"
+	    "sub	$64, %[n]\n"
+	    "jnz	1b\n"
+	    "vzeroupper\n"
+	    : [d] "+r" (dst), [s] "+r" (s), [n] "+r" (n)
+	    : [t] "r" (tbl), [f] "r" (raidz_x86_0f), [a] "r" (add)
+	    : RAIDZ_X86_CLOBBERS);
+}
+
+static void
+raidz_avx2_gen_p(void *p, const void *d, size_t dsize)
+{
+	raidz_x86_gen(raidz_avx2_gen_p_kern, RAIDZ_X86_P, p, NULL, NULL, d,
+	    dsize, dsize);
+}
+
+static void
+raidz_avx2_gen_q(void *q, const void *d, size_t dsize, size_t qsize)
+{
+	raidz_x86_gen(raidz_avx2_gen_q_kern, RAIDZ_X86_Q, NULL, q, NULL, d,
+	    dsize, qsize);
+}
+
+static void
+raidz_avx2_gen_pq(void *p, void *q, const void *d, size_t dsize, size_t psize)
+{
+	raidz_x86_gen(raidz_avx2_gen_pq_kern, RAIDZ_X86_PQ, p, q, NULL, d,
+	    dsize, psize);
+}
+
+static void
+raidz_avx2_gen_pqr(void *p, void *q, void *r, const void *d, size_t dsize,
+    size_t psize)
+{
+	raidz_x86_gen(raidz_avx2_gen_pqr_kern, RAIDZ_X86_PQR, p, q, r, d,
+	    dsize, psize);
+}
+
+static void
+raidz_avx2_mul(void *dst, size_t size, uint8_t c)
+{
+	if (c != 1)
+		raidz_x86_mul(raidz_avx2_mul_kern, dst, NULL, size, c);
+}
+
+static void
+raidz_avx2_mul_add(void *dst, const void *src, size_t size, uint8_t c)
+{
+	if (c == 1)
+		raidz_avx2_gen_p(dst, src, size);
+	else
+		raidz_x86_mul(raidz_avx2_mul_kern, dst, src, size, c);
+}
+
+const raidz_impl_ops_t vdev_raidz_avx2_impl = {
+	raidz_avx2_gen_p,
+	raidz_avx2_gen_q,
+	raidz_avx2_gen_pq,
+	raidz_avx2_gen_pqr,
+	raidz_avx2_mul,
+	raidz_avx2_mul_add,
+	zfs_avx2_available,
+	"avx2"
+};
+
+#endif /* __x86_64__ */
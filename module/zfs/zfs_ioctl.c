@@ -1086,7 +1086,7 @@ zfs_ioc_pool_create(struct file *filp, zfs_cmd_t *zc)
 
 		(void) nvlist_lookup_uint64(props,
 		    zpool_prop_to_name(ZPOOL_PROP_VERSION), &version);
-		if (version < SPA_VERSION_INITIAL || version > SPA_VERSION) {
+		if (!SPA_VERSION_IS_SUPPORTED(version)) {
 			error = EINVAL;
 			goto pool_props_bad;
 		}
@@ -1312,7 +1312,8 @@ zfs_ioc_pool_upgrade(struct file *filp, zfs_cmd_t *zc)
 	if ((error = spa_open(zc->zc_name, &spa, FTAG)) != 0)
 		return (error);
 
-	if (zc->zc_cookie < spa_version(spa) || zc->zc_cookie > SPA_VERSION) {
+	if (zc->zc_cookie < spa_version(spa) ||
+	    !SPA_VERSION_IS_SUPPORTED(zc->zc_cookie)) {
 		spa_close(spa, FTAG);
 		return (EINVAL);
 	}
@@ -3225,6 +3226,11 @@ zfs_check_settable(struct file *filp, const char *dsname,
 			    SPA_VERSION_ZLE_COMPRESSION))
 				return (ENOTSUP);
 
+			if (intval == ZIO_COMPRESS_LZ4 &&
+			    zfs_earlier_version(dsname,
+			    SPA_VERSION_LZ4_COMPRESSION))
+				return (ENOTSUP);
+
 			/*
 			 * If this is a bootable dataset then
 			 * verify that the compression algorithm
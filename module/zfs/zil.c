@@ -78,6 +78,25 @@ boolean_t zfs_nocacheflush = B_FALSE;
 
 static kmem_cache_t *zil_lwb_cache;
 
+static zil_stats_t zil_stats_template = {
+	{ "commits",			KSTAT_DATA_UINT64 },
+	{ "commit_writers",		KSTAT_DATA_UINT64 },
+	{ "lwbs",			KSTAT_DATA_UINT64 },
+	{ "lwb_bytes_used",		KSTAT_DATA_UINT64 },
+	{ "lwb_bytes_alloc",		KSTAT_DATA_UINT64 },
+	{ "flushes",			KSTAT_DATA_UINT64 },
+	{ "flushes_coalesced",		KSTAT_DATA_UINT64 },
+	{ "alloc_slog",			KSTAT_DATA_UINT64 },
+	{ "alloc_normal",		KSTAT_DATA_UINT64 },
+	{ "alloc_failed",		KSTAT_DATA_UINT64 },
+};
+
+/*
+ * Weight of a new sample in the commit rate and lwb latency moving
+ * averages used to size log blocks: 1 / 2^ZIL_AVG_SHIFT.
+ */
+#define	ZIL_AVG_SHIFT	3
+
 #define	LWB_EMPTY(lwb) ((BP_GET_LSIZE(&lwb->lwb_blk) - \
     sizeof (zil_chain_t)) == (lwb->lwb_sz - lwb->lwb_nused))
 
@@ -428,7 +447,17 @@ zil_alloc_lwb(zilog_t *zilog, blkptr_t *bp, uint64_t txg)
 	lwb->lwb_buf = zio_buf_alloc(BP_GET_LSIZE(bp));
 	lwb->lwb_max_txg = txg;
 	lwb->lwb_zio = NULL;
+	lwb->lwb_root_zio = NULL;
 	lwb->lwb_tx = NULL;
+	lwb->lwb_state = LWB_STATE_OPENED;
+	lwb->lwb_flush_deferred = B_FALSE;
+	lwb->lwb_flush_gen = 0;
+	lwb->lwb_issued = 0;
+	lwb->lwb_error = 0;
+	lwb->lwb_commit_seq = 0;
+	lwb->lwb_lr_seq = 0;
+	list_create(&lwb->lwb_waiters, sizeof (zil_commit_waiter_t),
+	    offsetof(zil_commit_waiter_t, zcw_node));
 	if (BP_GET_CHECKSUM(bp) == ZIO_CHECKSUM_ZILOG2) {
 		lwb->lwb_nused = sizeof (zil_chain_t);
 		lwb->lwb_sz = BP_GET_LSIZE(bp);
@@ -455,6 +484,7 @@ zil_create(zilog_t *zilog)
 	uint64_t txg = 0;
 	dmu_tx_t *tx = NULL;
 	blkptr_t blk;
+	boolean_t slog;
 	int error = 0;
 
 	/*
@@ -484,10 +514,18 @@ zil_create(zilog_t *zilog)
 		}
 
 		error = zio_alloc_zil(zilog->zl_spa, txg, &blk, NULL,
-		    ZIL_MIN_BLKSZ, zilog->zl_logbias == ZFS_LOGBIAS_LATENCY);
+		    ZIL_MIN_BLKSZ, zilog->zl_logbias == ZFS_LOGBIAS_LATENCY,
+		    &slog);
 
-		if (error == 0)
+		if (error == 0) {
 			zil_init_log_chain(zilog, &blk);
+			if (slog)
+				ZIL_STAT_BUMP(zilog, zs_alloc_slog);
+			else
+				ZIL_STAT_BUMP(zilog, zs_alloc_normal);
+		} else {
+			ZIL_STAT_BUMP(zilog, zs_alloc_failed);
+		}
 	}
 
 	/*
@@ -554,9 +592,12 @@ zil_destroy(zilog_t *zilog, boolean_t keep_first)
 		ASSERT(!keep_first);
 		while ((lwb = list_head(&zilog->zl_lwb_list)) != NULL) {
 			list_remove(&zilog->zl_lwb_list, lwb);
+			ASSERT(lwb->lwb_state == LWB_STATE_OPENED ||
+			    lwb->lwb_state == LWB_STATE_DONE);
 			if (lwb->lwb_buf != NULL)
 				zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
 			zio_free_zil(zilog->zl_spa, txg, &lwb->lwb_blk);
+			list_destroy(&lwb->lwb_waiters);
 			kmem_cache_free(zil_lwb_cache, lwb);
 		}
 	} else if (!keep_first) {
@@ -684,12 +725,9 @@ zil_add_block(zilog_t *zilog, const blkptr_t *bp)
 	if (zfs_nocacheflush)
 		return;
 
-	ASSERT(zilog->zl_writer);
-
 	/*
-	 * Even though we're zl_writer, we still need a lock because the
-	 * zl_get_data() callbacks may have dmu_sync() done callbacks
-	 * that will run concurrently.
+	 * Called from lwb write and dmu_sync() done callbacks, which may
+	 * run concurrently with each other and with the log writer.
 	 */
 	mutex_enter(&zilog->zl_vdev_lock);
 	for (i = 0; i < ndvas; i++) {
@@ -703,42 +741,138 @@ zil_add_block(zilog_t *zilog, const blkptr_t *bp)
 	mutex_exit(&zilog->zl_vdev_lock);
 }
 
-void
-zil_flush_vdevs(zilog_t *zilog)
+/*
+ * Flush the write caches of all the vdevs collected so far.  The flushes
+ * are issued as children of the lwb's root zio, so the lwb isn't FLUSHED
+ * until they complete.  The vdevs include those of earlier lwbs that
+ * deferred their flush to this one, and may include some written for
+ * later lwbs; flushing those early is harmless.  This is called under
+ * zl_lock as the lwb's flush generation is assigned, so that the vdevs
+ * are drained in generation order: a later generation can't find the
+ * tree empty while an earlier one's flushes have yet to be issued.
+ */
+static void
+zil_lwb_flush_vdevs(zilog_t *zilog, lwb_t *lwb)
 {
 	spa_t *spa = zilog->zl_spa;
 	avl_tree_t *t = &zilog->zl_vdev_tree;
 	void *cookie = NULL;
 	zil_vdev_node_t *zv;
-	zio_t *zio;
-
-	ASSERT(zilog->zl_writer);
 
 	/*
-	 * We don't need zl_vdev_lock here because we're the zl_writer,
-	 * and all zl_get_data() callbacks are done.
+	 * SCL_STATE is held from zil_lwb_write_start() until the root zio
+	 * is done.  Not all devices actually support the
+	 * DKIOCFLUSHWRITECACHE ioctl, so it's OK if the flushes fail.
 	 */
-	if (avl_numnodes(t) == 0)
-		return;
-
-	spa_config_enter(spa, SCL_STATE, FTAG, RW_READER);
-
-	zio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
+	ASSERT(spa_config_held(spa, SCL_STATE, RW_READER));
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
 
+	mutex_enter(&zilog->zl_vdev_lock);
 	while ((zv = avl_destroy_nodes(t, &cookie)) != NULL) {
 		vdev_t *vd = vdev_lookup_top(spa, zv->zv_vdev);
-		if (vd != NULL)
-			zio_flush(zio, vd);
+		if (vd != NULL) {
+			zio_flush(lwb->lwb_root_zio, vd);
+			ZIL_STAT_BUMP(zilog, zs_flushes);
+		}
 		kmem_free(zv, sizeof (*zv));
 	}
+	mutex_exit(&zilog->zl_vdev_lock);
+}
+
+/*
+ * Move the lwbs at the head of zl_lwb_issued that have been written and
+ * flushed to LWB_STATE_DONE and notify their waiters.  A log record is
+ * only reachable on replay if every earlier log block made it to disk,
+ * so once a write fails every lwb from there on reports an error, until
+ * a waiter has waited for a txg sync that frees the failed block.
+ */
+static void
+zil_lwb_retire(zilog_t *zilog)
+{
+	zil_commit_waiter_t *zcw;
+	lwb_t *lwb;
+	int error;
+
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+
+	while ((lwb = list_head(&zilog->zl_lwb_issued)) != NULL &&
+	    lwb->lwb_state == LWB_STATE_FLUSHED &&
+	    lwb->lwb_flush_gen <= zilog->zl_flushed_gen) {
+		list_remove(&zilog->zl_lwb_issued, lwb);
+		lwb->lwb_state = LWB_STATE_DONE;
+
+		if (lwb->lwb_error != 0)
+			zilog->zl_lwb_errors++;
+
+		if (zilog->zl_lwb_errors == zilog->zl_lwb_healed) {
+			error = 0;
+			zilog->zl_commit_seq = MAX(zilog->zl_commit_seq,
+			    lwb->lwb_commit_seq);
+			zilog->zl_commit_lr_seq = MAX(zilog->zl_commit_lr_seq,
+			    lwb->lwb_lr_seq);
+		} else {
+			error = lwb->lwb_error ? lwb->lwb_error : EIO;
+		}
+
+		while ((zcw = list_head(&lwb->lwb_waiters)) != NULL) {
+			list_remove(&lwb->lwb_waiters, zcw);
+			zcw->zcw_done = B_TRUE;
+			zcw->zcw_error = error;
+			zcw->zcw_commit_seq = lwb->lwb_commit_seq;
+			zcw->zcw_errors = zilog->zl_lwb_errors;
+			cv_signal(&zcw->zcw_cv);
+		}
+	}
+
+	if (list_is_empty(&zilog->zl_lwb_issued))
+		cv_broadcast(&zilog->zl_cv_writer);
+}
+
+/*
+ * Function called when a log block write and its cache flushes complete
+ */
+static void
+zil_lwb_flush_done(zio_t *zio)
+{
+	lwb_t *lwb = zio->io_private;
+	zilog_t *zilog = lwb->lwb_zilog;
+	dmu_tx_t *tx = lwb->lwb_tx;
+	lwb_t *flwb;
+
+	spa_config_exit(zilog->zl_spa, SCL_STATE, lwb);
+
+	mutex_enter(&zilog->zl_lock);
+	ASSERT(lwb->lwb_state == LWB_STATE_ISSUED);
+	lwb->lwb_state = LWB_STATE_FLUSHED;
 
 	/*
-	 * Wait for all the flushes to complete.  Not all devices actually
-	 * support the DKIOCFLUSHWRITECACHE ioctl, so it's OK if it fails.
+	 * Advance zl_flushed_gen past the generations whose flushes are all
+	 * done, stopping at the oldest that is still in flight.
 	 */
-	(void) zio_wait(zio);
+	while ((flwb = list_head(&zilog->zl_lwb_flushing)) != NULL &&
+	    flwb->lwb_state != LWB_STATE_ISSUED) {
+		list_remove(&zilog->zl_lwb_flushing, flwb);
+		ASSERT3U(flwb->lwb_flush_gen, ==, zilog->zl_flushed_gen + 1);
+		zilog->zl_flushed_gen = flwb->lwb_flush_gen;
+	}
 
-	spa_config_exit(spa, SCL_STATE, FTAG);
+	zilog->zl_lwb_latency +=
+	    (gethrtime() - lwb->lwb_issued - zilog->zl_lwb_latency) >>
+	    ZIL_AVG_SHIFT;
+	lwb->lwb_zio = NULL;
+	lwb->lwb_root_zio = NULL;
+	lwb->lwb_tx = NULL;
+	zil_lwb_retire(zilog);
+	mutex_exit(&zilog->zl_lock);
+
+	/*
+	 * Now that we've written this log block, we have a stable pointer
+	 * to the next block in the chain, so it's OK to let the txg in
+	 * which we allocated the next block sync.  Holding the txg until
+	 * the lwb is DONE also guarantees that zil_sync() in that txg can
+	 * free it.
+	 */
+	dmu_tx_commit(tx);
 }
 
 /*
@@ -749,7 +883,7 @@ zil_lwb_write_done(zio_t *zio)
 {
 	lwb_t *lwb = zio->io_private;
 	zilog_t *zilog = lwb->lwb_zilog;
-	dmu_tx_t *tx = lwb->lwb_tx;
+	lwb_t *nlwb;
 
 	ASSERT(BP_GET_COMPRESS(zio->io_bp) == ZIO_COMPRESS_OFF);
 	ASSERT(BP_GET_TYPE(zio->io_bp) == DMU_OT_INTENT_LOG);
@@ -759,26 +893,35 @@ zil_lwb_write_done(zio_t *zio)
 	ASSERT(!BP_IS_HOLE(zio->io_bp));
 	ASSERT(zio->io_bp->blk_fill == 0);
 
+	zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
+
 	/*
-	 * Ensure the lwb buffer pointer is cleared before releasing
-	 * the txg. If we have had an allocation failure and
-	 * the txg is waiting to sync then we want want zil_sync()
-	 * to remove the lwb so that it's not picked up as the next new
-	 * one in zil_commit_writer(). zil_sync() will only remove
-	 * the lwb if lwb_buf is null.
+	 * This log block, and any dmu_sync()'d blocks it refers to, must
+	 * be flushed out of the device write caches before the lwb counts
+	 * as stable.  If a later lwb is still being written, leave that to
+	 * it: the flush it issues once its own write completes covers ours
+	 * as well, and the vdevs are usually the same.
 	 */
-	zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
+	zil_add_block(zilog, zio->io_bp);
+
 	mutex_enter(&zilog->zl_lock);
 	lwb->lwb_buf = NULL;
-	lwb->lwb_tx = NULL;
+	lwb->lwb_error = zio->io_error;
+	for (nlwb = list_next(&zilog->zl_lwb_issued, lwb); nlwb != NULL;
+	    nlwb = list_next(&zilog->zl_lwb_issued, nlwb)) {
+		if (nlwb->lwb_buf != NULL)
+			break;
+	}
+	if (nlwb != NULL) {
+		lwb->lwb_flush_deferred = B_TRUE;
+		lwb->lwb_flush_gen = zilog->zl_flush_gen + 1;
+		ZIL_STAT_BUMP(zilog, zs_flushes_coalesced);
+	} else {
+		lwb->lwb_flush_gen = ++zilog->zl_flush_gen;
+		list_insert_tail(&zilog->zl_lwb_flushing, lwb);
+		zil_lwb_flush_vdevs(zilog, lwb);
+	}
 	mutex_exit(&zilog->zl_lock);
-
-	/*
-	 * Now that we've written this log block, we have a stable pointer
-	 * to the next block in the chain, so it's OK to let the txg in
-	 * which we allocated the next block sync.
-	 */
-	dmu_tx_commit(tx);
 }
 
 /*
@@ -793,12 +936,10 @@ zil_lwb_write_init(zilog_t *zilog, lwb_t *lwb)
 	    ZB_ZIL_OBJECT, ZB_ZIL_LEVEL,
 	    lwb->lwb_blk.blk_cksum.zc_word[ZIL_ZC_SEQ]);
 
-	if (zilog->zl_root_zio == NULL) {
-		zilog->zl_root_zio = zio_root(zilog->zl_spa, NULL, NULL,
-		    ZIO_FLAG_CANFAIL);
-	}
 	if (lwb->lwb_zio == NULL) {
-		lwb->lwb_zio = zio_rewrite(zilog->zl_root_zio, zilog->zl_spa,
+		lwb->lwb_root_zio = zio_root(zilog->zl_spa,
+		    zil_lwb_flush_done, lwb, ZIO_FLAG_CANFAIL);
+		lwb->lwb_zio = zio_rewrite(lwb->lwb_root_zio, zilog->zl_spa,
 		    0, &lwb->lwb_blk, lwb->lwb_buf, BP_GET_LSIZE(&lwb->lwb_blk),
 		    zil_lwb_write_done, lwb, ZIO_PRIORITY_LOG_WRITE,
 		    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE, &zb);
@@ -828,9 +969,48 @@ uint64_t zil_slog_limit = 1024 * 1024;
 	(((zilog)->zl_cur_used < zil_slog_limit) || \
 	((zilog)->zl_itx_list_sz < (zil_slog_limit << 1))))
 
+/*
+ * Number of log record bytes expected to be committed during one lwb
+ * write, going by the recent commit byte rate and lwb latency.
+ */
+static uint64_t
+zil_lwb_expected(zilog_t *zilog)
+{
+	uint64_t rate = zilog->zl_commit_rate;
+	hrtime_t latency = zilog->zl_lwb_latency;
+
+	if (rate == 0 || latency <= 0)
+		return (0);
+
+	return (MIN(rate * (latency / (NANOSEC / MICROSEC)) / MICROSEC,
+	    SPA_MAXBLOCKSIZE));
+}
+
+/*
+ * Fold the bytes committed by a log writer pass into the commit byte
+ * rate.  Calls are serialized by zl_writer.
+ */
+static void
+zil_commit_rate_update(zilog_t *zilog, uint64_t bytes)
+{
+	hrtime_t now = gethrtime();
+	hrtime_t delta = now - zilog->zl_commit_time;
+	int64_t rate;
+
+	zilog->zl_commit_time = now;
+	if (delta <= 0)
+		return;
+
+	rate = (bytes * NANOSEC) / delta;
+	zilog->zl_commit_rate +=
+	    (rate - (int64_t)zilog->zl_commit_rate) >> ZIL_AVG_SHIFT;
+}
+
 /*
  * Start a log block write and advance to the next log block.
- * Calls are serialized.
+ * Calls are serialized by zl_writer.  The write proceeds in the
+ * background; the lwb joins zl_lwb_issued, in chain order, until it is
+ * DONE.
  */
 static lwb_t *
 zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
@@ -842,6 +1022,7 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	dmu_tx_t *tx;
 	uint64_t txg;
 	uint64_t zil_blksz, wsz;
+	boolean_t slog;
 	int i, error;
 
 	if (BP_GET_CHECKSUM(&lwb->lwb_blk) == ZIO_CHECKSUM_ZILOG2) {
@@ -859,7 +1040,7 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 * before writing it in order to establish the log chain.
 	 * Note that if the allocation of nlwb synced before we wrote
 	 * the block that points at it (lwb), we'd leak it if we crashed.
-	 * Therefore, we don't do dmu_tx_commit() until zil_lwb_write_done().
+	 * Therefore, we don't do dmu_tx_commit() until zil_lwb_flush_done().
 	 * We dirty the dataset to ensure that zil_sync() will be called
 	 * to clean up in the event of allocation failure or I/O failure.
 	 */
@@ -872,36 +1053,38 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 
 	/*
 	 * Log blocks are pre-allocated. Here we select the size of the next
-	 * block, based on size used in the last block.
-	 * - first find the smallest bucket that will fit the block from a
-	 *   limited set of block sizes. This is because it's faster to write
-	 *   blocks allocated from the same metaslab as they are adjacent or
-	 *   close.
-	 * - next find the maximum from the new suggested size and an array of
-	 *   previous sizes. This lessens a picket fence effect of wrongly
-	 *   guesssing the size if we have a stream of say 2k, 64k, 2k, 64k
-	 *   requests.
+	 * block.  Other committers keep filling it while this one is being
+	 * written, so size it for the log records we expect in that time:
+	 * the commit byte rate times the lwb latency, but at least what the
+	 * current commit has used so far.  Then find the smallest bucket that
+	 * will fit the block from a limited set of block sizes.  This is
+	 * because it's faster to write blocks allocated from the same
+	 * metaslab as they are adjacent or close.
 	 *
 	 * Note we only write what is used, but we can't just allocate
 	 * the maximum block size because we can exhaust the available
 	 * pool log space.
 	 */
-	zil_blksz = zilog->zl_cur_used + sizeof (zil_chain_t);
+	zil_blksz = MAX(zilog->zl_cur_used, zil_lwb_expected(zilog)) +
+	    sizeof (zil_chain_t);
 	for (i = 0; zil_blksz > zil_block_buckets[i]; i++)
 		continue;
 	zil_blksz = zil_block_buckets[i];
 	if (zil_blksz == UINT64_MAX)
 		zil_blksz = SPA_MAXBLOCKSIZE;
-	zilog->zl_prev_blks[zilog->zl_prev_rotor] = zil_blksz;
-	for (i = 0; i < ZIL_PREV_BLKS; i++)
-		zil_blksz = MAX(zil_blksz, zilog->zl_prev_blks[i]);
-	zilog->zl_prev_rotor = (zilog->zl_prev_rotor + 1) & (ZIL_PREV_BLKS - 1);
 
 	BP_ZERO(bp);
 	/* pass the old blkptr in order to spread log blocks across devs */
 	error = zio_alloc_zil(spa, txg, bp, &lwb->lwb_blk, zil_blksz,
-	    USE_SLOG(zilog));
-	if (!error) {
+	    USE_SLOG(zilog), &slog);
+	if (error) {
+		ZIL_STAT_BUMP(zilog, zs_alloc_failed);
+	} else {
+		if (slog)
+			ZIL_STAT_BUMP(zilog, zs_alloc_slog);
+		else
+			ZIL_STAT_BUMP(zilog, zs_alloc_normal);
+
 		ASSERT3U(bp->blk_birth, ==, txg);
 		bp->blk_cksum = lwb->lwb_blk.blk_cksum;
 		bp->blk_cksum.zc_word[ZIL_ZC_SEQ]++;
@@ -910,9 +1093,6 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 		 * Allocate a new log write buffer (lwb).
 		 */
 		nlwb = zil_alloc_lwb(zilog, bp, txg);
-
-		/* Record the block for later vdev flushing */
-		zil_add_block(zilog, &lwb->lwb_blk);
 	}
 
 	if (BP_GET_CHECKSUM(&lwb->lwb_blk) == ZIO_CHECKSUM_ZILOG2) {
@@ -934,7 +1114,26 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 */
 	bzero(lwb->lwb_buf + lwb->lwb_nused, wsz - lwb->lwb_nused);
 
+	mutex_enter(&zilog->zl_lock);
+	ASSERT(lwb->lwb_state == LWB_STATE_OPENED);
+	lwb->lwb_state = LWB_STATE_ISSUED;
+	lwb->lwb_lr_seq = zilog->zl_lr_seq;
+	lwb->lwb_issued = gethrtime();
+	list_insert_tail(&zilog->zl_lwb_issued, lwb);
+	mutex_exit(&zilog->zl_lock);
+
+	ZIL_STAT_BUMP(zilog, zs_lwbs);
+	ZIL_STAT_INCR(zilog, zs_lwb_bytes_used, lwb->lwb_nused);
+	ZIL_STAT_INCR(zilog, zs_lwb_bytes_alloc, lwb->lwb_sz);
+
+	/*
+	 * Hold SCL_STATE until the cache flushes issued by
+	 * zil_lwb_write_done() have completed; see zil_lwb_flush_done().
+	 */
+	spa_config_enter(spa, SCL_STATE, lwb, RW_READER);
+
 	zio_nowait(lwb->lwb_zio); /* Kick off the write for the old log block */
+	zio_nowait(lwb->lwb_root_zio);
 
 	/*
 	 * If there was an allocation failure then nlwb will be null which
@@ -1134,19 +1333,60 @@ zil_clean(zilog_t *zilog)
 	mutex_exit(&zilog->zl_lock);
 }
 
+/*
+ * Wait for the lwb zcw is attached to, if any, to be DONE.  If the log
+ * chain was broken the records may not be reachable on replay, so fall
+ * back to waiting for them to sync in the txg.  Called and returns with
+ * zl_lock held.
+ */
+static void
+zil_commit_waiter_wait(zilog_t *zilog, zil_commit_waiter_t *zcw)
+{
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+
+	DTRACE_PROBE1(zil__cw3, zilog_t *, zilog);
+	while (!zcw->zcw_done)
+		cv_wait(&zcw->zcw_cv, &zilog->zl_lock);
+	DTRACE_PROBE1(zil__cw4, zilog_t *, zilog);
+
+	if (zcw->zcw_error != 0) {
+		mutex_exit(&zilog->zl_lock);
+		txg_wait_synced(zilog->zl_dmu_pool, 0);
+		mutex_enter(&zilog->zl_lock);
+
+		/*
+		 * The txg sync freed every lwb that was DONE when we were
+		 * notified, including the ones that failed.
+		 */
+		zilog->zl_lwb_healed = MAX(zilog->zl_lwb_healed,
+		    zcw->zcw_errors);
+		zilog->zl_commit_seq = MAX(zilog->zl_commit_seq,
+		    zcw->zcw_commit_seq);
+	}
+}
+
+/*
+ * Fill and issue log blocks for all itxs up to seq, then attach zcw to
+ * the last lwb issued.  Called and returns with zl_lock held; the caller
+ * must wait on zcw.
+ */
 static void
-zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid)
+zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid,
+    zil_commit_waiter_t *zcw)
 {
 	uint64_t txg;
 	uint64_t commit_seq = 0;
 	itx_t *itx, *itx_next;
 	lwb_t *lwb;
 	spa_t *spa;
-	int error = 0;
+	uint64_t errors;
+
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+	ASSERT(!zilog->zl_writer);
 
 	zilog->zl_writer = B_TRUE;
-	ASSERT(zilog->zl_root_zio == NULL);
 	spa = zilog->zl_spa;
+	ZIL_STAT_BUMP(zilog, zs_commit_writers);
 
 	if (zilog->zl_suspend) {
 		lwb = NULL;
@@ -1159,6 +1399,8 @@ zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid)
 			 */
 			if (list_is_empty(&zilog->zl_itx_list)) {
 				zilog->zl_writer = B_FALSE;
+				cv_broadcast(&zilog->zl_cv_writer);
+				zcw->zcw_done = B_TRUE;
 				return;
 			}
 			mutex_exit(&zilog->zl_lock);
@@ -1228,64 +1470,113 @@ zil_commit_writer(zilog_t *zilog, uint64_t seq, uint64_t foid)
 	if (lwb != NULL && lwb->lwb_zio != NULL)
 		lwb = zil_lwb_write_start(zilog, lwb);
 
+	zil_commit_rate_update(zilog, zilog->zl_cur_used);
 	zilog->zl_prev_used = zilog->zl_cur_used;
 	zilog->zl_cur_used = 0;
 
-	/*
-	 * Wait if necessary for the log blocks to be on stable storage.
-	 */
-	if (zilog->zl_root_zio) {
-		DTRACE_PROBE1(zil__cw3, zilog_t *, zilog);
-		error = zio_wait(zilog->zl_root_zio);
-		zilog->zl_root_zio = NULL;
-		DTRACE_PROBE1(zil__cw4, zilog_t *, zilog);
-		zil_flush_vdevs(zilog);
-	}
+	mutex_enter(&zilog->zl_lock);
 
-	if (error || lwb == NULL)
+	if (lwb == NULL) {
+		/*
+		 * The log is suspended or we failed to allocate the next
+		 * log block, so the chain ends here.  Let the lwbs already
+		 * issued complete, then wait for the txg to sync.  We stay
+		 * the writer so nobody tries to extend the chain meanwhile.
+		 */
+		while (!list_is_empty(&zilog->zl_lwb_issued))
+			cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
+		errors = zilog->zl_lwb_errors;
+		mutex_exit(&zilog->zl_lock);
 		txg_wait_synced(zilog->zl_dmu_pool, 0);
+		mutex_enter(&zilog->zl_lock);
 
-	mutex_enter(&zilog->zl_lock);
-	zilog->zl_writer = B_FALSE;
-
-	ASSERT3U(commit_seq, >=, zilog->zl_commit_seq);
-	zilog->zl_commit_seq = commit_seq;
+		zilog->zl_lwb_healed = MAX(zilog->zl_lwb_healed, errors);
+		zilog->zl_commit_seq = MAX(zilog->zl_commit_seq, commit_seq);
+		zcw->zcw_done = B_TRUE;
+	} else if ((lwb = list_tail(&zilog->zl_lwb_issued)) != NULL) {
+		/*
+		 * Our records are in the last lwb issued or before it, so
+		 * we're done when it is.
+		 */
+		lwb->lwb_commit_seq = MAX(lwb->lwb_commit_seq, commit_seq);
+		list_insert_tail(&lwb->lwb_waiters, zcw);
+	} else {
+		/*
+		 * Nothing needed to be written, or everything we wrote has
+		 * already completed.
+		 */
+		zcw->zcw_done = B_TRUE;
+		zcw->zcw_commit_seq = commit_seq;
+		zcw->zcw_errors = zilog->zl_lwb_errors;
+		if (zilog->zl_lwb_errors != zilog->zl_lwb_healed)
+			zcw->zcw_error = EIO;
+		else
+			zilog->zl_commit_seq = MAX(zilog->zl_commit_seq,
+			    commit_seq);
+	}
 
-	/*
-	 * Remember the highest committed log sequence number for ztest.
-	 * We only update this value when all the log writes succeeded,
-	 * because ztest wants to ASSERT that it got the whole log chain.
-	 */
-	if (error == 0 && lwb != NULL)
-		zilog->zl_commit_lr_seq = zilog->zl_lr_seq;
+	zilog->zl_writer = B_FALSE;
+	cv_broadcast(&zilog->zl_cv_writer);
 }
 
 /*
  * Push zfs transactions to stable storage up to the supplied sequence number.
  * If foid is 0 push out all transactions, otherwise push only those
  * for that file or might have been used to create that file.
+ *
+ * Only one thread at a time fills log blocks (the zl_writer), but it
+ * doesn't wait for them: it attaches a commit waiter to the last lwb
+ * it issued and gives up zl_writer, so the next committer can fill and
+ * issue the following lwbs while the earlier ones are being written.
+ * A committer whose records are already in an issued lwb just waits on
+ * that lwb.
  */
 void
 zil_commit(zilog_t *zilog, uint64_t seq, uint64_t foid)
 {
+	zil_commit_waiter_t zcw;
+	lwb_t *lwb;
+
 	if (zilog->zl_sync == ZFS_SYNC_DISABLED || seq == 0)
 		return;
 
+	ZIL_STAT_BUMP(zilog, zs_commits);
+
+	cv_init(&zcw.zcw_cv, NULL, CV_DEFAULT, NULL);
+	zcw.zcw_done = B_FALSE;
+	zcw.zcw_error = 0;
+	zcw.zcw_commit_seq = 0;
+	zcw.zcw_errors = 0;
+
 	mutex_enter(&zilog->zl_lock);
 
 	seq = MIN(seq, zilog->zl_itx_seq);	/* cap seq at largest itx seq */
 
-	while (zilog->zl_writer) {
-		cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
+	for (;;) {
 		if (seq <= zilog->zl_commit_seq) {
-			mutex_exit(&zilog->zl_lock);
-			return;
+			zcw.zcw_done = B_TRUE;
+			break;
+		}
+		if (zilog->zl_writer) {
+			cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
+			continue;
+		}
+		for (lwb = list_head(&zilog->zl_lwb_issued); lwb != NULL;
+		    lwb = list_next(&zilog->zl_lwb_issued, lwb)) {
+			if (lwb->lwb_commit_seq >= seq)
+				break;
 		}
+		if (lwb != NULL)
+			list_insert_tail(&lwb->lwb_waiters, &zcw);
+		else
+			zil_commit_writer(zilog, seq, foid, &zcw);
+		break;
 	}
-	zil_commit_writer(zilog, seq, foid); /* drops zl_lock */
-	/* wake up others waiting on the commit */
-	cv_broadcast(&zilog->zl_cv_writer);
+
+	zil_commit_waiter_wait(zilog, &zcw);
 	mutex_exit(&zilog->zl_lock);
+
+	cv_destroy(&zcw.zcw_cv);
 }
 
 /*
@@ -1299,7 +1590,7 @@ zil_is_committed(zilog_t *zilog)
 
 	mutex_enter(&zilog->zl_lock);
 
-	while (zilog->zl_writer)
+	while (zilog->zl_writer || !list_is_empty(&zilog->zl_lwb_issued))
 		cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
 
 	if (!list_is_empty(&zilog->zl_itx_list))
@@ -1368,10 +1659,12 @@ zil_sync(zilog_t *zilog, dmu_tx_t *tx)
 
 	while ((lwb = list_head(&zilog->zl_lwb_list)) != NULL) {
 		zh->zh_log = lwb->lwb_blk;
-		if (lwb->lwb_buf != NULL || lwb->lwb_max_txg > txg)
+		if (lwb->lwb_state != LWB_STATE_DONE ||
+		    lwb->lwb_max_txg > txg)
 			break;
 		list_remove(&zilog->zl_lwb_list, lwb);
 		zio_free_zil(spa, txg, &lwb->lwb_blk);
+		list_destroy(&lwb->lwb_waiters);
 		kmem_cache_free(zil_lwb_cache, lwb);
 
 		/*
@@ -1434,6 +1727,12 @@ zil_alloc(objset_t *os, zil_header_t *zh_phys)
 	list_create(&zilog->zl_lwb_list, sizeof (lwb_t),
 	    offsetof(lwb_t, lwb_node));
 
+	list_create(&zilog->zl_lwb_issued, sizeof (lwb_t),
+	    offsetof(lwb_t, lwb_issue_node));
+
+	list_create(&zilog->zl_lwb_flushing, sizeof (lwb_t),
+	    offsetof(lwb_t, lwb_flush_node));
+
 	mutex_init(&zilog->zl_vdev_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	avl_create(&zilog->zl_vdev_tree, zil_vdev_compare,
@@ -1442,6 +1741,8 @@ zil_alloc(objset_t *os, zil_header_t *zh_phys)
 	cv_init(&zilog->zl_cv_writer, NULL, CV_DEFAULT, NULL);
 	cv_init(&zilog->zl_cv_suspend, NULL, CV_DEFAULT, NULL);
 
+	zilog->zl_stats = zil_stats_template;
+
 	return (zilog);
 }
 
@@ -1454,11 +1755,16 @@ zil_free(zilog_t *zilog)
 
 	while ((lwb = list_head(&zilog->zl_lwb_list)) != NULL) {
 		list_remove(&zilog->zl_lwb_list, lwb);
+		ASSERT(lwb->lwb_state == LWB_STATE_OPENED ||
+		    lwb->lwb_state == LWB_STATE_DONE);
 		if (lwb->lwb_buf != NULL)
 			zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
+		list_destroy(&lwb->lwb_waiters);
 		kmem_cache_free(zil_lwb_cache, lwb);
 	}
 	list_destroy(&zilog->zl_lwb_list);
+	list_destroy(&zilog->zl_lwb_issued);
+	list_destroy(&zilog->zl_lwb_flushing);
 
 	avl_destroy(&zilog->zl_vdev_tree);
 	mutex_destroy(&zilog->zl_vdev_lock);
@@ -1480,11 +1786,22 @@ zilog_t *
 zil_open(objset_t *os, zil_get_data_t *get_data)
 {
 	zilog_t *zilog = dmu_objset_zil(os);
+	char kname[KSTAT_STRLEN];
 
 	zilog->zl_get_data = get_data;
 	zilog->zl_clean_taskq = taskq_create("zil_clean", 1, minclsyspri,
 	    2, 2, TASKQ_PREPOPULATE);
 
+	(void) snprintf(kname, KSTAT_STRLEN, "zil-%llu-%s",
+	    (u_longlong_t)dmu_objset_id(os), spa_name(zilog->zl_spa));
+	zilog->zl_kstat = kstat_create("zfs", 0, kname, "misc",
+	    KSTAT_TYPE_NAMED, sizeof (zil_stats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (zilog->zl_kstat != NULL) {
+		zilog->zl_kstat->ks_data = &zilog->zl_stats;
+		kstat_install(zilog->zl_kstat);
+	}
+
 	return (zilog);
 }
 
@@ -1508,6 +1825,11 @@ zil_close(zilog_t *zilog)
 		txg_wait_synced(zilog->zl_dmu_pool, txg);
 	}
 
+	if (zilog->zl_kstat != NULL) {
+		kstat_delete(zilog->zl_kstat);
+		zilog->zl_kstat = NULL;
+	}
+
 	taskq_destroy(zilog->zl_clean_taskq);
 	zilog->zl_clean_taskq = NULL;
 	zilog->zl_get_data = NULL;
@@ -1551,7 +1873,7 @@ zil_suspend(zilog_t *zilog)
 	 * Wait for any in-flight log writes to complete.
 	 */
 	mutex_enter(&zilog->zl_lock);
-	while (zilog->zl_writer)
+	while (zilog->zl_writer || !list_is_empty(&zilog->zl_lwb_issued))
 		cv_wait(&zilog->zl_cv_writer, &zilog->zl_lock);
 	mutex_exit(&zilog->zl_lock);
 
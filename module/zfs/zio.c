@@ -159,6 +159,7 @@ zio_init(void)
 	}
 
 	zio_inject_init();
+	lz4_init();
 }
 
 void
@@ -186,6 +187,7 @@ zio_fini(void)
 	kmem_cache_destroy(zio_cache);
 
 	zio_inject_fini();
+	lz4_fini();
 }
 
 /*
@@ -735,6 +737,67 @@ zio_ioctl(zio_t *pio, spa_t *spa, vdev_t *vd, int cmd,
 	return (zio);
 }
 
+/*
+ * Free (TRIM) the range [offset, offset + size) of vd, which has been
+ * released by the allocator.  The range is mapped down the vdev tree:
+ * every child of a mirror holds the same range, while a RAID-Z child is
+ * only handed the rows whose sector on that child falls inside the range.
+ * The leaf zios describe the range on the device in io_offset and io_size;
+ * they carry no data, so io_size may exceed SPA_MAXBLOCKSIZE.
+ */
+zio_t *
+zio_trim(zio_t *pio, spa_t *spa, vdev_t *vd, uint64_t offset, uint64_t size,
+    enum zio_flag flags)
+{
+	zio_t *zio;
+	int c;
+
+	if (vd->vdev_ops->vdev_op_leaf) {
+		if (vd->vdev_notrim || size == 0)
+			return (zio_null(pio, spa, NULL, NULL, NULL, flags));
+
+		zio = zio_create(pio, spa, 0, NULL, NULL, 0, NULL, NULL,
+		    ZIO_TYPE_IOCTL, ZIO_PRIORITY_FREE, flags, vd,
+		    offset + VDEV_LABEL_START_SIZE, NULL,
+		    ZIO_STAGE_OPEN, ZIO_IOCTL_PIPELINE);
+
+		zio->io_cmd = DKIOCFREE;
+		zio->io_orig_size = zio->io_size = size;
+
+		return (zio);
+	}
+
+	zio = zio_null(pio, spa, NULL, NULL, NULL, flags);
+
+	if (vd->vdev_ops == &vdev_raidz_ops) {
+		uint64_t ashift = vd->vdev_top->vdev_ashift;
+		uint64_t dcols = vd->vdev_children;
+		uint64_t s = offset >> ashift;
+		uint64_t e = (offset + size) >> ashift;
+
+		/*
+		 * Sector b of the RAID-Z vdev is row b / dcols of
+		 * child b % dcols.
+		 */
+		for (c = 0; c < dcols; c++) {
+			uint64_t first = s > c ? (s - c + dcols - 1) / dcols : 0;
+			uint64_t last = e > c ? (e - c + dcols - 1) / dcols : 0;
+
+			if (last > first)
+				zio_nowait(zio_trim(zio, spa, vd->vdev_child[c],
+				    first << ashift, (last - first) << ashift,
+				    flags));
+		}
+	} else if (vd->vdev_ops != &vdev_missing_ops &&
+	    vd->vdev_ops != &vdev_hole_ops) {
+		for (c = 0; c < vd->vdev_children; c++)
+			zio_nowait(zio_trim(zio, spa, vd->vdev_child[c],
+			    offset, size, flags));
+	}
+
+	return (zio);
+}
+
 zio_t *
 zio_read_phys(zio_t *pio, vdev_t *vd, uint64_t offset, uint64_t size,
     void *data, int checksum, zio_done_func_t *done, void *private,
@@ -2212,10 +2275,11 @@ zio_dva_unallocate(zio_t *zio, zio_gang_node_t *gn, blkptr_t *bp)
 
 /*
  * Try to allocate an intent log block.  Return 0 on success, errno on failure.
+ * If slog is non-NULL, it is set to whether the block came from the log class.
  */
 int
 zio_alloc_zil(spa_t *spa, uint64_t txg, blkptr_t *new_bp, blkptr_t *old_bp,
-    uint64_t size, boolean_t use_slog)
+    uint64_t size, boolean_t use_slog, boolean_t *slog)
 {
 	int error = 1;
 
@@ -2225,6 +2289,9 @@ zio_alloc_zil(spa_t *spa, uint64_t txg, blkptr_t *new_bp, blkptr_t *old_bp,
 		error = metaslab_alloc(spa, spa_log_class(spa), size,
 		    new_bp, 1, txg, old_bp, METASLAB_HINTBP_AVOID);
 
+	if (slog != NULL)
+		*slog = (error == 0);
+
 	if (error)
 		error = metaslab_alloc(spa, spa_normal_class(spa), size,
 		    new_bp, 1, txg, old_bp, METASLAB_HINTBP_AVOID);
@@ -43,16 +43,56 @@
 #include <sys/zio.h>
 #include <sys/zfs_rlock.h>
 #include <sys/zfs_znode.h>
+#include <sys/vdev_disk.h>
 #include <sys/zvol.h>
 
 unsigned int zvol_major = ZVOL_MAJOR;
-unsigned int zvol_threads = 0;
+unsigned int zvol_taskqs = 0;
+unsigned int zvol_threads = 4;
 
-static taskq_t *zvol_taskq;
+/*
+ * Bios are handed to one of zvol_ntaskqs taskqs, chosen by the CPU they
+ * were submitted on, so that zvols and CPUs do not contend on one queue.
+ */
+static taskq_t **zvol_taskq;
+static unsigned int zvol_ntaskqs;
+static kmem_cache_t *zvol_io_cache;
 static kmutex_t zvol_state_lock;
 static list_t zvol_state_list;
 static char *zvol_tag = "zvol_tag";
 
+/*
+ * Per-volume I/O statistics.  The queued and active counts are the bios
+ * waiting for and running in a taskq thread; the times are the total
+ * nanoseconds from submission to completion.
+ */
+typedef struct zvol_stats {
+	kstat_named_t	zs_reads;
+	kstat_named_t	zs_writes;
+	kstat_named_t	zs_nread;
+	kstat_named_t	zs_nwritten;
+	kstat_named_t	zs_queued;
+	kstat_named_t	zs_active;
+	kstat_named_t	zs_read_time;
+	kstat_named_t	zs_write_time;
+} zvol_stats_t;
+
+static zvol_stats_t zvol_stats_template = {
+	{ "reads",		KSTAT_DATA_UINT64 },
+	{ "writes",		KSTAT_DATA_UINT64 },
+	{ "nread",		KSTAT_DATA_UINT64 },
+	{ "nwritten",		KSTAT_DATA_UINT64 },
+	{ "queued",		KSTAT_DATA_UINT64 },
+	{ "active",		KSTAT_DATA_UINT64 },
+	{ "read_time",		KSTAT_DATA_UINT64 },
+	{ "write_time",		KSTAT_DATA_UINT64 },
+};
+
+#define	ZVOL_STAT_INCR(zv, stat, val) \
+	atomic_add_64(&(zv)->zv_stats.stat.value.ui64, (val))
+#define	ZVOL_STAT_BUMP(zv, stat)	ZVOL_STAT_INCR(zv, stat, 1)
+#define	ZVOL_STAT_BUMPDOWN(zv, stat)	ZVOL_STAT_INCR(zv, stat, -1)
+
 /*
  * The in-core state of each volume.
  */
@@ -70,12 +110,22 @@ typedef struct zvol_state {
 	dev_t			zv_dev;		/* device id */
 	struct gendisk		*zv_disk;	/* generic disk */
 	struct request_queue	*zv_queue;	/* request queue */
-	spinlock_t		zv_lock;	/* request queue lock */
+	zvol_stats_t		zv_stats;	/* I/O statistics */
+	kstat_t			*zv_kstat;	/* I/O statistics kstat */
 	list_node_t		zv_next;	/* next zvol_state_t linkage */
 } zvol_state_t;
 
 #define	ZVOL_RDONLY	0x1
 
+/*
+ * A bio on its way through a zvol taskq.
+ */
+typedef struct zvol_io {
+	zvol_state_t	*zi_zv;		/* volume */
+	struct bio	*zi_bio;	/* bio being serviced */
+	hrtime_t	zi_start;	/* submission time */
+} zvol_io_t;
+
 /*
  * Find the next available range of ZVOL_MINORS minor numbers.  The
  * zvol_state_list is kept in ascending minor order so we simply need
@@ -409,6 +459,19 @@ zvol_replay_write(zvol_state_t *zv, lr_write_t *lr, boolean_t byteswap)
 	return (error);
 }
 
+/*
+ * Replay a TX_TRUNCATE ZIL transaction logged for a discard.
+ */
+static int
+zvol_replay_truncate(zvol_state_t *zv, lr_truncate_t *lr, boolean_t byteswap)
+{
+	if (byteswap)
+		byteswap_uint64_array(lr, sizeof (*lr));
+
+	return (dmu_free_long_range(zv->zv_objset, ZVOL_OBJ,
+	    lr->lr_offset, lr->lr_length));
+}
+
 static int
 zvol_replay_err(zvol_state_t *zv, lr_t *lr, boolean_t byteswap)
 {
@@ -417,7 +480,7 @@ zvol_replay_err(zvol_state_t *zv, lr_t *lr, boolean_t byteswap)
 
 /*
  * Callback vectors for replaying records.
- * Only TX_WRITE is needed for zvol.
+ * Only TX_WRITE and TX_TRUNCATE are needed for zvol.
  */
 zil_replay_func_t *zvol_replay_vector[TX_MAX_TYPE] = {
 	(zil_replay_func_t *)zvol_replay_err,	/* no such transaction type */
@@ -430,7 +493,7 @@ zil_replay_func_t *zvol_replay_vector[TX_MAX_TYPE] = {
 	(zil_replay_func_t *)zvol_replay_err,	/* TX_LINK */
 	(zil_replay_func_t *)zvol_replay_err,	/* TX_RENAME */
 	(zil_replay_func_t *)zvol_replay_write,	/* TX_WRITE */
-	(zil_replay_func_t *)zvol_replay_err,	/* TX_TRUNCATE */
+	(zil_replay_func_t *)zvol_replay_truncate,	/* TX_TRUNCATE */
 	(zil_replay_func_t *)zvol_replay_err,	/* TX_SETATTR */
 	(zil_replay_func_t *)zvol_replay_err,	/* TX_ACL */
 };
@@ -508,23 +571,90 @@ zvol_log_write(zvol_state_t *zv, dmu_tx_t *tx,
 	}
 }
 
+/*
+ * zvol_log_truncate() handles discards using TX_TRUNCATE ZIL transactions.
+ */
+static void
+zvol_log_truncate(zvol_state_t *zv, dmu_tx_t *tx,
+		  uint64_t offset, uint64_t size, int sync)
+{
+	zilog_t *zilog = zv->zv_zilog;
+	itx_t *itx;
+	lr_truncate_t *lr;
+
+	if (zil_replaying(zilog, tx))
+		return;
+
+	itx = zil_itx_create(TX_TRUNCATE, sizeof (*lr));
+	lr = (lr_truncate_t *)&itx->itx_lr;
+	lr->lr_foid = ZVOL_OBJ;
+	lr->lr_offset = offset;
+	lr->lr_length = size;
+
+	itx->itx_sync = sync;
+	(void) zil_itx_assign(zilog, itx, tx);
+}
+
+/*
+ * Account for a bio leaving the taskq queue for a thread.
+ */
+static void
+zvol_io_start(zvol_io_t *zi)
+{
+	ZVOL_STAT_BUMPDOWN(zi->zi_zv, zs_queued);
+	ZVOL_STAT_BUMP(zi->zi_zv, zs_active);
+}
+
+/*
+ * Complete the bio and account for it.
+ */
+static void
+zvol_io_done(zvol_io_t *zi, uint64_t size, int error)
+{
+	zvol_state_t *zv = zi->zi_zv;
+	hrtime_t delta = gethrtime() - zi->zi_start;
+
+	if (bio_data_dir(zi->zi_bio) == WRITE) {
+		ZVOL_STAT_BUMP(zv, zs_writes);
+		ZVOL_STAT_INCR(zv, zs_nwritten, size);
+		ZVOL_STAT_INCR(zv, zs_write_time, delta);
+	} else {
+		ZVOL_STAT_BUMP(zv, zs_reads);
+		ZVOL_STAT_INCR(zv, zs_nread, size);
+		ZVOL_STAT_INCR(zv, zs_read_time, delta);
+	}
+	ZVOL_STAT_BUMPDOWN(zv, zs_active);
+
+	BIO_END_IO(zi->zi_bio, -error);
+	kmem_cache_free(zvol_io_cache, zi);
+}
+
 /*
  * Common write path running under the zvol taskq context.  This function
- * is responsible for copying the request structure data in to the DMU and
- * signaling the request queue with the result of the copy.
+ * is responsible for copying the bio data in to the DMU and completing
+ * the bio with the result of the copy.  An empty bio is a cache flush.
  */
 static void
 zvol_write(void *arg)
 {
-	struct request *req = (struct request *)arg;
-	struct request_queue *q = req->q;
-	zvol_state_t *zv = q->queuedata;
-	uint64_t offset = blk_rq_pos(req) << 9;
-	uint64_t size = blk_rq_bytes(req);
+	zvol_io_t *zi = (zvol_io_t *)arg;
+	struct bio *bio = zi->zi_bio;
+	zvol_state_t *zv = zi->zi_zv;
+	uint64_t offset = bio->bi_sector << 9;
+	uint64_t size = bio->bi_size;
+	int sync = bio->bi_rw & (1 << DIO_RW_SYNCIO);
 	int error = 0;
 	dmu_tx_t *tx;
 	rl_t *rl;
 
+	zvol_io_start(zi);
+
+	if (size == 0) {
+		zil_commit(zv->zv_zilog, UINT64_MAX, ZVOL_OBJ);
+		zvol_io_done(zi, size, 0);
+		return;
+	}
+
 	rl = zfs_range_lock(&zv->zv_znode, offset, size, RL_WRITER);
 
 	tx = dmu_tx_create(zv->zv_objset);
@@ -535,43 +665,97 @@ zvol_write(void *arg)
 	if (error) {
 		dmu_tx_abort(tx);
 		zfs_range_unlock(rl);
-		blk_end_request(req, -error, size);
+		zvol_io_done(zi, size, error);
 		return;
 	}
 
-	error = dmu_write_req(zv->zv_objset, ZVOL_OBJ, req, tx);
+	error = dmu_write_bio(zv->zv_objset, ZVOL_OBJ, bio, tx);
 	if (error == 0)
-		zvol_log_write(zv, tx, offset, size, rq_is_sync(req));
+		zvol_log_write(zv, tx, offset, size, sync);
 
 	dmu_tx_commit(tx);
 	zfs_range_unlock(rl);
 
-	if (rq_is_sync(req))
+	if (sync)
 		zil_commit(zv->zv_zilog, UINT64_MAX, ZVOL_OBJ);
 
-	blk_end_request(req, -error, size);
+	zvol_io_done(zi, size, error);
+}
+
+/*
+ * Discard path running under the zvol taskq context.  The range is freed
+ * in the DMU so the space returns to the pool, which in turn may pass it
+ * on to the underlying devices as a TRIM.  Partial blocks at either end
+ * are zeroed, so a discarded range always reads back as zeros.
+ */
+static void
+zvol_discard(void *arg)
+{
+	zvol_io_t *zi = (zvol_io_t *)arg;
+	struct bio *bio = zi->zi_bio;
+	zvol_state_t *zv = zi->zi_zv;
+	uint64_t offset = bio->bi_sector << 9;
+	uint64_t size = bio->bi_size;
+	int sync = bio->bi_rw & (1 << DIO_RW_SYNCIO);
+	int error = 0;
+	dmu_tx_t *tx;
+	rl_t *rl;
+
+	zvol_io_start(zi);
+
+	if (size == 0) {
+		zvol_io_done(zi, size, 0);
+		return;
+	}
+
+	rl = zfs_range_lock(&zv->zv_znode, offset, size, RL_WRITER);
+
+	tx = dmu_tx_create(zv->zv_objset);
+	dmu_tx_hold_free(tx, ZVOL_OBJ, offset, size);
+
+	error = dmu_tx_assign(tx, TXG_WAIT);
+	if (error) {
+		dmu_tx_abort(tx);
+		zfs_range_unlock(rl);
+		zvol_io_done(zi, size, error);
+		return;
+	}
+
+	error = dmu_free_range(zv->zv_objset, ZVOL_OBJ, offset, size, tx);
+	if (error == 0)
+		zvol_log_truncate(zv, tx, offset, size, sync);
+
+	dmu_tx_commit(tx);
+	zfs_range_unlock(rl);
+
+	if (sync)
+		zil_commit(zv->zv_zilog, UINT64_MAX, ZVOL_OBJ);
+
+	zvol_io_done(zi, size, error);
 }
 
 /*
  * Common read path running under the zvol taskq context.  This function
  * is responsible for copying the requested data out of the DMU and in to
- * a linux request structure.  It then must signal the request queue with
- * an error code describing the result of the copy.
+ * the bio.  It then completes the bio with an error code describing the
+ * result of the copy.
  */
 static void
 zvol_read(void *arg)
 {
-	struct request *req = (struct request *)arg;
-	struct request_queue *q = req->q;
-	zvol_state_t *zv = q->queuedata;
-	uint64_t offset = blk_rq_pos(req) << 9;
-	uint64_t size = blk_rq_bytes(req);
+	zvol_io_t *zi = (zvol_io_t *)arg;
+	struct bio *bio = zi->zi_bio;
+	zvol_state_t *zv = zi->zi_zv;
+	uint64_t offset = bio->bi_sector << 9;
+	uint64_t size = bio->bi_size;
 	int error;
 	rl_t *rl;
 
+	zvol_io_start(zi);
+
 	rl = zfs_range_lock(&zv->zv_znode, offset, size, RL_READER);
 
-	error = dmu_read_req(zv->zv_objset, ZVOL_OBJ, req);
+	error = dmu_read_bio(zv->zv_objset, ZVOL_OBJ, bio);
 
 	zfs_range_unlock(rl);
 
@@ -579,83 +763,72 @@ zvol_read(void *arg)
 	if (error == ECKSUM)
 		error = EIO;
 
-	blk_end_request(req, -error, size);
+	zvol_io_done(zi, size, error);
 }
 
 /*
- * Request will be added back to the request queue and retried if
- * it cannot be immediately dispatched to the taskq for handling
+ * Hand the bio to the taskq of the submitting CPU.  make_request() runs
+ * in the submitter's process context, where the stock __make_request()
+ * also blocks waiting for a free request, so the dispatch may sleep for
+ * the taskq entry.  Servicing the bio inline instead could deadlock, the
+ * DMU may wait on I/O that is queued behind this very bio.
  */
-static inline void
-zvol_dispatch(task_func_t func, struct request *req)
+static void
+zvol_dispatch(zvol_state_t *zv, task_func_t func, struct bio *bio)
 {
-	if (!taskq_dispatch(zvol_taskq, func, (void *)req, TQ_NOSLEEP))
-		blk_requeue_request(req->q, req);
+	taskq_t *tq = zvol_taskq[CPU_SEQID % zvol_ntaskqs];
+	zvol_io_t *zi;
+
+	zi = kmem_cache_alloc(zvol_io_cache, KM_PUSHPAGE);
+	zi->zi_zv = zv;
+	zi->zi_bio = bio;
+	zi->zi_start = gethrtime();
+
+	ZVOL_STAT_BUMP(zv, zs_queued);
+	VERIFY(taskq_dispatch(tq, func, (void *)zi, TQ_SLEEP) != 0);
 }
 
 /*
- * Common request path.  Rather than registering a custom make_request()
- * function we use the generic Linux version.  This is done because it allows
- * us to easily merge read requests which would otherwise we performed
- * synchronously by the DMU.  This is less critical in write case where the
- * DMU will perform the correct merging within a transaction group.  Using
- * the generic make_request() also let's use leverage the fact that the
- * elevator with ensure correct ordering in regards to barrior IOs.  On
- * the downside it means that in the write case we end up doing request
- * merging twice once in the elevator and once in the DMU.
+ * Common bio path.  A custom make_request() function is registered so
+ * bios are mapped straight on to DMU reads and writes without passing
+ * through the elevator.  Merging requests there buys nothing, since the
+ * DMU prefetches reads and aggregates writes within a transaction group,
+ * and a single request queue lock would serialize every submitter.
  *
- * The request handler is called under a spin lock so all the real work
- * is handed off to be done in the context of the zvol taskq.  This function
- * simply performs basic request sanity checking and hands off the request.
+ * This function simply performs basic sanity checking and hands the bio
+ * off to be serviced in the context of a zvol taskq.
  */
-static void
-zvol_request(struct request_queue *q)
+static int
+zvol_make_request(struct request_queue *q, struct bio *bio)
 {
 	zvol_state_t *zv = q->queuedata;
-	struct request *req;
-	unsigned int size;
-
-	while ((req = blk_fetch_request(q)) != NULL) {
-		size = blk_rq_bytes(req);
-
-		if (blk_rq_pos(req) + blk_rq_sectors(req) >
-		    get_capacity(zv->zv_disk)) {
-			printk(KERN_INFO
-			       "%s: bad access: block=%llu, count=%lu\n",
-			       req->rq_disk->disk_name,
-			       (long long unsigned)blk_rq_pos(req),
-			       (long unsigned)blk_rq_sectors(req));
-			__blk_end_request(req, -EIO, size);
-			continue;
-		}
-
-		if (!blk_fs_request(req)) {
-			printk(KERN_INFO "%s: non-fs cmd\n",
-			       req->rq_disk->disk_name);
-			__blk_end_request(req, -EIO, size);
-			continue;
-		}
 
-		switch (rq_data_dir(req)) {
-		case READ:
-			zvol_dispatch(zvol_read, req);
-			break;
-		case WRITE:
-			if (unlikely(get_disk_ro(zv->zv_disk)) ||
-			    unlikely(zv->zv_flags & ZVOL_RDONLY)) {
-				__blk_end_request(req, -EROFS, size);
-				break;
-			}
+	if (bio->bi_sector + bio_sectors(bio) > get_capacity(zv->zv_disk)) {
+		printk(KERN_INFO
+		       "%s: bad access: block=%llu, count=%lu\n",
+		       zv->zv_disk->disk_name,
+		       (long long unsigned)bio->bi_sector,
+		       (long unsigned)bio_sectors(bio));
+		BIO_END_IO(bio, -EIO);
+		return (0);
+	}
 
-			zvol_dispatch(zvol_write, req);
-			break;
-		default:
-			printk(KERN_INFO "%s: unknown cmd: %d\n",
-			       req->rq_disk->disk_name, (int)rq_data_dir(req));
-			__blk_end_request(req, -EIO, size);
-			break;
+	if (bio_data_dir(bio) == WRITE) {
+		if (unlikely(get_disk_ro(zv->zv_disk)) ||
+		    unlikely(zv->zv_flags & ZVOL_RDONLY)) {
+			BIO_END_IO(bio, -EROFS);
+			return (0);
 		}
+
+		if (bio_is_discard(bio))
+			zvol_dispatch(zv, zvol_discard, bio);
+		else
+			zvol_dispatch(zv, zvol_write, bio);
+	} else {
+		zvol_dispatch(zv, zvol_read, bio);
 	}
+
+	return (0);
 }
 
 static void
@@ -1037,15 +1210,23 @@ static zvol_state_t *
 zvol_alloc(dev_t dev, const char *name)
 {
 	zvol_state_t *zv;
+	char kname[KSTAT_STRLEN];
 
 	zv = kmem_zalloc(sizeof (zvol_state_t), KM_SLEEP);
 	if (zv == NULL)
 		goto out;
 
-	zv->zv_queue = blk_init_queue(zvol_request, &zv->zv_lock);
+	zv->zv_queue = blk_alloc_queue(GFP_KERNEL);
 	if (zv->zv_queue == NULL)
 		goto out_kmem;
 
+	blk_queue_make_request(zv->zv_queue, zvol_make_request);
+#ifdef HAVE_BLK_QUEUE_DISCARD
+	/* Larger discards are split so each is freed in a modest tx */
+	blk_queue_max_discard_sectors(zv->zv_queue, DMU_MAX_ACCESS >> 9);
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, zv->zv_queue);
+#endif /* HAVE_BLK_QUEUE_DISCARD */
+
 	zv->zv_disk = alloc_disk(ZVOL_MINORS);
 	if (zv->zv_disk == NULL)
 		goto out_queue;
@@ -1058,9 +1239,18 @@ zvol_alloc(dev_t dev, const char *name)
 	mutex_init(&zv->zv_znode.z_range_lock, NULL, MUTEX_DEFAULT, NULL);
 	avl_create(&zv->zv_znode.z_range_avl, zfs_range_compare,
 	    sizeof (rl_t), offsetof(rl_t, r_node));
-	spin_lock_init(&zv->zv_lock);
 	list_link_init(&zv->zv_next);
 
+	zv->zv_stats = zvol_stats_template;
+	snprintf(kname, KSTAT_STRLEN, "zvol%u", MINOR(dev));
+	zv->zv_kstat = kstat_create("zfs", 0, kname, "disk",
+	    KSTAT_TYPE_NAMED, sizeof (zvol_stats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (zv->zv_kstat != NULL) {
+		zv->zv_kstat->ks_data = &zv->zv_stats;
+		kstat_install(zv->zv_kstat);
+	}
+
 	zv->zv_disk->major = zvol_major;
 	zv->zv_disk->first_minor = (dev & MINORMASK);
 	zv->zv_disk->fops = &zvol_ops;
@@ -1084,6 +1274,9 @@ out:
 static void
 zvol_free(zvol_state_t *zv)
 {
+	if (zv->zv_kstat != NULL)
+		kstat_delete(zv->zv_kstat);
+
 	avl_destroy(&zv->zv_znode.z_range_avl);
 	mutex_destroy(&zv->zv_znode.z_range_lock);
 
@@ -1285,28 +1478,49 @@ zvol_remove_minors(const char *pool)
 	kmem_free(str, DISK_NAME_LEN);
 }
 
+static void
+zvol_taskqs_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < zvol_ntaskqs; i++)
+		if (zvol_taskq[i] != NULL)
+			taskq_destroy(zvol_taskq[i]);
+
+	kmem_free(zvol_taskq, zvol_ntaskqs * sizeof (taskq_t *));
+	zvol_taskq = NULL;
+}
+
 int
 zvol_init(void)
 {
-	int error;
+	int error, i;
 
 	if (!zvol_threads)
-		zvol_threads = num_online_cpus();
-
-	zvol_taskq = taskq_create(ZVOL_DRIVER, zvol_threads, maxclsyspri,
-		                  zvol_threads, INT_MAX, TASKQ_PREPOPULATE);
-	if (zvol_taskq == NULL) {
-		printk(KERN_INFO "ZFS: taskq_create() failed\n");
-		return (-ENOMEM);
+		zvol_threads = 1;
+
+	zvol_ntaskqs = zvol_taskqs ? zvol_taskqs : num_online_cpus();
+	zvol_taskq = kmem_zalloc(zvol_ntaskqs * sizeof (taskq_t *), KM_SLEEP);
+	for (i = 0; i < zvol_ntaskqs; i++) {
+		zvol_taskq[i] = taskq_create(ZVOL_DRIVER, zvol_threads,
+		    maxclsyspri, zvol_threads, INT_MAX, TASKQ_PREPOPULATE);
+		if (zvol_taskq[i] == NULL) {
+			printk(KERN_INFO "ZFS: taskq_create() failed\n");
+			zvol_taskqs_destroy();
+			return (-ENOMEM);
+		}
 	}
 
 	error = register_blkdev(zvol_major, ZVOL_DRIVER);
 	if (error) {
 		printk(KERN_INFO "ZFS: register_blkdev() failed %d\n", error);
-		taskq_destroy(zvol_taskq);
+		zvol_taskqs_destroy();
 		return (error);
 	}
 
+	zvol_io_cache = kmem_cache_create("zvol_io_cache", sizeof (zvol_io_t),
+	    0, NULL, NULL, NULL, NULL, NULL, 0);
+
 	blk_register_region(MKDEV(zvol_major, 0), 1UL << MINORBITS,
 	                    THIS_MODULE, zvol_probe, NULL, NULL);
 
@@ -1325,7 +1539,8 @@ zvol_fini(void)
 	zvol_remove_minors(NULL);
 	blk_unregister_region(MKDEV(zvol_major, 0), 1UL << MINORBITS);
 	unregister_blkdev(zvol_major, ZVOL_DRIVER);
-	taskq_destroy(zvol_taskq);
+	zvol_taskqs_destroy();
+	kmem_cache_destroy(zvol_io_cache);
 	mutex_destroy(&zvol_state_lock);
 	list_destroy(&zvol_state_list);
 }
@@ -1333,5 +1548,8 @@ zvol_fini(void)
 module_param(zvol_major, uint, 0);
 MODULE_PARM_DESC(zvol_major, "Major number for zvol device");
 
+module_param(zvol_taskqs, uint, 0);
+MODULE_PARM_DESC(zvol_taskqs, "Number of zvol taskqs, 0 for one per CPU");
+
 module_param(zvol_threads, uint, 0);
-MODULE_PARM_DESC(zvol_threads, "Number of threads for zvol device");
+MODULE_PARM_DESC(zvol_threads, "Number of threads per zvol taskq");